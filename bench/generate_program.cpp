@@ -0,0 +1,244 @@
+// Writes the sources of a synthetic program for the benchmarks: <cus>
+// compilation units of <functions> functions of <lines> lines each, a
+// bench_main.cpp running <threads> threads, and program.json describing
+// where RunBench should stop it.
+//
+//   GenerateProgram <dir> <cus> <functions> <lines> <threads> <hits>
+#include <sys/stat.h>
+
+#include <algorithm>
+#include <fstream>
+#include <iostream>
+#include <string>
+
+namespace {
+
+// Lines of bench_leaf, where step and next are timed
+const auto kStepLines = 24;
+// Frames of bench_depth above bench_leaf when it is hit
+const auto kDepth = 32;
+// Times bench_leaf is hit, each time step, next and finish are timed, and
+// times bench_loop and bench_record are, each time step over or recording
+// their loop is
+const auto kRounds = 5;
+// Iterations of the loop on a single line of bench_loop
+const auto kLoopIterations = 100000;
+// Iterations of the loop on a single line of bench_record, each writing to
+// bench_array
+const auto kRecordIterations = 10000;
+// Functions and lines breakpoints are timed on
+const auto kProbes = 10;
+
+const auto kHeader = "// Generated by GenerateProgram, do not edit";
+
+std::string FunctionName(int cu, int function) {
+  return "cu" + std::to_string(cu) + "_fn" + std::to_string(function);
+}
+
+// Functions of a compilation unit, one after another, followed by
+// cu<n>_all calling them all.
+void WriteCu(const std::string& path, int cu, int functions, int lines) {
+  std::ofstream out{path};
+  out << kHeader << "\n\n";
+  for (int f = 0; f < functions; f++) {
+    out << "int " << FunctionName(cu, f) << "(int x) {\n";
+    out << "  int v = x;\n";
+    for (int l = 0; l < lines - 2; l++) {
+      out << "  v = v * " << (l % 7 + 2) << " + " << f << ";\n";
+    }
+    out << "  return v;\n";
+    out << "}\n\n";
+  }
+  out << "int cu" << cu << "_all(int x) {\n";
+  out << "  int r = x;\n";
+  for (int f = 0; f < functions; f++) {
+    out << "  r += " << FunctionName(cu, f) << "(r);\n";
+  }
+  out << "  return r;\n";
+  out << "}\n";
+}
+
+// Line of the second statement of function f in a file written by
+// WriteCu, breakpoints by function go on the first
+int ProbeLine(int function, int lines) {
+  // The header and a blank line, then lines + 3 per function
+  return 3 + function * (lines + 3) + 2;
+}
+
+// main runs the rounds through bench_leaf, bench_loop and then
+// bench_record, then calls bench_hot and bench_traced hits times each,
+// then every function once. Threads other than main keep calling the
+// functions of cu 0, so breakpoints elsewhere are only hit by main. Given
+// an argument, main instead keeps running like the other threads until it
+// is killed, for the debugger to attach to.
+// Returns the line breakpoints on bench_hot go on, and sets *record_line
+// to the line of the loop of bench_record.
+int WriteMain(const std::string& path, int cus, int threads, int hits,
+              int* record_line) {
+  std::ofstream out{path};
+  int line = 1;
+  auto emit = [&out, &line](const std::string& text) {
+    out << text << "\n";
+    line++;
+  };
+  emit(kHeader);
+  emit("#include <sys/prctl.h>");
+  emit("");
+  emit("#include <atomic>");
+  emit("#include <chrono>");
+  emit("#include <thread>");
+  emit("#include <vector>");
+  emit("");
+  for (int cu = 0; cu < cus; cu++) {
+    emit("int cu" + std::to_string(cu) + "_all(int x);");
+  }
+  emit("");
+  emit("std::atomic<bool> done{false};");
+  emit("volatile int sink;");
+  emit("int bench_array[256];");
+  emit("");
+  emit("int bench_leaf(int x) {");
+  emit("  int v = x;");
+  for (int l = 0; l < kStepLines; l++) {
+    emit("  v = v * 3 + " + std::to_string(l) + ";");
+  }
+  emit("  return v;");
+  emit("}");
+  emit("");
+  emit("int bench_hot(int x) {");
+  auto hot_line = line;
+  emit("  int y = x * 2;");
+  emit("  return y + 1;");
+  emit("}");
+  emit("");
+  emit("int bench_traced(int x) {");
+  emit("  int y = x * 3;");
+  emit("  return y + 1;");
+  emit("}");
+  emit("");
+  emit("void bench_traced_done() {}");
+  emit("");
+  emit("int bench_loop(int x) {");
+  emit("  int v = x;");
+  emit("  for (int i = 0; i < " + std::to_string(kLoopIterations) +
+       "; i++) { v += i; }");
+  emit("  return v;");
+  emit("}");
+  emit("");
+  emit("int bench_record(int x) {");
+  emit("  int v = x;");
+  *record_line = line;
+  emit("  for (int i = 0; i < " + std::to_string(kRecordIterations) +
+       "; i++) { bench_array[i % 256] ^= i + v; }");
+  emit("  return bench_array[x % 256];");
+  emit("}");
+  emit("");
+  emit("int bench_depth(int n) {");
+  emit("  if (n == 0) {");
+  emit("    return bench_leaf(n);");
+  emit("  }");
+  emit("  return bench_depth(n - 1) + 1;");
+  emit("}");
+  emit("");
+  emit("void worker() {");
+  emit("  while (!done) {");
+  emit("    sink = cu0_all(sink);");
+  emit("    std::this_thread::sleep_for(std::chrono::milliseconds(1));");
+  emit("  }");
+  emit("}");
+  emit("");
+  emit("int main(int argc, char**) {");
+  emit("  std::vector<std::thread> workers;");
+  emit("  for (int i = 1; i < " + std::to_string(threads) + "; i++) {");
+  emit("    workers.emplace_back(worker);");
+  emit("  }");
+  emit("  if (argc > 1) {");
+  // Yama's ptrace_scope 1 only lets ancestors attach otherwise
+  emit("    prctl(PR_SET_PTRACER, PR_SET_PTRACER_ANY);");
+  emit("    worker();");
+  emit("  }");
+  emit("  for (int i = 0; i < " + std::to_string(kRounds) + "; i++) {");
+  emit("    sink = bench_depth(" + std::to_string(kDepth) + ");");
+  emit("  }");
+  emit("  for (int i = 0; i < " + std::to_string(kRounds) + "; i++) {");
+  emit("    sink = bench_loop(sink);");
+  emit("  }");
+  emit("  for (int i = 0; i < " + std::to_string(kRounds) + "; i++) {");
+  emit("    sink = bench_record(sink);");
+  emit("  }");
+  emit("  for (int i = 0; i < " + std::to_string(hits) + "; i++) {");
+  emit("    sink = bench_hot(i);");
+  emit("  }");
+  emit("  for (int i = 0; i < " + std::to_string(hits) + "; i++) {");
+  emit("    sink = bench_traced(i);");
+  emit("  }");
+  emit("  bench_traced_done();");
+  for (int cu = 0; cu < cus; cu++) {
+    emit("  sink = cu" + std::to_string(cu) + "_all(sink);");
+  }
+  emit("  done = true;");
+  emit("  for (auto& t : workers) {");
+  emit("    t.join();");
+  emit("  }");
+  emit("}");
+  return hot_line;
+}
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  if (argc != 7) {
+    std::cerr << "Usage: " << argv[0]
+              << " <dir> <cus> <functions> <lines> <threads> <hits>"
+              << std::endl;
+    return 1;
+  }
+  std::string dir = argv[1];
+  auto cus = std::stoi(argv[2]);
+  auto functions = std::stoi(argv[3]);
+  auto lines = std::stoi(argv[4]);
+  auto threads = std::stoi(argv[5]);
+  auto hits = std::stoi(argv[6]);
+  // Probes stay out of cu 0, which the other threads run
+  if (cus < 2 || functions < 1 || lines < 2 || threads < 1 || hits < 1) {
+    std::cerr << "Need at least 2 cus, 1 function, 2 lines, 1 thread and "
+                 "1 hit"
+              << std::endl;
+    return 1;
+  }
+  mkdir(dir.c_str(), 0755);
+
+  for (int cu = 0; cu < cus; cu++) {
+    WriteCu(dir + "/cu_" + std::to_string(cu) + ".cpp", cu, functions,
+            lines);
+  }
+  int record_line = 0;
+  auto hot_line =
+      WriteMain(dir + "/bench_main.cpp", cus, threads, hits, &record_line);
+
+  std::ofstream out{dir + "/program.json"};
+  out << "{\"cus\": " << cus << ", \"functions\": " << functions
+      << ", \"lines\": " << lines << ", \"threads\": " << threads
+      << ", \"hits\": " << hits << ", \"rounds\": " << kRounds
+      << ", \"steps\": " << kStepLines / 2 << ", \"hot_file\": "
+      << "\"/bench_main.cpp\", \"hot_line\": " << hot_line
+      << ", \"record_line\": " << record_line
+      << ", \"probes\": [";
+  // Spread over the functions outside cu 0
+  auto candidates = (cus - 1) * functions;
+  auto probes = std::min(kProbes, candidates);
+  for (int p = 0; p < probes; p++) {
+    auto n = p * candidates / probes;
+    auto cu = 1 + n / functions;
+    auto function = n % functions;
+    out << (p == 0 ? "" : ", ") << "{\"function\": \""
+        << FunctionName(cu, function) << "\", \"file\": \"/cu_" << cu
+        << ".cpp\", \"line\": " << ProbeLine(function, lines) << "}";
+  }
+  out << "]}" << std::endl;
+  if (!out) {
+    std::cerr << "Cannot write " << dir << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -0,0 +1,599 @@
+// Times debugger commands end to end on a program written by
+// GenerateProgram, driving the debugger through its command server, and
+// writes the results as JSON:
+//   {"format": 4, "program": {...}, "results": {"startup_cold": {...}}}
+// Every result has runs, total_ns, min_ns, median_ns and max_ns, and the
+// rates of hits or commands also per_second. Results are always written in
+// the same order and only change shape along with "format", so files
+// written at different commits can be compared directly.
+//
+// Most results time a command end to end. tracepoint_hits is a single
+// continue through every call of a function with a tracepoint, and
+// read_memory_pipelined 10000 read-memory commands sent with up to 64 of
+// them waiting for their results. step_loop is a step over a line looping
+// 100000 times, and step_loop_single the same step single-stepping every
+// instruction, as step did before it ran to the ends of lines. record is
+// recording a line looping 10000 times with record, and
+// record_single_step single-stepping the same line without recording;
+// record also has log_bytes_per_million_instructions and slowdown, its
+// mean over record_single_step's.
+//
+// all_stop is not timed here but taken from the debugger: how long
+// stopping the other threads took at each breakpoint hit. index_threads_<n>
+// are how long building the index took on n threads, as index-info
+// reports it. gcore is writing a core of the program stopped at bench_hot,
+// gcore_gdb is gdb doing the same as timed by its python, and has no runs
+// when gdb is not installed. attach and detach are how long the threads of
+// a running copy of the program were stopped while the debugger attached
+// to and detached from it, as the debugger reports it.
+//
+//   RunBench <debugger> <program> <program.json> [<output.json>]
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "json.h"
+#include "session.h"
+
+namespace {
+
+const auto kFormat = 4;
+// In output order
+const char* const kResults[] = {"startup_cold",
+                                "startup_warm",
+                                "breakpoint_function",
+                                "breakpoint_line",
+                                "symbol",
+                                "backtrace",
+                                "variables",
+                                "step",
+                                "next",
+                                "finish",
+                                "step_loop",
+                                "step_loop_single",
+                                "record",
+                                "record_single_step",
+                                "breakpoint_hits",
+                                "breakpoint_hits_lifting",
+                                "tracepoint_hits",
+                                "read_memory",
+                                "read_memory_pipelined",
+                                "all_stop",
+                                "index_threads_1",
+                                "index_threads_2",
+                                "index_threads_4",
+                                "index_threads_8",
+                                "gcore",
+                                "gcore_gdb",
+                                "attach",
+                                "detach"};
+// Results that are rates, with per_second
+const char* const kRates[] = {"breakpoint_hits", "breakpoint_hits_lifting",
+                              "tracepoint_hits", "read_memory",
+                              "read_memory_pipelined"};
+// read-memory commands timed each way
+const auto kReads = 10000;
+// read-memory commands in flight at once when pipelined
+const auto kPipelineDepth = 64;
+// Index threads index_threads_<n> are timed with
+const int kIndexThreads[] = {1, 2, 4, 8};
+// Times the index is built on each number of threads
+const auto kIndexRuns = 3;
+// Core files written by the debugger and by gdb each
+const auto kCoreRuns = 3;
+// Times the debugger attaches to and detaches from a running program
+const auto kAttachRuns = 10;
+// How long the program runs before the first attach, for its threads to
+// have started
+const auto kAttachDelay = std::chrono::milliseconds(100);
+
+uint64_t NowNs() {
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(
+             std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+class Bench {
+ public:
+  Bench(std::string debugger, std::string program, Json manifest)
+      : debugger_{std::move(debugger)},
+        program_{std::move(program)},
+        manifest_{std::move(manifest)},
+        socket_{std::filesystem::temp_directory_path() /
+                ("debugger-bench-" + std::to_string(getpid()) + ".sock")} {}
+
+  void Run() {
+    // A fresh index cache, so the first startup builds the index and the
+    // second loads it
+    auto cache = std::filesystem::temp_directory_path() /
+                 ("debugger-bench-" + std::to_string(getpid()));
+    std::filesystem::create_directories(cache);
+    setenv("XDG_CACHE_HOME", cache.c_str(), 1);
+    try {
+      Start("startup_cold");
+      {
+        auto session = Start("startup_warm");
+        Breakpoints(*session);
+        Rounds(*session);
+        Loops(*session);
+        Records(*session);
+        BreakpointHits(*session);
+        TracepointHits(*session);
+        ReadMemory(*session);
+        Cores(*session);
+      }
+      IndexThreads(cache);
+      AttachDetach();
+    } catch (...) {
+      std::filesystem::remove_all(cache);
+      throw;
+    }
+    std::filesystem::remove_all(cache);
+  }
+
+  Json ToJson() const {
+    auto json = Json::Object();
+    json["format"] = kFormat;
+    auto& program = json["program"] = Json::Object();
+    for (const auto* key : {"cus", "functions", "lines", "threads"}) {
+      program[key] = Number(key);
+    }
+    auto& results = json["results"] = Json::Object();
+    for (const auto* name : kResults) {
+      auto& result = results[name] = Json::Object();
+      auto samples = Samples(name);
+      uint64_t total = 0;
+      for (auto ns : samples) {
+        total += ns;
+      }
+      result["runs"] = static_cast<uint64_t>(samples.size());
+      result["total_ns"] = total;
+      result["min_ns"] = samples.empty() ? 0 : samples.front();
+      result["median_ns"] = samples.empty() ? 0 : samples[samples.size() / 2];
+      result["max_ns"] = samples.empty() ? 0 : samples.back();
+      if (std::string(name) == "record") {
+        result["log_bytes_per_million_instructions"] =
+            recorded_instructions_ == 0
+                ? 0
+                : recorded_bytes_ * 1e6 / recorded_instructions_;
+        auto single = Samples("record_single_step");
+        uint64_t single_total = 0;
+        for (auto ns : single) {
+          single_total += ns;
+        }
+        result["slowdown"] =
+            samples.empty() || single_total == 0
+                ? 0
+                : (static_cast<double>(total) / samples.size()) /
+                      (static_cast<double>(single_total) / single.size());
+      }
+      if (std::find_if(std::begin(kRates), std::end(kRates),
+                       [name](const char* rate) {
+                         return std::string(rate) == name;
+                       }) != std::end(kRates)) {
+        auto it = hits_.find(name);
+        auto hits = it != hits_.end() ? it->second : samples.size();
+        result["per_second"] = total == 0 ? 0 : hits * 1e9 / total;
+      }
+    }
+    return json;
+  }
+
+  void Print(std::ostream& out) const {
+    out << std::left << std::setw(24) << "" << std::right << std::setw(6)
+        << "runs" << std::setw(12) << "median" << std::setw(12) << "min"
+        << std::setw(12) << "max" << std::endl;
+    out << std::fixed << std::setprecision(3);
+    for (const auto* name : kResults) {
+      auto samples = Samples(name);
+      if (samples.empty()) {
+        continue;
+      }
+      out << std::left << std::setw(24) << name << std::right << std::setw(6)
+          << samples.size() << std::setw(9)
+          << samples[samples.size() / 2] / 1e6 << " ms" << std::setw(9)
+          << samples.front() / 1e6 << " ms" << std::setw(9)
+          << samples.back() / 1e6 << " ms" << std::endl;
+    }
+  }
+
+ private:
+  double Number(const std::string& key) const {
+    const auto* value = manifest_.Find(key);
+    if (value == nullptr || value->GetType() != Json::Type::kNumber) {
+      throw std::runtime_error("program.json has no " + key);
+    }
+    return value->AsNumber();
+  }
+
+  std::vector<uint64_t> Samples(const std::string& name) const {
+    auto it = samples_.find(name);
+    if (it == samples_.end()) {
+      return {};
+    }
+    auto samples = it->second;
+    std::sort(samples.begin(), samples.end());
+    return samples;
+  }
+
+  // Run cmd, adding how long it took to the samples of name
+  Json Time(Session& session, const std::string& name,
+            const std::string& cmd) {
+    auto start = NowNs();
+    auto result = session.Run(cmd);
+    samples_[name].push_back(NowNs() - start);
+    return result;
+  }
+
+  // Start the debugger and wait for its index, timing it all as name
+  std::unique_ptr<Session> Start(const std::string& name) {
+    auto start = NowNs();
+    auto session = std::make_unique<Session>(
+        debugger_, std::vector<std::string>{program_}, socket_);
+    while (session->Output("index-info").find("in progress") !=
+           std::string::npos) {
+      std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+    samples_[name].push_back(NowNs() - start);
+    return session;
+  }
+
+  // Dump cores of the program stopped at bench_hot, then have gdb run a
+  // copy of it to the same place and dump cores of that
+  void Cores(Session& session) {
+    auto core = socket_ + ".core";
+    for (int i = 0; i < kCoreRuns; i++) {
+      Time(session, "gcore", "gcore " + core);
+    }
+    std::filesystem::remove(core);
+    if (std::system("gdb --version > /dev/null 2>&1") != 0) {
+      return;
+    }
+    const std::string kPrefix = "gcore_ns ";
+    auto command =
+        "gdb -nx -batch -ex 'break bench_hot' -ex run"
+        " -ex 'python import time; start = time.perf_counter_ns()'"
+        " -ex 'gcore " + core + "'"
+        " -ex 'python print(\"" + kPrefix +
+        "\" + str(time.perf_counter_ns() - start))' -ex kill " + program_ +
+        " 2> /dev/null";
+    for (int i = 0; i < kCoreRuns; i++) {
+      auto* out = popen(command.c_str(), "r");
+      if (out == nullptr) {
+        throw std::runtime_error("Cannot run gdb");
+      }
+      char line[4096];
+      while (fgets(line, sizeof(line), out) != nullptr) {
+        if (std::string(line).rfind(kPrefix, 0) == 0) {
+          samples_["gcore_gdb"].push_back(std::stoull(line + kPrefix.size()));
+        }
+      }
+      pclose(out);
+    }
+    std::filesystem::remove(core);
+  }
+
+  // Attach to a copy of the program running on its own and detach again
+  void AttachDetach() {
+    auto pid = fork();
+    if (pid < 0) {
+      throw std::runtime_error("fork failed");
+    }
+    if (pid == 0) {
+      freopen("/dev/null", "w", stdout);
+      execl(program_.c_str(), program_.c_str(), "run", nullptr);
+      _exit(127);
+    }
+    try {
+      std::this_thread::sleep_for(kAttachDelay);
+      Session session{debugger_, {"-p", std::to_string(pid)}, socket_};
+      for (int i = 0; i < kAttachRuns; i++) {
+        StoppedFor(session, "detach", "detach", " resumed in ");
+        StoppedFor(session, "attach", "attach " + std::to_string(pid),
+                   " stopped in ");
+      }
+      session.Run("detach");
+    } catch (...) {
+      kill(pid, SIGKILL);
+      waitpid(pid, nullptr, 0);
+      throw;
+    }
+    kill(pid, SIGKILL);
+    waitpid(pid, nullptr, 0);
+  }
+
+  // Run cmd and add the milliseconds it reports after marker to the
+  // samples of name
+  void StoppedFor(Session& session, const std::string& name,
+                  const std::string& cmd, const std::string& marker) {
+    auto output = session.Output(cmd);
+    auto pos = output.find(marker);
+    if (pos == std::string::npos) {
+      throw std::runtime_error(cmd + " did not report the stop: " + output);
+    }
+    auto ms = std::stod(output.substr(pos + marker.size()));
+    samples_[name].push_back(static_cast<uint64_t>(ms * 1e6));
+  }
+
+  // Build the index from scratch on each number of threads in turn
+  void IndexThreads(const std::filesystem::path& cache) {
+    const std::string kBuilt = "built in ";
+    for (auto threads : kIndexThreads) {
+      setenv("DEBUGGER_INDEX_THREADS", std::to_string(threads).c_str(), 1);
+      for (int run = 0; run < kIndexRuns; run++) {
+        std::filesystem::remove_all(cache);
+        std::filesystem::create_directories(cache);
+        Session session{debugger_, {program_}, socket_};
+        std::string info;
+        while ((info = session.Output("index-info")).find(kBuilt) ==
+               std::string::npos) {
+          std::this_thread::sleep_for(std::chrono::microseconds(100));
+        }
+        auto ms = std::stod(info.substr(info.find(kBuilt) + kBuilt.size()));
+        samples_["index_threads_" + std::to_string(threads)].push_back(
+            static_cast<uint64_t>(ms * 1e6));
+      }
+    }
+    unsetenv("DEBUGGER_INDEX_THREADS");
+  }
+
+  void SetBreakpoint(Session& session, const std::string& name,
+                     const std::string& location) {
+    auto result = Time(session, name, "breakpoint " + location);
+    const auto* output = result.Find("output");
+    if (output == nullptr ||
+        output->AsString().find("Breakpoint set") == std::string::npos) {
+      throw std::runtime_error("No breakpoint set at " + location);
+    }
+  }
+
+  void ExpectStop(Session& session, const std::string& function) {
+    auto result = session.Run("backtrace 1");
+    const auto* frames = result.Find("frames");
+    if (frames == nullptr || frames->Items().empty()) {
+      throw std::runtime_error("Expected a stop in " + function);
+    }
+    const auto* name = frames->Items()[0].Find("function");
+    if (name == nullptr || name->AsString() != function) {
+      throw std::runtime_error(
+          "Stopped in " + (name ? name->AsString() : "?") + ", expected " +
+          function);
+    }
+  }
+
+  // Breakpoints and symbol lookups spread over the compilation units
+  void Breakpoints(Session& session) {
+    for (const auto& probe : manifest_.Find("probes")->Items()) {
+      const auto& function = probe.Find("function")->AsString();
+      auto line = static_cast<int>(probe.Find("line")->AsNumber());
+      SetBreakpoint(session, "breakpoint_function", function);
+      SetBreakpoint(session, "breakpoint_line",
+                    probe.Find("file")->AsString() + ":" +
+                        std::to_string(line));
+      Time(session, "symbol", "symbol " + function);
+    }
+  }
+
+  // Each time bench_leaf is hit, 32 frames down: look around, step and
+  // next through it and finish
+  void Rounds(Session& session) {
+    session.Run("breakpoint bench_leaf");
+    auto steps = static_cast<int>(Number("steps"));
+    for (int round = 0; round < Number("rounds"); round++) {
+      session.Run("continue");
+      ExpectStop(session, "bench_leaf");
+      Time(session, "backtrace", "backtrace");
+      Time(session, "variables", "variables");
+      for (int i = 0; i < steps; i++) {
+        Time(session, "step", "step");
+      }
+      for (int i = 0; i < steps; i++) {
+        Time(session, "next", "next");
+      }
+      Time(session, "finish", "finish");
+      ExpectStop(session, "bench_depth");
+    }
+  }
+
+  // Each time bench_loop is hit, step onto the line of its loop and time
+  // stepping over it, the first rounds by address ranges and the rest by
+  // single-stepping
+  void Loops(Session& session) {
+    session.Run("breakpoint bench_loop");
+    auto rounds = static_cast<int>(Number("rounds"));
+    for (int round = 0; round < rounds; round++) {
+      auto ranges = round < (rounds + 1) / 2;
+      session.Run(ranges ? "range-stepping on" : "range-stepping off");
+      session.Run("continue");
+      ExpectStop(session, "bench_loop");
+      session.Run("step");
+      Time(session, ranges ? "step_loop" : "step_loop_single", "step");
+      ExpectStop(session, "bench_loop");
+    }
+    session.Run("range-stepping on");
+  }
+
+  // Each time bench_record is hit, step onto the line of its loop and
+  // either record it or single-step over it, taking turns
+  void Records(Session& session) {
+    session.Run("breakpoint bench_record");
+    auto end = manifest_.Find("hot_file")->AsString() + ":" +
+               std::to_string(static_cast<int>(Number("record_line")) + 1);
+    for (int round = 0; round < Number("rounds"); round++) {
+      session.Run("continue");
+      ExpectStop(session, "bench_record");
+      session.Run("step");
+      if (round % 2 == 0) {
+        auto result = Time(session, "record", "record " + end);
+        const auto* output = result.Find("output");
+        // "Recorded <n> instructions in ..., log of <bytes> bytes"
+        std::istringstream in{output ? output->AsString() : ""};
+        std::string word;
+        uint64_t instructions = 0, bytes = 0;
+        in >> word >> instructions;
+        while (in >> word && word != "of") {
+        }
+        if (word != "of" || !(in >> bytes) || instructions == 0) {
+          throw std::runtime_error("Nothing recorded: " +
+                                   (output ? output->AsString() : ""));
+        }
+        recorded_instructions_ += instructions;
+        recorded_bytes_ += bytes;
+        session.Run("record-stop");
+      } else {
+        session.Run("range-stepping off");
+        Time(session, "record_single_step", "step");
+        session.Run("range-stepping on");
+      }
+      ExpectStop(session, "bench_record");
+    }
+  }
+
+  // Continue to a breakpoint in a function called in a loop, half of the
+  // time stepping past it out of line and half lifting it
+  void BreakpointHits(Session& session) {
+    session.Run("breakpoint " + manifest_.Find("hot_file")->AsString() +
+                ":" + std::to_string(static_cast<int>(Number("hot_line"))));
+    auto hits = static_cast<int>(Number("hits"));
+    for (int i = 0; i < hits / 2; i++) {
+      Time(session, "breakpoint_hits", "continue");
+      AllStop(session);
+    }
+    session.Run("displaced-stepping off");
+    for (int i = hits / 2; i < hits; i++) {
+      Time(session, "breakpoint_hits_lifting", "continue");
+      AllStop(session);
+    }
+    session.Run("displaced-stepping on");
+    ExpectStop(session, "bench_hot");
+  }
+
+  // Continue through the calls of a function with a tracepoint on it,
+  // which record without stopping
+  void TracepointHits(Session& session) {
+    session.Run("trace bench_traced x");
+    session.Run("breakpoint bench_traced_done");
+    auto hits = static_cast<uint64_t>(Number("hits"));
+    Time(session, "tracepoint_hits", "continue");
+    hits_["tracepoint_hits"] += hits;
+    ExpectStop(session, "bench_traced_done");
+    // "<n> records, <m> overwritten"
+    std::istringstream dump{session.Output("tdump")};
+    uint64_t records = 0, overwritten = 0;
+    std::string word;
+    dump >> records >> word >> overwritten;
+    if (records + overwritten != hits) {
+      throw std::runtime_error("Tracepoint hit " +
+                               std::to_string(records + overwritten) +
+                               " times, expected " + std::to_string(hits));
+    }
+  }
+
+  // Read the top of the stack with read-memory, one command at a time and
+  // then pipelined
+  void ReadMemory(Session& session) {
+    auto rsp = session.Run("read-register rsp").Find("value")->AsString();
+    auto cmd = "read-memory " + rsp + " 8";
+    for (int i = 0; i < kReads; i++) {
+      Time(session, "read_memory", cmd);
+    }
+    auto start = NowNs();
+    for (int sent = 0, received = 0; received < kReads;) {
+      if (sent < kReads && sent - received < kPipelineDepth) {
+        session.Send(cmd);
+        sent++;
+      } else {
+        session.Receive(cmd);
+        received++;
+      }
+    }
+    samples_["read_memory_pipelined"].push_back(NowNs() - start);
+    hits_["read_memory_pipelined"] += kReads;
+  }
+
+  // Add how long the last all-stop took, as threads reports it, to the
+  // all_stop samples. Nothing to add if the program runs a single thread.
+  void AllStop(Session& session) {
+    const std::string kPrefix = "Last all-stop halted ";
+    auto output = session.Output("threads");
+    auto pos = output.find(kPrefix);
+    if (pos == std::string::npos) {
+      return;
+    }
+    // "<n> threads in <us> us"
+    std::istringstream in{output.substr(pos + kPrefix.size())};
+    std::string threads, word;
+    double us;
+    if (!(in >> threads >> word >> word >> us)) {
+      throw std::runtime_error("Cannot read the all-stop time: " + output);
+    }
+    samples_["all_stop"].push_back(static_cast<uint64_t>(us * 1e3));
+  }
+
+  std::string debugger_;
+  std::string program_;
+  Json manifest_;
+  std::string socket_;
+  std::map<std::string, std::vector<uint64_t>> samples_;
+  // Hits or commands the samples of a result add up to, where it is not
+  // one per sample
+  std::map<std::string, uint64_t> hits_;
+  // What record reported over all of its runs
+  uint64_t recorded_instructions_ = 0;
+  uint64_t recorded_bytes_ = 0;
+};
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  if (argc != 4 && argc != 5) {
+    std::cerr << "Usage: " << argv[0]
+              << " <debugger> <program> <program.json> [<output.json>]"
+              << std::endl;
+    return 1;
+  }
+  try {
+    std::ifstream in{argv[3]};
+    std::stringstream manifest;
+    manifest << in.rdbuf();
+    if (!in) {
+      throw std::runtime_error(std::string("Cannot read ") + argv[3]);
+    }
+    Bench bench{std::filesystem::absolute(argv[1]),
+                std::filesystem::absolute(argv[2]),
+                Json::Parse(manifest.str())};
+    bench.Run();
+    bench.Print(std::cout);
+    auto json = bench.ToJson().Dump();
+    if (argc == 5) {
+      std::ofstream out{argv[4]};
+      out << json << std::endl;
+      if (!out) {
+        throw std::runtime_error(std::string("Cannot write ") + argv[4]);
+      }
+      std::cout << "Results written to " << argv[4] << std::endl;
+    } else {
+      std::cout << json << std::endl;
+    }
+  } catch (const std::exception& e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
@@ -1,10 +1,8 @@
 #include "breakpoint.h"
 
-#include <sys/ptrace.h>
-
+#include <algorithm>
 #include <iostream>
 
-const auto kByteMask = 0xff;
 const auto kInt3 = 0xcc;
 
 void Breakpoint::Enable() {
@@ -12,12 +10,9 @@ void Breakpoint::Enable() {
     std::cout << "Already enabled" << std::endl;
     return;
   };
-  auto word = ptrace(PTRACE_PEEKTEXT, pid_, addr_, nullptr);
-  instruction_ = word & kByteMask;
-  // Set lowest byte to 0xcc.
-  uint64_t new_instruction = (word & ~kByteMask) | kInt3;
-  ptrace(PTRACE_POKETEXT, pid_, addr_, new_instruction);
-  enabled_ = true;
+  BreakpointBatch batch{memory_};
+  batch.Enable(this);
+  batch.Commit();
 }
 
 void Breakpoint::Disable() {
@@ -25,13 +20,104 @@ void Breakpoint::Disable() {
     std::cout << "Not enabled" << std::endl;
     return;
   };
-  auto word = ptrace(PTRACE_PEEKTEXT, pid_, addr_, nullptr);
-  // Set lowest byte to instruction_
-  uint64_t original_word = (word & ~kByteMask) | instruction_;
-  ptrace(PTRACE_POKETEXT, pid_, addr_, original_word);
-  enabled_ = false;
+  BreakpointBatch batch{memory_};
+  batch.Disable(this);
+  batch.Commit();
 }
 
 bool Breakpoint::IsEnabled() const { return enabled_; }
 
+bool Breakpoint::IsTemporary() const { return temporary_; }
+
+void Breakpoint::SetTemporary(bool temporary) { temporary_ = temporary; }
+
 std::uintptr_t Breakpoint::GetAddress() const { return addr_; }
+
+uint8_t Breakpoint::GetOriginalByte() const { return instruction_; }
+
+void Breakpoint::SetCondition(std::shared_ptr<const Expression> condition) {
+  condition_ = std::move(condition);
+}
+
+const Expression* Breakpoint::GetCondition() const { return condition_.get(); }
+
+void Breakpoint::SetIgnoreCount(uint64_t count) { ignore_count_ = count; }
+
+uint64_t Breakpoint::GetIgnoreCount() const { return ignore_count_; }
+
+bool Breakpoint::RegisterHit() {
+  hit_count_++;
+  if (ignore_count_ > 0) {
+    ignore_count_--;
+    return false;
+  }
+  return true;
+}
+
+uint64_t Breakpoint::GetHitCount() const { return hit_count_; }
+
+void Breakpoint::AddConditionTime(std::chrono::nanoseconds t) {
+  condition_time_ += t;
+}
+
+std::chrono::nanoseconds Breakpoint::GetConditionTime() const {
+  return condition_time_;
+}
+
+void Breakpoint::SetTrace(
+    std::vector<std::shared_ptr<const Expression>> exprs) {
+  trace_ = std::move(exprs);
+}
+
+bool Breakpoint::IsTracepoint() const { return !trace_.empty(); }
+
+const std::vector<std::shared_ptr<const Expression>>& Breakpoint::GetTrace()
+    const {
+  return trace_;
+}
+
+void BreakpointBatch::Enable(Breakpoint* bp) {
+  if (!bp->enabled_) {
+    patches_.push_back(Patch{bp, true});
+  }
+}
+
+void BreakpointBatch::Disable(Breakpoint* bp) {
+  if (bp->enabled_) {
+    patches_.push_back(Patch{bp, false});
+  }
+}
+
+void BreakpointBatch::Commit() {
+  std::sort(patches_.begin(), patches_.end(),
+            [](const Patch& a, const Patch& b) {
+              return a.bp->addr_ < b.bp->addr_;
+            });
+
+  std::vector<uint8_t> text;
+  for (auto first = patches_.begin(); first != patches_.end();) {
+    // All patches on the same page as the first one
+    auto page = first->bp->addr_ / kPageSize;
+    auto last = std::find_if(first, patches_.end(), [page](const Patch& p) {
+      return p.bp->addr_ / kPageSize != page;
+    });
+    auto start = first->bp->addr_;
+    auto end = (last - 1)->bp->addr_ + 1;
+
+    text.resize(end - start);
+    memory_->Read(start, text.data(), text.size());
+    for (auto it = first; it != last; ++it) {
+      auto& byte = text[it->bp->addr_ - start];
+      if (it->enable) {
+        it->bp->instruction_ = byte;
+        byte = kInt3;
+      } else {
+        byte = it->bp->instruction_;
+      }
+      it->bp->enabled_ = it->enable;
+    }
+    memory_->WriteText(start, text.data(), text.size());
+    first = last;
+  }
+  patches_.clear();
+}
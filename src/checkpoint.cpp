@@ -0,0 +1,46 @@
+#include "checkpoint.h"
+
+#include <sys/syscall.h>
+#include <sys/wait.h>
+
+#include <cstring>
+#include <stdexcept>
+
+#include "inject_syscall.h"
+#include "ptrace_wrapper.h"
+
+pid_t ForkTracee(TracedThread* thread, Memory* memory, int options) {
+  auto tid = thread->tid;
+  auto saved = thread->registers.GetAll();
+  Ptrace(PTRACE_SETOPTIONS, tid, nullptr, options | PTRACE_O_TRACEFORK);
+  unsigned long child = 0;
+  auto result = InjectSyscall(thread, memory, SYS_fork, {},
+                              [tid, &child](int event) {
+                                if (event == PTRACE_EVENT_FORK) {
+                                  Ptrace(PTRACE_GETEVENTMSG, tid, nullptr,
+                                         &child);
+                                }
+                              });
+  Ptrace(PTRACE_SETOPTIONS, tid, nullptr, options);
+  if (result < 0 || child == 0) {
+    throw std::runtime_error(std::string("fork failed: ") +
+                             strerror(result < 0 ? -result : ESRCH));
+  }
+
+  // The child starts out stopped, at the same point with a 0 in rax
+  pid_t pid = child;
+  int status = 0;
+  if (Waitpid(pid, &status, __WALL) != pid || !WIFSTOPPED(status)) {
+    throw std::runtime_error("Lost the forked process " +
+                             std::to_string(pid));
+  }
+  RegisterFile registers{pid};
+  registers.SetAll(saved);
+  registers.Flush();
+  // The child still has the syscall at its pc, the parent's code is back
+  uint8_t code[kSyscallLength];
+  memory->Read(saved.rip, code, sizeof(code));
+  Memory child_memory{pid};
+  child_memory.WriteText(saved.rip, code, sizeof(code));
+  return pid;
+}
@@ -0,0 +1,181 @@
+#include "command_server.h"
+
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <stdexcept>
+#include <utility>
+#include <vector>
+
+#include "debugger.h"
+
+namespace {
+
+const auto kReadSize = 64 * 1024;
+
+void WriteAll(int fd, const std::string& data) {
+  size_t done = 0;
+  while (done < data.size()) {
+    auto n = send(fd, data.data() + done, data.size() - done, MSG_NOSIGNAL);
+    if (n < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::runtime_error(std::string("send: ") + strerror(errno));
+    }
+    done += n;
+  }
+}
+
+}  // namespace
+
+CommandServer::CommandServer(Debugger* debugger, std::string socket_path)
+    : debugger_{debugger}, path_{std::move(socket_path)} {
+  sockaddr_un addr{};
+  addr.sun_family = AF_UNIX;
+  if (path_.size() >= sizeof(addr.sun_path)) {
+    throw std::runtime_error("Socket path too long: " + path_);
+  }
+  path_.copy(addr.sun_path, path_.size());
+
+  listen_fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+  if (listen_fd_ < 0) {
+    throw std::runtime_error(std::string("socket: ") + strerror(errno));
+  }
+  unlink(path_.c_str());
+  if (bind(listen_fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) !=
+          0 ||
+      listen(listen_fd_, 1) != 0) {
+    auto error = std::string("bind ") + path_ + ": " + strerror(errno);
+    close(listen_fd_);
+    throw std::runtime_error(error);
+  }
+}
+
+CommandServer::~CommandServer() {
+  close(listen_fd_);
+  unlink(path_.c_str());
+}
+
+void CommandServer::Run() {
+  std::cout << "Listening on " << path_ << std::endl;
+  while (true) {
+    auto fd = accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+    if (fd < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::runtime_error(std::string("accept: ") + strerror(errno));
+    }
+    bool keep_going = true;
+    try {
+      keep_going = ServeClient(fd);
+    } catch (std::exception& e) {
+      std::cerr << e.what() << std::endl;
+    }
+    close(fd);
+    if (!keep_going) {
+      return;
+    }
+  }
+}
+
+bool CommandServer::ServeClient(int fd) {
+  commands_ = 0;
+  auto start = std::chrono::steady_clock::now();
+  std::string pending;
+  std::string out;
+  std::vector<char> buf(kReadSize);
+  bool keep_going = true;
+  while (keep_going) {
+    auto n = read(fd, buf.data(), buf.size());
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      break;
+    }
+    pending.append(buf.data(), n);
+
+    // Everything that arrived in one read is answered with one write
+    size_t begin = 0;
+    size_t end;
+    while (keep_going && (end = pending.find('\n', begin)) != pending.npos) {
+      keep_going = HandleLine(pending.substr(begin, end - begin), &out);
+      begin = end + 1;
+    }
+    pending.erase(0, begin);
+    WriteAll(fd, out);
+    out.clear();
+  }
+
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  std::cout << std::dec << commands_ << " commands in " << elapsed.count()
+            << " s (" << commands_ / elapsed.count() << " commands/s)"
+            << std::endl;
+  return keep_going;
+}
+
+bool CommandServer::HandleLine(const std::string& line, std::string* out) {
+  if (line.find_first_not_of(" \t\r") == line.npos) {
+    return true;
+  }
+  bool quit = false;
+  Json response;
+  try {
+    auto request = Json::Parse(line);
+    if (request.GetType() == Json::Type::kArray) {
+      response = Json::Array();
+      for (const auto& r : request.Items()) {
+        if (quit) {
+          break;
+        }
+        response.Push(HandleRequest(r, &quit));
+      }
+    } else {
+      response = HandleRequest(request, &quit);
+    }
+  } catch (std::exception& e) {
+    response = Json::Object();
+    response["id"] = Json();
+    response["ok"] = false;
+    response["error"] = e.what();
+  }
+  response.Dump(out);
+  *out += '\n';
+  return !quit;
+}
+
+Json CommandServer::HandleRequest(const Json& request, bool* quit) {
+  auto response = Json::Object();
+  const auto* id = request.Find("id");
+  response["id"] = id != nullptr ? *id : Json();
+  const auto* command = request.Find("command");
+  if (command == nullptr || command->GetType() != Json::Type::kString) {
+    response["ok"] = false;
+    response["error"] = "Request needs a \"command\" string";
+    return response;
+  }
+
+  commands_++;
+  if (command->AsString() == "quit") {
+    *quit = true;
+    response["ok"] = true;
+    return response;
+  }
+  try {
+    auto result = debugger_->ExecuteJson(command->AsString());
+    response["ok"] = true;
+    response["result"] = std::move(result);
+  } catch (std::exception& e) {
+    response["ok"] = false;
+    response["error"] = e.what();
+  }
+  return response;
+}
@@ -0,0 +1,436 @@
+#include "core_file.h"
+
+#include <elf.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/procfs.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <climits>
+#include <cstring>
+#include <fstream>
+#include <iterator>
+#include <sstream>
+#include <stdexcept>
+
+#include "memory.h"
+
+namespace {
+
+// Memory is copied in chunks of at most this, so a chunk that fails to
+// read is retried page by page without redoing much
+const auto kChunkSize = 4 << 20;
+const auto kNoteAlign = 4;
+
+struct Mapping {
+  uint64_t start;
+  uint64_t end;
+  uint64_t offset;
+  uint32_t flags;  // PF_R, PF_W and PF_X
+  std::string path;
+};
+
+std::vector<Mapping> ReadMappings(pid_t pid) {
+  std::vector<Mapping> mappings;
+  std::ifstream maps("/proc/" + std::to_string(pid) + "/maps");
+  std::string line;
+  while (std::getline(maps, line)) {
+    std::istringstream fields{line};
+    std::string range, perms, offset, device, inode;
+    fields >> range >> perms >> offset >> device >> inode;
+    std::string path;
+    std::getline(fields >> std::ws, path);
+    // Unreadable mappings have nothing to dump, and the kernel's
+    // [vvar] and [vsyscall] pages cannot be read
+    if (perms.size() < 3 || perms[0] != 'r' || path.rfind("[vvar", 0) == 0 ||
+        path == "[vsyscall]") {
+      continue;
+    }
+    Mapping m;
+    auto dash = range.find('-');
+    m.start = std::stoull(range.substr(0, dash), nullptr, 16);
+    m.end = std::stoull(range.substr(dash + 1), nullptr, 16);
+    m.offset = std::stoull(offset, nullptr, 16);
+    m.flags = PF_R;
+    m.flags |= (perms[1] == 'w' ? PF_W : 0) | (perms[2] == 'x' ? PF_X : 0);
+    m.path = path;
+    mappings.push_back(m);
+  }
+  return mappings;
+}
+
+std::string ReadProcFile(pid_t pid, const char* name) {
+  std::ifstream file("/proc/" + std::to_string(pid) + "/" + name,
+                     std::ios::binary);
+  return std::string{std::istreambuf_iterator<char>(file), {}};
+}
+
+void AppendNote(std::string* notes, uint32_t type, const void* desc,
+                size_t size) {
+  static const char kName[] = "CORE";
+  Elf64_Nhdr header{sizeof(kName), static_cast<Elf64_Word>(size), type};
+  notes->append(reinterpret_cast<const char*>(&header), sizeof(header));
+  notes->append(kName, sizeof(kName));
+  notes->resize((notes->size() + kNoteAlign - 1) & ~(kNoteAlign - 1));
+  notes->append(static_cast<const char*>(desc), size);
+  notes->resize((notes->size() + kNoteAlign - 1) & ~(kNoteAlign - 1));
+}
+
+std::string BuildNotes(pid_t pid, const std::vector<CoreThread>& threads,
+                       const std::vector<Mapping>& mappings) {
+  std::string notes;
+  for (size_t i = 0; i < threads.size(); i++) {
+    const auto& thread = threads[i];
+    elf_prstatus status{};
+    status.pr_info.si_signo = thread.signal;
+    status.pr_cursig = thread.signal;
+    status.pr_pid = thread.tid;
+    status.pr_pgrp = getpgid(pid);
+    status.pr_sid = getsid(pid);
+    static_assert(sizeof(status.pr_reg) == sizeof(thread.regs));
+    std::memcpy(&status.pr_reg, &thread.regs, sizeof(thread.regs));
+    status.pr_fpvalid = 1;
+    AppendNote(&notes, NT_PRSTATUS, &status, sizeof(status));
+
+    if (i == 0) {
+      // Process wide notes follow the first thread's status, as the
+      // kernel writes them
+      elf_prpsinfo info{};
+      info.pr_sname = 't';
+      info.pr_state = 3;
+      info.pr_pid = pid;
+      info.pr_pgrp = status.pr_pgrp;
+      info.pr_sid = status.pr_sid;
+      auto comm = ReadProcFile(pid, "comm");
+      comm = comm.substr(0, comm.find('\n'));
+      comm.copy(info.pr_fname, sizeof(info.pr_fname) - 1);
+      auto args = ReadProcFile(pid, "cmdline");
+      std::replace(args.begin(), args.end(), '\0', ' ');
+      args.copy(info.pr_psargs, sizeof(info.pr_psargs) - 1);
+      AppendNote(&notes, NT_PRPSINFO, &info, sizeof(info));
+
+      auto auxv = ReadProcFile(pid, "auxv");
+      AppendNote(&notes, NT_AUXV, auxv.data(), auxv.size());
+
+      // NT_FILE: count, page size, then start, end and page offset of
+      // each file mapping followed by their names
+      std::vector<uint64_t> ranges{0, kPageSize};
+      std::string names;
+      for (const auto& m : mappings) {
+        if (m.path.empty() || m.path[0] != '/') {
+          continue;
+        }
+        ranges[0]++;
+        ranges.insert(ranges.end(), {m.start, m.end, m.offset / kPageSize});
+        names.append(m.path.c_str(), m.path.size() + 1);
+      }
+      std::string file(reinterpret_cast<const char*>(ranges.data()),
+                       ranges.size() * sizeof(uint64_t));
+      file += names;
+      AppendNote(&notes, NT_FILE, file.data(), file.size());
+    }
+    AppendNote(&notes, NT_FPREGSET, &thread.fpregs, sizeof(thread.fpregs));
+  }
+  return notes;
+}
+
+struct Chunk {
+  uint64_t addr;
+  uint8_t* out;
+  size_t len;
+};
+
+// Read a chunk that failed as a whole, page by page. Pages that cannot be
+// read at all are left as zeros; returns how many bytes those were.
+uint64_t ReadChunkByPage(Memory* memory, const Chunk& chunk) {
+  uint64_t unreadable = 0;
+  for (size_t offset = 0; offset < chunk.len; offset += kPageSize) {
+    auto len = std::min<size_t>(kPageSize, chunk.len - offset);
+    try {
+      memory->Read(chunk.addr + offset, chunk.out + offset, len);
+    } catch (std::exception&) {
+      unreadable += len;
+    }
+  }
+  return unreadable;
+}
+
+// Copy every chunk from pid, up to IOV_MAX of them per process_vm_readv.
+uint64_t CopyChunks(pid_t pid, const std::vector<Chunk>& chunks) {
+  Memory memory{pid};
+  uint64_t unreadable = 0;
+  std::vector<iovec> local;
+  std::vector<iovec> remote;
+  size_t next = 0;
+  while (next < chunks.size()) {
+    auto count = std::min<size_t>(chunks.size() - next, IOV_MAX);
+    local.clear();
+    remote.clear();
+    for (size_t i = next; i < next + count; i++) {
+      local.push_back({chunks[i].out, chunks[i].len});
+      remote.push_back(
+          {reinterpret_cast<void*>(chunks[i].addr), chunks[i].len});
+    }
+    ++memory_syscall_count;
+    auto n = process_vm_readv(pid, local.data(), count, remote.data(), count,
+                              0);
+    // The transfer stops at the first chunk with a page it cannot read
+    uint64_t copied = n < 0 ? 0 : n;
+    while (count != 0 && copied >= chunks[next].len) {
+      copied -= chunks[next].len;
+      next++;
+      count--;
+    }
+    if (count != 0) {
+      unreadable += ReadChunkByPage(&memory, chunks[next]);
+      next++;
+    }
+  }
+  return unreadable;
+}
+
+}  // namespace
+
+CoreDumpStats WriteCore(
+    const std::string& path, pid_t pid, const std::vector<CoreThread>& threads,
+    const std::vector<std::pair<uint64_t, uint8_t>>& patches) {
+  auto mappings = ReadMappings(pid);
+  auto notes = BuildNotes(pid, threads, mappings);
+
+  // ELF header, program headers and notes, then the memory page aligned
+  auto phnum = mappings.size() + 1;
+  auto notes_offset = sizeof(Elf64_Ehdr) + phnum * sizeof(Elf64_Phdr);
+  uint64_t offset =
+      (notes_offset + notes.size() + kPageSize - 1) & ~(kPageSize - 1ULL);
+  std::vector<Elf64_Phdr> phdrs(phnum);
+  phdrs[0].p_type = PT_NOTE;
+  phdrs[0].p_offset = notes_offset;
+  phdrs[0].p_filesz = notes.size();
+  phdrs[0].p_align = kNoteAlign;
+  CoreDumpStats stats;
+  for (size_t i = 0; i < mappings.size(); i++) {
+    auto& phdr = phdrs[i + 1];
+    phdr.p_type = PT_LOAD;
+    phdr.p_flags = mappings[i].flags;
+    phdr.p_offset = offset;
+    phdr.p_vaddr = mappings[i].start;
+    phdr.p_filesz = phdr.p_memsz = mappings[i].end - mappings[i].start;
+    phdr.p_align = kPageSize;
+    offset += phdr.p_filesz;
+    stats.bytes += phdr.p_filesz;
+  }
+  stats.mappings = mappings.size();
+
+  auto fd = open(path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    throw std::runtime_error("Cannot create " + path);
+  }
+  // Allocate the blocks up front: a full disk would otherwise only show
+  // as SIGBUS when the mapping below is written to
+  if (auto error = posix_fallocate(fd, 0, offset); error != 0) {
+    close(fd);
+    unlink(path.c_str());
+    throw std::runtime_error("Cannot allocate " + std::to_string(offset) +
+                             " bytes for " + path + ": " + strerror(error));
+  }
+  auto* file = static_cast<uint8_t*>(
+      mmap(nullptr, offset, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0));
+  close(fd);
+  if (file == MAP_FAILED) {
+    throw std::runtime_error("Cannot map " + path);
+  }
+
+  Elf64_Ehdr ehdr{};
+  std::memcpy(ehdr.e_ident, ELFMAG, SELFMAG);
+  ehdr.e_ident[EI_CLASS] = ELFCLASS64;
+  ehdr.e_ident[EI_DATA] = ELFDATA2LSB;
+  ehdr.e_ident[EI_VERSION] = EV_CURRENT;
+  ehdr.e_ident[EI_OSABI] = ELFOSABI_NONE;
+  ehdr.e_type = ET_CORE;
+  ehdr.e_machine = EM_X86_64;
+  ehdr.e_version = EV_CURRENT;
+  ehdr.e_phoff = sizeof(Elf64_Ehdr);
+  ehdr.e_ehsize = sizeof(Elf64_Ehdr);
+  ehdr.e_phentsize = sizeof(Elf64_Phdr);
+  ehdr.e_phnum = phnum;
+  std::memcpy(file, &ehdr, sizeof(ehdr));
+  std::memcpy(file + ehdr.e_phoff, phdrs.data(),
+              phdrs.size() * sizeof(Elf64_Phdr));
+  std::memcpy(file + notes_offset, notes.data(), notes.size());
+
+  std::vector<Chunk> chunks;
+  for (size_t i = 1; i < phdrs.size(); i++) {
+    for (uint64_t done = 0; done < phdrs[i].p_filesz; done += kChunkSize) {
+      chunks.push_back(
+          {phdrs[i].p_vaddr + done, file + phdrs[i].p_offset + done,
+           std::min<size_t>(kChunkSize, phdrs[i].p_filesz - done)});
+    }
+  }
+  stats.unreadable = CopyChunks(pid, chunks);
+
+  for (const auto& [addr, byte] : patches) {
+    for (size_t i = 1; i < phdrs.size(); i++) {
+      if (addr >= phdrs[i].p_vaddr &&
+          addr < phdrs[i].p_vaddr + phdrs[i].p_filesz) {
+        file[phdrs[i].p_offset + addr - phdrs[i].p_vaddr] = byte;
+      }
+    }
+  }
+  munmap(file, offset);
+  return stats;
+}
+
+CoreFile::CoreFile(const std::string& path) {
+  fd_ = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  struct stat st {};
+  if (fd_ < 0 || fstat(fd_, &st) != 0) {
+    throw std::runtime_error("Cannot open " + path);
+  }
+  size_ = st.st_size;
+  auto* data = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd_, 0);
+  if (size_ < sizeof(Elf64_Ehdr) || data == MAP_FAILED) {
+    close(fd_);
+    throw std::runtime_error("Cannot map " + path);
+  }
+  data_ = static_cast<const uint8_t*>(data);
+
+  const auto* ehdr = reinterpret_cast<const Elf64_Ehdr*>(data_);
+  if (std::memcmp(ehdr->e_ident, ELFMAG, SELFMAG) != 0 ||
+      ehdr->e_ident[EI_CLASS] != ELFCLASS64 || ehdr->e_type != ET_CORE ||
+      ehdr->e_machine != EM_X86_64 ||
+      ehdr->e_phoff + ehdr->e_phnum * sizeof(Elf64_Phdr) > size_) {
+    munmap(data, size_);
+    close(fd_);
+    throw std::runtime_error(path + " is not an x86-64 core file");
+  }
+  const auto* phdrs =
+      reinterpret_cast<const Elf64_Phdr*>(data_ + ehdr->e_phoff);
+  for (int i = 0; i < ehdr->e_phnum; i++) {
+    const auto& phdr = phdrs[i];
+    // Truncated cores keep the part that made it to disk
+    uint64_t filesz = 0;
+    if (phdr.p_offset < size_) {
+      filesz = std::min<uint64_t>(phdr.p_filesz, size_ - phdr.p_offset);
+    }
+    if (phdr.p_type == PT_LOAD) {
+      segments_.push_back(
+          {phdr.p_vaddr, phdr.p_memsz, filesz, data_ + phdr.p_offset});
+    } else if (phdr.p_type == PT_NOTE) {
+      ParseNotes(data_ + phdr.p_offset, filesz);
+    }
+  }
+  std::sort(segments_.begin(), segments_.end(),
+            [](const auto& a, const auto& b) { return a.vaddr < b.vaddr; });
+  if (threads_.empty()) {
+    munmap(data, size_);
+    close(fd_);
+    throw std::runtime_error(path + " has no threads");
+  }
+}
+
+CoreFile::~CoreFile() {
+  munmap(const_cast<uint8_t*>(data_), size_);
+  close(fd_);
+}
+
+void CoreFile::ParseNotes(const uint8_t* notes, size_t size) {
+  auto align = [](size_t n) {
+    return (n + kNoteAlign - 1) & ~(kNoteAlign - 1);
+  };
+  size_t pos = 0;
+  while (pos + sizeof(Elf64_Nhdr) <= size) {
+    const auto* header = reinterpret_cast<const Elf64_Nhdr*>(notes + pos);
+    auto desc_pos = pos + sizeof(Elf64_Nhdr) + align(header->n_namesz);
+    if (desc_pos + header->n_descsz > size) {
+      break;
+    }
+    const auto* desc = notes + desc_pos;
+    if (header->n_type == NT_PRSTATUS &&
+        header->n_descsz >= sizeof(elf_prstatus)) {
+      elf_prstatus status;
+      std::memcpy(&status, desc, sizeof(status));
+      CoreThread thread{};
+      thread.tid = status.pr_pid;
+      thread.signal = status.pr_cursig;
+      std::memcpy(&thread.regs, &status.pr_reg, sizeof(thread.regs));
+      threads_.push_back(thread);
+      if (pid_ == 0) {
+        pid_ = status.pr_pid;
+      }
+    } else if (header->n_type == NT_PRPSINFO &&
+               header->n_descsz >= sizeof(elf_prpsinfo)) {
+      elf_prpsinfo info;
+      std::memcpy(&info, desc, sizeof(info));
+      pid_ = info.pr_pid;
+    } else if (header->n_type == NT_FPREGSET && !threads_.empty() &&
+               header->n_descsz >= sizeof(user_fpregs_struct)) {
+      std::memcpy(&threads_.back().fpregs, desc, sizeof(user_fpregs_struct));
+    } else if (header->n_type == NT_AUXV) {
+      for (size_t i = 0; i + 16 <= header->n_descsz; i += 16) {
+        uint64_t entry[2];
+        std::memcpy(entry, desc + i, sizeof(entry));
+        auxv_.emplace_back(entry[0], entry[1]);
+      }
+    }
+    pos = align(desc_pos + header->n_descsz);
+  }
+}
+
+void CoreFile::ReadMemory(uint64_t addr, void* buf, size_t len) {
+  auto* out = static_cast<uint8_t*>(buf);
+  while (len != 0) {
+    // Last segment starting at or below addr
+    auto it = std::upper_bound(
+        segments_.begin(), segments_.end(), addr,
+        [](uint64_t a, const Segment& s) { return a < s.vaddr; });
+    if (it == segments_.begin() || addr >= std::prev(it)->vaddr +
+                                               std::prev(it)->memsz) {
+      std::stringstream msg;
+      msg << "Address 0x" << std::hex << addr << " is not in the core file";
+      throw std::runtime_error(msg.str());
+    }
+    const auto& segment = *std::prev(it);
+    auto offset = addr - segment.vaddr;
+    auto n = std::min<uint64_t>(len, segment.memsz - offset);
+    // Memory the core does not contain, e.g. unmodified file pages, reads
+    // as zeros
+    auto in_file =
+        offset < segment.filesz ? std::min(n, segment.filesz - offset) : 0;
+    std::memcpy(out, segment.data + offset, in_file);
+    std::memset(out + in_file, 0, n - in_file);
+    out += n;
+    addr += n;
+    len -= n;
+  }
+}
+
+uint64_t CoreFile::ReadRegister(pid_t tid, Register::Reg r) {
+  for (const auto& thread : threads_) {
+    if (thread.tid == tid) {
+      uint64_t value;
+      std::memcpy(&value,
+                  reinterpret_cast<const uint8_t*>(&thread.regs) +
+                      static_cast<size_t>(r) * sizeof(uint64_t),
+                  sizeof(value));
+      return value;
+    }
+  }
+  throw std::runtime_error("No thread " + std::to_string(tid) +
+                           " in the core file");
+}
+
+pid_t CoreFile::Pid() const { return pid_; }
+
+const std::vector<CoreThread>& CoreFile::Threads() const { return threads_; }
+
+uint64_t CoreFile::EntryPoint() const {
+  for (const auto& [type, value] : auxv_) {
+    if (type == AT_ENTRY) {
+      return value;
+    }
+  }
+  return 0;
+}
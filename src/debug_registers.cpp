@@ -0,0 +1,122 @@
+#include "debug_registers.h"
+
+#include <sys/user.h>
+
+#include <algorithm>
+#include <cstddef>
+#include <stdexcept>
+
+#include "ptrace_wrapper.h"
+
+const auto kDr6 = 6;
+const auto kDr7 = 7;
+const auto kDr7ControlShift = 16;
+const auto kDr7ControlBits = 4;
+
+namespace {
+
+// DR7 LEN field encoding
+uint64_t EncodeLength(int len) {
+  switch (len) {
+    case 1:
+      return 0b00;
+    case 2:
+      return 0b01;
+    case 4:
+      return 0b11;
+    case 8:
+      return 0b10;
+    default:
+      throw std::runtime_error("Watch length must be 1, 2, 4 or 8");
+  }
+}
+
+}  // namespace
+
+void DebugRegisters::AddThread(pid_t tid) {
+  if (std::find(threads_.begin(), threads_.end(), tid) != threads_.end()) {
+    return;
+  }
+  threads_.push_back(tid);
+  for (int slot = 0; slot < kSlots; slot++) {
+    if (slots_[slot].used) {
+      WriteDebugRegister(tid, slot, slots_[slot].addr);
+    }
+  }
+  if (dr7_ != 0) {
+    WriteDebugRegister(tid, kDr7, dr7_);
+  }
+}
+
+void DebugRegisters::RemoveThread(pid_t tid) {
+  threads_.erase(std::remove(threads_.begin(), threads_.end(), tid),
+                 threads_.end());
+}
+
+int DebugRegisters::Set(uint64_t addr, WatchKind kind, int len) {
+  if (kind == WatchKind::execute) {
+    len = 1;
+  }
+  auto length_bits = EncodeLength(len);
+  if (addr % len != 0) {
+    throw std::runtime_error("Watched address must be aligned to its length");
+  }
+
+  int slot = 0;
+  while (slot < kSlots && slots_[slot].used) {
+    slot++;
+  }
+  if (slot == kSlots) {
+    throw std::runtime_error("All hardware breakpoint slots are in use");
+  }
+
+  WriteDebugRegister(slot, addr);
+  auto shift = kDr7ControlShift + slot * kDr7ControlBits;
+  dr7_ &= ~(0xfULL << shift);
+  dr7_ |= (static_cast<uint64_t>(kind) | (length_bits << 2)) << shift;
+  dr7_ |= 1ULL << (slot * 2);  // local enable
+  WriteDebugRegister(kDr7, dr7_);
+
+  slots_[slot] = Slot{true, addr, kind, len, 0};
+  return slot;
+}
+
+void DebugRegisters::Clear(int slot) {
+  if (slot < 0 || slot >= kSlots || !slots_[slot].used) {
+    throw std::runtime_error("No hardware breakpoint in that slot");
+  }
+  dr7_ &= ~(1ULL << (slot * 2));
+  WriteDebugRegister(kDr7, dr7_);
+  slots_[slot].used = false;
+}
+
+int DebugRegisters::TriggeredSlot(pid_t tid) {
+  auto dr6 = ReadDebugRegister(tid, kDr6);
+  WriteDebugRegister(tid, kDr6, 0);
+  for (int slot = 0; slot < kSlots; slot++) {
+    if ((dr6 & (1ULL << slot)) != 0 && slots_[slot].used) {
+      return slot;
+    }
+  }
+  return -1;
+}
+
+DebugRegisters::Slot& DebugRegisters::Get(int slot) { return slots_.at(slot); }
+
+bool DebugRegisters::InUse() const { return dr7_ != 0; }
+
+uint64_t DebugRegisters::ReadDebugRegister(pid_t tid, int n) {
+  auto offset = offsetof(struct user, u_debugreg) + n * sizeof(uint64_t);
+  return Ptrace(PTRACE_PEEKUSER, tid, offset, nullptr);
+}
+
+void DebugRegisters::WriteDebugRegister(pid_t tid, int n, uint64_t value) {
+  auto offset = offsetof(struct user, u_debugreg) + n * sizeof(uint64_t);
+  Ptrace(PTRACE_POKEUSER, tid, offset, value);
+}
+
+void DebugRegisters::WriteDebugRegister(int n, uint64_t value) const {
+  for (auto tid : threads_) {
+    WriteDebugRegister(tid, n, value);
+  }
+}
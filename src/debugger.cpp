@@ -1,51 +1,39 @@
 #include "debugger.h"
 
+#include <dirent.h>
 #include <sys/ptrace.h>
 #include <sys/user.h>
 #include <sys/wait.h>
 
+#include <cstring>
+#include <chrono>
+#include <cstdlib>
 #include <fstream>
+#include <future>
+#include <iomanip>
 #include <iostream>
+#include <regex>
 #include <sstream>
+#include <thread>
 
 #include "breakpoint.h"
+#include "command_server.h"
+#include "core_file.h"
+#include "gdb_server.h"
+#include "index_cache.h"
 #include "linenoise.h"
+#include "memory.h"
+#include "ptrace_wrapper.h"
 #include "registers.h"
+#include "stats.h"
+#include "x86_decoder.h"
 
 const auto kHexBase = 16;
 const auto kRegisterCount = 27;
-const auto kRetAddressOffset = 8;
-
-namespace Register {
-const std::unordered_map<Reg, std::pair<std::string, int>> register_lookup = {
-    {r15, {"r15", 15}},
-    {r14, {"r14", 14}},
-    {r13, {"r13", 13}},
-    {r12, {"r12", 12}},
-    {rbp, {"rbp", 6}},
-    {rbx, {"rbx", 3}},
-    {r11, {"r11", 11}},
-    {r10, {"r10", 10}},
-    {r9, {"r9", 9}},
-    {r8, {"r8", 8}},
-    {rax, {"rax", 0}},
-    {rcx, {"rcx", 2}},
-    {rdx, {"rdx", 1}},
-    {rsi, {"rsi", 4}},
-    {rdi, {"rdi", 5}},
-    {orig_rax, {"orig_rax", -1}},
-    {rip, {"rip", -1}},
-    {cs, {"cs", 51}},
-    {eflags, {"eflags", 49}},
-    {rsp, {"rsp", 7}},
-    {ss, {"ss", 52}},
-    {fs_base, {"fs_base", 58}},
-    {gs_base, {"gs_base", 59}},
-    {ds, {"ds", 53}},
-    {es, {"es", 50}},
-    {fs, {"fs", 54}},
-    {gs, {"gs", 55}}};
-}  // namespace Register
+const auto kMaxArgs = 64;
+const auto kListLines = 10;
+const auto kMaxFrames = 256;
+const auto kMaxInstructionLength = 15;
 
 std::string to_string(SymbolType st) {
   switch (st) {
@@ -63,118 +51,946 @@ std::string to_string(SymbolType st) {
   return "";
 }
 
+std::vector<pid_t> ListThreads(pid_t pid) {
+  std::vector<pid_t> tids;
+  auto path = "/proc/" + std::to_string(pid) + "/task";
+  auto* dir = opendir(path.c_str());
+  if (dir == nullptr) {
+    return tids;
+  }
+  while (auto* entry = readdir(dir)) {
+    if (entry->d_name[0] != '.') {
+      tids.push_back(std::stoi(entry->d_name));
+    }
+  }
+  closedir(dir);
+  return tids;
+}
+
+// Evaluates DWARF locations against the stopped thread's registers, or
+// against those of frame when one is given.
 class PtraceExprContext : public dwarf::expr_context {
  public:
-  explicit PtraceExprContext(pid_t pid, uint64_t load_address)
-      : pid_{pid}, load_address_{load_address} {}
+  explicit PtraceExprContext(Target* target, uint64_t load_address,
+                             pid_t tid,
+                             const Unwinder::Frame* frame = nullptr)
+      : target_{target},
+        load_address_{load_address},
+        tid_{tid},
+        frame_{frame} {}
 
   dwarf::taddr reg(unsigned regnum) override {
+    if (frame_ != nullptr) {
+      if (regnum >= Unwinder::kRegisters ||
+          (frame_->valid & (1u << regnum)) == 0) {
+        throw std::runtime_error("Register not saved in this frame");
+      }
+      return frame_->regs[regnum];
+    }
     auto it = std::find_if(
         begin(Register::register_lookup), end(Register::register_lookup),
         [regnum](auto& p) { return (p.second.second == regnum); });
     if (it == end(Register::register_lookup)) {
       throw std::out_of_range("Dwarf register not found!");
     }
-    struct user_regs_struct regs;
-    ptrace(PTRACE_GETREGS, pid_, nullptr, &regs);
-    return *(reinterpret_cast<uint64_t*>(&regs) +
-             static_cast<size_t>((*it).first));
+    return target_->ReadRegister(tid_, (*it).first);
   }
 
   dwarf::taddr pc() override {
-    struct user_regs_struct regs;
-    ptrace(PTRACE_GETREGS, pid_, nullptr, &regs);
-    return regs.rip - load_address_;
+    if (frame_ != nullptr) {
+      return frame_->pc - frame_->return_address - load_address_;
+    }
+    return target_->ReadRegister(tid_, Register::rip) - load_address_;
   }
 
   dwarf::taddr deref_size(dwarf::taddr address, unsigned size) override {
-    // name TODO take into account size
-    return ptrace(PTRACE_PEEKDATA, pid_, address + load_address_, nullptr);
+    dwarf::taddr value = 0;
+    target_->ReadMemory(address + load_address_, &value,
+                        std::min<size_t>(size, sizeof(value)));
+    return value;
   }
 
  private:
-  pid_t pid_;
+  Target* target_;
   uint64_t load_address_;
+  pid_t tid_;
+  const Unwinder::Frame* frame_;
 };
 
-SymbolType to_symbol_type(elf::stt sym) {
-  switch (sym) {
-    case elf::stt::notype:
-      return SymbolType::notype;
-    case elf::stt::object:
-      return SymbolType::object;
-    case elf::stt::func:
-      return SymbolType::func;
-    case elf::stt::section:
-      return SymbolType::section;
-    case elf::stt::file:
-      return SymbolType::file;
-    default:
-      return SymbolType::notype;
+// Where a variable of a compiled expression lives
+struct DwarfExpressionVariable : ExpressionVariable {
+  explicit DwarfExpressionVariable(Debugger::VariableLocation location)
+      : location{std::move(location)} {}
+  Debugger::VariableLocation location;
+};
+
+// Feeds breakpoint conditions from the stopped tracee
+class DebuggerExprContext : public ExpressionContext {
+ public:
+  explicit DebuggerExprContext(Debugger* debugger) : debugger_{debugger} {}
+
+  uint64_t ReadRegister(Register::Reg r) override {
+    return debugger_->GetRegister(r);
+  }
+
+  uint64_t ReadMemory(uint64_t addr) override {
+    return debugger_->GetMemory(addr);
+  }
+
+  uint64_t ReadVariable(const ExpressionVariable& var) override {
+    return debugger_->ReadExpressionVariable(
+        static_cast<const DwarfExpressionVariable&>(var).location);
+  }
+
+ private:
+  Debugger* debugger_;
+};
+
+std::vector<symbol> Debugger::LookupSymbol(const std::string& name) const {
+  return symbol_index_.get().Lookup(name);
+}
+
+void Debugger::PrintSymbolForAddress(uint64_t addr) const {
+  symbol sym;
+  uint64_t offset = 0;
+  if (!symbol_index_.get().FindByAddress(SubtractLoadAddress(addr), &sym,
+                                        &offset)) {
+    std::cout << "No symbol matches 0x" << std::hex << addr << std::endl;
+    return;
   }
+  std::cout << (sym.demangled.empty() ? sym.name : sym.demangled) << " + 0x"
+            << std::hex << offset << " (" << to_string(sym.type) << ")"
+            << std::endl;
 }
 
-std::vector<symbol> Debugger::LookupSymbol(const std::string& name) {
-  std::vector<symbol> syms;
+void Debugger::StartServer(const std::string& socket_path) {
+  CommandServer server{this, socket_path};
+  server.Run();
+  if (attached_ && !exited_) {
+    Detach();
+  }
+}
 
-  for (const auto& sec : elf_.sections()) {
-    if (sec.get_hdr().type != elf::sht::symtab &&
-        sec.get_hdr().type != elf::sht::dynsym) {
-      continue;
+Json Debugger::ExecuteJson(const std::string& cmd_line) {
+  auto result = Json::Object();
+  auto cmd_argv = SplitCommand(cmd_line);
+  if (cmd_argv.empty()) {
+    return result;
+  }
+  CommandTimer timer{cmd_argv[0]};
+
+  // Text the command prints is returned as "output"
+  std::ostringstream output;
+  struct Redirect {
+    std::ostream& stream;
+    std::streambuf* saved;
+    ~Redirect() { stream.rdbuf(saved); }
+  };
+  Redirect redirect_out{std::cout, std::cout.rdbuf(output.rdbuf())};
+  Redirect redirect_err{std::cerr, std::cerr.rdbuf(output.rdbuf())};
+
+  const auto& cmd = cmd_argv[0];
+  if (cmd == "registers-dump" && cmd_argv.size() == 1) {
+    auto& registers = result["registers"] = Json::Object();
+    for (const auto& [reg, info] : Register::register_lookup) {
+      registers[info.first] = Json::Hex(GetRegister(reg));
     }
-
-    for (auto sym_iter = sec.as_symtab().begin();
-         sym_iter != sec.as_symtab().end(); sym_iter++) {
-      auto sym = *sym_iter;
-      if (sym.get_name() == name || name == "*") {
-        const auto& d = sym.get_data();
-        syms.push_back(
-            symbol{to_symbol_type(d.type()), sym.get_name(), d.value});
+  } else if (cmd == "read-register" && cmd_argv.size() == 2) {
+    result["value"] = Json::Hex(GetRegister(cmd_argv[1]));
+  } else if (cmd == "read-memory" &&
+             (cmd_argv.size() == 2 || cmd_argv.size() == 3)) {
+    auto addr = std::stoul(cmd_argv[1], 0, kHexBase);
+    auto len = cmd_argv.size() == 3 ? std::stoul(cmd_argv[2], 0, 0)
+                                     : sizeof(uint64_t);
+    static const char kDigits[] = "0123456789abcdef";
+    std::string hex;
+    std::vector<uint8_t> bytes(len);
+    target_->ReadMemory(addr, bytes.data(), len);
+    for (auto byte : bytes) {
+      hex += kDigits[byte >> 4];
+      hex += kDigits[byte & 0xf];
+    }
+    result["address"] = Json::Hex(addr);
+    result["bytes"] = hex;
+  } else if (cmd == "backtrace" && cmd_argv.size() <= 2) {
+    auto max_frames =
+        cmd_argv.size() == 2 ? std::stoul(cmd_argv[1]) : kMaxFrames;
+    auto& frames = result["frames"] = Json::Array();
+    auto unwound = UnwindStack(CurrentThread(), max_frames);
+    for (size_t n = 0; n < unwound.size(); n++) {
+      auto pc = unwound[n].pc - unwound[n].return_address;
+      auto frame = Json::Object();
+      frame["number"] = static_cast<uint64_t>(n);
+      frame["pc"] = Json::Hex(unwound[n].pc);
+      frame["function"] = FunctionName(pc);
+      if (const auto* line = pc_index_.FindLine(SubtractLoadAddress(pc))) {
+        frame["file"] = std::string(pc_index_.File(*line));
+        frame["line"] = line->line;
       }
+      frames.Push(std::move(frame));
     }
+  } else if (cmd == "variables" && cmd_argv.size() == 1) {
+    auto& vars = result["variables"] = Json::Array();
+    for (const auto& var : GetVariables()) {
+      auto v = Json::Object();
+      v["name"] = var.name;
+      v["location"] = var.location;
+      v["value"] = Json::Hex(var.value);
+      vars.Push(std::move(v));
+    }
+  } else if (cmd == "stats" && cmd_argv.size() == 2 &&
+             cmd_argv[1] == "json") {
+    result["stats"] = debugger_stats.ToJson();
+  } else {
+    ProcessCommand(cmd_line);
+  }
+  if (!output.str().empty()) {
+    result["output"] = output.str();
   }
-  return syms;
+  return result;
+}
+
+void Debugger::StatsCommand(const std::vector<std::string>& args) {
+  if (args.empty()) {
+    debugger_stats.Print(std::cout);
+  } else if ((args[0] == "on" || args[0] == "off") && args.size() == 1) {
+    stats_enabled = args[0] == "on";
+  } else if (args[0] == "reset" && args.size() == 1) {
+    debugger_stats.Reset();
+  } else if (args[0] == "json" && args.size() == 1) {
+    std::cout << debugger_stats.ToJson().Dump() << std::endl;
+  } else if (args[0] == "json") {
+    std::ofstream out{args[1]};
+    if (!out) {
+      throw std::runtime_error("Cannot open " + args[1]);
+    }
+    out << debugger_stats.ToJson().Dump() << std::endl;
+  } else {
+    throw std::runtime_error("Usage: stats [on|off|reset|json [file]]");
+  }
+}
+
+void Debugger::StartGdbServer(const std::string& address) {
+  RequireLiveProcess();
+  GdbServer server{this, address};
+  server.Run();
 }
 
 void Debugger::StartRepl() {
   char* line_read = nullptr;
   while ((line_read = linenoise("(db) > ")) != nullptr) {
     linenoiseHistoryAdd(line_read);
-    ProcessCommand(line_read);
+    auto ptrace_calls_before = ptrace_call_count;
+    auto memory_syscalls_before = memory_syscall_count;
+    try {
+      ProcessCommand(line_read);
+    } catch (std::exception& e) {
+      std::cerr << e.what() << std::endl;
+    }
+    if (show_ptrace_count_) {
+      std::cout << std::dec << "[" << ptrace_call_count - ptrace_calls_before
+                << " ptrace calls, "
+                << memory_syscall_count - memory_syscalls_before
+                << " memory syscalls]" << std::endl;
+    }
     linenoiseFree(line_read);
   }
+  if (attached_ && !exited_) {
+    Detach();
+  }
+}
+
+void Debugger::Attach(pid_t pid) {
+  if (!threads_.empty() && !exited_) {
+    throw std::runtime_error("Already debugging process " +
+                             std::to_string(pid_) + ", detach first");
+  }
+  struct stat exe {};
+  struct stat binary {};
+  auto exe_path = "/proc/" + std::to_string(pid) + "/exe";
+  if (stat(exe_path.c_str(), &exe) != 0 || stat(binary_name_, &binary) != 0 ||
+      exe.st_dev != binary.st_dev || exe.st_ino != binary.st_ino) {
+    throw std::runtime_error("Process " + std::to_string(pid) +
+                             " is not running " + binary_name_);
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  StopRecording();
+  pid_ = pid;
+  current_tid_ = reported_tid_ = pid;
+  memory_.SetPid(pid);
+  debug_registers_ = DebugRegisters();
+  displaced_.Reset();
+  threads_.clear();
+  exited_ = false;
+
+  // PTRACE_SEIZE leaves the threads running. Threads cloned by a seized
+  // thread are followed through PTRACE_O_TRACECLONE, rescan until no
+  // thread that was not seized yet turns up.
+  for (bool seized = true; seized;) {
+    seized = false;
+    for (auto tid : ListThreads(pid)) {
+      if (threads_.count(tid) != 0) {
+        continue;
+      }
+      if (Ptrace(PTRACE_SEIZE, tid, nullptr, kPtraceOptions) != 0) {
+        if (tid == pid) {
+          auto error = std::string(strerror(errno));
+          pid_ = 0;
+          threads_.clear();
+          throw std::runtime_error("Cannot attach to " + std::to_string(pid) +
+                                   ": " + error);
+        }
+        // Exited or already followed from its parent
+        continue;
+      }
+      threads_.try_emplace(tid, tid).first->second.running = true;
+      seized = true;
+    }
+  }
+  StopAllThreads();
+  for (const auto& [tid, thread] : threads_) {
+    debug_registers_.AddThread(tid);
+  }
+  load_address_ = GetLoadAddress();
+  attached_ = true;
+
+  // Breakpoints kept from before a detach go back in
+  BreakpointBatch batch{&memory_};
+  for (auto& [addr, bp] : breakpoints_) {
+    batch.Enable(&bp);
+  }
+  batch.Commit();
+
+  std::chrono::duration<double, std::milli> elapsed =
+      std::chrono::steady_clock::now() - start;
+  std::cout << "Attached to process " << std::dec << pid << ", "
+            << threads_.size() << " threads stopped in " << std::fixed
+            << std::setprecision(2) << elapsed.count() << " ms"
+            << std::defaultfloat << std::endl;
+  PrintCurrentSource();
+}
+
+void Debugger::Detach() {
+  CurrentThread();  // throws if there is no process
+  if (core_) {
+    std::cout << "Closed the core file of process " << std::dec << pid_
+              << std::endl;
+    threads_.clear();
+    pid_ = 0;
+    core_ = false;
+    target_ = std::make_unique<ProcessTarget>(&memory_, &threads_);
+    return;
+  }
+  auto start = std::chrono::steady_clock::now();
+  StopRecording();
+
+  // Every thread is stopped at the prompt, so nothing can run into a
+  // breakpoint while they are taken out. User breakpoints stay listed for
+  // the next attach.
+  StopFunctionTrace();
+  BreakpointBatch batch{&memory_};
+  for (auto& [addr, bp] : breakpoints_) {
+    batch.Disable(&bp);
+  }
+  batch.Commit();
+  std::erase_if(breakpoints_,
+                [](const auto& bp) { return bp.second.IsTemporary(); });
+  for (int slot = 0; slot < DebugRegisters::kSlots; slot++) {
+    if (debug_registers_.Get(slot).used) {
+      debug_registers_.Clear(slot);
+    }
+  }
+
+  for (auto& [tid, thread] : threads_) {
+    thread.registers.Flush();
+    uint64_t signal = thread.pending_signal;
+    Ptrace(PTRACE_DETACH, tid, nullptr, signal);
+  }
+
+  std::chrono::duration<double, std::milli> elapsed =
+      std::chrono::steady_clock::now() - start;
+  std::cout << "Detached from process " << std::dec << pid_ << ", "
+            << threads_.size() << " threads resumed in " << std::fixed
+            << std::setprecision(2) << elapsed.count() << " ms"
+            << std::defaultfloat << std::endl;
+  threads_.clear();
+  pid_ = 0;
+  attached_ = false;
+}
+
+void Debugger::OpenCore(const std::string& path) {
+  if (!threads_.empty() && !exited_) {
+    throw std::runtime_error("Already debugging process " +
+                             std::to_string(pid_) + ", detach first");
+  }
+  auto core = std::make_unique<CoreFile>(path);
+  StopRecording();
+  threads_.clear();
+  for (const auto& t : core->Threads()) {
+    auto& thread = threads_.try_emplace(t.tid, t.tid).first->second;
+    thread.stop_reason = t.signal != 0 ? strsignal(t.signal) : "core";
+  }
+  pid_ = core->Pid();
+  current_tid_ = reported_tid_ = core->Threads().front().tid;
+  selected_frame_ = 0;
+  exited_ = false;
+  attached_ = false;
+  // Nothing may reach a process through these by mistake
+  memory_.SetPid(0);
+  debug_registers_ = DebugRegisters();
+  displaced_.Reset();
+  // A PIE binary's load address is where its entry point ended up
+  load_address_ = 0;
+  if (elf_.get_hdr().type == elf::et::dyn) {
+    load_address_ = core->EntryPoint() - elf_.get_hdr().entry;
+  }
+  auto signal = core->Threads().front().signal;
+  std::cout << "Core of process " << std::dec << pid_ << ", "
+            << threads_.size() << " threads";
+  if (signal != 0) {
+    std::cout << ", stopped by " << strsignal(signal);
+  }
+  std::cout << std::endl;
+  target_ = std::move(core);
+  core_ = true;
+  PrintCurrentSource();
+}
+
+void Debugger::RequireLiveProcess() const {
+  if (core_) {
+    throw std::runtime_error("Not possible on a core file");
+  }
+  if (record_log_.Replaying()) {
+    throw std::runtime_error(
+        "Not possible while replaying the record log, use record-stop");
+  }
+}
+
+void Debugger::WriteCoreFile(const std::string& path) {
+  CurrentThread();  // throws if there is no process
+  RequireLiveProcess();
+  // The thread that stopped goes first, debuggers show it as current
+  std::vector<CoreThread> threads;
+  auto add = [&threads](TracedThread& thread) {
+    CoreThread t{};
+    t.tid = thread.tid;
+    t.signal = thread.pending_signal;
+    t.regs = thread.registers.GetAll();
+    Ptrace(PTRACE_GETFPREGS, thread.tid, nullptr, &t.fpregs);
+    threads.push_back(t);
+  };
+  add(CurrentThread());
+  for (auto& [tid, thread] : threads_) {
+    if (tid != current_tid_) {
+      add(thread);
+    }
+  }
+  // The core shows the code without the int3s
+  std::vector<std::pair<uint64_t, uint8_t>> patches;
+  for (const auto& [addr, bp] : breakpoints_) {
+    if (bp.IsEnabled()) {
+      patches.emplace_back(addr, bp.GetOriginalByte());
+    }
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  auto stats = WriteCore(path, pid_, threads, patches);
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  const auto kMiB = 1024.0 * 1024;
+  std::cout << "Wrote " << std::dec << std::fixed << std::setprecision(1)
+            << stats.bytes / kMiB << " MiB from " << stats.mappings
+            << " mappings to " << path << " in " << elapsed.count() * 1000
+            << " ms (" << stats.bytes / kMiB / elapsed.count() << " MiB/s)"
+            << std::defaultfloat << std::endl;
+  if (stats.unreadable != 0) {
+    std::cout << stats.unreadable << " bytes could not be read and are zeros"
+              << std::endl;
+  }
+}
+
+void Debugger::TakeCheckpoint() {
+  auto& thread = CurrentThread();
+  RequireLiveProcess();
+  if (exited_) {
+    throw std::runtime_error("The process has exited");
+  }
+  auto start = std::chrono::steady_clock::now();
+  auto pid = ForkTracee(&thread, &memory_, kPtraceOptions);
+  Ptrace(PTRACE_SETOPTIONS, pid, nullptr, kCheckpointOptions);
+  // The snapshot gets whatever breakpoints are set when it is restarted
+  Memory snapshot{pid};
+  for (const auto& [addr, bp] : breakpoints_) {
+    if (bp.IsEnabled()) {
+      auto byte = bp.GetOriginalByte();
+      snapshot.WriteText(addr, &byte, 1);
+    }
+  }
+  std::chrono::duration<double, std::milli> elapsed =
+      std::chrono::steady_clock::now() - start;
+
+  auto pc = thread.registers.Get(Register::rip);
+  auto n = next_checkpoint_++;
+  const auto& checkpoint =
+      checkpoints_.emplace(n, Checkpoint{pid, pc, FunctionName(pc)})
+          .first->second;
+  std::cout << "Checkpoint " << std::dec << n << ": process " << pid
+            << " at 0x" << std::hex << pc << " in " << checkpoint.function
+            << ", taken in " << std::fixed << std::setprecision(2)
+            << elapsed.count() << " ms" << std::defaultfloat << std::endl;
+  if (threads_.size() > 1) {
+    std::cout << "Only thread " << std::dec << thread.tid
+              << " is in the checkpoint" << std::endl;
+  }
+}
+
+void Debugger::RestartCheckpoint(int n) {
+  RequireLiveProcess();
+  auto checkpoint = checkpoints_.find(n);
+  if (checkpoint == checkpoints_.end()) {
+    throw std::runtime_error("No checkpoint " + std::to_string(n));
+  }
+  auto live = !threads_.empty() && !exited_;
+  if (live && attached_) {
+    throw std::runtime_error("Process " + std::to_string(pid_) +
+                             " was attached to, detach before restarting");
+  }
+  auto start = std::chrono::steady_clock::now();
+  TracedThread snapshot{checkpoint->second.pid};
+  Memory snapshot_memory{checkpoint->second.pid};
+  auto pid = ForkTracee(&snapshot, &snapshot_memory, kCheckpointOptions);
+  Ptrace(PTRACE_SETOPTIONS, pid, nullptr, kPtraceOptions);
+  StopRecording();
+
+  if (live) {
+    kill(pid_, SIGKILL);
+    while (!exited_) {
+      Wait();
+    }
+  }
+  if (pid_ != 0) {
+    debug_registers_.RemoveThread(pid_);
+  }
+  pid_ = pid;
+  current_tid_ = reported_tid_ = pid;
+  memory_.SetPid(pid);
+  displaced_.Reset();
+  threads_.clear();
+  threads_.try_emplace(pid, pid).first->second.stop_reason = "restarted";
+  debug_registers_.AddThread(pid);
+  selected_frame_ = 0;
+  exited_ = false;
+
+  // The copy has no breakpoints in: writing back the bytes they replaced
+  // changes nothing, then the int3s go in. Function tracing stops with the
+  // process it was tracing.
+  StopFunctionTrace();
+  std::erase_if(breakpoints_,
+                [](const auto& bp) { return bp.second.IsTemporary(); });
+  std::vector<Breakpoint*> enabled;
+  BreakpointBatch lift{&memory_};
+  for (auto& [addr, bp] : breakpoints_) {
+    if (bp.IsEnabled()) {
+      lift.Disable(&bp);
+      enabled.push_back(&bp);
+    }
+  }
+  lift.Commit();
+  BreakpointBatch insert{&memory_};
+  for (auto* bp : enabled) {
+    insert.Enable(bp);
+  }
+  insert.Commit();
+
+  std::chrono::duration<double, std::milli> elapsed =
+      std::chrono::steady_clock::now() - start;
+  std::cout << "Restarted checkpoint " << std::dec << n << " as process "
+            << pid << " in " << std::fixed << std::setprecision(2)
+            << elapsed.count() << " ms" << std::defaultfloat << std::endl;
+  PrintCurrentSource();
+}
+
+void Debugger::PrintCheckpoints() const {
+  for (const auto& [n, checkpoint] : checkpoints_) {
+    std::cout << std::dec << n << "  process " << checkpoint.pid << "  0x"
+              << std::hex << checkpoint.pc << "  " << checkpoint.function
+              << std::endl;
+  }
 }
 
-void Debugger::HandleSigtrap(siginfo_t siginfo) const {
+void Debugger::Record(const std::string& location) {
+  auto& thread = CurrentThread();
+  RequireLiveProcess();
+  if (thread.pending_signal != 0) {
+    throw std::runtime_error(std::string("The thread has a pending ") +
+                             strsignal(thread.pending_signal) +
+                             ", continue it first");
+  }
+  auto stops = ResolveLocation(location);
+  std::unordered_set<std::uintptr_t> stop_at(stops.begin(), stops.end());
+  auto tid = thread.tid;
+  record_log_.Start(tid, thread.registers.GetAll());
+  target_ = std::make_unique<ReplayTarget>(&record_log_, &memory_, &threads_);
+
+  // Other threads stay stopped, so only this one and the kernel change
+  // memory meanwhile
+  auto start = std::chrono::steady_clock::now();
+  std::unordered_map<std::uintptr_t, Instruction> decoded;
+  std::string reason;
+  while (true) {
+    auto pc = thread.registers.Get(Register::rip);
+    auto insn = decoded.find(pc);
+    if (insn == decoded.end()) {
+      auto text = ReadText(pc, kMaxInstructionLength);
+      Instruction decoded_insn;
+      if (!DecodeInstruction(text.data(), text.size(), &decoded_insn)) {
+        reason = "at an instruction it cannot decode";
+        break;
+      }
+      insn = decoded.emplace(pc, decoded_insn).first;
+    }
+    if (!WritesModelled(insn->second, thread.registers.GetAll())) {
+      reason = "at system call " +
+               std::to_string(thread.registers.Get(Register::rax)) +
+               ", whose writes to memory it cannot log";
+      break;
+    }
+    // A breakpoint under the instruction is lifted for the step
+    auto bp = breakpoints_.find(pc);
+    auto lifted = bp != breakpoints_.end() && bp->second.IsEnabled();
+    if (lifted) {
+      bp->second.Disable();
+    }
+    auto status = RecordStep(&record_log_, &thread, &memory_, insn->second);
+    if (!WIFSTOPPED(status)) {
+      HandleThreadEvent(tid, status, false);
+      reason = "as the thread exited";
+      break;
+    }
+    if (lifted) {
+      bp->second.Enable();
+    }
+    if (WSTOPSIG(status) != SIGTRAP || status >> 16 != 0) {
+      // A signal, or an event such as a new thread. The instruction did
+      // not complete and is not logged.
+      HandleThreadEvent(tid, status, true);
+      StopAllThreads();
+      reason = std::string("by ") + strsignal(WSTOPSIG(status));
+      break;
+    }
+    pc = thread.registers.Get(Register::rip);
+    if (stop_at.count(pc) != 0) {
+      break;
+    }
+    bp = breakpoints_.find(pc);
+    if (bp != breakpoints_.end() && bp->second.IsEnabled() &&
+        !bp->second.IsTemporary()) {
+      reason = "at a breakpoint";
+      break;
+    }
+  }
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+
+  auto count = record_log_.Size();
+  auto bytes = record_log_.Bytes();
+  std::cout << "Recorded " << std::dec << count << " instructions in "
+            << std::fixed << std::setprecision(1) << elapsed.count() * 1000
+            << " ms (" << std::setprecision(0) << count / elapsed.count()
+            << " instructions/s), log of " << bytes << " bytes ("
+            << std::setprecision(2)
+            << static_cast<double>(bytes) / std::max<size_t>(count, 1)
+            << " per instruction)" << std::defaultfloat << std::endl;
+  if (!reason.empty()) {
+    std::cout << "Recording stopped " << reason << std::endl;
+  }
+  if (threads_.count(tid) == 0 || exited_) {
+    StopRecording();
+    if (!threads_.empty()) {
+      current_tid_ = threads_.begin()->first;
+    }
+    return;
+  }
+  thread.stop_reason = "recorded";
+  PrintCurrentSource();
+}
+
+void Debugger::StopRecording() {
+  record_log_.Clear();
+  if (!core_) {
+    target_ = std::make_unique<ProcessTarget>(&memory_, &threads_);
+  }
+}
+
+void Debugger::PrintRecordLog() const {
+  if (!record_log_.Active()) {
+    std::cout << "No record log" << std::endl;
+    return;
+  }
+  std::cout << "Record log of thread " << std::dec << record_log_.Tid()
+            << ": " << record_log_.Size() << " instructions in "
+            << record_log_.Bytes() << " bytes, at instruction "
+            << record_log_.Position() << std::endl;
+}
+
+void Debugger::SelectRecordedThread() {
+  if (!record_log_.Active()) {
+    throw std::runtime_error("No record log, use record <location>");
+  }
+  current_tid_ = record_log_.Tid();
+  selected_frame_ = 0;
+}
+
+void Debugger::ReverseStepInstruction() {
+  SelectRecordedThread();
+  if (!record_log_.StepBack()) {
+    std::cout << "No more reverse-execution history" << std::endl;
+  }
+  PrintCurrentSource();
+}
+
+void Debugger::ReverseStep() {
+  SelectRecordedThread();
+  auto line_at_pc = [this] {
+    return pc_index_.FindLine(
+        SubtractLoadAddress(GetRegister(Register::rip)));
+  };
+  auto same_line = [this](const PCIndex::Line* a, const PCIndex::Line* b) {
+    return a != nullptr && b != nullptr && a->line == b->line &&
+           pc_index_.File(*a) == pc_index_.File(*b);
+  };
+
+  // Back out of the current line and through code without line
+  // information, then on to the first instruction of the line reached
+  const auto* start = line_at_pc();
+  const PCIndex::Line* line = nullptr;
+  while (line == nullptr) {
+    if (!record_log_.StepBack()) {
+      std::cout << "No more reverse-execution history" << std::endl;
+      PrintCurrentSource();
+      return;
+    }
+    line = line_at_pc();
+    if (same_line(line, start)) {
+      line = nullptr;
+    }
+  }
+  while (record_log_.StepBack()) {
+    if (!same_line(line_at_pc(), line)) {
+      record_log_.StepForward();
+      break;
+    }
+  }
+  PrintCurrentSource();
+}
+
+void Debugger::ReverseContinue() {
+  SelectRecordedThread();
+  while (record_log_.StepBack()) {
+    auto pc = GetRegister(Register::rip);
+    auto bp = breakpoints_.find(pc);
+    if (bp != breakpoints_.end() && bp->second.IsEnabled() &&
+        !bp->second.IsTemporary() && !bp->second.IsTracepoint()) {
+      std::cout << "**Hit breakpoint at address 0x" << std::hex << pc
+                << "**" << std::endl;
+      PrintCurrentSource();
+      return;
+    }
+  }
+  std::cout << "No more reverse-execution history" << std::endl;
+  PrintCurrentSource();
+}
+
+void Debugger::LoadIndexes() {
+  auto start = std::chrono::steady_clock::now();
+  auto elapsed_ms = [start] {
+    return std::chrono::duration<double, std::milli>(
+               std::chrono::steady_clock::now() - start)
+        .count();
+  };
+
+  IndexCache cache{binary_name_, elf_};
+  SymbolIndex symbols;
+  if (cache.Load(dwarf_, &pc_index_, &symbols)) {
+    std::promise<SymbolIndex> loaded;
+    loaded.set_value(std::move(symbols));
+    symbol_index_ = loaded.get_future().share();
+    index_time_ms_ = elapsed_ms();
+    std::cout << "Debug index loaded from cache in " << std::fixed
+              << std::setprecision(1) << index_time_ms_ << " ms"
+              << std::defaultfloat << std::endl;
+    return;
+  }
+
+  // Index in the background so the prompt comes up straight away, lookups
+  // wait for the parts they need.
+  index_threads_ = std::max(1U, std::thread::hardware_concurrency());
+  if (const auto* threads = std::getenv("DEBUGGER_INDEX_THREADS")) {
+    index_threads_ = std::max(1, std::atoi(threads));
+  }
+  pc_index_.Build(dwarf_, index_threads_);
+  symbol_index_ =
+      std::async(std::launch::async, [this] { return SymbolIndex(elf_); })
+          .share();
+  index_writer_ = std::async(std::launch::async, [this, cache, elapsed_ms] {
+    pc_index_.Wait();
+    symbol_index_.wait();
+    index_time_ms_ = elapsed_ms();
+    cache.Store(pc_index_, symbol_index_.get());
+  });
+  std::cout << "Indexing " << pc_index_.CuCount() << " compilation units on "
+            << index_threads_ << " threads" << std::endl;
+}
+
+void Debugger::PrintIndexInfo() const {
+  std::cout << "Debug index: " << std::dec << pc_index_.ReadyCount() << "/"
+            << pc_index_.CuCount() << " compilation units";
+  if (index_threads_ == 0) {
+    std::cout << ", loaded from cache in ";
+  } else {
+    std::cout << ", " << index_threads_ << " threads, ";
+    std::cout << (index_time_ms_ == 0 ? "in progress" : "built in ");
+  }
+  if (index_time_ms_ != 0) {
+    std::cout << std::fixed << std::setprecision(1) << index_time_ms_ << " ms"
+              << std::defaultfloat;
+  }
+  std::cout << std::endl;
+  std::cout << "Unwind tables: " << unwinder_.FdeCount() << " FDEs, "
+            << unwinder_.CachedFdeCount() << " decoded" << std::endl;
+}
+
+void Debugger::HandleSigtrap(siginfo_t siginfo) {
   switch (siginfo.si_code) {
     case SI_KERNEL:
     case TRAP_BRKPT: {
       auto pc = GetRegister(Register::rip);
       pc--;  // rewind PC to the trap instruction
       SetRegister(Register::rip, pc);
+      auto bp = breakpoints_.find(pc);
+      auto& thread = CurrentThread();
+      thread.stop_reason = "breakpoint";
+      thread.at_breakpoint = bp != breakpoints_.end();
+      if (bp != breakpoints_.end() && HandleFunctionTraceHit(pc)) {
+        auto_resume_ = true;
+        return;
+      }
+      if (bp != breakpoints_.end() && bp->second.IsTracepoint()) {
+        RecordTracepoint(bp->second);
+        auto_resume_ = true;
+        return;
+      }
+      if (bp != breakpoints_.end() && !bp->second.IsTemporary() &&
+          !ShouldStopAtBreakpoint(bp->second)) {
+        auto_resume_ = true;
+        return;
+      }
+      if (bp != breakpoints_.end() && bp->second.IsTemporary()) {
+        // Stepping stop, the stepping command reports where it ended up.
+        // Other threads passing through the stepped code carry on.
+        thread.stop_reason = "step";
+        auto_resume_ = current_tid_ != stepping_tid_;
+        return;
+      }
       std::cout << "**Hit breakpoint at address 0x" << std::hex << pc << "**"
                 << std::endl;
-      auto offset_pc = SubtractLoadAddress(pc);
-      auto line_entry = GetLineEntryFromPC(offset_pc);
-      PrintSource(line_entry->file->path, line_entry->line);
+      PrintCurrentSource();
       return;
     }
     case TRAP_TRACE:
       // Single stepping
+      CurrentThread().stop_reason = "step";
+      return;
+    case TRAP_HWBKPT:
+      CurrentThread().stop_reason = "hardware breakpoint";
+      // The instruction has not run for execute slots and has already run
+      // for watchpoints, so the PC needs no adjustment either way.
+      ReportHardwareBreakpoint();
       return;
     default:
       std::cout << "Unknown SIGTRAP code " << siginfo.si_code << std::endl;
   }
 }
 
-int Debugger::Wait(int* status) const {
-  auto ret = waitpid(pid_, status, 0);
-  auto siginfo = GetSigInfo();
+void Debugger::Wait() {
+  if (exited_) {
+    // Checkpoints are children too, waitpid would block on them
+    std::cout << "Process exited" << std::endl;
+    return;
+  }
+  auto_resume_ = false;
+  selected_frame_ = 0;
+  auto previous_tid = current_tid_;
+  int status = 0;
+  while (true) {
+    auto tid = Waitpid(-1, &status, __WALL);
+    if (tid < 0) {
+      std::cout << "Process exited" << std::endl;
+      exited_ = true;
+      return;
+    }
+    if (HandleThreadEvent(tid, status, false)) {
+      current_tid_ = tid;
+      break;
+    }
+    if (exited_) {
+      return;
+    }
+    if (threads_.count(current_tid_) == 0) {
+      // The thread being stepped has exited
+      current_tid_ = threads_.begin()->first;
+      std::cout << "[Thread " << std::dec << previous_tid << " exited]"
+                << std::endl;
+    }
+    if (std::none_of(threads_.begin(), threads_.end(),
+                     [](const auto& t) { return t.second.running; })) {
+      return;
+    }
+  }
+
+  // Hits passed on without stopping (tracepoints, breakpoints whose
+  // condition is false, ftrace) are handled on the stopped thread alone,
+  // the others only stop when the hit does
+  ReportStop(status);
+  if (auto_resume_) {
+    return;
+  }
+  StopAllThreads();
+  if (exited_) {
+    return;
+  }
+  if (current_tid_ != reported_tid_) {
+    std::cout << "[Switching to thread " << std::dec << current_tid_ << "]"
+              << std::endl;
+    reported_tid_ = current_tid_;
+  }
+}
+
+void Debugger::ReportStop(int status) {
+  auto& thread = CurrentThread();
+  auto event = status >> 16;
+  if (event == PTRACE_EVENT_STOP) {
+    thread.stop_reason = strsignal(WSTOPSIG(status));
+    std::cout << "Stopped by " << thread.stop_reason << std::endl;
+    return;
+  }
+  if (event == PTRACE_EVENT_EXEC) {
+    thread.stop_reason = "exec";
+    displaced_.Reset();
+    std::cout << "Process called exec, its symbols are no longer valid"
+              << std::endl;
+    return;
+  }
+
+  auto siginfo = StopSigInfo(status);
   switch (siginfo.si_signo) {
     case SIGTRAP:
       HandleSigtrap(siginfo);
       break;
     case SIGSEGV: {
+      thread.stop_reason = "segmentation fault";
+      thread.pending_signal = SIGSEGV;
       std::array<std::string, 4> reason{"SEGV_MAPERR", "SEGV_ACCERR",
                                         "SEGV_BNDERR", "SEGV_PKUERR"};
       if (siginfo.si_code > 0 && siginfo.si_code < reason.size()) {
@@ -187,38 +1003,293 @@ int Debugger::Wait(int* status) const {
       break;
     }
     default:
-      std::cout << "Got signal " << strsignal(siginfo.si_signo) << std::endl;
+      thread.stop_reason = strsignal(siginfo.si_signo);
+      thread.pending_signal = siginfo.si_signo;
+      std::cout << "Got signal " << thread.stop_reason << std::endl;
+  }
+}
+
+bool Debugger::HandleThreadEvent(pid_t tid, int status, bool stopping) {
+  auto it = threads_.find(tid);
+  if (WIFEXITED(status) || WIFSIGNALED(status)) {
+    // The leader is reaped only after all other threads are gone
+    if (tid == pid_) {
+      std::cout << "Process exited" << std::endl;
+      exited_ = true;
+      exit_status_ = status;
+    } else if (it != threads_.end()) {
+      debug_registers_.RemoveThread(tid);
+      displaced_.Forget(tid);
+      threads_.erase(it);
+    }
+    return false;
+  }
+  if (!WIFSTOPPED(status)) {
+    return false;
+  }
+  if (it == threads_.end()) {
+    // The first stop of a new thread can overtake the clone event
+    it = threads_.try_emplace(tid, tid).first;
+    it->second.starting = true;
+  }
+  auto& thread = it->second;
+  thread.running = false;
+  thread.registers.Invalidate();
+  if (displaced_.MapBack(&thread)) {
+    // Stopped before it ran the copy, it still has to step past the
+    // breakpoint
+    thread.at_breakpoint = true;
+  }
+
+  auto event = status >> 16;
+  if (thread.starting) {
+    // First stop of a new thread, give it the hardware breakpoints
+    thread.starting = false;
+    debug_registers_.AddThread(tid);
+    if (resume_all_) {
+      ResumeThread(thread, PTRACE_CONT);
+    }
+    return false;
+  }
+  if (event == PTRACE_EVENT_CLONE) {
+    unsigned long new_tid = 0;
+    Ptrace(PTRACE_GETEVENTMSG, tid, nullptr, &new_tid);
+    auto [child, inserted] = threads_.try_emplace(new_tid, new_tid);
+    if (inserted) {
+      // Its first stop is still to come
+      child->second.running = true;
+      child->second.starting = true;
+    }
+    std::cout << "[New thread " << std::dec << new_tid << "]" << std::endl;
+    if (!stopping) {
+      ResumeThread(thread, thread.resume_request);
+    } else {
+      thread.stop_reason = "interrupted";
+    }
+    return false;
+  }
+  if (event == PTRACE_EVENT_STOP && WSTOPSIG(status) == SIGTRAP) {
+    // PTRACE_INTERRUPT. One sent to a thread that stopped for some other
+    // reason first is still pending and fires once it is resumed.
+    if (!stopping) {
+      ResumeThread(thread, thread.resume_request);
+    } else {
+      thread.stop_reason = "interrupted";
+    }
+    return false;
+  }
+  if (!stopping) {
+    return true;
+  }
+
+  // Caught stopping for something else before the interrupt took effect.
+  // Signals are kept to be delivered on resume, a breakpoint is rewound so
+  // it hits again and is reported then.
+  thread.stop_reason = "interrupted";
+  if (event == 0 && WSTOPSIG(status) != SIGTRAP) {
+    thread.pending_signal = WSTOPSIG(status);
+  } else if (event == 0) {
+    siginfo_t info{};
+    Ptrace(PTRACE_GETSIGINFO, tid, nullptr, &info);
+    auto pc = thread.registers.Get(Register::rip) - 1;
+    auto bp = breakpoints_.find(pc);
+    if ((info.si_code == TRAP_BRKPT || info.si_code == SI_KERNEL) &&
+        bp != breakpoints_.end() && bp->second.IsEnabled()) {
+      thread.registers.Set(Register::rip, pc);
+    }
+  }
+  return false;
+}
+
+void Debugger::StopAllThreads() {
+  auto start = std::chrono::steady_clock::now();
+  resume_all_ = false;
+  size_t interrupted = 0;
+  for (auto& [tid, thread] : threads_) {
+    if (thread.running && !thread.starting) {
+      Ptrace(PTRACE_INTERRUPT, tid, nullptr, nullptr);
+      interrupted++;
+    }
+  }
+  while (std::any_of(threads_.begin(), threads_.end(),
+                     [](const auto& t) { return t.second.running; })) {
+    int status = 0;
+    auto tid = Waitpid(-1, &status, __WALL);
+    if (tid < 0) {
+      break;
+    }
+    HandleThreadEvent(tid, status, true);
+    if (exited_) {
+      return;
+    }
+  }
+  if (interrupted != 0) {
+    stop_latency_us_ = std::chrono::duration<double, std::micro>(
+                           std::chrono::steady_clock::now() - start)
+                           .count();
+    stopped_threads_ = interrupted;
+  }
+}
+
+void Debugger::ResumeAllThreads() {
+  // Threads other than the current one that reported a breakpoint are moved
+  // past it out of line. Those that cannot are stepped past it one at a
+  // time, the others staying stopped so none can run through the
+  // breakpoint while it is lifted.
+  std::vector<pid_t> at_breakpoint;
+  for (const auto& [tid, thread] : threads_) {
+    if (tid != current_tid_ && thread.at_breakpoint) {
+      at_breakpoint.push_back(tid);
+    }
+  }
+  auto current = current_tid_;
+  for (auto tid : at_breakpoint) {
+    if (threads_.count(tid) == 0 ||
+        DisplaceBreakpoint(threads_.at(tid)) !=
+            DisplacedStepper::Result::kUnsupported) {
+      continue;
+    }
+    current_tid_ = tid;
+    LiftBreakpoint();
+    if (exited_) {
+      return;
+    }
+  }
+  if (threads_.count(current) != 0) {
+    current_tid_ = current;
+  }
+
+  resume_all_ = true;
+  for (auto& [tid, thread] : threads_) {
+    if (!thread.running) {
+      ResumeThread(thread, PTRACE_CONT);
+    }
+  }
+}
+
+TracedThread& Debugger::CurrentThread() const {
+  if (threads_.empty()) {
+    throw std::runtime_error("No process, use attach <pid>");
+  }
+  return threads_.at(current_tid_);
+}
+
+void Debugger::SelectThread(pid_t tid) {
+  if (threads_.count(tid) == 0) {
+    std::cout << "No thread " << std::dec << tid << std::endl;
+    return;
+  }
+  current_tid_ = tid;
+  reported_tid_ = tid;
+  selected_frame_ = 0;
+  std::cout << "[Current thread is " << std::dec << tid << "]" << std::endl;
+  PrintCurrentSource();
+}
+
+std::string Debugger::FunctionName(uint64_t pc) const {
+  if (const auto* func = pc_index_.FindFunction(SubtractLoadAddress(pc))) {
+    return std::string(pc_index_.Name(*func));
+  }
+  symbol sym;
+  uint64_t offset = 0;
+  if (symbol_index_.get().FindByAddress(SubtractLoadAddress(pc), &sym,
+                                        &offset)) {
+    return sym.demangled.empty() ? sym.name : sym.demangled;
+  }
+  return "??";
+}
+
+void Debugger::PrintThreads() const {
+  for (auto& [tid, thread] : threads_) {
+    auto pc = target_->ReadRegister(tid, Register::rip);
+    std::cout << (tid == current_tid_ ? "* " : "  ") << std::dec << tid
+              << "  0x" << std::hex << pc << "  " << FunctionName(pc) << "  ("
+              << thread.stop_reason << ")" << std::endl;
+  }
+  if (stopped_threads_ != 0) {
+    std::cout << "Last all-stop halted " << std::dec << stopped_threads_
+              << " threads in " << std::fixed << std::setprecision(1)
+              << stop_latency_us_ << " us" << std::defaultfloat << std::endl;
   }
-  return ret;
 }
 
 void Debugger::StepOverBreakpoint() {
-  // Subtract 1 from PC because the interrupt instruction was 1 byte
-  // which is what the PC would have incremented by when it executes the
-  // interrupt
-  auto possible_breakpoint_address = GetRegister(Register::rip);
-
-  if (breakpoints_.count(possible_breakpoint_address) != 0) {
-    auto& bp = breakpoints_[possible_breakpoint_address];
-    if (!bp.IsEnabled()) {
+  switch (DisplaceBreakpoint(CurrentThread())) {
+    case DisplacedStepper::Result::kEmulated:
+      CurrentThread().stop_reason = "step";
+      return;
+    case DisplacedStepper::Result::kDisplaced:
+      // The stop moves the pc from the copy back to the original code
+      SingleStepInstruction();
+      return;
+    case DisplacedStepper::Result::kUnsupported:
+      LiftBreakpoint();
       return;
+  }
+}
+
+void Debugger::LiftBreakpoint() {
+  auto bp = breakpoints_.find(GetRegister(Register::rip));
+  if (bp == breakpoints_.end() || !bp->second.IsEnabled()) {
+    return;
+  }
+  // Undo the trap at the address, take one step and put it back
+  bp->second.Disable();
+  ResumeTracee(PTRACE_SINGLESTEP);
+  Wait();
+  bp->second.Enable();
+}
+
+DisplacedStepper::Result Debugger::DisplaceBreakpoint(TracedThread& thread) {
+  RequireLiveProcess();
+  if (!displaced_stepping_) {
+    return DisplacedStepper::Result::kUnsupported;
+  }
+  auto pc = thread.registers.Get(Register::rip);
+  auto bp = breakpoints_.find(pc);
+  if (bp == breakpoints_.end() || !bp->second.IsEnabled()) {
+    return DisplacedStepper::Result::kUnsupported;
+  }
+  uint8_t code[kMaxInstructionLength];
+  size_t len = sizeof(code);
+  try {
+    memory_.Read(pc, code, len);
+  } catch (const std::runtime_error&) {
+    // The instruction may end right before an unmapped page
+    len = kPageSize - pc % kPageSize;
+    memory_.Read(pc, code, len);
+  }
+  for (size_t i = 0; i < len; i++) {
+    auto other = i == 0 ? bp : breakpoints_.find(pc + i);
+    if (other != breakpoints_.end() && other->second.IsEnabled()) {
+      code[i] = other->second.GetOriginalByte();
     }
-    // Set PC to the breakpoint address
-    SetRegister(Register::rip, possible_breakpoint_address);
-    // Undo the trap at the address
-    bp.Disable();
-    // Take one step and re-enable breakpoint
-    ptrace(PTRACE_SINGLESTEP, pid_, nullptr, nullptr);
-    Wait();
-    bp.Enable();
   }
+  return displaced_.Displace(&thread, pc, code, len);
 }
 
 void Debugger::SingleStepInstruction() {
-  ptrace(PTRACE_SINGLESTEP, pid_, nullptr, nullptr);
+  ResumeTracee(PTRACE_SINGLESTEP);
   Wait();
 }
 
+void Debugger::ResumeTracee(enum __ptrace_request request) const {
+  ResumeThread(CurrentThread(), request);
+}
+
+void Debugger::ResumeThread(TracedThread& thread,
+                            enum __ptrace_request request) const {
+  RequireLiveProcess();
+  record_log_.Clear();
+  thread.registers.Flush();
+  thread.running = true;
+  thread.at_breakpoint = false;
+  thread.resume_request = request;
+  uint64_t signal = thread.pending_signal;
+  thread.pending_signal = 0;
+  Ptrace(request, thread.tid, nullptr, signal);
+}
+
 void Debugger::SingleStepInstructionWithBreakpointCheck() {
   if (breakpoints_.count(GetRegister(Register::rip)) != 0) {
     StepOverBreakpoint();
@@ -234,79 +1305,271 @@ void Debugger::RemoveBreakpoint(std::uintptr_t addr) {
   breakpoints_.erase(addr);
 }
 
-void Debugger::StepOut() {
-  auto frame_pointer = GetRegister(Register::rbp);
-  auto return_address = GetMemory(frame_pointer + kRetAddressOffset);
+std::vector<std::uintptr_t> Debugger::InsertTemporaryBreakpoints(
+    const std::vector<std::uintptr_t>& addrs) {
+  RequireLiveProcess();
+  std::vector<std::uintptr_t> inserted;
+  stepping_tid_ = current_tid_;
+  BreakpointBatch batch{&memory_};
+  for (auto addr : addrs) {
+    if (ftrace_owned_.erase(addr) != 0) {
+      // Borrow the ftrace breakpoint so the step stops there
+      breakpoints_.at(addr).SetTemporary(true);
+      inserted.push_back(addr);
+      continue;
+    }
+    if (breakpoints_.count(addr) != 0) {
+      continue;
+    }
+    auto& bp = breakpoints_[addr] = Breakpoint(&memory_, addr, true);
+    batch.Enable(&bp);
+    inserted.push_back(addr);
+  }
+  batch.Commit();
+  return inserted;
+}
+
+void Debugger::RemoveBreakpoints(const std::vector<std::uintptr_t>& addrs) {
+  BreakpointBatch batch{&memory_};
+  std::vector<std::uintptr_t> removed;
+  for (auto addr : addrs) {
+    if (ftrace_entries_.count(addr) != 0 || ftrace_returns_.count(addr) != 0) {
+      // Still needed by ftrace, hand it over rather than remove it
+      breakpoints_.at(addr).SetTemporary(false);
+      ftrace_owned_.insert(addr);
+      continue;
+    }
+    batch.Disable(&breakpoints_.at(addr));
+    removed.push_back(addr);
+  }
+  batch.Commit();
+  for (auto addr : removed) {
+    breakpoints_.erase(addr);
+  }
+}
 
-  bool should_remove_breakpoint = false;
-  if (breakpoints_.count(return_address) == 0) {
-    SetBreakpointAtAddress(return_address);
-    should_remove_breakpoint = true;
+void Debugger::StepOut() {
+  auto frames = UnwindStack(CurrentThread(), 2);
+  if (frames.size() < 2) {
+    throw std::runtime_error("No caller frame to return to");
   }
+  auto to_delete = InsertTemporaryBreakpoints({frames[1].pc});
 
   Continue();
 
-  if (should_remove_breakpoint) {
-    RemoveBreakpoint(return_address);
-  }
+  FinishStep(to_delete);
 }
 
-void Debugger::StepIn() {
+void Debugger::SingleStepToNextLine() {
   auto line =
-      GetLineEntryFromPC(SubtractLoadAddress(GetRegister(Register::rip)))->line;
-  while (GetLineEntryFromPC(SubtractLoadAddress(GetRegister(Register::rip)))
-             ->line == line) {
+      GetLineEntryFromPC(SubtractLoadAddress(GetRegister(Register::rip))).line;
+  while (!exited_ &&
+         GetLineEntryFromPC(SubtractLoadAddress(GetRegister(Register::rip)))
+                 .line == line) {
     SingleStepInstructionWithBreakpointCheck();
   }
-  auto line_entry =
-      GetLineEntryFromPC(SubtractLoadAddress(GetRegister(Register::rip)));
-  PrintSource(line_entry->file->path, line_entry->line);
+}
+
+void Debugger::StepIn() {
+  if (!range_stepping_) {
+    SingleStepToNextLine();
+    PrintCurrentSource();
+    return;
+  }
+  auto pc = GetRegister(Register::rip);
+  auto line = GetLineEntryFromPC(SubtractLoadAddress(pc)).line;
+  const auto& func = GetFunctionFromPC(SubtractLoadAddress(pc));
+
+  // The rows of the current line and the rows of every other line, which
+  // are where control lands when it leaves the current one.
+  std::vector<std::pair<uint64_t, uint64_t>> line_ranges;
+  std::vector<std::uintptr_t> stops;
+  for (const auto& row : pc_index_.LinesInRange(func.low, func.high)) {
+    if (row.line == line) {
+      line_ranges.emplace_back(load_address_ + row.address,
+                               load_address_ + row.end);
+    } else {
+      stops.push_back(load_address_ + row.address);
+    }
+  }
+  auto in_line = [&line_ranges](uint64_t addr) {
+    return std::any_of(line_ranges.begin(), line_ranges.end(),
+                       [addr](const auto& r) {
+                         return addr >= r.first && addr < r.second;
+                       });
+  };
+
+  // Direct branches and calls out of the line get a breakpoint on their
+  // target. Where the target is only known at run time (indirect branches,
+  // returns) the instruction itself is single-stepped.
+  std::unordered_set<std::uintptr_t> step_points;
+  for (const auto& [low, high] : line_ranges) {
+    auto text = ReadText(low, high - low);
+    for (size_t offset = 0; offset < text.size();) {
+      Instruction insn;
+      if (!DecodeInstruction(&text[offset], text.size() - offset, &insn)) {
+        SingleStepToNextLine();
+        PrintCurrentSource();
+        return;
+      }
+      auto addr = low + offset;
+      switch (insn.kind) {
+        case Instruction::Kind::kCall:
+        case Instruction::Kind::kJump:
+        case Instruction::Kind::kCondJump: {
+          auto target = insn.BranchTarget(addr);
+          // Calls into code without line information (e.g. through the
+          // PLT) are stepped over
+          if (!in_line(target) &&
+              (insn.kind != Instruction::Kind::kCall ||
+               pc_index_.FindLine(SubtractLoadAddress(target)) != nullptr)) {
+            stops.push_back(target);
+          }
+          break;
+        }
+        case Instruction::Kind::kIndirectCall:
+        case Instruction::Kind::kIndirectJump:
+        case Instruction::Kind::kReturn:
+          step_points.insert(addr);
+          stops.push_back(addr);
+          break;
+        default:
+          break;
+      }
+      offset += insn.length;
+    }
+  }
+
+  auto to_delete = InsertTemporaryBreakpoints(stops);
+  // Return addresses of calls into code without line information
+  std::unordered_set<std::uintptr_t> resume_points;
+
+  while (!exited_) {
+    pc = GetRegister(Register::rip);
+    if (step_points.count(pc) != 0) {
+      SingleStepInstructionWithBreakpointCheck();
+      if (exited_) {
+        break;
+      }
+      pc = GetRegister(Register::rip);
+      if (!in_line(pc)) {
+        if (pc_index_.FindLine(SubtractLoadAddress(pc)) != nullptr) {
+          break;
+        }
+        // An indirect call into code without line information, let it run
+        // until it comes back
+        auto return_address = GetMemory(GetRegister(Register::rsp));
+        if (!in_line(return_address)) {
+          break;
+        }
+        resume_points.insert(return_address);
+        auto added = InsertTemporaryBreakpoints({return_address});
+        to_delete.insert(to_delete.end(), added.begin(), added.end());
+      }
+      if (step_points.count(pc) != 0) {
+        continue;
+      }
+    }
+    Continue();
+    pc = GetRegister(Register::rip);
+    if (step_points.count(pc) == 0 && resume_points.count(pc) == 0) {
+      break;
+    }
+  }
+
+  FinishStep(to_delete);
+}
+
+std::vector<uint8_t> Debugger::ReadText(uintptr_t addr, size_t len) const {
+  std::vector<uint8_t> text(len);
+  target_->ReadMemory(addr, text.data(), len);
+  for (const auto& [bp_addr, bp] : breakpoints_) {
+    if (bp.IsEnabled() && bp_addr >= addr && bp_addr < addr + len) {
+      text[bp_addr - addr] = bp.GetOriginalByte();
+    }
+  }
+  return text;
+}
+
+void Debugger::FinishStep(const std::vector<std::uintptr_t>& temporaries) {
+  if (exited_) {
+    return;
+  }
+  auto pc = GetRegister(Register::rip);
+  auto bp = breakpoints_.find(pc);
+  // A user breakpoint or signal stop has been reported already
+  bool report = bp != breakpoints_.end() && bp->second.IsTemporary();
+  RemoveBreakpoints(temporaries);
+  if (report || breakpoints_.count(pc) == 0) {
+    PrintCurrentSource();
+  }
+}
+
+void Debugger::PrintCurrentSource() {
+  const auto* line_entry =
+      pc_index_.FindLine(SubtractLoadAddress(GetRegister(Register::rip)));
+  if (line_entry != nullptr) {
+    PrintSource(std::string(pc_index_.File(*line_entry)), line_entry->line);
+  }
 }
 
 void Debugger::StepOver() {
-  auto func =
+  const auto& func =
       GetFunctionFromPC(SubtractLoadAddress(GetRegister(Register::rip)));
-  auto func_entry = dwarf::at_low_pc(func);
-  auto func_end = dwarf::at_high_pc(func);
-
-  auto line = GetLineEntryFromPC(func_entry);
-  auto start_line =
+  const auto& start_line =
       GetLineEntryFromPC(SubtractLoadAddress(GetRegister(Register::rip)));
 
-  std::vector<std::uintptr_t> to_delete{};
-
-  while (line->address < func_end) {
-    auto load_address = load_address_ + line->address;
-    if (line->address != start_line->address &&
-        breakpoints_.count(load_address) == 0) {
-      SetBreakpointAtAddress(load_address);
-      to_delete.push_back(load_address);
+  std::vector<std::uintptr_t> stops;
+  for (const auto& line : pc_index_.LinesInRange(func.low, func.high)) {
+    if (line.address != start_line.address) {
+      stops.push_back(load_address_ + line.address);
     }
-    ++line;
   }
 
-  auto frame_pointer = GetRegister(Register::rbp);
-  auto return_address = GetMemory(frame_pointer + kRetAddressOffset);
-  if (breakpoints_.count(return_address) == 0) {
-    SetBreakpointAtAddress(return_address);
-    to_delete.push_back(return_address);
+  // Returning from the function ends the step too
+  auto frames = UnwindStack(CurrentThread(), 2);
+  if (frames.size() == 2) {
+    stops.push_back(frames[1].pc);
   }
 
+  auto to_delete = InsertTemporaryBreakpoints(stops);
+
   Continue();
 
-  for (auto addr : to_delete) {
-    RemoveBreakpoint(addr);
-  }
+  FinishStep(to_delete);
 }
 
 void Debugger::Continue() {
-  StepOverBreakpoint();
-  ptrace(PTRACE_CONT, pid_, nullptr, nullptr);
-  Wait();
+  // Breakpoints whose condition or ignore count says not to stop ask for
+  // the tracee to be resumed straight away.
+  do {
+    // Past a breakpoint out of line without a stop if possible
+    if (DisplaceBreakpoint(CurrentThread()) ==
+        DisplacedStepper::Result::kUnsupported) {
+      // After a hit that was passed on the other threads are still
+      // running, and would run through the lifted breakpoint
+      StopAllThreads();
+      if (exited_) {
+        return;
+      }
+      LiftBreakpoint();
+    }
+    if (exited_) {
+      return;
+    }
+    ResumeAllThreads();
+    Wait();
+  } while (auto_resume_ && !exited_);
 }
 
 void Debugger::SetBreakpointAtAddress(std::uintptr_t addr) {
-  Breakpoint b(pid_, addr);
+  RequireLiveProcess();
+  if (breakpoints_.count(addr) != 0) {
+    std::cout << "Breakpoint already set at address : 0x" << std::hex << addr
+              << std::endl;
+    return;
+  }
+  Breakpoint b(&memory_, addr);
   b.Enable();
   breakpoints_[addr] = b;
   std::cout << "Breakpoint set at address : 0x" << std::hex << addr
@@ -315,6 +1578,11 @@ void Debugger::SetBreakpointAtAddress(std::uintptr_t addr) {
 
 bool Debugger::MatchCmd(std::vector<std::string>& input, const std::string& cmd,
                         int num_args) {
+  return MatchCmd(input, cmd, num_args, num_args);
+}
+
+bool Debugger::MatchCmd(std::vector<std::string>& input, const std::string& cmd,
+                        int min_args, int max_args) {
   // If input is longer, there are garbage character at the end
   if (input[0].size() > cmd.size()) {
     return false;
@@ -325,8 +1593,13 @@ bool Debugger::MatchCmd(std::vector<std::string>& input, const std::string& cmd,
   }
 
   // Check there are right number of arguments
-  if (input.size() != num_args + 1) {
-    std::cerr << cmd << " takes " << num_args << " arguments." << std::endl;
+  if (input.size() < static_cast<size_t>(min_args) + 1 ||
+      input.size() > static_cast<size_t>(max_args) + 1) {
+    std::cerr << cmd << " takes " << min_args;
+    if (max_args != min_args) {
+      std::cerr << " to " << max_args;
+    }
+    std::cerr << " arguments." << std::endl;
     return false;
   }
 
@@ -345,28 +1618,48 @@ std::vector<std::string> Debugger::SplitCommand(const std::string& cmd,
 }
 
 void Debugger::ReadVariables() {
-  auto func =
-      GetFunctionFromPC(SubtractLoadAddress(GetRegister(Register::rip)));
+  for (const auto& var : GetVariables()) {
+    std::cout << var.name << " (" << var.location << ") = " << std::hex
+              << var.value << std::endl;
+  }
+}
+
+std::vector<Debugger::VariableValue> Debugger::GetVariables() {
+  // Variables of the selected frame, found through its registers
+  std::vector<Unwinder::Frame> frames;
+  const Unwinder::Frame* frame = nullptr;
+  auto pc = GetRegister(Register::rip);
+  if (selected_frame_ != 0) {
+    frames = UnwindStack(CurrentThread(), selected_frame_ + 1);
+    if (frames.size() <= selected_frame_) {
+      throw std::runtime_error("Selected frame no longer exists");
+    }
+    frame = &frames[selected_frame_];
+    pc = frame->pc - frame->return_address;
+  }
+  auto func = GetFunctionDie(GetFunctionFromPC(SubtractLoadAddress(pc)));
 
+  std::vector<VariableValue> vars;
   for (const auto& die : func) {
     if (die.tag == dwarf::DW_TAG::variable) {
       auto loc_val = die[dwarf::DW_AT::location];
       if (loc_val.get_type() == dwarf::value::type::exprloc) {
-        PtraceExprContext context{pid_, load_address_};
+        PtraceExprContext context{target_.get(), load_address_,
+                                  CurrentThread().tid, frame};
         auto result = loc_val.as_exprloc().evaluate(&context);
         switch (result.location_type) {
           case dwarf::expr_result::type::address: {
-            auto value = GetMemory(result.value);
-            std::cout << dwarf::at_name(die) << " (0x" << std::hex
-                      << result.value << ") = " << value << std::endl;
+            std::stringstream location;
+            location << "0x" << std::hex << result.value;
+            vars.push_back(VariableValue{dwarf::at_name(die), location.str(),
+                                         GetMemory(result.value)});
             break;
           }
-          case dwarf::expr_result::type::reg: {
-            auto value = GetRegisterFromDwarfRegister(result.value);
-            std::cout << dwarf::at_name(die) << " (reg" << result.value
-                      << ") = " << value << std::endl;
+          case dwarf::expr_result::type::reg:
+            vars.push_back(VariableValue{dwarf::at_name(die),
+                                         "reg" + std::to_string(result.value),
+                                         context.reg(result.value)});
             break;
-          }
           default:
             throw std::runtime_error("Unhandled variable location");
         }
@@ -375,6 +1668,365 @@ void Debugger::ReadVariables() {
       }
     }
   }
+  return vars;
+}
+
+Debugger::VariableLocation Debugger::FindVariable(uint64_t pc,
+                                                 const std::string& name) {
+  OpTimer timer{StatOp::kDwarf};
+  auto func = GetFunctionDie(GetFunctionFromPC(SubtractLoadAddress(pc)));
+
+  for (const auto& die : func) {
+    if ((die.tag != dwarf::DW_TAG::variable &&
+         die.tag != dwarf::DW_TAG::formal_parameter) ||
+        !die.has(dwarf::DW_AT::name) || dwarf::at_name(die) != name) {
+      continue;
+    }
+    auto loc_val = die[dwarf::DW_AT::location];
+    if (loc_val.get_type() != dwarf::value::type::exprloc) {
+      throw std::runtime_error("Unhandled variable location");
+    }
+    VariableLocation var{loc_val.as_exprloc(), sizeof(uint64_t), false};
+    if (die.has(dwarf::DW_AT::type)) {
+      auto type = dwarf::at_type(die);
+      if (type.has(dwarf::DW_AT::byte_size)) {
+        var.size = type[dwarf::DW_AT::byte_size].as_uconstant();
+      }
+      if (type.has(dwarf::DW_AT::encoding)) {
+        auto encoding = type[dwarf::DW_AT::encoding].as_uconstant();
+        var.is_signed =
+            encoding == static_cast<uint64_t>(dwarf::DW_ATE::signed_) ||
+            encoding == static_cast<uint64_t>(dwarf::DW_ATE::signed_char);
+      }
+    }
+    return var;
+  }
+  throw std::runtime_error("No variable named " + name);
+}
+
+uint64_t Debugger::GetVariableAddress(const std::string& name,
+                                      int* size) {
+  auto var = FindVariable(GetRegister(Register::rip), name);
+  PtraceExprContext context{target_.get(), load_address_,
+                            CurrentThread().tid};
+  auto result = var.location.evaluate(&context);
+  if (result.location_type != dwarf::expr_result::type::address) {
+    throw std::runtime_error("Variable " + name + " is not in memory");
+  }
+  *size = var.size;
+  return result.value;
+}
+
+uint64_t Debugger::ReadExpressionVariable(const VariableLocation& var) {
+  PtraceExprContext context{target_.get(), load_address_,
+                            CurrentThread().tid};
+  auto result = var.location.evaluate(&context);
+
+  uint64_t value = 0;
+  switch (result.location_type) {
+    case dwarf::expr_result::type::address:
+      target_->ReadMemory(result.value, &value,
+                          std::min<size_t>(var.size, sizeof(value)));
+      break;
+    case dwarf::expr_result::type::reg:
+      value = GetRegisterFromDwarfRegister(result.value);
+      break;
+    default:
+      throw std::runtime_error("Unhandled variable location");
+  }
+  // Narrow signed integers need sign extension for comparisons to work
+  if (var.is_signed && var.size < sizeof(value)) {
+    auto shift = 64 - var.size * 8;
+    value = static_cast<int64_t>(value << shift) >> shift;
+  }
+  return value;
+}
+
+std::shared_ptr<const Expression> Debugger::CompileExpression(
+    uint64_t pc, const std::string& source) {
+  auto resolver = [this, pc](const std::string& name) {
+    return std::make_shared<const DwarfExpressionVariable>(
+        FindVariable(pc, name));
+  };
+  return std::make_shared<const Expression>(
+      Expression::Compile(source, resolver));
+}
+
+bool Debugger::ShouldStopAtBreakpoint(Breakpoint& bp) {
+  if (!bp.RegisterHit()) {
+    return false;
+  }
+  const auto* condition = bp.GetCondition();
+  if (condition == nullptr) {
+    return true;
+  }
+  auto start = std::chrono::steady_clock::now();
+  try {
+    DebuggerExprContext context{this};
+    auto result = condition->Evaluate(&context);
+    bp.AddConditionTime(std::chrono::steady_clock::now() - start);
+    return result != 0;
+  } catch (std::exception& e) {
+    std::cerr << "Error evaluating condition: " << e.what() << std::endl;
+    return true;
+  }
+}
+
+void Debugger::RecordTracepoint(Breakpoint& bp) {
+  if (!bp.RegisterHit()) {
+    return;
+  }
+  auto& record = trace_buffer_.Append();
+  record.time_ns = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                       std::chrono::steady_clock::now().time_since_epoch())
+                       .count();
+  record.addr = GetRegister(Register::rip);
+  record.tid = current_tid_;
+  record.failed = 0;
+  const auto& exprs = bp.GetTrace();
+  record.count = exprs.size();
+  DebuggerExprContext context{this};
+  for (size_t i = 0; i < exprs.size(); i++) {
+    try {
+      record.values[i] = exprs[i]->Evaluate(&context);
+    } catch (std::exception&) {
+      record.values[i] = 0;
+      record.failed |= 1u << i;
+    }
+  }
+}
+
+void Debugger::SetTracepoint(const std::string& location,
+                             const std::string& exprs) {
+  std::vector<std::string> sources;
+  std::stringstream ss{exprs};
+  std::string source;
+  while (std::getline(ss, source, ',')) {
+    sources.push_back(source);
+  }
+  if (sources.empty() || sources.size() > TraceBuffer::kMaxValues) {
+    throw std::runtime_error("A tracepoint records 1 to " +
+                             std::to_string(TraceBuffer::kMaxValues) +
+                             " expressions");
+  }
+  RequireLiveProcess();
+  for (auto addr : ResolveLocation(location)) {
+    if (breakpoints_.count(addr) != 0) {
+      throw std::runtime_error("Breakpoint already set at " + location);
+    }
+    // Compile first so a bad expression leaves no tracepoint behind
+    std::vector<std::shared_ptr<const Expression>> compiled;
+    for (const auto& s : sources) {
+      compiled.push_back(CompileExpression(addr, s));
+    }
+    Breakpoint bp(&memory_, addr);
+    bp.SetTrace(std::move(compiled));
+    bp.Enable();
+    breakpoints_[addr] = bp;
+    std::cout << "Tracepoint set at address : 0x" << std::hex << addr
+              << std::endl;
+  }
+}
+
+void Debugger::DumpTrace(std::ostream& out) const {
+  auto size = trace_buffer_.Size();
+  out << std::dec << size << " records, "
+      << trace_buffer_.Total() - size << " overwritten";
+  if (size > 1) {
+    auto span_ns =
+        trace_buffer_.At(size - 1).time_ns - trace_buffer_.At(0).time_ns;
+    if (span_ns != 0) {
+      out << ", " << std::fixed << std::setprecision(0)
+          << (size - 1) * 1e9 / span_ns << " hits/s" << std::defaultfloat;
+    }
+  }
+  out << std::endl;
+  for (size_t i = 0; i < size; i++) {
+    const auto& record = trace_buffer_.At(i);
+    // Names come from the tracepoint, which may since have been removed
+    auto bp = breakpoints_.find(record.addr);
+    auto names = bp != breakpoints_.end() ? bp->second.GetTrace().size() : 0;
+    out << std::dec << record.time_ns << " " << record.tid << " 0x" << std::hex
+        << record.addr;
+    for (size_t v = 0; v < record.count; v++) {
+      out << " ";
+      if (v < names) {
+        out << bp->second.GetTrace()[v]->GetSource() << "=";
+      }
+      if (record.failed & (1u << v)) {
+        out << "<error>";
+      } else {
+        out << "0x" << record.values[v];
+      }
+    }
+    out << std::endl;
+  }
+}
+
+void Debugger::StartFunctionTrace(const std::string& regex) {
+  RequireLiveProcess();
+  StopFunctionTrace();
+  function_tracer_.Clear();
+  std::regex pattern{regex};
+  // DIEs are not safe to walk while the index workers are
+  pc_index_.Wait();
+  BreakpointBatch batch{&memory_};
+  size_t shared = 0;
+  for (const auto& cu : dwarf_.compilation_units()) {
+    for (const auto& die : cu.root()) {
+      if (die.tag != dwarf::DW_TAG::subprogram ||
+          !die.has(dwarf::DW_AT::low_pc)) {
+        continue;
+      }
+      auto name = DieName(die);
+      if (!std::regex_search(name, pattern)) {
+        continue;
+      }
+      // The return address is only at the top of the stack before the
+      // prologue, so this traps on the first instruction
+      auto addr = load_address_ + dwarf::at_low_pc(die);
+      if (ftrace_entries_.count(addr) != 0) {
+        continue;
+      }
+      ftrace_entries_[addr] = function_tracer_.AddFunction(name);
+      if (breakpoints_.count(addr) != 0) {
+        shared++;
+        continue;
+      }
+      auto& bp = breakpoints_[addr] = Breakpoint(&memory_, addr);
+      batch.Enable(&bp);
+      ftrace_owned_.insert(addr);
+    }
+  }
+  batch.Commit();
+  std::cout << std::dec << "Tracing " << ftrace_entries_.size()
+            << " functions";
+  if (shared != 0) {
+    std::cout << ", " << shared << " of them sharing a breakpoint";
+  }
+  std::cout << std::endl;
+}
+
+void Debugger::StopFunctionTrace() {
+  BreakpointBatch batch{&memory_};
+  for (auto addr : ftrace_owned_) {
+    batch.Disable(&breakpoints_.at(addr));
+  }
+  batch.Commit();
+  for (auto addr : ftrace_owned_) {
+    breakpoints_.erase(addr);
+  }
+  ftrace_owned_.clear();
+  ftrace_entries_.clear();
+  ftrace_returns_.clear();
+}
+
+bool Debugger::HandleFunctionTraceHit(std::uintptr_t pc) {
+  auto now = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                 std::chrono::steady_clock::now().time_since_epoch())
+                 .count();
+  auto sp = GetRegister(Register::rsp);
+  if (auto entry = ftrace_entries_.find(pc); entry != ftrace_entries_.end()) {
+    function_tracer_.OnEntry(current_tid_, entry->second,
+                             sp + sizeof(uint64_t), now);
+    auto return_address = GetMemory(sp);
+    if (ftrace_returns_.insert(return_address).second &&
+        breakpoints_.count(return_address) == 0) {
+      Breakpoint bp(&memory_, return_address);
+      bp.Enable();
+      breakpoints_[return_address] = bp;
+      ftrace_owned_.insert(return_address);
+    }
+  }
+  if (ftrace_returns_.count(pc) != 0) {
+    function_tracer_.OnReturn(current_tid_, sp, now);
+  }
+  return ftrace_owned_.count(pc) != 0;
+}
+
+void Debugger::PrintBreakpoints() const {
+  for (const auto& [addr, bp] : breakpoints_) {
+    if (bp.IsTemporary() || ftrace_owned_.count(addr) != 0) {
+      continue;
+    }
+    std::cout << "0x" << std::hex << addr << std::dec
+              << " hits: " << bp.GetHitCount();
+    if (bp.GetIgnoreCount() != 0) {
+      std::cout << " ignore next: " << bp.GetIgnoreCount();
+    }
+    if (bp.IsTracepoint()) {
+      std::cout << " trace:";
+      for (const auto& expr : bp.GetTrace()) {
+        std::cout << " " << expr->GetSource();
+      }
+    }
+    if (const auto* condition = bp.GetCondition()) {
+      auto total_ns = bp.GetConditionTime().count();
+      std::cout << " if " << condition->GetSource()
+                << " (condition time: " << total_ns / 1000 << " us";
+      if (bp.GetHitCount() != 0) {
+        std::cout << ", " << total_ns / bp.GetHitCount() << " ns/hit";
+      }
+      std::cout << ")";
+    }
+    std::cout << std::endl;
+  }
+}
+
+void Debugger::SetWatchpoint(const std::string& location,
+                             const std::string& mode, int len) {
+  RequireLiveProcess();
+  uint64_t addr = 0;
+  int size = sizeof(uint64_t);
+  if (location.find("0x") == 0) {
+    addr = std::stoul(location, 0, kHexBase);
+  } else {
+    addr = GetVariableAddress(location, &size);
+  }
+  if (len == 0) {
+    len = std::min<int>(size, sizeof(uint64_t));
+  }
+
+  WatchKind kind;
+  if (mode == "w") {
+    kind = WatchKind::write;
+  } else if (mode == "rw" || mode == "r") {
+    // x86 can only trap reads together with writes
+    kind = WatchKind::read_write;
+  } else {
+    throw std::runtime_error("Watch mode must be r, w or rw");
+  }
+
+  auto slot = debug_registers_.Set(addr, kind, len);
+  debug_registers_.Get(slot).value = GetMemory(addr);
+  std::cout << "Watchpoint " << slot << " set on 0x" << std::hex << addr
+            << " (" << std::dec << len << " bytes)" << std::endl;
+}
+
+void Debugger::ReportHardwareBreakpoint() {
+  auto slot = debug_registers_.TriggeredSlot(current_tid_);
+  triggered_slot_ = slot;
+  if (slot < 0) {
+    std::cout << "Unknown hardware breakpoint trap" << std::endl;
+    return;
+  }
+  auto& hw = debug_registers_.Get(slot);
+  if (hw.kind == WatchKind::execute) {
+    std::cout << "**Hit hardware breakpoint " << slot << " at address 0x"
+              << std::hex << hw.addr << "**" << std::endl;
+  } else {
+    auto mask = hw.len == sizeof(uint64_t) ? ~0ULL : (1ULL << (hw.len * 8)) - 1;
+    auto value = GetMemory(hw.addr);
+    std::cout << "**Watchpoint " << slot << " on 0x" << std::hex << hw.addr
+              << ": 0x" << (hw.value & mask) << " -> 0x" << (value & mask)
+              << "**" << std::endl;
+    hw.value = value;
+  }
+  const auto* line_entry =
+      pc_index_.FindLine(SubtractLoadAddress(GetRegister(Register::rip)));
+  if (line_entry != nullptr) {
+    PrintSource(std::string(pc_index_.File(*line_entry)), line_entry->line);
+  }
 }
 
 uint64_t Debugger::GetRegisterFromDwarfRegister(int regnum) {
@@ -388,7 +2040,9 @@ uint64_t Debugger::GetRegisterFromDwarfRegister(int regnum) {
 }
 
 uint64_t Debugger::GetMemory(uintptr_t addr) const {
-  return ptrace(PTRACE_PEEKDATA, pid_, addr, nullptr);
+  uint64_t value = 0;
+  target_->ReadMemory(addr, &value, sizeof(value));
+  return value;
 }
 
 uint64_t Debugger::GetRegister(std::string s) const {
@@ -401,13 +2055,98 @@ uint64_t Debugger::GetRegister(std::string s) const {
 }
 
 uint64_t Debugger::GetRegister(Register::Reg r) const {
-  user_regs_struct regs;
-  ptrace(PTRACE_GETREGS, pid_, nullptr, &regs);
-  return *(reinterpret_cast<uint64_t*>(&regs) + static_cast<size_t>(r));
+  return target_->ReadRegister(CurrentThread().tid, r);
 }
 
 void Debugger::SetMemory(uintptr_t addr, uint64_t value) const {
-  ptrace(PTRACE_POKEDATA, pid_, addr, value);
+  RequireLiveProcess();
+  memory_.WriteWord(addr, value);
+}
+
+void Debugger::DumpMemory(uintptr_t addr, size_t len,
+                          const std::string& format) const {
+  std::vector<uint8_t> data(len);
+  target_->ReadMemory(addr, data.data(), len);
+  const auto kBytesPerRow = 16;
+
+  if (format == "string") {
+    std::string text(data.begin(), data.end());
+    std::cout << text.substr(0, text.find('\0')) << std::endl;
+    return;
+  }
+  if (format != "hexdump" && format != "bytes" && format != "words") {
+    throw std::runtime_error("Unknown memory format " + format);
+  }
+
+  std::ostringstream out;
+  out << std::hex << std::setfill('0');
+  for (size_t row = 0; row < len; row += kBytesPerRow) {
+    auto row_len = std::min<size_t>(kBytesPerRow, len - row);
+    out << "0x" << std::setw(kHexBase) << addr + row << ": ";
+    if (format == "words") {
+      for (size_t i = 0; i < row_len; i += sizeof(uint64_t)) {
+        uint64_t word = 0;
+        std::memcpy(&word, &data[row + i],
+                    std::min(sizeof(word), row_len - i));
+        out << "0x" << std::setw(kHexBase) << word << " ";
+      }
+    } else {
+      for (size_t i = 0; i < kBytesPerRow; i++) {
+        if (i < row_len) {
+          out << std::setw(2) << static_cast<int>(data[row + i]) << " ";
+        } else if (format == "hexdump") {
+          out << "   ";
+        }
+      }
+      if (format == "hexdump") {
+        out << " |";
+        for (size_t i = 0; i < row_len; i++) {
+          auto c = data[row + i];
+          out << (std::isprint(c) ? static_cast<char>(c) : '.');
+        }
+        out << "|";
+      }
+    }
+    out << "\n";
+  }
+  std::cout << out.str() << std::flush;
+}
+
+void Debugger::FillMemory(uintptr_t addr, const std::string& value,
+                          size_t len, const std::string& format) const {
+  RequireLiveProcess();
+  std::vector<uint8_t> pattern;
+  if (format == "words") {
+    auto word = std::stoul(value, 0, kHexBase);
+    auto* bytes = reinterpret_cast<uint8_t*>(&word);
+    pattern.assign(bytes, bytes + sizeof(word));
+  } else if (format == "bytes" || format == "hexdump") {
+    auto start = value.find("0x") == 0 ? 2 : 0;
+    if ((value.size() - start) % 2 != 0) {
+      throw std::runtime_error("Byte string needs an even number of digits");
+    }
+    for (auto i = start; i < value.size(); i += 2) {
+      pattern.push_back(std::stoul(value.substr(i, 2), 0, kHexBase));
+    }
+  } else if (format == "string") {
+    pattern.assign(value.begin(), value.end());
+  } else {
+    throw std::runtime_error("Unknown memory format " + format);
+  }
+  if (pattern.empty()) {
+    return;
+  }
+
+  // The pattern is repeated (or truncated) to fill len bytes, so a large
+  // region is still written with one bulk transfer.
+  if (len == 0) {
+    len = pattern.size();
+  }
+  std::vector<uint8_t> data(len);
+  for (size_t i = 0; i < len; i++) {
+    data[i] = pattern[i % pattern.size()];
+  }
+  memory_.Write(addr, data.data(), data.size());
 }
 
 void Debugger::SetRegister(std::string s, uint64_t value) const {
@@ -423,110 +2162,135 @@ void Debugger::SetRegister(Register::Reg r, uint64_t value) const {
   if (r < 0 || r > kRegisterCount) {
     throw std::runtime_error("Attempted to set a bad register");
   }
-  user_regs_struct regs;
-  ptrace(PTRACE_GETREGS, pid_, nullptr, &regs);
-  *(reinterpret_cast<uint64_t*>(&regs) + static_cast<size_t>(r)) = value;
-  ptrace(PTRACE_SETREGS, pid_, nullptr, &regs);
+  RequireLiveProcess();
+  CurrentThread().registers.Set(r, value);
 }
 
-dwarf::die Debugger::GetFunctionFromPC(uint64_t pc) {
-  for (const auto& compilation_unit : dwarf_.compilation_units()) {
-    if (dwarf::die_pc_range(compilation_unit.root()).contains(pc)) {
-      for (const auto& die : compilation_unit.root()) {
-        if (die.tag == dwarf::DW_TAG::subprogram) {
-          if (die.has(dwarf::DW_AT::low_pc) &&
-              dwarf::die_pc_range(die).contains(pc)) {
-            return die;
-          }
-        }
-      }
-    }
+const PCIndex::Function& Debugger::GetFunctionFromPC(uint64_t pc) const {
+  const auto* func = pc_index_.FindFunction(pc);
+  if (func == nullptr) {
+    throw std::out_of_range{"Cannot find function"};
   }
-  throw std::out_of_range{"Cannot find function"};
+  return *func;
 }
 
-dwarf::line_table::iterator Debugger::GetLineEntryFromPC(uint64_t pc) const {
-  for (const auto& compilation_unit : dwarf_.compilation_units()) {
-    if (dwarf::die_pc_range(compilation_unit.root()).contains(pc)) {
-      const auto& line_table = compilation_unit.get_line_table();
-      auto it = line_table.find_address(pc);
-      if (it == line_table.end()) {
-        throw std::out_of_range{"Cannot find line entry!"};
-      }
-      return it;
-    }
+const PCIndex::Line& Debugger::GetLineEntryFromPC(uint64_t pc) const {
+  const auto* line = pc_index_.FindLine(pc);
+  if (line == nullptr) {
+    throw std::out_of_range{"Cannot find line entry"};
   }
-  throw std::out_of_range{"Cannot find line entry"};
+  return *line;
+}
+
+dwarf::die Debugger::GetFunctionDie(const PCIndex::Function& func) const {
+  OpTimer timer{StatOp::kDwarf};
+  const auto& cu = dwarf_.compilation_units().at(func.cu);
+  return FindDieByOffset(cu.root(), func.die_offset);
 }
 
 uint64_t Debugger::GetLoadAddress() {
   // If this is a dynamic library (e.g. PIE)
   if (elf_.get_hdr().type == elf::et::dyn) {
-    // The load address is found in /proc/pid/maps
+    // The load address is the start of the mapping of the binary's first
+    // page in /proc/pid/maps. Its first line is not necessarily that, e.g.
+    // when the process was attached to rather than launched.
+    struct stat binary {};
+    stat(binary_name_, &binary);
     std::ifstream maps("/proc/" + std::to_string(pid_) + "/maps");
-    std::string addr;
-    std::getline(maps, addr, '-');
-    return std::stol(addr, 0, kHexBase);
+    std::string line;
+    uint64_t first = 0;
+    while (std::getline(maps, line)) {
+      std::istringstream fields{line};
+      std::string range, perms, offset, device;
+      ino_t inode = 0;
+      fields >> range >> perms >> offset >> device >> inode;
+      auto start = std::stoul(range, 0, kHexBase);
+      if (first == 0) {
+        first = start;
+      }
+      if (inode == binary.st_ino && std::stoul(offset, 0, kHexBase) == 0) {
+        return start;
+      }
+    }
+    return first;
   }
   return 0;
 }
 
 siginfo_t Debugger::GetSigInfo() const {
   siginfo_t info;
-  ptrace(PTRACE_GETSIGINFO, pid_, nullptr, &info);
+  Ptrace(PTRACE_GETSIGINFO, current_tid_, nullptr, &info);
   return info;
 }
 
+siginfo_t Debugger::StopSigInfo(int status) const {
+  auto& thread = CurrentThread();
+  // Without hardware slots in use a plain SIGTRAP is either the end of a
+  // single step or a software breakpoint, which the registers tell apart
+  // without asking the kernel.
+  if (WSTOPSIG(status) == SIGTRAP && (status >> 16) == 0 &&
+      !debug_registers_.InUse()) {
+    siginfo_t info{};
+    info.si_signo = SIGTRAP;
+    if (thread.resume_request == PTRACE_SINGLESTEP) {
+      info.si_code = TRAP_TRACE;
+      return info;
+    }
+    auto bp = breakpoints_.find(GetRegister(Register::rip) - 1);
+    if (bp != breakpoints_.end() && bp->second.IsEnabled()) {
+      info.si_code = TRAP_BRKPT;
+      return info;
+    }
+  }
+  return GetSigInfo();
+}
+
 void Debugger::PrintSource(const std::string& file_name, unsigned line,
                            unsigned n_lines_context) {
-  std::ifstream file{file_name};
+  auto* file = source_cache_.Get(file_name);
+  if (file == nullptr) {
+    std::cerr << "Cannot read source file " << file_name << std::endl;
+    return;
+  }
 
   // Work out a window around the desired line
   auto start_line = line <= n_lines_context ? 1 : line - n_lines_context;
   auto end_line = line + n_lines_context +
                   (line < n_lines_context ? n_lines_context - line : 0) + 1;
-
-  char c{};
-  auto current_line = 1U;
-  // Skip lines up until start_line
-  while (current_line != start_line && file.get(c)) {
-    if (c == '\n') {
-      ++current_line;
-    }
-  }
-
-  // Output cursor if we're at the current line
-  std::cout << (current_line == line ? "> " : "  ");
-
-  // Write lines up until end_line
-  while (current_line <= end_line && file.get(c)) {
-    std::cout << c;
-    if (c == '\n') {
-      ++current_line;
-      // Output cursor if we're at the current line
-      std::cout << (current_line == line ? "> " : "  ");
-    }
+  end_line = std::min(end_line, file->LineCount());
+
+  std::string window;
+  for (auto current_line = start_line; current_line <= end_line;
+       ++current_line) {
+    window += current_line == line ? "> " : "  ";
+    window += file->Line(current_line);
+    window += '\n';
   }
-
-  // Write newline and make sure that the stream is flushed properly
-  std::cout << std::endl;
+  // Write the window at once and make sure that the stream is flushed
+  std::cout << window << std::flush;
 }
 
 uint64_t Debugger::SubtractLoadAddress(uint64_t addr) const {
   return addr - load_address_;
 }
 
-void Debugger::SetBreakpointAtFunction(const std::string& name) {
+std::vector<std::uintptr_t> Debugger::FunctionAddresses(
+    const std::string& name) const {
+  OpTimer timer{StatOp::kDwarf};
+  // Walking the DIEs races the index workers, let them finish first
+  pc_index_.Wait();
+  std::vector<std::uintptr_t> addrs;
   for (const auto& cu : dwarf_.compilation_units()) {
     for (const auto& die : cu.root()) {
       if (die.has(dwarf::DW_AT::name) && dwarf::at_name(die) == name) {
         auto low_pc = dwarf::at_low_pc(die);
-        auto entry = GetLineEntryFromPC(low_pc);
-        entry++;  // skip prologue
-        SetBreakpointAtAddress(load_address_ + entry->address);
+        const auto& entry = GetLineEntryFromPC(low_pc);
+        // skip prologue, the next row starts where this one ends
+        addrs.push_back(load_address_ + entry.end);
       }
     }
   }
+  return addrs;
 }
 
 bool is_suffix(const std::string& a, const std::string& b) {
@@ -536,40 +2300,248 @@ bool is_suffix(const std::string& a, const std::string& b) {
   return std::equal(a.begin(), a.end(), b.begin() + (b.size() - a.size()));
 }
 
-void Debugger::SetBreakpointAtSourceLine(const std::string& file,
-                                         unsigned line) {
+std::vector<std::uintptr_t> Debugger::SourceLineAddresses(
+    const std::string& file, unsigned line) const {
+  OpTimer timer{StatOp::kDwarf};
+  // Line tables are loaded lazily and not thread safe, keep out of the way
+  // of the index workers
+  pc_index_.Wait();
   for (const auto& cu : dwarf_.compilation_units()) {
     if (is_suffix(file, dwarf::at_name(cu.root()))) {
       const auto& lt = cu.get_line_table();
       for (const auto& entry : lt) {
         if (entry.is_stmt && entry.line == line) {
-          SetBreakpointAtAddress(load_address_ + entry.address);
-          return;
+          return {load_address_ + entry.address};
         }
       }
     }
   }
+  return {};
+}
+
+std::vector<std::uintptr_t> Debugger::ResolveLocation(
+    const std::string& location) const {
+  if (location.find("0x") == 0) {
+    return {std::stoul(location, 0, kHexBase)};
+  }
+  if (location.find(':') != std::string::npos) {
+    auto file_and_line = SplitCommand(location, ':');
+    return SourceLineAddresses(file_and_line[0], std::stoi(file_and_line[1]));
+  }
+  return FunctionAddresses(location);
+}
+
+std::string Debugger::FindSourceFile(const std::string& file) const {
+  OpTimer timer{StatOp::kDwarf};
+  pc_index_.Wait();
+  for (const auto& cu : dwarf_.compilation_units()) {
+    for (const auto& entry : cu.get_line_table()) {
+      if (is_suffix(file, entry.file->path)) {
+        return entry.file->path;
+      }
+    }
+  }
+  return file;
+}
+
+void Debugger::ListSource(const std::string& location, unsigned n_lines) {
+  auto file_and_line = SplitCommand(location, ':');
+  if (file_and_line.size() != 2) {
+    std::cerr << "Expected <file>:<line>" << std::endl;
+    return;
+  }
+  PrintSource(FindSourceFile(file_and_line[0]), std::stoi(file_and_line[1]),
+              n_lines / 2);
 }
 
-void Debugger::PrintBacktrace() {
-  auto output_frame = [frame_number = 0](auto&& func) mutable {
-    std::cout << "Frame #" << frame_number++ << ": 0x" << dwarf::at_low_pc(func)
-              << " " << dwarf::at_name(func) << std::endl;
+std::vector<Unwinder::Frame> Debugger::UnwindStack(TracedThread& thread,
+                                                  size_t max_frames) const {
+  Unwinder::Frame frame;
+  frame.pc = target_->ReadRegister(thread.tid, Register::rip);
+  for (const auto& [reg, info] : Register::register_lookup) {
+    auto regnum = info.second;
+    if (regnum >= 0 && regnum < Unwinder::kRegisters) {
+      frame.regs[regnum] = target_->ReadRegister(thread.tid, reg);
+      frame.valid |= 1u << regnum;
+    }
+  }
+  // rip has no DWARF number of its own, CFA rules (e.g. the .plt ones)
+  // name it as the return address column
+  frame.regs[Unwinder::kReturnAddress] = frame.pc;
+  frame.valid |= 1u << Unwinder::kReturnAddress;
+  auto read = [this](uint64_t addr, uint64_t* value) {
+    try {
+      target_->ReadMemory(addr, value, sizeof(*value));
+      return true;
+    } catch (std::exception&) {
+      return false;
+    }
   };
 
-  auto current_func =
-      GetFunctionFromPC(SubtractLoadAddress(GetRegister(Register::rip)));
-  output_frame(current_func);
+  std::vector<Unwinder::Frame> frames{frame};
+  while (frames.size() < max_frames) {
+    Unwinder::Frame caller;
+    if (!unwinder_.Step(frames.back(), &caller, load_address_, read)) {
+      break;
+    }
+    // Callers' frames are further up the stack, anything else is garbage
+    if (caller.regs[Unwinder::kRsp] <= frames.back().regs[Unwinder::kRsp]) {
+      break;
+    }
+    frames.push_back(caller);
+  }
+  return frames;
+}
+
+void Debugger::PrintFrame(size_t n, const Unwinder::Frame& frame) const {
+  std::cout << (n == selected_frame_ ? "* " : "  ") << "Frame #" << std::dec
+            << n << ": 0x" << std::hex << frame.pc << " "
+            << FunctionName(frame.pc - frame.return_address) << std::endl;
+}
+
+void Debugger::PrintBacktrace(size_t max_frames) {
+  auto frames = UnwindStack(CurrentThread(), max_frames);
+  for (size_t n = 0; n < frames.size(); n++) {
+    PrintFrame(n, frames[n]);
+  }
+  if (frames.size() == max_frames) {
+    std::cout << "(more frames may follow, limit is " << std::dec
+              << max_frames << ")" << std::endl;
+  }
+}
+
+void Debugger::SelectFrame(size_t n) {
+  auto frames = UnwindStack(CurrentThread(), n + 1);
+  if (n >= frames.size()) {
+    std::cout << "No frame " << std::dec << n << ", the stack has "
+              << frames.size() << std::endl;
+    return;
+  }
+  selected_frame_ = n;
+  PrintFrame(n, frames[n]);
+  auto pc = frames[n].pc - frames[n].return_address;
+  if (const auto* line = pc_index_.FindLine(SubtractLoadAddress(pc))) {
+    PrintSource(std::string(pc_index_.File(*line)), line->line);
+  }
+}
 
-  auto frame_pointer = GetRegister(Register::rbp);
-  auto return_address = GetMemory(frame_pointer + kRetAddressOffset);
+void Debugger::Profile(double hz, double seconds, std::ostream& out) {
+  CurrentThread();  // throws if there is no process
+  RequireLiveProcess();
+  if (hz <= 0 || seconds <= 0) {
+    throw std::runtime_error("Rate and duration must be positive");
+  }
+  using Clock = std::chrono::steady_clock;
+  auto to_clock = [](double s) {
+    return std::chrono::duration_cast<Clock::duration>(
+        std::chrono::duration<double>(s));
+  };
+  auto period = to_clock(1 / hz);
+
+  // Breakpoints would stop threads between samples, so they are lifted
+  // for the duration
+  std::vector<Breakpoint*> lifted;
+  BreakpointBatch batch{&memory_};
+  for (auto& [addr, bp] : breakpoints_) {
+    if (bp.IsEnabled()) {
+      batch.Disable(&bp);
+      lifted.push_back(&bp);
+    }
+  }
+  batch.Commit();
+
+  // Stacks are kept as raw PCs while sampling and symbolized afterwards
+  std::map<std::vector<uint64_t>, uint64_t> stacks;
+  uint64_t samples = 0;
+  uint64_t rounds = 0;
+  uint64_t missed = 0;
+  Clock::duration stopped{0};
+  Clock::duration max_stopped{0};
+  auto start = Clock::now();
+  auto end = start + to_clock(seconds);
+  for (auto tick = start; tick < end; tick += period) {
+    if (Clock::now() >= tick + period) {
+      missed++;
+      continue;
+    }
+    std::this_thread::sleep_until(tick);
+    auto stop_start = Clock::now();
+    StopAllThreads();
+    if (exited_) {
+      break;
+    }
+    for (auto& [tid, thread] : threads_) {
+      std::vector<uint64_t> pcs;
+      for (const auto& frame : UnwindStack(thread, kMaxFrames)) {
+        pcs.push_back(frame.pc);
+      }
+      stacks[pcs]++;
+      samples++;
+    }
+    rounds++;
+    resume_all_ = true;
+    for (auto& [tid, thread] : threads_) {
+      thread.at_breakpoint = false;
+      if (!thread.running) {
+        ResumeThread(thread, PTRACE_CONT);
+      }
+    }
+    auto stop_time = Clock::now() - stop_start;
+    stopped += stop_time;
+    max_stopped = std::max(max_stopped, stop_time);
+  }
+  StopAllThreads();
+  auto elapsed = std::chrono::duration<double>(Clock::now() - start).count();
+  if (!exited_) {
+    for (auto* bp : lifted) {
+      batch.Enable(bp);
+    }
+    batch.Commit();
+    if (threads_.count(current_tid_) == 0) {
+      current_tid_ = threads_.begin()->first;
+    }
+  }
 
-  while (dwarf::at_name(current_func) != "main") {
-    current_func = GetFunctionFromPC(SubtractLoadAddress(return_address));
-    output_frame(current_func);
-    frame_pointer = GetMemory(frame_pointer);
-    return_address = GetMemory(frame_pointer + kRetAddressOffset);
+  std::unordered_map<uint64_t, std::string> names;
+  std::map<std::string, uint64_t> folded;
+  for (const auto& [pcs, count] : stacks) {
+    std::string line;
+    // Folded stacks list the outermost frame first
+    for (size_t i = pcs.size(); i-- > 0;) {
+      auto pc = i == 0 ? pcs[i] : pcs[i] - 1;
+      auto name = names.find(pc);
+      if (name == names.end()) {
+        auto function = FunctionName(pc);
+        if (function == "??") {
+          std::stringstream hex;
+          hex << "0x" << std::hex << pc;
+          function = hex.str();
+        }
+        name = names.emplace(pc, function).first;
+      }
+      line += name->second;
+      line += i == 0 ? "" : ";";
+    }
+    folded[line] += count;
   }
+  for (const auto& [line, count] : folded) {
+    out << line << " " << std::dec << count << "\n";
+  }
+  out.flush();
+
+  auto mean_us = rounds == 0 ? 0.0
+                             : std::chrono::duration<double, std::micro>(
+                                   stopped).count() / rounds;
+  std::cout << std::dec << samples << " samples in " << rounds
+            << " rounds over " << std::fixed << std::setprecision(2)
+            << elapsed << " s: "
+            << rounds / elapsed << " rounds/s of " << hz << " requested, "
+            << missed << " ticks missed" << std::endl
+            << "Stop to resume " << mean_us << " us mean, "
+            << std::chrono::duration<double, std::micro>(max_stopped).count()
+            << " us max, tracee stopped "
+            << 100 * std::chrono::duration<double>(stopped).count() / elapsed
+            << "% of the time" << std::defaultfloat << std::endl;
 }
 
 void Debugger::ProcessCommand(const std::string& cmd_line) {
@@ -578,19 +2550,26 @@ void Debugger::ProcessCommand(const std::string& cmd_line) {
   if (cmd_argv.empty()) {
     return;
   }
+  CommandTimer timer{cmd_argv[0]};
 
   if (MatchCmd(cmd_argv, "continue", 0)) {
     Continue();
-  } else if (MatchCmd(cmd_argv, "breakpoint", 1)) {
-    auto cmd_arg = cmd_argv[1];
-    if (cmd_arg.find("0x") == 0) {
-      std::string addr(cmd_arg, 2);  // Start from loc 2
-      SetBreakpointAtAddress(std::stol(addr, 0, kHexBase));
-    } else if (cmd_arg.find(":") != std::string::npos) {
-      auto file_and_line = SplitCommand(cmd_arg, ':');
-      SetBreakpointAtSourceLine(file_and_line[0], std::stoi(file_and_line[1]));
-    } else {
-      SetBreakpointAtFunction(cmd_arg);
+  } else if (MatchCmd(cmd_argv, "breakpoint", 1, kMaxArgs)) {
+    std::string condition;
+    if (cmd_argv.size() > 2) {
+      if (cmd_argv[2] != "if" || cmd_argv.size() == 3) {
+        throw std::runtime_error("Usage: breakpoint <location> [if <expr>]");
+      }
+      for (size_t i = 3; i < cmd_argv.size(); i++) {
+        condition += cmd_argv[i] + " ";
+      }
+    }
+    for (auto addr : ResolveLocation(cmd_argv[1])) {
+      // Compile first so a bad condition leaves no breakpoint behind
+      auto compiled =
+          condition.empty() ? nullptr : CompileExpression(addr, condition);
+      SetBreakpointAtAddress(addr);
+      breakpoints_.at(addr).SetCondition(compiled);
     }
   } else if (MatchCmd(cmd_argv, "registers-dump", 0)) {
     for (const auto& [k, v] : Register::register_lookup) {
@@ -606,42 +2585,163 @@ void Debugger::ProcessCommand(const std::string& cmd_line) {
     }
   } else if (MatchCmd(cmd_argv, "write-register", 2)) {
     SetRegister(cmd_argv[1], std::stol(cmd_argv[2], 0, kHexBase));
-  } else if (MatchCmd(cmd_argv, "read-memory", 1)) {
-    auto cmd_arg = cmd_argv[1];
-    auto start_str = cmd_arg.find("0x") == 0 ? 2 : 0;
-    std::string addr(cmd_arg, start_str);
-    std::cout << std::hex << "0x" << GetMemory(std::stol(addr, 0, kHexBase))
-              << std::endl;
-  } else if (MatchCmd(cmd_argv, "write-memory", 2)) {
-    auto cmd_arg = cmd_argv[1];
-    auto start_str = cmd_arg.find("0x") == 0 ? 2 : 0;
-    std::string addr(cmd_arg, start_str);
-
-    cmd_arg = cmd_argv[2];
-    start_str = cmd_arg.find("0x") == 0 ? 2 : 0;
-    std::string value(cmd_arg, start_str);
-    SetMemory(std::stol(addr, 0, kHexBase), std::stol(value, 0, kHexBase));
+  } else if (MatchCmd(cmd_argv, "read-memory", 1, 3)) {
+    auto addr = std::stoul(cmd_argv[1], 0, kHexBase);
+    if (cmd_argv.size() == 2) {
+      std::cout << std::hex << "0x" << GetMemory(addr) << std::endl;
+      return;
+    }
+    DumpMemory(addr, std::stoul(cmd_argv[2], 0, 0),
+               cmd_argv.size() > 3 ? cmd_argv[3] : "hexdump");
+  } else if (MatchCmd(cmd_argv, "write-memory", 2, 4)) {
+    auto addr = std::stoul(cmd_argv[1], 0, kHexBase);
+    if (cmd_argv.size() == 3) {
+      SetMemory(addr, std::stoul(cmd_argv[2], 0, kHexBase));
+      return;
+    }
+    FillMemory(addr, cmd_argv[2], std::stoul(cmd_argv[3], 0, 0),
+               cmd_argv.size() > 4 ? cmd_argv[4] : "words");
   } else if (MatchCmd(cmd_argv, "symbol", 1)) {
+    if (cmd_argv[1].find("0x") == 0) {
+      PrintSymbolForAddress(std::stoul(cmd_argv[1], 0, kHexBase));
+      return;
+    }
     auto syms = LookupSymbol(cmd_argv[1]);
     for (auto&& s : syms) {
       std::cout << s.name << " " << to_string(s.type) << " 0x" << std::hex
-                << s.addr << std::endl;
+                << s.addr;
+      if (!s.demangled.empty()) {
+        std::cout << " " << s.demangled;
+      }
+      std::cout << std::endl;
     }
+  } else if (MatchCmd(cmd_argv, "list", 1, 2)) {
+    ListSource(cmd_argv[1],
+               cmd_argv.size() > 2 ? std::stoul(cmd_argv[2]) : kListLines);
   } else if (MatchCmd(cmd_argv, "step", 0)) {
     StepIn();
   } else if (MatchCmd(cmd_argv, "stepi", 0)) {
     SingleStepInstructionWithBreakpointCheck();
     auto offset_pc = SubtractLoadAddress(GetRegister(Register::rip));
-    auto line_entry = GetLineEntryFromPC(offset_pc);
-    PrintSource(line_entry->file->path, line_entry->line);
+    const auto& line_entry = GetLineEntryFromPC(offset_pc);
+    PrintSource(std::string(pc_index_.File(line_entry)), line_entry.line);
   } else if (MatchCmd(cmd_argv, "next", 0)) {
     StepOver();
   } else if (MatchCmd(cmd_argv, "finish", 0)) {
     StepOut();
-  } else if (MatchCmd(cmd_argv, "backtrace", 0)) {
-    PrintBacktrace();
+  } else if (MatchCmd(cmd_argv, "backtrace", 0, 1)) {
+    PrintBacktrace(cmd_argv.size() == 2 ? std::stoul(cmd_argv[1]) : kMaxFrames);
   } else if (MatchCmd(cmd_argv, "variables", 0)) {
     ReadVariables();
+  } else if (MatchCmd(cmd_argv, "ignore", 2)) {
+    for (auto addr : ResolveLocation(cmd_argv[1])) {
+      if (breakpoints_.count(addr) == 0) {
+        throw std::runtime_error("No breakpoint at " + cmd_argv[1]);
+      }
+      breakpoints_.at(addr).SetIgnoreCount(std::stoul(cmd_argv[2]));
+    }
+  } else if (MatchCmd(cmd_argv, "info-breakpoints", 0)) {
+    PrintBreakpoints();
+  } else if (MatchCmd(cmd_argv, "hbreak", 1)) {
+    RequireLiveProcess();
+    for (auto addr : ResolveLocation(cmd_argv[1])) {
+      auto slot = debug_registers_.Set(addr, WatchKind::execute, 1);
+      std::cout << "Hardware breakpoint " << slot << " set at address : 0x"
+                << std::hex << addr << std::endl;
+    }
+  } else if (MatchCmd(cmd_argv, "watch", 1, 3)) {
+    SetWatchpoint(cmd_argv[1], cmd_argv.size() > 2 ? cmd_argv[2] : "w",
+                  cmd_argv.size() > 3 ? std::stoi(cmd_argv[3]) : 0);
+  } else if (MatchCmd(cmd_argv, "hdelete", 1)) {
+    debug_registers_.Clear(std::stoi(cmd_argv[1]));
+  } else if (MatchCmd(cmd_argv, "attach", 1)) {
+    Attach(std::stoi(cmd_argv[1]));
+  } else if (MatchCmd(cmd_argv, "detach", 0)) {
+    Detach();
+  } else if (MatchCmd(cmd_argv, "thread", 1)) {
+    // Matched ahead of threads: "thread <tid>" is a prefix of it and would
+    // be refused there for its argument
+    SelectThread(std::stoi(cmd_argv[1]));
+  } else if (MatchCmd(cmd_argv, "threads", 0)) {
+    PrintThreads();
+  } else if (MatchCmd(cmd_argv, "index-info", 0)) {
+    PrintIndexInfo();
+  } else if (MatchCmd(cmd_argv, "ptrace-count", 1)) {
+    show_ptrace_count_ = cmd_argv[1] == "on";
+  } else if (MatchCmd(cmd_argv, "trace", 2, kMaxArgs)) {
+    std::string exprs;
+    for (size_t i = 2; i < cmd_argv.size(); i++) {
+      exprs += cmd_argv[i] + " ";
+    }
+    SetTracepoint(cmd_argv[1], exprs);
+  } else if (MatchCmd(cmd_argv, "tdump", 0, 1)) {
+    if (cmd_argv.size() == 1) {
+      DumpTrace(std::cout);
+    } else {
+      std::ofstream out{cmd_argv[1]};
+      if (!out) {
+        throw std::runtime_error("Cannot open " + cmd_argv[1]);
+      }
+      DumpTrace(out);
+    }
+  } else if (MatchCmd(cmd_argv, "ftrace", 0, 1)) {
+    StartFunctionTrace(cmd_argv.size() == 2 ? cmd_argv[1] : "");
+  } else if (MatchCmd(cmd_argv, "ftrace-off", 0)) {
+    StopFunctionTrace();
+  } else if (MatchCmd(cmd_argv, "ftrace-report", 0, 1)) {
+    if (cmd_argv.size() == 1) {
+      function_tracer_.PrintReport(std::cout);
+    } else {
+      std::ofstream out{cmd_argv[1]};
+      if (!out) {
+        throw std::runtime_error("Cannot open " + cmd_argv[1]);
+      }
+      function_tracer_.WriteChromeTrace(out, pid_);
+    }
+  } else if (MatchCmd(cmd_argv, "profile", 2, 3)) {
+    if (cmd_argv.size() == 3) {
+      Profile(std::stod(cmd_argv[1]), std::stod(cmd_argv[2]), std::cout);
+    } else {
+      std::ofstream out{cmd_argv[3]};
+      if (!out) {
+        throw std::runtime_error("Cannot open " + cmd_argv[3]);
+      }
+      Profile(std::stod(cmd_argv[1]), std::stod(cmd_argv[2]), out);
+    }
+  } else if (MatchCmd(cmd_argv, "frame", 1)) {
+    SelectFrame(std::stoul(cmd_argv[1]));
+  } else if (MatchCmd(cmd_argv, "gdbserver", 1)) {
+    StartGdbServer(cmd_argv[1]);
+  } else if (MatchCmd(cmd_argv, "gcore", 1)) {
+    WriteCoreFile(cmd_argv[1]);
+  } else if (MatchCmd(cmd_argv, "core", 1)) {
+    OpenCore(cmd_argv[1]);
+  } else if (MatchCmd(cmd_argv, "checkpoint", 0)) {
+    TakeCheckpoint();
+  } else if (MatchCmd(cmd_argv, "restart", 1)) {
+    RestartCheckpoint(std::stoi(cmd_argv[1]));
+  } else if (MatchCmd(cmd_argv, "info-checkpoints", 0)) {
+    PrintCheckpoints();
+  } else if (MatchCmd(cmd_argv, "record", 0, 1)) {
+    if (cmd_argv.size() == 2) {
+      Record(cmd_argv[1]);
+    } else {
+      PrintRecordLog();
+    }
+  } else if (MatchCmd(cmd_argv, "record-stop", 0)) {
+    StopRecording();
+  } else if (MatchCmd(cmd_argv, "reverse-step", 0)) {
+    ReverseStep();
+  } else if (MatchCmd(cmd_argv, "reverse-stepi", 0)) {
+    ReverseStepInstruction();
+  } else if (MatchCmd(cmd_argv, "reverse-continue", 0)) {
+    ReverseContinue();
+  } else if (MatchCmd(cmd_argv, "stats", 0, 2)) {
+    StatsCommand({cmd_argv.begin() + 1, cmd_argv.end()});
+  } else if (MatchCmd(cmd_argv, "displaced-stepping", 1)) {
+    displaced_stepping_ = cmd_argv[1] == "on";
+  } else if (MatchCmd(cmd_argv, "range-stepping", 1)) {
+    range_stepping_ = cmd_argv[1] == "on";
   } else {
     std::cerr << "Please check the command" << std::endl;
   }
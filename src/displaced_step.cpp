@@ -0,0 +1,199 @@
+#include "displaced_step.h"
+
+#include <sys/mman.h>
+#include <sys/syscall.h>
+
+#include <iterator>
+#include <limits>
+#include <stdexcept>
+#include <string>
+
+#include "inject_syscall.h"
+#include "x86_decoder.h"
+
+namespace {
+
+// Long enough for the longest instruction and two jumps
+const auto kSlotSize = 48;
+// jmp *0(%rip) followed by the absolute destination
+const uint8_t kJumpAbsolute[] = {0xff, 0x25, 0, 0, 0, 0};
+const auto kJumpSize = sizeof(kJumpAbsolute) + sizeof(uint64_t);
+// How far from the code the scratch page is asked for, well within reach
+// of a RIP-relative displacement either way
+const uint64_t kScratchDistance = 256 << 20;
+
+void AppendJump(std::vector<uint8_t>* out, uint64_t dest) {
+  out->insert(out->end(), std::begin(kJumpAbsolute), std::end(kJumpAbsolute));
+  for (size_t i = 0; i < sizeof(dest); i++) {
+    out->push_back(dest >> (i * 8));
+  }
+}
+
+void PutLittleEndian(uint8_t* out, int64_t value, int size) {
+  for (int i = 0; i < size; i++) {
+    out[i] = value >> (i * 8);
+  }
+}
+
+}  // namespace
+
+void DisplacedStepper::Reset() {
+  scratch_ = 0;
+  scratch_failed_ = false;
+  free_slots_.clear();
+  copies_.clear();
+  displaced_.clear();
+}
+
+DisplacedStepper::Result DisplacedStepper::Displace(TracedThread* thread,
+                                                    uint64_t addr,
+                                                    const uint8_t* code,
+                                                    size_t len) {
+  Instruction insn;
+  if (!DecodeInstruction(code, len, &insn)) {
+    return Result::kUnsupported;
+  }
+  auto next = addr + insn.length;
+  auto& registers = thread->registers;
+  switch (insn.kind) {
+    case Instruction::Kind::kJump:
+      registers.Set(Register::rip, insn.BranchTarget(addr));
+      return Result::kEmulated;
+    case Instruction::Kind::kCall: {
+      auto rsp = registers.Get(Register::rsp) - sizeof(next);
+      try {
+        memory_->Write(rsp, &next, sizeof(next));
+      } catch (const std::runtime_error&) {
+        // Let the call itself fault
+        return Result::kUnsupported;
+      }
+      registers.Set(Register::rsp, rsp);
+      registers.Set(Register::rip, insn.BranchTarget(addr));
+      return Result::kEmulated;
+    }
+    case Instruction::Kind::kIndirectCall:
+      // Would push an address in the scratch page
+      return Result::kUnsupported;
+    case Instruction::Kind::kOther:
+      if (insn.rel_size != 0) {
+        return Result::kUnsupported;
+      }
+      break;
+    default:
+      break;
+  }
+
+  if (scratch_ == 0 && !MapScratch(thread, addr)) {
+    return Result::kUnsupported;
+  }
+  std::vector<uint8_t> original(code, code + insn.length);
+  auto copy = copies_.find(addr);
+  if (copy == copies_.end() || copy->second.code != original) {
+    uint64_t slot = 0;
+    if (copy != copies_.end()) {
+      slot = copy->second.slot;
+      copies_.erase(copy);
+    } else if ((slot = AllocateSlot()) == 0) {
+      return Result::kUnsupported;
+    }
+    auto text = original;
+    if (insn.rip_relative) {
+      auto disp = insn.disp + static_cast<int64_t>(addr - slot);
+      if (disp < std::numeric_limits<int32_t>::min() ||
+          disp > std::numeric_limits<int32_t>::max()) {
+        free_slots_.push_back(slot);
+        return Result::kUnsupported;
+      }
+      PutLittleEndian(&text[insn.disp_offset], disp, insn.disp_size);
+    }
+    uint64_t taken = 0;
+    if (insn.kind == Instruction::Kind::kCondJump) {
+      // Taken, jump over the jump back to a jump to the target
+      taken = insn.BranchTarget(addr);
+      PutLittleEndian(&text[insn.rel_offset], kJumpSize, insn.rel_size);
+    }
+    AppendJump(&text, next);
+    if (taken != 0) {
+      AppendJump(&text, taken);
+    }
+    memory_->WriteText(slot, text.data(), text.size());
+    copy = copies_.emplace(addr, Copy{slot, original, taken, 0}).first;
+  }
+  copy->second.last_used = ++uses_;
+  registers.Set(Register::rip, copy->second.slot);
+  displaced_[thread->tid] = addr;
+  return Result::kDisplaced;
+}
+
+bool DisplacedStepper::MapBack(TracedThread* thread) {
+  auto it = displaced_.find(thread->tid);
+  if (it == displaced_.end()) {
+    return false;
+  }
+  const auto& copy = copies_.at(it->second);
+  auto addr = it->second;
+  displaced_.erase(it);
+  auto pc = thread->registers.Get(Register::rip);
+  auto length = copy.code.size();
+  if (pc == copy.slot) {
+    thread->registers.Set(Register::rip, addr);
+    return true;
+  }
+  if (pc == copy.slot + length) {
+    thread->registers.Set(Register::rip, addr + length);
+  } else if (copy.taken != 0 && pc == copy.slot + length + kJumpSize) {
+    thread->registers.Set(Register::rip, copy.taken);
+  }
+  return false;
+}
+
+void DisplacedStepper::Forget(pid_t tid) { displaced_.erase(tid); }
+
+bool DisplacedStepper::MapScratch(TracedThread* thread, uint64_t addr) {
+  if (scratch_failed_) {
+    return false;
+  }
+  // Only a hint, the kernel puts it elsewhere if that is taken
+  auto hint = addr > kScratchDistance ? addr - kScratchDistance
+                                      : addr + kScratchDistance;
+  hint &= ~(kPageSize - 1ULL);
+  uint64_t args[6] = {hint, kPageSize, PROT_READ | PROT_EXEC,
+                      MAP_PRIVATE | MAP_ANONYMOUS, static_cast<uint64_t>(-1),
+                      0};
+  auto result = InjectSyscall(thread, memory_, SYS_mmap, args);
+  if (result < 0) {
+    scratch_failed_ = true;
+    return false;
+  }
+  scratch_ = result;
+  for (uint64_t offset = 0; offset + kSlotSize <= kPageSize;
+       offset += kSlotSize) {
+    free_slots_.push_back(scratch_ + offset);
+  }
+  return true;
+}
+
+uint64_t DisplacedStepper::AllocateSlot() {
+  if (!free_slots_.empty()) {
+    auto slot = free_slots_.back();
+    free_slots_.pop_back();
+    return slot;
+  }
+  auto victim = copies_.end();
+  for (auto it = copies_.begin(); it != copies_.end(); ++it) {
+    bool in_use = false;
+    for (const auto& [tid, addr] : displaced_) {
+      in_use |= addr == it->first;
+    }
+    if (!in_use && (victim == copies_.end() ||
+                    it->second.last_used < victim->second.last_used)) {
+      victim = it;
+    }
+  }
+  if (victim == copies_.end()) {
+    return 0;
+  }
+  auto slot = victim->second.slot;
+  copies_.erase(victim);
+  return slot;
+}
@@ -0,0 +1,430 @@
+#include "expression.h"
+
+#include <array>
+#include <cctype>
+#include <cstring>
+#include <stdexcept>
+
+// Recursive descent parser emitting bytecode into an Expression. Each
+// precedence level is one method, from lowest (||) to highest (unary).
+class ExpressionParser {
+ public:
+  ExpressionParser(const std::string& source, const Expression::Resolver& r,
+                   Expression* out)
+      : src_{source}, resolver_{r}, out_{out} {}
+
+  void Parse() {
+    LogicalOr();
+    SkipSpace();
+    if (pos_ != src_.size()) {
+      Fail("unexpected '" + src_.substr(pos_, 1) + "'");
+    }
+  }
+
+ private:
+  using Op = Expression::Op;
+
+  void LogicalOr() {
+    LogicalAnd();
+    while (Accept("||")) {
+      auto jump = EmitJump(Op::kJumpIfTrue);
+      Pop();
+      LogicalAnd();
+      Emit(Op::kBool);
+      Patch(jump);
+    }
+  }
+
+  void LogicalAnd() {
+    BitOr();
+    while (Accept("&&")) {
+      auto jump = EmitJump(Op::kJumpIfFalse);
+      Pop();
+      BitOr();
+      Emit(Op::kBool);
+      Patch(jump);
+    }
+  }
+
+  void BitOr() {
+    BitXor();
+    while (!Peek("||") && Accept("|")) {
+      BitXor();
+      Binary(Op::kOr);
+    }
+  }
+
+  void BitXor() {
+    BitAnd();
+    while (Accept("^")) {
+      BitAnd();
+      Binary(Op::kXor);
+    }
+  }
+
+  void BitAnd() {
+    Equality();
+    while (!Peek("&&") && Accept("&")) {
+      Equality();
+      Binary(Op::kAnd);
+    }
+  }
+
+  void Equality() {
+    Relational();
+    while (true) {
+      if (Accept("==")) {
+        Relational();
+        Binary(Op::kEq);
+      } else if (Accept("!=")) {
+        Relational();
+        Binary(Op::kNe);
+      } else {
+        return;
+      }
+    }
+  }
+
+  void Relational() {
+    Shift();
+    while (true) {
+      if (Accept("<=")) {
+        Shift();
+        Binary(Op::kLe);
+      } else if (Accept(">=")) {
+        Shift();
+        Binary(Op::kGe);
+      } else if (!Peek("<<") && Accept("<")) {
+        Shift();
+        Binary(Op::kLt);
+      } else if (!Peek(">>") && Accept(">")) {
+        Shift();
+        Binary(Op::kGt);
+      } else {
+        return;
+      }
+    }
+  }
+
+  void Shift() {
+    Additive();
+    while (true) {
+      if (Accept("<<")) {
+        Additive();
+        Binary(Op::kShl);
+      } else if (Accept(">>")) {
+        Additive();
+        Binary(Op::kShr);
+      } else {
+        return;
+      }
+    }
+  }
+
+  void Additive() {
+    Multiplicative();
+    while (true) {
+      if (Accept("+")) {
+        Multiplicative();
+        Binary(Op::kAdd);
+      } else if (Accept("-")) {
+        Multiplicative();
+        Binary(Op::kSub);
+      } else {
+        return;
+      }
+    }
+  }
+
+  void Multiplicative() {
+    Unary();
+    while (true) {
+      if (Accept("*")) {
+        Unary();
+        Binary(Op::kMul);
+      } else if (Accept("/")) {
+        Unary();
+        Binary(Op::kDiv);
+      } else if (Accept("%")) {
+        Unary();
+        Binary(Op::kMod);
+      } else {
+        return;
+      }
+    }
+  }
+
+  void Unary() {
+    if (Accept("-")) {
+      Unary();
+      Emit(Op::kNeg);
+    } else if (Accept("!")) {
+      Unary();
+      Emit(Op::kNot);
+    } else if (Accept("~")) {
+      Unary();
+      Emit(Op::kBitNot);
+    } else if (Accept("*")) {
+      Unary();
+      Emit(Op::kDeref);
+    } else {
+      Primary();
+    }
+  }
+
+  void Primary() {
+    SkipSpace();
+    if (Accept("(")) {
+      LogicalOr();
+      if (!Accept(")")) {
+        Fail("expected ')'");
+      }
+      return;
+    }
+    if (pos_ < src_.size() && std::isdigit(src_[pos_])) {
+      size_t len = 0;
+      auto value = std::stoull(src_.substr(pos_), &len, 0);
+      pos_ += len;
+      Emit(Op::kConst);
+      EmitBytes(&value, sizeof(value));
+      Push();
+      return;
+    }
+    bool is_register = Accept("$");
+    auto name = Identifier();
+    if (name.empty()) {
+      Fail("expected a value");
+    }
+    if (is_register) {
+      for (const auto& [reg, info] : Register::register_lookup) {
+        if (info.first == name) {
+          Emit(Op::kReg);
+          out_->code_.push_back(static_cast<uint8_t>(reg));
+          Push();
+          return;
+        }
+      }
+      Fail("unknown register $" + name);
+    }
+    auto slot = static_cast<uint32_t>(out_->variables_.size());
+    out_->variables_.push_back(resolver_(name));
+    Emit(Op::kVar);
+    EmitBytes(&slot, sizeof(slot));
+    Push();
+  }
+
+  std::string Identifier() {
+    auto start = pos_;
+    while (pos_ < src_.size() &&
+           (std::isalnum(src_[pos_]) || src_[pos_] == '_')) {
+      pos_++;
+    }
+    return src_.substr(start, pos_ - start);
+  }
+
+  void SkipSpace() {
+    while (pos_ < src_.size() && std::isspace(src_[pos_])) {
+      pos_++;
+    }
+  }
+
+  bool Peek(const char* token) {
+    SkipSpace();
+    return src_.compare(pos_, std::strlen(token), token) == 0;
+  }
+
+  bool Accept(const char* token) {
+    if (!Peek(token)) {
+      return false;
+    }
+    pos_ += std::strlen(token);
+    return true;
+  }
+
+  void Emit(Op op) { out_->code_.push_back(static_cast<uint8_t>(op)); }
+
+  void EmitBytes(const void* data, size_t len) {
+    const auto* bytes = static_cast<const uint8_t*>(data);
+    out_->code_.insert(out_->code_.end(), bytes, bytes + len);
+  }
+
+  // Emit a jump with a placeholder target, returns where to patch it
+  size_t EmitJump(Op op) {
+    Emit(op);
+    auto at = out_->code_.size();
+    uint32_t target = 0;
+    EmitBytes(&target, sizeof(target));
+    return at;
+  }
+
+  void Patch(size_t at) {
+    auto target = static_cast<uint32_t>(out_->code_.size());
+    std::memcpy(&out_->code_[at], &target, sizeof(target));
+  }
+
+  void Binary(Op op) {
+    Emit(op);
+    depth_--;
+  }
+
+  void Pop() {
+    Emit(Op::kPop);
+    depth_--;
+  }
+
+  void Push() {
+    if (++depth_ > Expression::kMaxStack) {
+      Fail("expression too deep");
+    }
+  }
+
+  [[noreturn]] void Fail(const std::string& msg) {
+    throw std::runtime_error("Bad expression at column " +
+                             std::to_string(pos_ + 1) + ": " + msg);
+  }
+
+  const std::string& src_;
+  const Expression::Resolver& resolver_;
+  Expression* out_;
+  size_t pos_ = 0;
+  int depth_ = 0;
+};
+
+Expression Expression::Compile(const std::string& source,
+                               const Resolver& resolver) {
+  Expression expr;
+  expr.source_ = source;
+  ExpressionParser{source, resolver, &expr}.Parse();
+  return expr;
+}
+
+const std::string& Expression::GetSource() const { return source_; }
+
+uint64_t Expression::Evaluate(ExpressionContext* context) const {
+  std::array<uint64_t, kMaxStack> stack{};
+  int sp = -1;
+  size_t pc = 0;
+
+  auto read_u32 = [this, &pc]() {
+    uint32_t v;
+    std::memcpy(&v, &code_[pc], sizeof(v));
+    pc += sizeof(v);
+    return v;
+  };
+
+  while (pc < code_.size()) {
+    auto op = static_cast<Op>(code_[pc++]);
+    auto& top = stack[sp < 0 ? 0 : sp];
+    // Operands of binary operators, valid only for those
+    uint64_t rhs = top;
+    uint64_t lhs = sp > 0 ? stack[sp - 1] : 0;
+    auto signed_rhs = static_cast<int64_t>(rhs);
+    auto signed_lhs = static_cast<int64_t>(lhs);
+    switch (op) {
+      case Op::kConst:
+        std::memcpy(&stack[++sp], &code_[pc], sizeof(uint64_t));
+        pc += sizeof(uint64_t);
+        continue;
+      case Op::kReg:
+        stack[++sp] =
+            context->ReadRegister(static_cast<Register::Reg>(code_[pc++]));
+        continue;
+      case Op::kVar:
+        stack[++sp] = context->ReadVariable(*variables_[read_u32()]);
+        continue;
+      case Op::kDeref:
+        top = context->ReadMemory(top);
+        continue;
+      case Op::kNeg:
+        top = -top;
+        continue;
+      case Op::kNot:
+        top = !top;
+        continue;
+      case Op::kBitNot:
+        top = ~top;
+        continue;
+      case Op::kBool:
+        top = top != 0;
+        continue;
+      case Op::kPop:
+        sp--;
+        continue;
+      case Op::kJumpIfFalse:
+      case Op::kJumpIfTrue: {
+        auto target = read_u32();
+        if ((top != 0) == (op == Op::kJumpIfTrue)) {
+          top = top != 0;
+          pc = target;
+        }
+        continue;
+      }
+      default:
+        break;
+    }
+
+    // Binary operators pop two values and push one
+    uint64_t result = 0;
+    switch (op) {
+      case Op::kAdd:
+        result = lhs + rhs;
+        break;
+      case Op::kSub:
+        result = lhs - rhs;
+        break;
+      case Op::kMul:
+        result = lhs * rhs;
+        break;
+      case Op::kDiv:
+      case Op::kMod:
+        if (rhs == 0) {
+          throw std::runtime_error("Division by zero in expression");
+        }
+        // INT64_MIN / -1 traps, and x / -1 is -x, x % -1 is 0 anyway
+        if (signed_rhs == -1) {
+          result = op == Op::kDiv ? -lhs : 0;
+        } else {
+          result = op == Op::kDiv ? signed_lhs / signed_rhs
+                                  : signed_lhs % signed_rhs;
+        }
+        break;
+      case Op::kShl:
+        result = lhs << (rhs & 63);
+        break;
+      case Op::kShr:
+        result = lhs >> (rhs & 63);
+        break;
+      case Op::kAnd:
+        result = lhs & rhs;
+        break;
+      case Op::kOr:
+        result = lhs | rhs;
+        break;
+      case Op::kXor:
+        result = lhs ^ rhs;
+        break;
+      case Op::kEq:
+        result = lhs == rhs;
+        break;
+      case Op::kNe:
+        result = lhs != rhs;
+        break;
+      case Op::kLt:
+        result = signed_lhs < signed_rhs;
+        break;
+      case Op::kLe:
+        result = signed_lhs <= signed_rhs;
+        break;
+      case Op::kGt:
+        result = signed_lhs > signed_rhs;
+        break;
+      case Op::kGe:
+        result = signed_lhs >= signed_rhs;
+        break;
+      default:
+        throw std::runtime_error("Corrupt expression bytecode");
+    }
+    stack[--sp] = result;
+  }
+  return sp < 0 ? 0 : stack[sp];
+}
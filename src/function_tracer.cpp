@@ -0,0 +1,171 @@
+#include "function_tracer.h"
+
+#include <algorithm>
+#include <iomanip>
+
+#include "json.h"
+
+namespace {
+
+double ToMs(uint64_t ns) { return ns / 1e6; }
+
+}  // namespace
+
+void FunctionTracer::Clear() { *this = FunctionTracer(); }
+
+uint32_t FunctionTracer::AddFunction(const std::string& name) {
+  names_.push_back(name);
+  return names_.size() - 1;
+}
+
+size_t FunctionTracer::FunctionCount() const { return names_.size(); }
+
+uint32_t FunctionTracer::NewNode(uint32_t function, uint32_t depth) {
+  nodes_.push_back(Node{function, depth});
+  return nodes_.size() - 1;
+}
+
+void FunctionTracer::OnEntry(pid_t tid, uint32_t function, uint64_t cfa,
+                             uint64_t time_ns) {
+  if (first_ns_ == 0) {
+    first_ns_ = time_ns;
+  }
+  auto it = threads_.find(tid);
+  if (it == threads_.end()) {
+    it = threads_.emplace(tid, Thread{NewNode(kNoFunction, 0)}).first;
+  }
+  auto& thread = it->second;
+  // Frames the stack pointer has already moved above were left without
+  // passing their return address
+  OnReturn(tid, cfa - 1, time_ns);
+
+  auto parent = thread.stack.empty() ? thread.root : thread.stack.back().node;
+  auto child = nodes_[parent].children.find(function);
+  uint32_t node = 0;
+  if (child != nodes_[parent].children.end()) {
+    node = child->second;
+  } else {
+    node = NewNode(function, nodes_[parent].depth + 1);
+    nodes_[parent].children[function] = node;
+  }
+  nodes_[node].calls++;
+  max_depth_ = std::max(max_depth_, nodes_[node].depth);
+  thread.stack.push_back(Frame{node, cfa, time_ns});
+}
+
+void FunctionTracer::OnReturn(pid_t tid, uint64_t sp, uint64_t time_ns) {
+  auto it = threads_.find(tid);
+  if (it == threads_.end()) {
+    return;
+  }
+  auto& stack = it->second.stack;
+  while (!stack.empty() && stack.back().cfa <= sp) {
+    auto frame = stack.back();
+    stack.pop_back();
+    auto duration = time_ns - frame.start_ns;
+    auto& node = nodes_[frame.node];
+    node.inclusive_ns += duration;
+    node.exclusive_ns += duration - frame.children_ns;
+    if (!stack.empty()) {
+      stack.back().children_ns += duration;
+    }
+    if (events_.size() < kMaxEvents) {
+      events_.push_back(Event{tid, node.function, frame.start_ns, duration});
+    } else {
+      dropped_events_++;
+    }
+  }
+}
+
+void FunctionTracer::PrintReport(std::ostream& out) const {
+  // Flat profile. Inclusive time only counts the outermost of recursive
+  // calls so it is not added up twice.
+  struct Totals {
+    uint64_t calls = 0;
+    uint64_t inclusive_ns = 0;
+    uint64_t exclusive_ns = 0;
+  };
+  std::vector<Totals> totals(names_.size());
+  std::vector<uint32_t> active(names_.size());
+  auto visit = [&](auto&& self, uint32_t n) -> void {
+    const auto& node = nodes_[n];
+    bool counted = node.function != kNoFunction;
+    if (counted) {
+      auto& t = totals[node.function];
+      t.calls += node.calls;
+      t.exclusive_ns += node.exclusive_ns;
+      if (active[node.function]++ == 0) {
+        t.inclusive_ns += node.inclusive_ns;
+      }
+    }
+    for (const auto& [function, child] : node.children) {
+      self(self, child);
+    }
+    if (counted) {
+      active[node.function]--;
+    }
+  };
+  for (const auto& [tid, thread] : threads_) {
+    visit(visit, thread.root);
+  }
+
+  std::vector<uint32_t> order;
+  for (uint32_t f = 0; f < names_.size(); f++) {
+    if (totals[f].calls != 0) {
+      order.push_back(f);
+    }
+  }
+  std::sort(order.begin(), order.end(), [&totals](auto a, auto b) {
+    return totals[a].exclusive_ns > totals[b].exclusive_ns;
+  });
+
+  out << std::fixed << std::setprecision(3) << std::dec;
+  out << std::setw(10) << "calls" << std::setw(14) << "total ms"
+      << std::setw(14) << "self ms"
+      << "  function" << std::endl;
+  for (auto f : order) {
+    out << std::setw(10) << totals[f].calls << std::setw(14)
+        << ToMs(totals[f].inclusive_ns) << std::setw(14)
+        << ToMs(totals[f].exclusive_ns) << "  " << names_[f] << std::endl;
+  }
+
+  for (const auto& [tid, thread] : threads_) {
+    out << std::endl << "Call graph of thread " << tid << ":" << std::endl;
+    for (const auto& [function, child] : nodes_[thread.root].children) {
+      PrintNode(out, child);
+    }
+    if (!thread.stack.empty()) {
+      out << "(" << thread.stack.size() << " calls still running)"
+          << std::endl;
+    }
+  }
+  out << std::endl << "Maximum call depth " << max_depth_ << std::endl;
+  if (dropped_events_ != 0) {
+    out << dropped_events_ << " calls not kept for the Chrome trace"
+        << std::endl;
+  }
+  out << std::defaultfloat;
+}
+
+void FunctionTracer::PrintNode(std::ostream& out, uint32_t n) const {
+  const auto& node = nodes_[n];
+  out << std::string(2 * (node.depth - 1), ' ') << names_[node.function]
+      << " " << node.calls << "x " << ToMs(node.inclusive_ns) << " ms (self "
+      << ToMs(node.exclusive_ns) << " ms)" << std::endl;
+  for (const auto& [function, child] : node.children) {
+    PrintNode(out, child);
+  }
+}
+
+void FunctionTracer::WriteChromeTrace(std::ostream& out, pid_t pid) const {
+  out << std::fixed << std::setprecision(3) << "{\"traceEvents\":[";
+  for (size_t i = 0; i < events_.size(); i++) {
+    const auto& event = events_[i];
+    out << (i == 0 ? "" : ",") << "\n{\"name\":"
+        << JsonQuote(names_[event.function])
+        << ",\"ph\":\"X\",\"ts\":" << (event.start_ns - first_ns_) / 1e3
+        << ",\"dur\":" << event.duration_ns / 1e3 << ",\"pid\":" << pid
+        << ",\"tid\":" << event.tid << "}";
+  }
+  out << "\n]}" << std::endl << std::defaultfloat;
+}
@@ -0,0 +1,959 @@
+#include "gdb_server.h"
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/user.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <climits>
+#include <csignal>
+#include <cstddef>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <sstream>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+#include "debugger.h"
+#include "ptrace_wrapper.h"
+
+namespace {
+
+// Largest packet the client may send, the reply to an m packet can hold
+// half of it in bytes
+const auto kPacketSize = 0x20000;
+const auto kReadSize = 64 * 1024;
+const auto kInterruptPollMs = 20;
+const auto kInterrupt = '\x03';
+
+// GDB's signal numbers by Linux signal number, they differ from SIGBUS on
+const int kGdbSignals[] = {0,  1,  2,  3,  4,  5,  6,  10, 8,  9,  30,
+                           11, 31, 13, 14, 15, 0,  20, 19, 17, 18, 21,
+                           22, 16, 24, 25, 26, 27, 28, 23, 32, 12};
+
+int GdbSignal(int signal) {
+  if (signal <= 0 || signal >= static_cast<int>(std::size(kGdbSignals))) {
+    return 0;
+  }
+  return kGdbSignals[signal];
+}
+
+int HostSignal(int gdb_signal) {
+  for (size_t i = 1; i < std::size(kGdbSignals); i++) {
+    if (kGdbSignals[i] == gdb_signal) {
+      return i;
+    }
+  }
+  return 0;
+}
+
+// Where the value of a register in the target description comes from
+enum class Source { kGeneral, kFloat, kTagWord };
+
+struct RegisterInfo {
+  std::string name;
+  int bits;
+  const char* type;
+  int feature;  // index into kFeatures
+  Source source;
+  // Register::Reg for kGeneral, byte offset into user_fpregs_struct and
+  // number of bytes there for kFloat
+  size_t offset;
+  size_t size;
+};
+
+const char* const kFeatures[] = {
+    "org.gnu.gdb.i386.core", "org.gnu.gdb.i386.sse", "org.gnu.gdb.i386.linux",
+    "org.gnu.gdb.i386.segments"};
+
+// Types the SSE feature uses
+const auto kVectorTypes = R"(<vector id="v4f" type="ieee_single" count="4"/>
+<vector id="v2d" type="ieee_double" count="2"/>
+<vector id="v16i8" type="int8" count="16"/>
+<vector id="v8i16" type="int16" count="8"/>
+<vector id="v4i32" type="int32" count="4"/>
+<vector id="v2i64" type="int64" count="2"/>
+<union id="vec128">
+<field name="v4_float" type="v4f"/>
+<field name="v2_double" type="v2d"/>
+<field name="v16_int8" type="v16i8"/>
+<field name="v8_int16" type="v8i16"/>
+<field name="v4_int32" type="v4i32"/>
+<field name="v2_int64" type="v2i64"/>
+<field name="uint128" type="uint128"/>
+</union>
+)";
+
+// Registers in the order of the g packet, which is GDB's amd64 numbering
+const std::vector<RegisterInfo>& Registers() {
+  static const auto registers = [] {
+    using Register::Reg;
+    std::vector<RegisterInfo> regs;
+    auto general = [&regs](const char* name, Reg reg, int bits,
+                           const char* type, int feature) {
+      regs.push_back({name, bits, type, feature, Source::kGeneral,
+                      static_cast<size_t>(reg), 0});
+    };
+    auto fpu = [&regs](std::string name, int bits, const char* type,
+                       int feature, size_t offset, size_t size) {
+      regs.push_back(
+          {std::move(name), bits, type, feature, Source::kFloat, offset, size});
+    };
+    const Reg kGprs[] = {Register::rax, Register::rbx, Register::rcx,
+                         Register::rdx, Register::rsi, Register::rdi,
+                         Register::rbp, Register::rsp, Register::r8,
+                         Register::r9,  Register::r10, Register::r11,
+                         Register::r12, Register::r13, Register::r14,
+                         Register::r15};
+    for (auto reg : kGprs) {
+      const char* type = reg == Register::rbp || reg == Register::rsp
+                             ? "data_ptr"
+                             : "int64";
+      general(Register::register_lookup.at(reg).first.c_str(), reg, 64, type,
+              0);
+    }
+    general("rip", Register::rip, 64, "code_ptr", 0);
+    general("eflags", Register::eflags, 32, "int32", 0);
+    general("cs", Register::cs, 32, "int32", 0);
+    general("ss", Register::ss, 32, "int32", 0);
+    general("ds", Register::ds, 32, "int32", 0);
+    general("es", Register::es, 32, "int32", 0);
+    general("fs", Register::fs, 32, "int32", 0);
+    general("gs", Register::gs, 32, "int32", 0);
+
+    // The x87 registers in the FXSAVE layout ptrace returns them in
+    for (int i = 0; i < 8; i++) {
+      fpu("st" + std::to_string(i), 80, "i387_ext", 0,
+          offsetof(user_fpregs_struct, st_space) + 16 * i, 10);
+    }
+    const auto kRip = offsetof(user_fpregs_struct, rip);
+    const auto kRdp = offsetof(user_fpregs_struct, rdp);
+    fpu("fctrl", 32, "int", 0, offsetof(user_fpregs_struct, cwd), 2);
+    fpu("fstat", 32, "int", 0, offsetof(user_fpregs_struct, swd), 2);
+    regs.push_back({"ftag", 32, "int", 0, Source::kTagWord, 0, 0});
+    fpu("fiseg", 32, "int", 0, kRip + 4, 4);
+    fpu("fioff", 32, "int", 0, kRip, 4);
+    fpu("foseg", 32, "int", 0, kRdp + 4, 4);
+    fpu("fooff", 32, "int", 0, kRdp, 4);
+    fpu("fop", 32, "int", 0, offsetof(user_fpregs_struct, fop), 2);
+
+    for (int i = 0; i < 16; i++) {
+      fpu("xmm" + std::to_string(i), 128, "vec128", 1,
+          offsetof(user_fpregs_struct, xmm_space) + 16 * i, 16);
+    }
+    fpu("mxcsr", 32, "int", 1, offsetof(user_fpregs_struct, mxcsr), 4);
+    general("orig_rax", Register::orig_rax, 64, "int", 2);
+    general("fs_base", Register::fs_base, 64, "int", 3);
+    general("gs_base", Register::gs_base, 64, "int", 3);
+    return regs;
+  }();
+  return registers;
+}
+
+std::string TargetXml() {
+  std::stringstream xml;
+  xml << "<?xml version=\"1.0\"?>\n"
+      << "<!DOCTYPE target SYSTEM \"gdb-target.dtd\">\n"
+      << "<target version=\"1.0\">\n"
+      << "<architecture>i386:x86-64</architecture>\n"
+      << "<osabi>GNU/Linux</osabi>\n";
+  const auto& regs = Registers();
+  for (int feature = 0; feature < static_cast<int>(std::size(kFeatures));
+       feature++) {
+    xml << "<feature name=\"" << kFeatures[feature] << "\">\n";
+    if (feature == 1) {
+      xml << kVectorTypes;
+    }
+    for (size_t n = 0; n < regs.size(); n++) {
+      if (regs[n].feature == feature) {
+        xml << "<reg name=\"" << regs[n].name << "\" bitsize=\""
+            << regs[n].bits << "\" type=\"" << regs[n].type << "\" regnum=\""
+            << n << "\"/>\n";
+      }
+    }
+    xml << "</feature>\n";
+  }
+  xml << "</target>\n";
+  return xml.str();
+}
+
+// The full x87 tag word GDB shows, from the FXSAVE one with a bit per
+// register that is only set for non-empty registers
+uint16_t FullTagWord(const user_fpregs_struct& fp) {
+  auto top = (fp.swd >> 11) & 7;
+  uint16_t tags = 0;
+  for (int physical = 0; physical < 8; physical++) {
+    unsigned tag = 3;  // empty
+    if ((fp.ftw & (1 << physical)) != 0) {
+      const auto* st = reinterpret_cast<const uint8_t*>(fp.st_space) +
+                       16 * ((physical - top) & 7);
+      uint64_t mantissa;
+      std::memcpy(&mantissa, st, sizeof(mantissa));
+      auto exponent = (st[9] << 8 | st[8]) & 0x7fff;
+      if (exponent == 0x7fff) {
+        tag = 2;  // special
+      } else if (exponent == 0) {
+        tag = mantissa == 0 ? 1 : 2;  // zero or denormal
+      } else {
+        tag = (mantissa >> 63) != 0 ? 0 : 2;  // valid or unnormal
+      }
+    }
+    tags |= tag << (2 * physical);
+  }
+  return tags;
+}
+
+uint16_t AbridgedTagWord(uint16_t tags) {
+  uint16_t abridged = 0;
+  for (int physical = 0; physical < 8; physical++) {
+    if (((tags >> (2 * physical)) & 3) != 3) {
+      abridged |= 1 << physical;
+    }
+  }
+  return abridged;
+}
+
+const char kHexDigits[] = "0123456789abcdef";
+
+void AppendHex(const uint8_t* bytes, size_t len, std::string* out) {
+  for (size_t i = 0; i < len; i++) {
+    *out += kHexDigits[bytes[i] >> 4];
+    *out += kHexDigits[bytes[i] & 0xf];
+  }
+}
+
+std::string HexNumber(uint64_t value) {
+  std::stringstream s;
+  s << std::hex << value;
+  return s.str();
+}
+
+std::vector<uint8_t> ParseHexBytes(const std::string& hex) {
+  if (hex.size() % 2 != 0) {
+    throw std::runtime_error("Odd number of hex digits");
+  }
+  std::vector<uint8_t> bytes(hex.size() / 2);
+  for (size_t i = 0; i < bytes.size(); i++) {
+    bytes[i] = std::stoul(hex.substr(2 * i, 2), nullptr, 16);
+  }
+  return bytes;
+}
+
+// Append reg's value in target byte order as hex
+void AppendRegister(const RegisterInfo& reg, RegisterFile* registers,
+                    const user_fpregs_struct& fp, std::string* out) {
+  std::vector<uint8_t> bytes(reg.bits / 8);
+  if (reg.source == Source::kGeneral) {
+    auto value = registers->Get(static_cast<Register::Reg>(reg.offset));
+    std::memcpy(bytes.data(), &value, std::min(bytes.size(), sizeof(value)));
+  } else if (reg.source == Source::kTagWord) {
+    auto tags = FullTagWord(fp);
+    std::memcpy(bytes.data(), &tags, sizeof(tags));
+  } else {
+    std::memcpy(bytes.data(),
+                reinterpret_cast<const uint8_t*>(&fp) + reg.offset, reg.size);
+  }
+  AppendHex(bytes.data(), bytes.size(), out);
+}
+
+// Set reg from bytes in target byte order. Floating point registers are
+// changed in fp, for the caller to write back.
+void SetRegister(const RegisterInfo& reg, const std::vector<uint8_t>& bytes,
+                 RegisterFile* registers, user_fpregs_struct* fp) {
+  if (bytes.size() != static_cast<size_t>(reg.bits / 8)) {
+    throw std::runtime_error("Wrong size for register " + reg.name);
+  }
+  if (reg.source == Source::kGeneral) {
+    uint64_t value = 0;
+    std::memcpy(&value, bytes.data(), std::min(bytes.size(), sizeof(value)));
+    registers->Set(static_cast<Register::Reg>(reg.offset), value);
+  } else if (reg.source == Source::kTagWord) {
+    uint16_t tags;
+    std::memcpy(&tags, bytes.data(), sizeof(tags));
+    fp->ftw = AbridgedTagWord(tags);
+  } else {
+    std::memcpy(reinterpret_cast<uint8_t*>(fp) + reg.offset, bytes.data(),
+                reg.size);
+  }
+}
+
+// "addr,len" as in m, M and Z packets
+std::pair<uint64_t, uint64_t> ParseAddressLength(const std::string& s) {
+  auto comma = s.find(',');
+  if (comma == s.npos) {
+    throw std::runtime_error("Expected addr,length");
+  }
+  return {std::stoull(s.substr(0, comma), nullptr, 16),
+          std::stoull(s.substr(comma + 1), nullptr, 16)};
+}
+
+// Thread ids are hex, -1 means all threads and 0 any thread
+pid_t ParseThreadId(const std::string& s) {
+  if (s == "-1") {
+    return -1;
+  }
+  return std::stol(s, nullptr, 16);
+}
+
+}  // namespace
+
+GdbServer::GdbServer(Debugger* debugger, const std::string& address)
+    : debugger_{debugger} {
+  debugger_->CurrentThread();  // throws if there is no process
+
+  auto colon = address.rfind(':');
+  auto port = colon == address.npos ? address : address.substr(colon + 1);
+  tcp_ = !port.empty() &&
+         port.find_first_not_of("0123456789") == std::string::npos;
+  if (tcp_) {
+    auto host = colon == address.npos || colon == 0 ? "127.0.0.1"
+                                                    : address.substr(0, colon);
+    addrinfo hints{};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* info = nullptr;
+    if (getaddrinfo(host.c_str(), port.c_str(), &hints, &info) != 0) {
+      throw std::runtime_error("Cannot resolve " + address);
+    }
+    listen_fd_ = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    int one = 1;
+    setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    auto bound = listen_fd_ >= 0 &&
+                 bind(listen_fd_, info->ai_addr, info->ai_addrlen) == 0;
+    freeaddrinfo(info);
+    if (!bound) {
+      auto error = "bind " + address + ": " + strerror(errno);
+      close(listen_fd_);
+      throw std::runtime_error(error);
+    }
+  } else {
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (address.size() >= sizeof(addr.sun_path)) {
+      throw std::runtime_error("Socket path too long: " + address);
+    }
+    address.copy(addr.sun_path, address.size());
+    listen_fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    unlink(address.c_str());
+    if (listen_fd_ < 0 || bind(listen_fd_, reinterpret_cast<sockaddr*>(&addr),
+                               sizeof(addr)) != 0) {
+      auto error = "bind " + address + ": " + strerror(errno);
+      close(listen_fd_);
+      throw std::runtime_error(error);
+    }
+    unix_path_ = address;
+  }
+  if (listen(listen_fd_, 1) != 0) {
+    close(listen_fd_);
+    throw std::runtime_error(std::string("listen: ") + strerror(errno));
+  }
+  std::cout << "Listening for gdb on " << address << std::endl;
+}
+
+GdbServer::~GdbServer() {
+  if (fd_ >= 0) {
+    close(fd_);
+  }
+  if (listen_fd_ >= 0) {
+    close(listen_fd_);
+  }
+  if (!unix_path_.empty()) {
+    unlink(unix_path_.c_str());
+  }
+}
+
+void GdbServer::Run() {
+  do {
+    fd_ = accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+  } while (fd_ < 0 && errno == EINTR);
+  if (fd_ < 0) {
+    throw std::runtime_error(std::string("accept: ") + strerror(errno));
+  }
+  if (tcp_) {
+    // Packets are small and latency bound
+    int one = 1;
+    setsockopt(fd_, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+  }
+  std::cout << "gdb connected" << std::endl;
+  stop_tid_ = debugger_->current_tid_;
+
+  std::string packet;
+  bool keep_going = true;
+  while (keep_going && ReadPacket(&packet)) {
+    std::string reply;
+    try {
+      keep_going = HandlePacket(packet, &reply);
+    } catch (std::exception& e) {
+      std::cerr << "gdb packet " << packet.substr(0, 32) << ": " << e.what()
+                << std::endl;
+      reply = "E01";
+    }
+    // k ends the session without a reply
+    if (keep_going || packet[0] != 'k') {
+      SendPacket(reply);
+    }
+  }
+  RemoveClientBreakpoints();
+  std::cout << "gdb disconnected" << std::endl;
+}
+
+bool GdbServer::ReadPacket(std::string* packet) {
+  while (true) {
+    size_t pos = 0;
+    while (pos < input_.size() && input_[pos] != '$') {
+      auto c = input_[pos++];
+      if (c == '-' && !last_packet_.empty()) {
+        send(fd_, last_packet_.data(), last_packet_.size(), MSG_NOSIGNAL);
+      } else if (c == kInterrupt) {
+        input_.erase(0, pos);
+        *packet = kInterrupt;
+        return true;
+      }
+      // '+' acks need nothing
+    }
+    input_.erase(0, pos);
+    auto hash = input_.find('#');
+    if (hash != input_.npos && hash + 2 < input_.size()) {
+      *packet = input_.substr(1, hash - 1);
+      auto checksum =
+          std::strtoul(input_.substr(hash + 1, 2).c_str(), nullptr, 16);
+      input_.erase(0, hash + 3);
+      if (no_ack_) {
+        return true;
+      }
+      uint8_t sum = 0;
+      for (auto c : *packet) {
+        sum += c;
+      }
+      auto ack = sum == checksum ? "+" : "-";
+      send(fd_, ack, 1, MSG_NOSIGNAL);
+      if (sum == checksum) {
+        return true;
+      }
+      continue;
+    }
+
+    char buf[kReadSize];
+    auto n = recv(fd_, buf, sizeof(buf), 0);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n <= 0) {
+      return false;
+    }
+    input_.append(buf, n);
+  }
+}
+
+void GdbServer::SendPacket(const std::string& payload) {
+  uint8_t sum = 0;
+  for (auto c : payload) {
+    sum += c;
+  }
+  last_packet_ = "$" + payload + "#";
+  last_packet_ += kHexDigits[sum >> 4];
+  last_packet_ += kHexDigits[sum & 0xf];
+  size_t done = 0;
+  while (done < last_packet_.size()) {
+    auto n = send(fd_, last_packet_.data() + done, last_packet_.size() - done,
+                  MSG_NOSIGNAL);
+    if (n < 0 && errno == EINTR) {
+      continue;
+    }
+    if (n < 0) {
+      throw std::runtime_error(std::string("send: ") + strerror(errno));
+    }
+    done += n;
+  }
+}
+
+bool GdbServer::HandlePacket(const std::string& packet, std::string* reply) {
+  auto args = packet.substr(1);
+  auto& threads = debugger_->threads_;
+  switch (packet[0]) {
+    case kInterrupt:
+    case '?':
+      *reply = StopReply();
+      return true;
+    case 'g':
+      *reply = ReadRegisters();
+      return true;
+    case 'G':
+      WriteRegisters(args);
+      *reply = "OK";
+      return true;
+    case 'p':
+      *reply = ReadRegister(std::stoul(args, nullptr, 16));
+      return true;
+    case 'P': {
+      auto equals = args.find('=');
+      WriteRegister(std::stoul(args.substr(0, equals), nullptr, 16),
+                    args.substr(equals + 1));
+      *reply = "OK";
+      return true;
+    }
+    case 'm': {
+      auto [addr, len] = ParseAddressLength(args);
+      *reply = ReadMemory(addr, len);
+      return true;
+    }
+    case 'M': {
+      auto colon = args.find(':');
+      auto [addr, len] = ParseAddressLength(args.substr(0, colon));
+      auto data = args.substr(colon + 1);
+      if (data.size() != 2 * len) {
+        throw std::runtime_error("M packet length mismatch");
+      }
+      WriteMemory(addr, data);
+      *reply = "OK";
+      return true;
+    }
+    case 'Z':
+    case 'z':
+      *reply = HandleBreakpoint(packet);
+      return true;
+    case 'c':
+    case 's':
+    case 'C':
+    case 'S': {
+      // Resume address arguments are not supported, gdb does not send them
+      auto action = packet.substr(0, 1);
+      if (packet[0] == 'C' || packet[0] == 'S') {
+        action += args.substr(0, args.find(';'));
+      }
+      *reply = HandleVCont(";" + action);
+      return true;
+    }
+    case 'H': {
+      auto tid = ParseThreadId(args.substr(1));
+      if (tid > 0 && threads.count(tid) == 0) {
+        *reply = "E01";
+      } else {
+        if (tid > 0) {
+          debugger_->current_tid_ = tid;
+        }
+        *reply = "OK";
+      }
+      return true;
+    }
+    case 'T':
+      *reply = threads.count(ParseThreadId(args)) != 0 ? "OK" : "E01";
+      return true;
+    case 'D':
+      RemoveClientBreakpoints();
+      debugger_->Detach();
+      *reply = "OK";
+      return false;
+    case 'k':
+      Kill();
+      return false;
+    case 'q':
+      *reply = HandleQuery(packet);
+      return true;
+    case 'Q':
+      if (packet == "QStartNoAckMode") {
+        // The ack for this packet has gone out, later ones are skipped
+        no_ack_ = true;
+        *reply = "OK";
+      }
+      return true;
+    case 'v':
+      if (packet == "vCont?") {
+        *reply = "vCont;c;C;s;S";
+      } else if (packet.rfind("vCont;", 0) == 0) {
+        *reply = HandleVCont(packet.substr(5));
+      } else if (packet.rfind("vKill", 0) == 0) {
+        Kill();
+        *reply = "OK";
+      }
+      return true;
+    default:
+      // An empty reply tells the client the packet is not supported
+      return true;
+  }
+}
+
+std::string GdbServer::HandleQuery(const std::string& packet) {
+  if (packet.rfind("qSupported", 0) == 0) {
+    return "PacketSize=" + HexNumber(kPacketSize) +
+           ";QStartNoAckMode+;qXfer:features:read+;qXfer:auxv:read+"
+           ";qXfer:exec-file:read+;swbreak+;hwbreak+;vContSupported+";
+  }
+  if (packet == "qAttached") {
+    return debugger_->attached_ ? "1" : "0";
+  }
+  if (packet == "qC") {
+    return "QC" + HexNumber(debugger_->current_tid_);
+  }
+  if (packet == "qfThreadInfo") {
+    std::string reply = "m";
+    for (const auto& [tid, thread] : debugger_->threads_) {
+      if (reply.size() > 1) {
+        reply += ',';
+      }
+      reply += HexNumber(tid);
+    }
+    return reply;
+  }
+  if (packet == "qsThreadInfo") {
+    return "l";
+  }
+  if (packet == "qSymbol::") {
+    return "OK";
+  }
+
+  const std::string kXfer = "qXfer:";
+  if (packet.rfind(kXfer, 0) != 0) {
+    return "";
+  }
+  // qXfer:<object>:read:<annex>:<offset>,<length>
+  auto parts = Debugger::SplitCommand(packet.substr(kXfer.size()), ':');
+  if (parts.size() < 3 || parts[1] != "read") {
+    return "";
+  }
+  const auto& offset_length = parts.back();
+  auto pid = std::to_string(debugger_->pid_);
+  if (parts[0] == "features" && parts[2] == "target.xml") {
+    static const auto xml = TargetXml();
+    return Xfer(xml, offset_length);
+  }
+  if (parts[0] == "auxv") {
+    std::ifstream auxv{"/proc/" + pid + "/auxv", std::ios::binary};
+    std::string data{std::istreambuf_iterator<char>(auxv), {}};
+    return Xfer(data, offset_length);
+  }
+  if (parts[0] == "exec-file") {
+    char path[PATH_MAX];
+    auto len =
+        readlink(("/proc/" + pid + "/exe").c_str(), path, sizeof(path) - 1);
+    if (len < 0) {
+      return "E01";
+    }
+    return Xfer(std::string(path, len), offset_length);
+  }
+  return "";
+}
+
+std::string GdbServer::Xfer(const std::string& object,
+                            const std::string& offset_length) {
+  auto [offset, length] = ParseAddressLength(offset_length);
+  if (offset >= object.size()) {
+    return "l";
+  }
+  auto chunk = object.substr(offset, length);
+  std::string reply = offset + chunk.size() < object.size() ? "m" : "l";
+  // Binary data escapes the characters that frame packets
+  for (auto c : chunk) {
+    if (c == '#' || c == '$' || c == '}' || c == '*') {
+      reply += '}';
+      reply += static_cast<char>(c ^ 0x20);
+    } else {
+      reply += c;
+    }
+  }
+  return reply;
+}
+
+std::string GdbServer::HandleVCont(const std::string& actions) {
+  // Actions are ";<action>[:<tid>]", the first one matching a thread
+  // applies to it. Threads are all-stop: a step runs only the stepped
+  // thread, a continue resumes all of them.
+  auto& threads = debugger_->threads_;
+  pid_t step_tid = 0;
+  int stop_thread_signal = 0;
+  bool stop_thread_matched = false;
+  for (const auto& action : Debugger::SplitCommand(actions.substr(1), ';')) {
+    auto colon = action.find(':');
+    pid_t tid =
+        colon == action.npos ? -1 : ParseThreadId(action.substr(colon + 1));
+    auto kind = action[0];
+    if (kind != 'c' && kind != 'C' && kind != 's' && kind != 'S') {
+      return "E01";
+    }
+    int signal = 0;
+    if (kind == 'C' || kind == 'S') {
+      signal = HostSignal(std::stoi(action.substr(1, 2), nullptr, 16));
+    }
+    if (!stop_thread_matched && (tid == -1 || tid == stop_tid_)) {
+      stop_thread_matched = true;
+      stop_thread_signal = signal;
+    }
+    if ((kind == 's' || kind == 'S') && step_tid == 0) {
+      step_tid = tid == -1 ? debugger_->current_tid_ : tid;
+    }
+  }
+
+  // Signals are only passed on if the client says so
+  auto stop_thread = threads.find(stop_tid_);
+  if (stop_thread != threads.end()) {
+    stop_thread->second.pending_signal = stop_thread_signal;
+  }
+  if (step_tid != 0) {
+    if (threads.count(step_tid) == 0) {
+      return "E01";
+    }
+    debugger_->current_tid_ = step_tid;
+    debugger_->SingleStepInstructionWithBreakpointCheck();
+  } else {
+    ContinueAll();
+  }
+  if (!debugger_->exited_) {
+    stop_tid_ = debugger_->current_tid_;
+  }
+  return StopReply();
+}
+
+void GdbServer::ContinueAll() {
+  // The client sends ^C to interrupt the running process. It is the only
+  // byte it sends until the stop reply, so a thread looks out for it while
+  // this one waits for the process to stop.
+  std::atomic<bool> stopped = false;
+  auto pid = debugger_->pid_;
+  std::thread watcher{[this, pid, &stopped] {
+    while (!stopped) {
+      pollfd p{fd_, POLLIN, 0};
+      if (poll(&p, 1, kInterruptPollMs) <= 0) {
+        continue;
+      }
+      char c;
+      if (recv(fd_, &c, 1, MSG_PEEK) != 1 || c != kInterrupt) {
+        return;
+      }
+      recv(fd_, &c, 1, 0);
+      kill(pid, SIGINT);
+    }
+  }};
+  try {
+    debugger_->Continue();
+  } catch (...) {
+    stopped = true;
+    watcher.join();
+    throw;
+  }
+  stopped = true;
+  watcher.join();
+}
+
+void GdbServer::Kill() {
+  if (debugger_->exited_) {
+    return;
+  }
+  kill(debugger_->pid_, SIGKILL);
+  while (!debugger_->exited_) {
+    debugger_->Wait();
+  }
+}
+
+std::string GdbServer::StopReply() {
+  if (debugger_->exited_) {
+    auto status = debugger_->exit_status_;
+    char reply[8];
+    if (WIFSIGNALED(status)) {
+      snprintf(reply, sizeof(reply), "X%02x", GdbSignal(WTERMSIG(status)));
+    } else {
+      snprintf(reply, sizeof(reply), "W%02x", WEXITSTATUS(status));
+    }
+    return reply;
+  }
+
+  auto it = debugger_->threads_.find(stop_tid_);
+  if (it == debugger_->threads_.end()) {
+    it = debugger_->threads_.find(debugger_->current_tid_);
+  }
+  auto& thread = it->second;
+  auto signal = thread.pending_signal != 0 ? thread.pending_signal : SIGTRAP;
+  char header[8];
+  snprintf(header, sizeof(header), "T%02x", GdbSignal(signal));
+  std::string reply = header;
+  reply += "thread:" + HexNumber(thread.tid) + ";";
+  if (thread.stop_reason == "breakpoint" && thread.at_breakpoint) {
+    reply += "swbreak:;";
+  } else if (thread.stop_reason == "hardware breakpoint" &&
+             debugger_->triggered_slot_ >= 0) {
+    auto slot = debugger_->triggered_slot_;
+    auto& hw = debugger_->debug_registers_.Get(slot);
+    int type = 1;
+    for (const auto& [key, s] : hw_slots_) {
+      if (s == slot) {
+        type = key.first;
+      }
+    }
+    const char* const kReasons[] = {"", "hwbreak", "watch", "rwatch",
+                                    "awatch"};
+    reply += kReasons[type];
+    reply += ":";
+    if (type != 1) {
+      reply += HexNumber(hw.addr);
+    }
+    reply += ";";
+  }
+  return reply;
+}
+
+std::string GdbServer::HandleBreakpoint(const std::string& packet) {
+  // [Zz]<type>,<addr>,<kind>
+  auto parts = Debugger::SplitCommand(packet.substr(1), ',');
+  if (parts.size() < 3) {
+    return "E01";
+  }
+  auto insert = packet[0] == 'Z';
+  auto type = std::stoi(parts[0]);
+  auto addr = std::stoull(parts[1], nullptr, 16);
+  auto kind = std::stoul(parts[2], nullptr, 16);
+
+  if (type == 0) {
+    auto& breakpoints = debugger_->breakpoints_;
+    if (insert && breakpoints.count(addr) == 0) {
+      Breakpoint bp(&debugger_->memory_, addr);
+      bp.Enable();
+      breakpoints[addr] = bp;
+      breakpoints_.insert(addr);
+    } else if (!insert && breakpoints_.erase(addr) != 0) {
+      debugger_->RemoveBreakpoint(addr);
+    }
+    return "OK";
+  }
+  if (type > 4) {
+    return "";
+  }
+
+  auto key = std::make_pair(type, addr);
+  auto& debug_registers = debugger_->debug_registers_;
+  if (!insert) {
+    auto it = hw_slots_.find(key);
+    if (it != hw_slots_.end()) {
+      debug_registers.Clear(it->second);
+      hw_slots_.erase(it);
+    }
+    return "OK";
+  }
+  if (hw_slots_.count(key) != 0) {
+    return "OK";
+  }
+  // x86 has no read-only watchpoints, reads are caught with accesses
+  const WatchKind kKinds[] = {WatchKind::execute, WatchKind::execute,
+                              WatchKind::write, WatchKind::read_write,
+                              WatchKind::read_write};
+  auto slot = debug_registers.Set(addr, kKinds[type], kind);
+  if (type != 1) {
+    debug_registers.Get(slot).value = debugger_->GetMemory(addr);
+  }
+  hw_slots_[key] = slot;
+  return "OK";
+}
+
+std::string GdbServer::ReadRegisters() {
+  auto& thread = debugger_->CurrentThread();
+  user_fpregs_struct fp{};
+  Ptrace(PTRACE_GETFPREGS, thread.tid, nullptr, &fp);
+  std::string reply;
+  for (const auto& reg : Registers()) {
+    AppendRegister(reg, &thread.registers, fp, &reply);
+  }
+  return reply;
+}
+
+void GdbServer::WriteRegisters(const std::string& hex) {
+  auto& thread = debugger_->CurrentThread();
+  user_fpregs_struct fp{};
+  Ptrace(PTRACE_GETFPREGS, thread.tid, nullptr, &fp);
+  size_t pos = 0;
+  for (const auto& reg : Registers()) {
+    if (pos >= hex.size()) {
+      break;
+    }
+    auto digits = reg.bits / 4;
+    SetRegister(reg, ParseHexBytes(hex.substr(pos, digits)),
+                &thread.registers, &fp);
+    pos += digits;
+  }
+  Ptrace(PTRACE_SETFPREGS, thread.tid, nullptr, &fp);
+}
+
+std::string GdbServer::ReadRegister(size_t n) {
+  const auto& reg = Registers().at(n);
+  auto& thread = debugger_->CurrentThread();
+  user_fpregs_struct fp{};
+  if (reg.source != Source::kGeneral) {
+    Ptrace(PTRACE_GETFPREGS, thread.tid, nullptr, &fp);
+  }
+  std::string hex;
+  AppendRegister(reg, &thread.registers, fp, &hex);
+  return hex;
+}
+
+void GdbServer::WriteRegister(size_t n, const std::string& hex) {
+  const auto& reg = Registers().at(n);
+  auto& thread = debugger_->CurrentThread();
+  user_fpregs_struct fp{};
+  if (reg.source != Source::kGeneral) {
+    Ptrace(PTRACE_GETFPREGS, thread.tid, nullptr, &fp);
+  }
+  SetRegister(reg, ParseHexBytes(hex), &thread.registers, &fp);
+  if (reg.source != Source::kGeneral) {
+    Ptrace(PTRACE_SETFPREGS, thread.tid, nullptr, &fp);
+  }
+}
+
+std::string GdbServer::ReadMemory(uint64_t addr, size_t len) {
+  len = std::min<size_t>(len, kPacketSize / 2);
+  // A read running into unmapped memory returns what precedes it
+  while (len != 0) {
+    try {
+      auto bytes = debugger_->ReadText(addr, len);
+      std::string hex;
+      hex.reserve(2 * len);
+      AppendHex(bytes.data(), bytes.size(), &hex);
+      return hex;
+    } catch (std::exception&) {
+      len /= 2;
+    }
+  }
+  return "E0e";  // EFAULT
+}
+
+void GdbServer::WriteMemory(uint64_t addr, const std::string& hex) {
+  auto bytes = ParseHexBytes(hex);
+  // Lift breakpoints under the write so they save the new bytes
+  std::vector<Breakpoint*> lifted;
+  for (auto& [bp_addr, bp] : debugger_->breakpoints_) {
+    if (bp.IsEnabled() && bp_addr >= addr && bp_addr < addr + bytes.size()) {
+      bp.Disable();
+      lifted.push_back(&bp);
+    }
+  }
+  debugger_->memory_.Write(addr, bytes.data(), bytes.size());
+  for (auto* bp : lifted) {
+    bp->Enable();
+  }
+}
+
+void GdbServer::RemoveClientBreakpoints() {
+  auto alive = !debugger_->exited_ && !debugger_->threads_.empty();
+  for (auto addr : breakpoints_) {
+    if (alive) {
+      debugger_->RemoveBreakpoint(addr);
+    } else {
+      debugger_->breakpoints_.erase(addr);
+    }
+  }
+  breakpoints_.clear();
+  for (const auto& [key, slot] : hw_slots_) {
+    if (alive && debugger_->debug_registers_.Get(slot).used) {
+      debugger_->debug_registers_.Clear(slot);
+    }
+  }
+  hw_slots_.clear();
+}
@@ -1,21 +1,78 @@
 #pragma once
 #include <sys/types.h>
 
+#include <chrono>
 #include <cstdint>
 #include <functional>
+#include <memory>
+#include <vector>
+
+#include "expression.h"
+#include "memory.h"
 
 class Breakpoint {
  public:
   Breakpoint() = default;
-  Breakpoint(pid_t pid, std::uintptr_t addr) : pid_{pid}, addr_{addr} {}
+  Breakpoint(Memory* memory, std::uintptr_t addr, bool temporary = false)
+      : temporary_{temporary}, addr_{addr}, memory_{memory} {}
   void Enable();
   void Disable();
   bool IsEnabled() const;
+  // Temporary breakpoints are internal to stepping and not reported.
+  bool IsTemporary() const;
+  void SetTemporary(bool temporary);
   std::uintptr_t GetAddress() const;
+  // Byte the int3 replaced, valid while enabled
+  uint8_t GetOriginalByte() const;
+
+  // Only stop when the condition evaluates to non-zero
+  void SetCondition(std::shared_ptr<const Expression> condition);
+  const Expression* GetCondition() const;
+  // Skip the next count hits
+  void SetIgnoreCount(uint64_t count);
+  uint64_t GetIgnoreCount() const;
+  // Count a hit. Returns false if it is to be skipped due to the ignore
+  // count, in which case the condition is not evaluated either.
+  bool RegisterHit();
+  uint64_t GetHitCount() const;
+  void AddConditionTime(std::chrono::nanoseconds t);
+  std::chrono::nanoseconds GetConditionTime() const;
+
+  // Make this a tracepoint, which records the values of exprs on every hit
+  // and never stops.
+  void SetTrace(std::vector<std::shared_ptr<const Expression>> exprs);
+  bool IsTracepoint() const;
+  const std::vector<std::shared_ptr<const Expression>>& GetTrace() const;
 
  private:
+  friend class BreakpointBatch;
   bool enabled_ = false;
+  bool temporary_ = false;
   std::uintptr_t addr_;
-  pid_t pid_;
+  Memory* memory_ = nullptr;
   uint8_t instruction_ = 0;
+  std::shared_ptr<const Expression> condition_;
+  uint64_t ignore_count_ = 0;
+  uint64_t hit_count_ = 0;
+  std::chrono::nanoseconds condition_time_{0};
+  std::vector<std::shared_ptr<const Expression>> trace_;
+};
+
+// Collects breakpoints to enable or disable and applies them together.
+// Patches are grouped by page, each page is read once and written back once
+// through /proc/pid/mem, instead of a peek and poke per breakpoint.
+class BreakpointBatch {
+ public:
+  explicit BreakpointBatch(Memory* memory) : memory_{memory} {}
+  void Enable(Breakpoint* bp);
+  void Disable(Breakpoint* bp);
+  void Commit();
+
+ private:
+  struct Patch {
+    Breakpoint* bp;
+    bool enable;
+  };
+  Memory* memory_;
+  std::vector<Patch> patches_;
 };
@@ -0,0 +1,28 @@
+#pragma once
+#include <sys/ptrace.h>
+#include <sys/types.h>
+
+#include <cstdint>
+#include <string>
+
+#include "memory.h"
+#include "traced_thread.h"
+
+// Options of checkpoint processes: killed along with the debugger rather
+// than left to run on as copies of the program.
+const auto kCheckpointOptions = kPtraceOptions | PTRACE_O_EXITKILL;
+
+// A stopped, traced copy of the debuggee, see ForkTracee.
+struct Checkpoint {
+  pid_t pid;
+  uint64_t pc;
+  std::string function;
+};
+
+// Fork the process of thread, which must be stopped, by having it run a
+// fork syscall in place of the instruction at its pc. Its registers and
+// code are put back, and the child gets the same ones, so the child is a
+// copy-on-write snapshot of the process with just that one thread. options
+// are the thread's ptrace options, the child is traced with them too and
+// left stopped. Throws if the fork fails.
+pid_t ForkTracee(TracedThread* thread, Memory* memory, int options);
@@ -0,0 +1,39 @@
+#pragma once
+#include <cstdint>
+#include <string>
+
+#include "json.h"
+
+class Debugger;
+
+// Serves debugger commands to tools over a Unix stream socket, one client
+// at a time. Each request is a line of JSON,
+//   {"id": 1, "command": "read-memory 0x401000 16"}
+// or an array of them, which is answered with an array. Responses are
+//   {"id": 1, "ok": true, "result": {...}}
+//   {"id": 1, "ok": false, "error": "..."}
+// in request order. Clients may send many requests without waiting for
+// the answers: every complete line read is executed and the responses to
+// them go out in a single write. "quit" stops the server.
+class CommandServer {
+ public:
+  CommandServer(Debugger* debugger, std::string socket_path);
+  ~CommandServer();
+  CommandServer(const CommandServer&) = delete;
+  CommandServer& operator=(const CommandServer&) = delete;
+
+  // Accept clients until one sends "quit".
+  void Run();
+
+ private:
+  // Serve a client until it disconnects, false if it sent "quit".
+  bool ServeClient(int fd);
+  // Append the response to a request line to out, false on "quit".
+  bool HandleLine(const std::string& line, std::string* out);
+  Json HandleRequest(const Json& request, bool* quit);
+
+  Debugger* debugger_;
+  std::string path_;
+  int listen_fd_ = -1;
+  uint64_t commands_ = 0;
+};
@@ -0,0 +1,73 @@
+#pragma once
+#include <sys/types.h>
+#include <sys/user.h>
+
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+#include "registers.h"
+#include "target.h"
+
+// State of one thread as a core file records it
+struct CoreThread {
+  pid_t tid;
+  int signal;  // signal the thread stopped with, 0 if none
+  user_regs_struct regs;
+  user_fpregs_struct fpregs;
+};
+
+struct CoreDumpStats {
+  size_t mappings = 0;
+  uint64_t bytes = 0;       // memory written
+  uint64_t unreadable = 0;  // bytes of it that read as zeros
+};
+
+// Write an ELF core file of the stopped process pid to path: a PT_LOAD
+// segment per readable mapping in /proc/pid/maps, and NT_PRSTATUS and
+// NT_FPREGSET notes per thread (threads.front() is reported as the one that
+// stopped), plus NT_PRPSINFO, NT_AUXV and NT_FILE. The file is mmapped and
+// filled by batches of large process_vm_readv calls straight into it.
+// patches are bytes to put back over the memory, e.g. those under
+// breakpoints.
+CoreDumpStats WriteCore(
+    const std::string& path, pid_t pid, const std::vector<CoreThread>& threads,
+    const std::vector<std::pair<uint64_t, uint8_t>>& patches);
+
+// An ELF core file, mmapped, as the target of a post-mortem session.
+class CoreFile : public Target {
+ public:
+  // Throws if path is not an x86-64 core file.
+  explicit CoreFile(const std::string& path);
+  ~CoreFile() override;
+  CoreFile(const CoreFile&) = delete;
+  CoreFile& operator=(const CoreFile&) = delete;
+
+  void ReadMemory(uint64_t addr, void* buf, size_t len) override;
+  uint64_t ReadRegister(pid_t tid, Register::Reg r) override;
+
+  pid_t Pid() const;
+  // In note order, the first is the thread that stopped
+  const std::vector<CoreThread>& Threads() const;
+  // Where the executable was entered, from the auxiliary vector, 0 if
+  // unknown
+  uint64_t EntryPoint() const;
+
+ private:
+  struct Segment {
+    uint64_t vaddr;
+    uint64_t memsz;
+    uint64_t filesz;
+    const uint8_t* data;
+  };
+  void ParseNotes(const uint8_t* notes, size_t size);
+
+  int fd_ = -1;
+  const uint8_t* data_ = nullptr;
+  size_t size_ = 0;
+  pid_t pid_ = 0;
+  std::vector<Segment> segments_;  // sorted by vaddr
+  std::vector<CoreThread> threads_;
+  std::vector<std::pair<uint64_t, uint64_t>> auxv_;
+};
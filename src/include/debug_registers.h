@@ -0,0 +1,56 @@
+#pragma once
+#include <sys/types.h>
+
+#include <array>
+#include <cstdint>
+#include <vector>
+
+// Condition a debug register slot triggers on, encoded as the DR7 R/W bits.
+// x86 has no read-only watchpoints, reads are caught with read_write.
+enum class WatchKind { execute = 0, write = 1, read_write = 3 };
+
+// The four x86 hardware breakpoint slots (DR0-DR3), programmed through
+// DR7 with PTRACE_POKEUSER. Execute slots act as breakpoints that need no
+// code patching, write/read_write slots are data watchpoints. Debug
+// registers are per thread, so every slot is programmed into every thread
+// of the debuggee.
+class DebugRegisters {
+ public:
+  static constexpr int kSlots = 4;
+
+  struct Slot {
+    bool used = false;
+    uint64_t addr = 0;
+    WatchKind kind = WatchKind::execute;
+    int len = 1;
+    uint64_t value = 0;  // last seen value of a watched location
+  };
+
+  DebugRegisters() = default;
+  explicit DebugRegisters(pid_t pid) : threads_{pid} {}
+
+  // Program the slots in use into a new, stopped thread. Threads already
+  // known are left alone.
+  void AddThread(pid_t tid);
+  void RemoveThread(pid_t tid);
+
+  // Program a free slot and return its number. len is 1, 2, 4 or 8 and addr
+  // must be aligned to it; execute slots always use len 1.
+  int Set(uint64_t addr, WatchKind kind, int len);
+  void Clear(int slot);
+  // Slot that caused the current SIGTRAP of thread tid according to its
+  // DR6, or -1. DR6 is reset so the next trap is decoded cleanly.
+  int TriggeredSlot(pid_t tid);
+  Slot& Get(int slot);
+  // True if any slot is programmed
+  bool InUse() const;
+
+ private:
+  static uint64_t ReadDebugRegister(pid_t tid, int n);
+  static void WriteDebugRegister(pid_t tid, int n, uint64_t value);
+  // Write a debug register of every thread
+  void WriteDebugRegister(int n, uint64_t value) const;
+  std::vector<pid_t> threads_;
+  std::array<Slot, kSlots> slots_{};
+  uint64_t dr7_ = 0;
+};
@@ -1,49 +1,149 @@
 #pragma once
 #include <fcntl.h>
 #include <signal.h>
+#include <sys/ptrace.h>
 #include <sys/stat.h>
 #include <sys/types.h>
 #include <unistd.h>
 
+#include <atomic>
+#include <future>
+#include <map>
+#include <memory>
+#include <ostream>
 #include <string>
 #include <unordered_set>
 #include <vector>
 
 #include "breakpoint.h"
+#include "checkpoint.h"
+#include "debug_registers.h"
+#include "displaced_step.h"
 #include "dwarf/dwarf++.hh"
 #include "elf/elf++.hh"
+#include "expression.h"
+#include "function_tracer.h"
+#include "json.h"
+#include "memory.h"
+#include "pc_index.h"
+#include "record_log.h"
 #include "registers.h"
-
-enum class SymbolType { notype, object, func, section, file };
-
-struct symbol {
-  SymbolType type;
-  std::string name;
-  std::uintptr_t addr;
-};
+#include "source_cache.h"
+#include "symbol_index.h"
+#include "target.h"
+#include "trace_buffer.h"
+#include "traced_thread.h"
+#include "unwinder.h"
 
 class Debugger {
+  friend class DebuggerExprContext;
+  friend struct DwarfExpressionVariable;
+  friend class CommandServer;
+  friend class GdbServer;
+
  public:
-  explicit Debugger(const char* binary_name, pid_t pid)
-      : binary_name_{binary_name}, pid_{pid} {
+  // Debug binary_name with no process yet, see Attach().
+  explicit Debugger(const char* binary_name) : binary_name_{binary_name} {
     auto fd = open(binary_name_, O_RDONLY);
     elf_ = elf::elf(elf::create_mmap_loader(fd));
     dwarf_ = dwarf::dwarf{dwarf::elf::create_loader(elf_)};
+    unwinder_ = Unwinder(elf_);
+    target_ = std::make_unique<ProcessTarget>(&memory_, &threads_);
+    LoadIndexes();
+  }
+  // Debug the launched process pid, seized and stopped at its exec.
+  Debugger(const char* binary_name, pid_t pid) : Debugger(binary_name) {
+    pid_ = pid;
+    current_tid_ = reported_tid_ = pid;
+    memory_.SetPid(pid);
+    debug_registers_ = DebugRegisters(pid);
+    threads_.try_emplace(pid, pid);
     load_address_ = GetLoadAddress();
   }
+  // Seize every thread of the running process pid, which must be running
+  // this binary, and stop them all.
+  void Attach(pid_t pid);
+  // Examine the threads and memory a core file of this binary recorded
+  // instead of a live process.
+  void OpenCore(const std::string& path);
+  // Take out all breakpoints and let the process run on untraced, or close
+  // the core file.
+  void Detach();
   void StartRepl();
+  // Serve commands to clients of a Unix socket instead of the terminal,
+  // see CommandServer.
+  void StartServer(const std::string& socket_path);
   void Continue();
   void SetBreakpointAtAddress(std::uintptr_t addr);
 
  private:
-  void HandleSigtrap(siginfo_t siginfo) const;
-  int Wait(int* status = nullptr) const;
+  // Fill pc_index_ and symbol_index_ from the on-disk cache, or start
+  // building them in the background and save them there when done.
+  void LoadIndexes();
+  void PrintIndexInfo() const;
+  // Throws when debugging a core file, which cannot run or be changed.
+  void RequireLiveProcess() const;
+  // Write a core file of the stopped process, like gdb's gcore.
+  void WriteCoreFile(const std::string& path);
+  // Snapshot the stopped process into a new checkpoint, see ForkTracee.
+  void TakeCheckpoint();
+  // Replace the process with a fresh copy of checkpoint n, which is kept
+  // for restarting from again.
+  void RestartCheckpoint(int n);
+  void PrintCheckpoints() const;
+  // Single-step the current thread to location or a user breakpoint,
+  // logging every instruction so that stretch can be run backwards.
+  void Record(const std::string& location);
+  // Drop the record log and look at the live process again.
+  void StopRecording();
+  void PrintRecordLog() const;
+  // Move back through the record log by an instruction, to the start of
+  // the previous line, or to the previous user breakpoint.
+  void ReverseStepInstruction();
+  void ReverseStep();
+  void ReverseContinue();
+  // Make the recorded thread current, throws if there is no record log.
+  void SelectRecordedThread();
+  // stats [on|off|reset|json [file]], prints the stats with no arguments.
+  void StatsCommand(const std::vector<std::string>& args);
+  void HandleSigtrap(siginfo_t siginfo);
+  // Wait for a running thread to stop for a reason worth reporting, make it
+  // the current thread, stop all the others and report it. Clone events,
+  // thread exits and stale interrupts are handled on the way.
+  void Wait();
+  // Book-keeping for a waitpid event of thread tid. Returns true if it is a
+  // stop to report, which never happens while stopping all threads.
+  bool HandleThreadEvent(pid_t tid, int status, bool stopping);
+  // Print why the current thread stopped, status as from waitpid.
+  void ReportStop(int status);
+  // Interrupt every running thread and wait until all have stopped.
+  void StopAllThreads();
+  // Step threads past reported breakpoints and resume all of them.
+  void ResumeAllThreads();
+  TracedThread& CurrentThread() const;
+  void PrintThreads() const;
+  void SelectThread(pid_t tid);
   siginfo_t GetSigInfo() const;
+  // Signal info for the current thread's stop, worked out from its
+  // registers where possible to save the PTRACE_GETSIGINFO call.
+  siginfo_t StopSigInfo(int status) const;
   void ProcessCommand(const std::string& cmd);
+  // Run a command for the command server. Registers, memory, frames and
+  // variables come back as structured values, anything the command
+  // prints as "output".
+  Json ExecuteJson(const std::string& cmd);
+  // Serve the process to one gdb client at address, see GdbServer.
+  void StartGdbServer(const std::string& address);
   static bool MatchCmd(std::vector<std::string>& input, const std::string& cmd,
                        int num_args);
-  static void PrintSource(const std::string& file_name, unsigned line,
-                          unsigned n_lines_context = 2 << 2);
+  static bool MatchCmd(std::vector<std::string>& input, const std::string& cmd,
+                       int min_args, int max_args);
+  void PrintSource(const std::string& file_name, unsigned line,
+                   unsigned n_lines_context = 2 << 2);
+  // Path of the line-table file ending in file, or file itself.
+  std::string FindSourceFile(const std::string& file) const;
+  // Print about n_lines lines around "<file>:<line>".
+  void ListSource(const std::string& location, unsigned n_lines);
   uint64_t GetRegister(Register::Reg r) const;
   uint64_t GetRegister(std::string s) const;
   uint64_t GetRegisterFromDwarfRegister(int regnum);
@@ -51,28 +151,189 @@ class Debugger {
   void SetRegister(Register::Reg r, uint64_t value) const;
   void SetRegister(std::string s, uint64_t value) const;
   void SetMemory(uintptr_t addr, uint64_t value) const;
+  // Print len bytes at addr as "hexdump", "bytes", "words" or "string".
+  void DumpMemory(uintptr_t addr, size_t len, const std::string& format) const;
+  // Write value, parsed according to format, repeated over len bytes.
+  void FillMemory(uintptr_t addr, const std::string& value, size_t len,
+                  const std::string& format) const;
+  // Write back cached registers and restart the current thread with
+  // request (PTRACE_CONT or PTRACE_SINGLESTEP).
+  void ResumeTracee(enum __ptrace_request request) const;
+  void ResumeThread(TracedThread& thread,
+                    enum __ptrace_request request) const;
+  // Single-step the current thread past the breakpoint it is stopped at,
+  // if any.
   void StepOverBreakpoint();
+  // Single-step the current thread past the breakpoint it is stopped at by
+  // taking the breakpoint out for the step, if it is at an enabled one.
+  void LiftBreakpoint();
+  // Move thread off the enabled breakpoint at its pc so it can be resumed
+  // with the breakpoint left in, kUnsupported if it is not at one or the
+  // breakpoint has to be lifted.
+  DisplacedStepper::Result DisplaceBreakpoint(TracedThread& thread);
   void SingleStepInstruction();
   void SingleStepInstructionWithBreakpointCheck();
   void StepOut();
   void StepOver();
   void StepIn();
+  // Single-step until the line number changes, for code StepIn cannot
+  // decode.
+  void SingleStepToNextLine();
+  // Remove a stepping command's temporary breakpoints and show where it
+  // stopped, unless the stop was already reported.
+  void FinishStep(const std::vector<std::uintptr_t>& temporaries);
+  void PrintCurrentSource();
+  // Tracee code with the original bytes under enabled breakpoints.
+  std::vector<uint8_t> ReadText(uintptr_t addr, size_t len) const;
   void RemoveBreakpoint(std::uintptr_t addr);
+  // Silently plant breakpoints at the addresses that have none yet, in one
+  // batch. Returns the ones added so they can be passed to RemoveBreakpoints.
+  std::vector<std::uintptr_t> InsertTemporaryBreakpoints(
+      const std::vector<std::uintptr_t>& addrs);
+  void RemoveBreakpoints(const std::vector<std::uintptr_t>& addrs);
   uint64_t GetLoadAddress();
-  dwarf::die GetFunctionFromPC(uint64_t pc);
-  dwarf::line_table::iterator GetLineEntryFromPC(uint64_t pc) const;
+  const PCIndex::Function& GetFunctionFromPC(uint64_t pc) const;
+  const PCIndex::Line& GetLineEntryFromPC(uint64_t pc) const;
+  dwarf::die GetFunctionDie(const PCIndex::Function& func) const;
   static std::vector<std::string> SplitCommand(const std::string& cmd,
                                                char c = ' ');
   uint64_t SubtractLoadAddress(uint64_t addr) const;
-  void SetBreakpointAtFunction(const std::string& name);
-  void SetBreakpointAtSourceLine(const std::string& file, unsigned line);
-  std::vector<symbol> LookupSymbol(const std::string& name);
-  void PrintBacktrace();
+  std::vector<std::uintptr_t> FunctionAddresses(const std::string& name) const;
+  std::vector<std::uintptr_t> SourceLineAddresses(const std::string& file,
+                                                  unsigned line) const;
+  // Addresses for a "0x<addr>", "<file>:<line>" or "<function>" location.
+  std::vector<std::uintptr_t> ResolveLocation(
+      const std::string& location) const;
+  // A variable's DWARF location plus what is needed to read its value
+  struct VariableLocation {
+    dwarf::expr location;
+    int size;
+    bool is_signed;
+  };
+  // Local variable or parameter of the function containing pc.
+  VariableLocation FindVariable(uint64_t pc, const std::string& name);
+  // Address and byte size of a variable of the current function.
+  uint64_t GetVariableAddress(const std::string& name, int* size);
+  // Compile an expression whose variables are those visible at pc.
+  std::shared_ptr<const Expression> CompileExpression(
+      uint64_t pc, const std::string& source);
+  uint64_t ReadExpressionVariable(const VariableLocation& var);
+  // Count a hit on a user breakpoint and decide from its ignore count and
+  // condition whether to stop.
+  bool ShouldStopAtBreakpoint(Breakpoint& bp);
+  void PrintBreakpoints() const;
+  // Record the values of a tracepoint's expressions into trace_buffer_.
+  void RecordTracepoint(Breakpoint& bp);
+  // Tracepoint at location recording the comma separated exprs.
+  void SetTracepoint(const std::string& location, const std::string& exprs);
+  void DumpTrace(std::ostream& out) const;
+  // Trace calls to the functions whose name matches regex, all if empty.
+  void StartFunctionTrace(const std::string& regex);
+  void StopFunctionTrace();
+  // Record the call or return an ftrace breakpoint at pc stands for. True
+  // if the breakpoint is ftrace's own and the thread can be resumed.
+  bool HandleFunctionTraceHit(std::uintptr_t pc);
+  // Watch an address or variable; mode is "r", "w" or "rw", len 0 means the
+  // size of the variable.
+  void SetWatchpoint(const std::string& location, const std::string& mode,
+                     int len);
+  void ReportHardwareBreakpoint();
+  std::vector<symbol> LookupSymbol(const std::string& name) const;
+  void PrintSymbolForAddress(uint64_t addr) const;
+  // The thread's frames, innermost first, at most max_frames of them.
+  std::vector<Unwinder::Frame> UnwindStack(TracedThread& thread,
+                                           size_t max_frames) const;
+  void PrintFrame(size_t n, const Unwinder::Frame& frame) const;
+  void PrintBacktrace(size_t max_frames);
+  // Make frame n of the current thread the one `variables` reads.
+  void SelectFrame(size_t n);
+  // Sample every thread's stack hz times a second for the given time and
+  // write them to out as folded stacks, the input of flamegraph.pl.
+  void Profile(double hz, double seconds, std::ostream& out);
+  // Name of the function containing pc, "??" if unknown.
+  std::string FunctionName(uint64_t pc) const;
+  struct VariableValue {
+    std::string name;
+    std::string location;  // "0x<address>" or "reg<n>"
+    uint64_t value;
+  };
+  // Variables of the selected frame's function.
+  std::vector<VariableValue> GetVariables();
   void ReadVariables();
-  pid_t pid_;
+  // Process being debugged, 0 if none
+  pid_t pid_ = 0;
   const char* binary_name_;
-  uint64_t load_address_;
+  uint64_t load_address_ = 0;
+  // The process was attached to rather than launched, so it is detached
+  // again rather than left traced when the debugger quits
+  bool attached_ = false;
   elf::elf elf_;
   dwarf::dwarf dwarf_;
+  Unwinder unwinder_;
+  PCIndex pc_index_;
+  std::shared_future<SymbolIndex> symbol_index_;
+  // Worker threads used to build the index, 0 if it came from the cache
+  unsigned index_threads_ = 0;
+  // Time to load or build the index, 0 while building
+  std::atomic<double> index_time_ms_ = 0;
+  SourceCache source_cache_;
+  // Memory and registers the inspection commands read, from the process
+  // or from a core file
+  std::unique_ptr<Target> target_;
+  // The threads are those of a core file, there is no process
+  bool core_ = false;
   std::unordered_map<std::uintptr_t, Breakpoint> breakpoints_;
+  // Stopped copies of the process made by `checkpoint`, by number. They
+  // have no breakpoints in, and outlive the process they were taken of.
+  std::map<int, Checkpoint> checkpoints_;
+  int next_checkpoint_ = 1;
+  TraceBuffer trace_buffer_;
+  FunctionTracer function_tracer_;
+  // Traced function entries and the return addresses seen so far. Their
+  // breakpoints are in ftrace_owned_ unless a user or stepping breakpoint
+  // was already there, which is then shared.
+  std::unordered_map<std::uintptr_t, uint32_t> ftrace_entries_;
+  std::unordered_set<std::uintptr_t> ftrace_returns_;
+  std::unordered_set<std::uintptr_t> ftrace_owned_;
+  // Threads of the debuggee by thread id, each with a register cache that
+  // is refilled after every stop
+  mutable std::map<pid_t, TracedThread> threads_;
+  // Thread that reported the last stop, commands act on it
+  pid_t current_tid_ = 0;
+  // Thread the user last saw a stop of
+  pid_t reported_tid_ = 0;
+  // Frame of the current thread selected with `frame`, 0 after every stop
+  size_t selected_frame_ = 0;
+  // Thread the temporary breakpoints of a stepping command are for
+  pid_t stepping_tid_ = 0;
+  // How long the last all-stop took and how many threads it stopped
+  double stop_latency_us_ = 0;
+  size_t stopped_threads_ = 0;
+  // Set while every thread has been resumed, new threads are then resumed
+  // too instead of being left stopped
+  bool resume_all_ = false;
+  mutable Memory memory_;
+  // History `record` logged, which target_ reads through while replaying.
+  // Cleared when the process runs on, it then no longer ends at the live
+  // state.
+  mutable RecordLog record_log_{&memory_};
+  DebugRegisters debug_registers_;
+  DisplacedStepper displaced_{&memory_};
+  // Step past breakpoints with DisplacedStepper rather than by lifting them
+  bool displaced_stepping_ = true;
+  // step runs to the ends of the line's address ranges rather than
+  // single-stepping every instruction of it
+  bool range_stepping_ = true;
+  bool show_ptrace_count_ = false;
+  // Set when the last stop should be silently resumed by Continue
+  bool auto_resume_ = false;
+  bool exited_ = false;
+  // waitpid status the process exited with
+  int exit_status_ = 0;
+  // Debug register slot behind the last hardware breakpoint stop, -1 if
+  // it could not be told
+  int triggered_slot_ = -1;
+  // Saves the index once built, declared last so it is waited for before
+  // anything it uses is destroyed
+  std::future<void> index_writer_;
 };
@@ -0,0 +1,71 @@
+#pragma once
+#include <sys/types.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <unordered_map>
+#include <vector>
+
+#include "memory.h"
+#include "traced_thread.h"
+
+// Steps threads past breakpoints without lifting the int3, so no other
+// thread can run through the unpatched instruction meanwhile. The original
+// instruction is copied into a scratch page mapped into the tracee, its
+// RIP-relative displacement fixed up, followed by a jump back; the thread
+// runs the copy and carries on in the original code. Relative calls and
+// jumps are emulated instead.
+class DisplacedStepper {
+ public:
+  enum class Result {
+    // The breakpoint has to be lifted to step past it
+    kUnsupported,
+    // The thread is past the instruction already
+    kEmulated,
+    // The thread is at the copy, to be resumed or single-stepped
+    kDisplaced,
+  };
+
+  explicit DisplacedStepper(Memory* memory) : memory_{memory} {}
+
+  // Forget the scratch page and the copies in it, for a new process or
+  // after an exec.
+  void Reset();
+  // Move thread, stopped on a breakpoint at addr, off the instruction
+  // there. code holds len bytes of the original code at addr.
+  Result Displace(TracedThread* thread, uint64_t addr, const uint8_t* code,
+                  size_t len);
+  // Move the pc of thread, which has just stopped, from inside a copy to
+  // the same point of the original code. True if it had not run the copy
+  // yet, it is then back on the breakpoint.
+  bool MapBack(TracedThread* thread);
+  // The thread has exited, its copy may be reused.
+  void Forget(pid_t tid);
+
+ private:
+  struct Copy {
+    uint64_t slot;
+    // Original instruction
+    std::vector<uint8_t> code;
+    // Target of a conditional jump, taken from a second jump after the one
+    // back, 0 for other instructions
+    uint64_t taken;
+    uint64_t last_used;
+  };
+
+  // Map the scratch page near addr through thread, false if it failed.
+  bool MapScratch(TracedThread* thread, uint64_t addr);
+  // A free slot, or the least recently used one no thread is at, 0 if
+  // there is none.
+  uint64_t AllocateSlot();
+
+  Memory* memory_;
+  uint64_t scratch_ = 0;
+  bool scratch_failed_ = false;
+  std::vector<uint64_t> free_slots_;
+  // By the address of the original instruction
+  std::unordered_map<uint64_t, Copy> copies_;
+  // Threads resumed at a copy, and the address of its original
+  std::unordered_map<pid_t, uint64_t> displaced_;
+  uint64_t uses_ = 0;
+};
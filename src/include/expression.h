@@ -0,0 +1,88 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include "registers.h"
+
+// A variable an expression refers to, as the resolver found it at compile
+// time. Subclassed by whoever resolves variables to say where it lives.
+class ExpressionVariable {
+ public:
+  virtual ~ExpressionVariable() = default;
+};
+
+// Where a compiled expression gets its operands from when it runs.
+class ExpressionContext {
+ public:
+  virtual ~ExpressionContext() = default;
+  virtual uint64_t ReadRegister(Register::Reg r) = 0;
+  virtual uint64_t ReadMemory(uint64_t addr) = 0;
+  // Value of a variable the resolver returned at compile time
+  virtual uint64_t ReadVariable(const ExpressionVariable& var) = 0;
+};
+
+// A small C-like integer expression, parsed once into stack machine
+// bytecode so it can be evaluated cheaply on every breakpoint hit.
+//
+//   $rax, $rip ...     registers
+//   name               variables, bound through the resolver
+//   *expr              64 bit memory read
+//   123, 0x7b          literals
+//   + - * / % << >> & | ^ ~ ! == != < <= > >= && || ( )
+//
+// Arithmetic is on 64 bit values and wraps around, division and
+// comparisons are signed.
+class Expression {
+ public:
+  // Maps a variable name to what is passed back to ReadVariable, kept by
+  // the expression. Throws if the variable does not exist.
+  using Resolver = std::function<std::shared_ptr<const ExpressionVariable>(
+      const std::string& name)>;
+
+  // Throws std::runtime_error on syntax errors.
+  static Expression Compile(const std::string& source,
+                            const Resolver& resolver);
+  uint64_t Evaluate(ExpressionContext* context) const;
+  const std::string& GetSource() const;
+
+ private:
+  enum class Op : uint8_t {
+    kConst,   // operand: 8 byte literal
+    kReg,     // operand: 1 byte register number
+    kVar,     // operand: 4 byte index into variables_
+    kDeref,
+    kNeg,
+    kNot,
+    kBitNot,
+    kAdd,
+    kSub,
+    kMul,
+    kDiv,
+    kMod,
+    kShl,
+    kShr,
+    kAnd,
+    kOr,
+    kXor,
+    kEq,
+    kNe,
+    kLt,
+    kLe,
+    kGt,
+    kGe,
+    kBool,
+    kJumpIfFalse,  // operand: 4 byte target, jumps keeping the top (0)
+    kJumpIfTrue,   // operand: 4 byte target, jumps keeping the top (!= 0)
+    kPop,
+  };
+  static constexpr int kMaxStack = 64;
+
+  friend class ExpressionParser;
+  std::string source_;
+  std::vector<uint8_t> code_;
+  // Variables the code refers to, each resolved once
+  std::vector<std::shared_ptr<const ExpressionVariable>> variables_;
+};
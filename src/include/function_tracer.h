@@ -0,0 +1,77 @@
+#pragma once
+#include <sys/types.h>
+
+#include <cstdint>
+#include <map>
+#include <ostream>
+#include <string>
+#include <vector>
+
+// Call counts, times and call graph of traced functions, fed from the
+// breakpoints ftrace plants on function entries and return addresses.
+// Times are wall clock and include the cost of the traps themselves.
+class FunctionTracer {
+ public:
+  // Calls kept for the Chrome trace, later ones are only counted
+  static constexpr size_t kMaxEvents = 1 << 20;
+
+  // Forget all functions and recorded calls.
+  void Clear();
+  // Id of a new traced function, passed to OnEntry.
+  uint32_t AddFunction(const std::string& name);
+  size_t FunctionCount() const;
+
+  // Thread tid entered function, cfa being its stack pointer before the
+  // call pushed the return address.
+  void OnEntry(pid_t tid, uint32_t function, uint64_t cfa, uint64_t time_ns);
+  // Thread tid is at a return address with stack pointer sp. Every call
+  // whose frame is now popped is finished, which also catches calls left
+  // through longjmp or exceptions.
+  void OnReturn(pid_t tid, uint64_t sp, uint64_t time_ns);
+
+  // Flat profile followed by the call graph of each thread.
+  void PrintReport(std::ostream& out) const;
+  // Finished calls in the Chrome trace event format.
+  void WriteChromeTrace(std::ostream& out, pid_t pid) const;
+
+ private:
+  static constexpr uint32_t kNoFunction = UINT32_MAX;
+
+  // Call graph node, one per distinct call path
+  struct Node {
+    uint32_t function = 0;
+    uint32_t depth = 0;
+    std::map<uint32_t, uint32_t> children{};  // function to node
+    uint64_t calls = 0;
+    uint64_t inclusive_ns = 0;
+    uint64_t exclusive_ns = 0;
+  };
+  // A call in progress
+  struct Frame {
+    uint32_t node;
+    uint64_t cfa;
+    uint64_t start_ns;
+    uint64_t children_ns = 0;
+  };
+  struct Event {
+    pid_t tid;
+    uint32_t function;
+    uint64_t start_ns;
+    uint64_t duration_ns;
+  };
+  struct Thread {
+    uint32_t root = 0;  // node the outermost calls hang off
+    std::vector<Frame> stack{};
+  };
+
+  uint32_t NewNode(uint32_t function, uint32_t depth);
+  void PrintNode(std::ostream& out, uint32_t node) const;
+
+  std::vector<std::string> names_;
+  std::vector<Node> nodes_;
+  std::map<pid_t, Thread> threads_;
+  std::vector<Event> events_;
+  uint64_t dropped_events_ = 0;
+  uint64_t first_ns_ = 0;
+  uint32_t max_depth_ = 0;
+};
@@ -0,0 +1,77 @@
+#pragma once
+#include <sys/types.h>
+
+#include <cstdint>
+#include <map>
+#include <set>
+#include <string>
+#include <utility>
+
+class Debugger;
+
+// GDB remote serial protocol stub serving the process the debugger controls
+// to gdb or an IDE, e.g. `target remote :1234`. The address is "[host:]port"
+// for TCP, on the loopback interface unless a host is given, and otherwise
+// the path of a Unix socket. One client is served until it detaches, kills
+// the process or disconnects; the process stays under the debugger after.
+//
+// Supports register access (g/G/p/P) including the x87 and SSE registers,
+// bulk memory access (m/M), software (Z0) and hardware (Z1-Z4) break and
+// watchpoints, vCont, qXfer of the target description, auxv and exec file,
+// PacketSize negotiation and no-ack mode. Stops are all-stop, as in the
+// REPL.
+class GdbServer {
+ public:
+  GdbServer(Debugger* debugger, const std::string& address);
+  ~GdbServer();
+  GdbServer(const GdbServer&) = delete;
+  GdbServer& operator=(const GdbServer&) = delete;
+
+  // Wait for a client and serve it until the session ends.
+  void Run();
+
+ private:
+  // Next packet from the client, false once it has disconnected. A ^C
+  // sent while the process is stopped comes back as "\x03".
+  bool ReadPacket(std::string* packet);
+  void SendPacket(const std::string& payload);
+  // Reply to packet in *reply, false if the session ends with it.
+  bool HandlePacket(const std::string& packet, std::string* reply);
+  std::string HandleQuery(const std::string& packet);
+  // Slice of an object read with qXfer, with the "m"/"l" prefix
+  static std::string Xfer(const std::string& object,
+                          const std::string& offset_length);
+  std::string HandleVCont(const std::string& actions);
+  std::string HandleBreakpoint(const std::string& packet);
+  std::string ReadRegisters();
+  void WriteRegisters(const std::string& hex);
+  std::string ReadRegister(size_t n);
+  void WriteRegister(size_t n, const std::string& hex);
+  std::string ReadMemory(uint64_t addr, size_t len);
+  void WriteMemory(uint64_t addr, const std::string& hex);
+  // Continue every thread, which a ^C from the client interrupts.
+  void ContinueAll();
+  void Kill();
+  // Reply describing why the process last stopped or how it exited
+  std::string StopReply();
+  // Take out the break and watchpoints the client left behind.
+  void RemoveClientBreakpoints();
+
+  Debugger* debugger_;
+  int listen_fd_ = -1;
+  int fd_ = -1;
+  bool tcp_ = false;
+  std::string unix_path_;
+  // Received but not yet parsed
+  std::string input_;
+  // Sent again if the client asks for it with a "-"
+  std::string last_packet_;
+  bool no_ack_ = false;
+  // Thread whose stop was last reported, resume signals apply to it
+  pid_t stop_tid_ = 0;
+  // Breakpoints the client inserted. One it inserts where the debugger
+  // already has a breakpoint shares that and is not removed with z0.
+  std::set<std::uintptr_t> breakpoints_;
+  // Debug register slots of Z1-Z4 by packet type and address
+  std::map<std::pair<int, uint64_t>, int> hw_slots_;
+};
@@ -0,0 +1,43 @@
+#pragma once
+#include <cstdint>
+#include <string>
+
+#include "dwarf/dwarf++.hh"
+#include "elf/elf++.hh"
+#include "pc_index.h"
+#include "symbol_index.h"
+
+// On-disk copy of the PC and symbol indexes of a binary, so a restart
+// against an unchanged binary does not parse DWARF or symbol tables again.
+//
+// Files live in $XDG_CACHE_HOME/debugger (or ~/.cache/debugger) and are
+// named after the ELF build-id, or a hash of path, mtime and size for
+// binaries without one. A file is a header followed by the raw index
+// tables; loading maps it, copies the tables out and checks every offset
+// and sort order the lookups rely on, so a corrupt file is ignored.
+class IndexCache {
+ public:
+  IndexCache(const std::string& binary_path, const elf::elf& elf);
+
+  // False if there is no usable cache file for the binary, whose DWARF is
+  // dw.
+  bool Load(const dwarf::dwarf& dw, PCIndex* pc_index,
+            SymbolIndex* symbol_index) const;
+  // Best effort, false if the file could not be written.
+  bool Store(const PCIndex& pc_index, const SymbolIndex& symbol_index) const;
+
+ private:
+  // Load from the size bytes of a mapped cache file at base.
+  bool Read(const dwarf::dwarf& dw, const char* base, size_t size,
+            PCIndex* pc_index, SymbolIndex* symbol_index) const;
+  // The shard of unit cu, whose dies lie in (die_low, die_high) of
+  // .debug_info, refers only to its own strings and dies and is sorted.
+  static bool CheckShard(const PCIndex::Shard& shard, uint32_t cu,
+                         uint64_t die_low, uint64_t die_high);
+  // Every entry, name and string offset is in range and the lookup tables
+  // are sorted.
+  static bool CheckSymbols(const SymbolIndex& sym);
+
+  std::string key_;   // build-id or path/mtime/size, checked on load
+  std::string path_;  // cache file, empty if there is no cache directory
+};
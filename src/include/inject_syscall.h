@@ -0,0 +1,18 @@
+#pragma once
+#include <cstdint>
+#include <functional>
+
+#include "memory.h"
+#include "traced_thread.h"
+
+// Length of the syscall instruction InjectSyscall puts at the pc
+const auto kSyscallLength = 2;
+
+// Have the stopped thread run syscall nr with args in place of the
+// instruction at its pc, then put its registers and code back. Returns the
+// syscall's result, a negative errno on failure. on_event is called with
+// each ptrace event the thread stops with on the way; signals that arrive
+// meanwhile are kept in its pending_signal. Throws if the thread exits.
+int64_t InjectSyscall(TracedThread* thread, Memory* memory, long nr,
+                      const uint64_t (&args)[6],
+                      const std::function<void(int event)>& on_event = {});
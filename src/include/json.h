@@ -0,0 +1,57 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <utility>
+#include <vector>
+
+// Just enough JSON for the command server protocol. Numbers are doubles,
+// so 64 bit values such as addresses are passed as "0x..." strings.
+class Json {
+ public:
+  enum class Type { kNull, kBool, kNumber, kString, kArray, kObject };
+
+  Json() = default;
+  Json(bool value) : type_{Type::kBool}, bool_{value} {}
+  Json(int value) : Json(static_cast<double>(value)) {}
+  Json(unsigned value) : Json(static_cast<double>(value)) {}
+  Json(int64_t value) : Json(static_cast<double>(value)) {}
+  Json(uint64_t value) : Json(static_cast<double>(value)) {}
+  Json(double value) : type_{Type::kNumber}, number_{value} {}
+  Json(const char* value) : Json(std::string(value)) {}
+  Json(std::string value) : type_{Type::kString}, string_{std::move(value)} {}
+  static Json Array();
+  static Json Object();
+  // "0x" followed by value in hex
+  static Json Hex(uint64_t value);
+
+  // Throws std::runtime_error on malformed input.
+  static Json Parse(const std::string& text);
+  std::string Dump() const;
+  void Dump(std::string* out) const;
+
+  Type GetType() const { return type_; }
+  bool IsNull() const { return type_ == Type::kNull; }
+  bool AsBool() const { return bool_; }
+  double AsNumber() const { return number_; }
+  const std::string& AsString() const { return string_; }
+  // Elements of an array
+  const std::vector<Json>& Items() const { return items_; }
+  void Push(Json value);
+  // Member of an object, added if missing. Turns a null into an object.
+  Json& operator[](const std::string& key);
+  // Member of an object, nullptr if there is none
+  const Json* Find(const std::string& key) const;
+
+ private:
+  friend class JsonParser;
+
+  Type type_ = Type::kNull;
+  bool bool_ = false;
+  double number_ = 0;
+  std::string string_;
+  std::vector<Json> items_;
+  std::vector<std::pair<std::string, Json>> members_;
+};
+
+// s quoted and escaped as a JSON string
+std::string JsonQuote(const std::string& s);
@@ -0,0 +1,39 @@
+#pragma once
+#include <sys/types.h>
+
+#include <cstdint>
+#include <vector>
+
+// Page size of the tracee, for rounding addresses and splitting accesses.
+const auto kPageSize = 4096;
+
+// Number of process_vm_readv/writev and /proc/pid/mem calls made so far.
+inline uint64_t memory_syscall_count = 0;
+
+// Bulk access to the tracee's address space. Transfers of any size are done
+// with process_vm_readv/process_vm_writev, falling back to /proc/pid/mem for
+// pages those refuse (e.g. writing to read-only text). Failures throw.
+class Memory {
+ public:
+  Memory() = default;
+  explicit Memory(pid_t pid) : pid_{pid} {}
+  Memory(const Memory&) = delete;
+  Memory& operator=(const Memory&) = delete;
+  ~Memory();
+  // Switch to another process.
+  void SetPid(pid_t pid);
+
+  void Read(uint64_t addr, void* buf, size_t len);
+  std::vector<uint8_t> Read(uint64_t addr, size_t len);
+  void Write(uint64_t addr, const void* buf, size_t len);
+  // Write straight through /proc/pid/mem, for patching code where
+  // process_vm_writev is known to fail.
+  void WriteText(uint64_t addr, const void* buf, size_t len);
+  uint64_t ReadWord(uint64_t addr);
+  void WriteWord(uint64_t addr, uint64_t value);
+
+ private:
+  int MemFd();
+  pid_t pid_ = 0;
+  int mem_fd_ = -1;
+};
@@ -0,0 +1,135 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <mutex>
+#include <span>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+#include "dwarf/dwarf++.hh"
+
+// Address sorted index over the DWARF function ranges and line table rows.
+// Built once per binary so that mapping a PC to its function or line is a
+// binary search instead of a walk over every compilation unit.
+//
+// There is one shard per compilation unit, built by a pool of worker
+// threads in the background. Lookups find the units covering an address
+// from their DW_AT_ranges and wait only for those shards, building a shard
+// themselves if no worker has picked it up yet.
+class PCIndex {
+ public:
+  struct Function {
+    uint64_t low;   // start of the address range covered by this entry
+    uint64_t high;  // one past the end of the range
+    uint64_t entry;  // entry address (low_pc) of the function
+    uint64_t die_offset;
+    uint32_t name;  // offset into the string table of the cu's shard
+    uint32_t cu;
+    uint32_t depth;  // 0 for subprograms, nesting level for inlined code
+    uint32_t padding = 0;  // zero in the index cache
+  };
+
+  struct Line {
+    uint64_t address;
+    uint64_t end;  // address of the next row in the sequence
+    uint32_t file;  // offset into the string table of the cu's shard
+    uint32_t line;
+    uint32_t cu;
+    uint32_t is_stmt;
+  };
+
+  PCIndex() = default;
+  PCIndex(const PCIndex&) = delete;
+  PCIndex& operator=(const PCIndex&) = delete;
+  ~PCIndex();
+
+  // Start indexing dw on threads workers, 0 meaning one per core. Returns
+  // once the address ranges of the compilation units are known. dw must
+  // outlive the index.
+  void Build(const dwarf::dwarf& dw, unsigned threads = 0);
+  // Block until every shard is built.
+  void Wait() const;
+  size_t CuCount() const;
+  size_t ReadyCount() const;
+
+  // Innermost function containing pc. Inlined subroutines are only
+  // considered when include_inlined is set. nullptr if there is none.
+  const Function* FindFunction(uint64_t pc, bool include_inlined = false) const;
+  // Line table row whose address range contains pc, nullptr if none.
+  const Line* FindLine(uint64_t pc) const;
+  // All line table rows with low <= address < high, in address order. The
+  // range must lie within one compilation unit, e.g. be a function's.
+  std::span<const Line> LinesInRange(uint64_t low, uint64_t high) const;
+
+  std::string_view Name(const Function& f) const;
+  std::string_view File(const Line& l) const;
+
+ private:
+  friend class IndexCache;
+
+  struct Shard {
+    std::vector<Function> functions;
+    // max_high[i] is the largest high of functions[0..i], which bounds how
+    // far back a lookup has to walk when ranges nest.
+    std::vector<uint64_t> max_high;
+    std::vector<Line> lines;
+    std::string strings;
+  };
+  struct CuRange {
+    uint64_t low;
+    uint64_t high;
+    uint32_t cu;
+    uint32_t padding = 0;
+  };
+  enum State : uint8_t { kQueued, kBuilding, kReady };
+
+  // Builds the shard of one compilation unit
+  class ShardBuilder {
+   public:
+    ShardBuilder(Shard* shard, uint32_t cu) : shard_{shard}, cu_{cu} {}
+    void IndexDie(const dwarf::die& die, uint32_t depth);
+    void IndexLineTable(const dwarf::line_table& lt);
+    void Finish();
+
+   private:
+    uint32_t Intern(const std::string& s);
+    Shard* shard_;
+    uint32_t cu_;
+    std::unordered_map<std::string, uint32_t> interned_;
+  };
+
+  // Take over prebuilt shards, e.g. loaded from the index cache.
+  void Adopt(std::vector<Shard> shards, std::vector<CuRange> cu_ranges,
+             std::vector<uint32_t> unranged_cus);
+  void SortCuRanges();
+  void Worker();
+  // Build shard cu unless someone else already is, true if this call did.
+  bool TryBuild(uint32_t cu) const;
+  const Shard& GetShard(uint32_t cu) const;
+  // Compilation units whose ranges may contain [low, high)
+  std::vector<uint32_t> CusFor(uint64_t low, uint64_t high) const;
+
+  const dwarf::dwarf* dwarf_ = nullptr;
+  // Mutable because lookups build the shards they need on demand
+  mutable std::vector<Shard> shards_;
+  mutable std::vector<std::atomic<uint8_t>> states_;
+  std::vector<CuRange> cu_ranges_;  // sorted by low
+  std::vector<uint64_t> cu_max_high_;  // prefix maximum of high, see Shard
+  std::vector<uint32_t> unranged_cus_;  // units without address ranges
+  std::atomic<uint32_t> next_cu_ = 0;  // next shard for the workers
+  mutable std::atomic<size_t> ready_count_ = 0;
+  mutable std::mutex mutex_;
+  mutable std::condition_variable ready_;
+  std::vector<std::thread> workers_;
+};
+
+// Name of a subprogram or inlined subroutine, following
+// DW_AT_abstract_origin and DW_AT_specification when the die has none.
+std::string DieName(const dwarf::die& die);
+
+// Find the die at the given section offset in the tree rooted at root.
+dwarf::die FindDieByOffset(const dwarf::die& root, uint64_t offset);
@@ -0,0 +1,27 @@
+#pragma once
+#include <sys/ptrace.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+
+#include <cstdint>
+
+#include "stats.h"
+
+// Number of ptrace(2) calls made so far, used to report what each command
+// costs in syscalls.
+inline uint64_t ptrace_call_count = 0;
+
+// Every ptrace call in the debugger goes through here so it is counted.
+template <typename Addr, typename Data>
+long Ptrace(enum __ptrace_request request, pid_t pid, Addr addr, Data data) {
+  OpTimer timer{StatOp::kPtrace};
+  ++ptrace_call_count;
+  return ptrace(request, pid, addr, data);
+}
+
+// waitpid(2), timed by `stats` like Ptrace. The time includes however long
+// the tracee ran.
+inline pid_t Waitpid(pid_t pid, int* status, int options) {
+  OpTimer timer{StatOp::kWaitpid};
+  return waitpid(pid, status, options);
+}
@@ -0,0 +1,116 @@
+#pragma once
+#include <sys/types.h>
+#include <sys/user.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <utility>
+#include <vector>
+
+#include "memory.h"
+#include "registers.h"
+#include "target.h"
+#include "traced_thread.h"
+#include "x86_decoder.h"
+
+// Memory an instruction changed, as the XOR of the bytes before and after
+struct MemoryChange {
+  uint64_t addr;
+  std::vector<uint8_t> delta;
+};
+
+// Address and length of the memory the decoded instruction may write when
+// run with regs: its ModRM operand, the stack slot of a push or call, the
+// destination of a string instruction or what a system call writes.
+// Lengths are generous, bytes that do not change cost nothing in the log.
+std::vector<std::pair<uint64_t, size_t>> WrittenRanges(
+    const Instruction& insn, const user_regs_struct& regs);
+// False if insn is a system call that may write memory WrittenRanges does
+// not know of, which a log would then silently get wrong.
+bool WritesModelled(const Instruction& insn, const user_regs_struct& regs);
+// Contents of ranges, each cut short where its memory stops being mapped.
+std::vector<std::vector<uint8_t>> ReadRanges(
+    Memory* memory, const std::vector<std::pair<uint64_t, size_t>>& ranges);
+// What changed between two reads of the same ranges.
+std::vector<MemoryChange> DiffRanges(
+    const std::vector<std::pair<uint64_t, size_t>>& ranges,
+    const std::vector<std::vector<uint8_t>>& before,
+    const std::vector<std::vector<uint8_t>>& after);
+
+// Execution history of one thread, an entry per instruction, with a cursor
+// that runs back and forth over it. Entries are appended to one buffer,
+// delta encoded: a mask of the registers that changed, the difference of
+// each as a zigzag varint, then the memory changes addressed relative to
+// rsp. Differences and XORs undo and redo alike, so the cursor moves both
+// ways over the same entry. Every entry ends with its length, reversed, to
+// walk the buffer backwards.
+class RecordLog {
+ public:
+  explicit RecordLog(Memory* memory) : memory_{memory} {}
+
+  // Start an empty log of thread tid, whose registers are regs.
+  void Start(pid_t tid, const user_regs_struct& regs);
+  void Clear();
+  // Log an instruction that left the registers as regs. The cursor must
+  // be at the end.
+  void Append(const user_regs_struct& regs,
+              const std::vector<MemoryChange>& changes);
+
+  // A log has been started and not cleared
+  bool Active() const;
+  pid_t Tid() const;
+  // The cursor is before the end, where the live process is
+  bool Replaying() const;
+  size_t Size() const;
+  size_t Position() const;
+  size_t Bytes() const;
+
+  // Move the cursor over one instruction, false at the start or end.
+  bool StepBack();
+  bool StepForward();
+  // Registers of the thread at the cursor
+  const user_regs_struct& Registers() const;
+  // Turn buf, the live contents of len bytes at addr, into what they were
+  // at the cursor.
+  void Rewind(uint64_t addr, uint8_t* buf, size_t len) const;
+
+ private:
+  // Decode the payload at pos, which ends where the returned offset is.
+  // Registers are moved by direction (1 or -1) times the deltas, memory
+  // changes are applied to overlay_.
+  size_t Apply(size_t pos, int direction);
+  void ApplyChange(uint64_t addr, const uint8_t* delta, size_t len);
+
+  Memory* memory_;
+  pid_t tid_ = 0;
+  std::vector<uint8_t> buffer_;
+  size_t size_ = 0;
+  // Cursor as an entry count and as the offset of the entry after it
+  size_t position_ = 0;
+  size_t offset_ = 0;
+  user_regs_struct regs_{};
+  // Bytes whose value at the cursor may differ from the live one
+  std::map<uint64_t, uint8_t> overlay_;
+};
+
+// Single-step the stopped thread over insn, the instruction at its pc, and
+// log it. Returns the waitpid status, the instruction is only logged if the
+// step ended with its trap.
+int RecordStep(RecordLog* log, TracedThread* thread, Memory* memory,
+               const Instruction& insn);
+
+// A live process looked at through a record log: the recorded thread's
+// registers and memory are those at the log's cursor.
+class ReplayTarget : public Target {
+ public:
+  ReplayTarget(RecordLog* log, Memory* memory,
+               std::map<pid_t, TracedThread>* threads)
+      : log_{log}, live_{memory, threads} {}
+  void ReadMemory(uint64_t addr, void* buf, size_t len) override;
+  uint64_t ReadRegister(pid_t tid, Register::Reg r) override;
+
+ private:
+  RecordLog* log_;
+  ProcessTarget live_;
+};
@@ -1,4 +1,9 @@
 #pragma once
+#include <sys/types.h>
+#include <sys/user.h>
+
+#include <cstdint>
+#include <string>
 #include <unordered_map>
 namespace Register {
 // order of enum dictated by sys/user.h
@@ -32,4 +37,33 @@ enum Reg {
   gs
 };
 
+// Register name and DWARF register number, -1 if DWARF has none
+extern const std::unordered_map<Reg, std::pair<std::string, int>>
+    register_lookup;
+
 }  // namespace Register
+
+// Cached copy of the tracee's registers. It is filled with one
+// PTRACE_GETREGS the first time a register is read after a stop, and
+// writes are kept local until Flush() is called before the tracee resumes.
+class RegisterFile {
+ public:
+  RegisterFile() = default;
+  explicit RegisterFile(pid_t pid) : pid_{pid} {}
+  uint64_t Get(Register::Reg r);
+  void Set(Register::Reg r, uint64_t value);
+  // Every register, as PTRACE_GETREGS returns them
+  const user_regs_struct& GetAll();
+  void SetAll(const user_regs_struct& regs);
+  // Write dirty registers back to the tracee.
+  void Flush();
+  // Drop the cached copy, the tracee has run since it was read.
+  void Invalidate();
+
+ private:
+  void Fill();
+  pid_t pid_ = 0;
+  user_regs_struct regs_{};
+  bool valid_ = false;
+  bool dirty_ = false;
+};
@@ -0,0 +1,45 @@
+#pragma once
+#include <sys/types.h>
+
+#include <ctime>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// A source file mapped into memory. Line offsets are worked out the first
+// time a line is asked for.
+class SourceFile {
+ public:
+  // Throws std::runtime_error if the file cannot be opened or mapped.
+  explicit SourceFile(const std::string& path);
+  SourceFile(const SourceFile&) = delete;
+  SourceFile& operator=(const SourceFile&) = delete;
+  ~SourceFile();
+
+  unsigned LineCount();
+  // Text of the 1-based line n without its newline, empty past the end.
+  std::string_view Line(unsigned n);
+  const timespec& GetMtime() const;
+
+ private:
+  void IndexLines();
+  const char* data_ = nullptr;
+  size_t size_ = 0;
+  timespec mtime_{};
+  bool indexed_ = false;
+  // Offset of the first character of each line
+  std::vector<size_t> line_offsets_;
+};
+
+// Keeps every source file shown so far mapped, re-reading a file when its
+// modification time changes.
+class SourceCache {
+ public:
+  // nullptr if the file cannot be read.
+  SourceFile* Get(const std::string& path);
+
+ private:
+  std::unordered_map<std::string, std::unique_ptr<SourceFile>> files_;
+};
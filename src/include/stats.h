@@ -0,0 +1,123 @@
+#pragma once
+#include <time.h>
+
+#include <array>
+#include <cstdint>
+#include <map>
+#include <ostream>
+#include <string>
+
+#include "json.h"
+
+// Operations the debugger's time goes to, timed per command by `stats`
+enum class StatOp { kPtrace, kWaitpid, kMemory, kDwarf, kSource, kCount };
+
+// Latencies in nanoseconds bucketed log-linearly, like HdrHistogram: 8
+// buckets per power of two, so any value is known to within 12.5% with a
+// fixed 4 KiB of counters.
+class LatencyHistogram {
+ public:
+  void Record(uint64_t ns);
+  uint64_t Count() const { return count_; }
+  uint64_t Total() const { return total_; }
+  uint64_t Max() const { return max_; }
+  // Upper bound of the bucket holding quantile q (0 to 1), 0 if empty
+  uint64_t Quantile(double q) const;
+  // Count, total, max and quantiles, plus the non-empty buckets as
+  // [upper bound, count] pairs
+  Json ToJson() const;
+
+ private:
+  static constexpr int kSubBucketBits = 3;
+  static constexpr int kSubBuckets = 1 << kSubBucketBits;
+  static int BucketIndex(uint64_t ns);
+  static uint64_t BucketUpperBound(int index);
+
+  std::array<uint64_t, 62 * kSubBuckets> counts_{};
+  uint64_t count_ = 0;
+  uint64_t total_ = 0;
+  uint64_t max_ = 0;
+};
+
+// Per command counts and latency histograms of the StatOps it made, and of
+// the command as a whole. Only the tracer thread records.
+class Stats {
+ public:
+  void Reset();
+  // Attribute what is recorded from now on to the command name, until
+  // EndCommand, which records the command's own latency.
+  bool InCommand() const { return current_ != nullptr; }
+  void BeginCommand(const std::string& name);
+  void EndCommand(uint64_t ns);
+  void Record(StatOp op, uint64_t ns);
+  // An op of this kind is being timed, nested ones are part of it
+  bool& Timing(StatOp op) { return timing_[static_cast<size_t>(op)]; }
+  void Print(std::ostream& out) const;
+  Json ToJson() const;
+
+ private:
+  struct CommandStats {
+    LatencyHistogram latency;
+    std::array<LatencyHistogram, static_cast<size_t>(StatOp::kCount)> ops;
+  };
+  std::map<std::string, CommandStats> commands_;
+  // Command being run, nullptr outside of commands
+  CommandStats* current_ = nullptr;
+  std::array<bool, static_cast<size_t>(StatOp::kCount)> timing_{};
+};
+
+// Off by default. When off, instrumented code only tests this flag.
+inline bool stats_enabled = false;
+inline Stats debugger_stats;
+
+inline uint64_t StatsClockNs() {
+  timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return static_cast<uint64_t>(ts.tv_sec) * 1000000000 + ts.tv_nsec;
+}
+
+// Times its scope as one op, if stats are enabled when it starts. Only
+// the outermost of nested timers of the same op records.
+class OpTimer {
+ public:
+  explicit OpTimer(StatOp op) : op_{op} {
+    if (stats_enabled && !debugger_stats.Timing(op)) {
+      debugger_stats.Timing(op) = true;
+      start_ = StatsClockNs();
+    }
+  }
+  ~OpTimer() {
+    if (start_ != 0) {
+      debugger_stats.Timing(op_) = false;
+      debugger_stats.Record(op_, StatsClockNs() - start_);
+    }
+  }
+  OpTimer(const OpTimer&) = delete;
+  OpTimer& operator=(const OpTimer&) = delete;
+
+ private:
+  StatOp op_;
+  uint64_t start_ = 0;
+};
+
+// Attributes the ops in its scope to a command and times the command. A
+// command run by another one is part of it.
+class CommandTimer {
+ public:
+  explicit CommandTimer(const std::string& name) {
+    if (stats_enabled && !debugger_stats.InCommand()) {
+      debugger_stats.BeginCommand(name);
+      start_ = StatsClockNs();
+    }
+  }
+  ~CommandTimer() {
+    if (start_ != 0) {
+      debugger_stats.EndCommand(StatsClockNs() - start_);
+    }
+  }
+  CommandTimer(const CommandTimer&) = delete;
+  CommandTimer& operator=(const CommandTimer&) = delete;
+
+ private:
+  uint64_t start_ = 0;
+};
@@ -0,0 +1,77 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include "elf/elf++.hh"
+
+enum class SymbolType { notype, object, func, section, file };
+
+struct symbol {
+  SymbolType type;
+  std::string name;
+  std::uintptr_t addr;
+  uint64_t size = 0;
+  std::string demangled;  // empty unless the name is a mangled C++ name
+};
+
+// FNV-1a hash of name. Unlike std::hash it is stable across builds, so it
+// can go into files such as the index cache.
+uint64_t HashName(std::string_view name);
+
+// Name and address index over .symtab and .dynsym, built once per ELF.
+// Exact names are found through a sorted array of name hashes, prefix and
+// glob queries through a sorted name array. Demangled C++ names are indexed
+// as well. All tables are flat so they can be saved by IndexCache.
+class SymbolIndex {
+ public:
+  SymbolIndex() = default;
+  explicit SymbolIndex(const elf::elf& elf);
+
+  // pattern is an exact name, or a glob ("foo*", "*bar", "f?o") matched
+  // against both the raw and the demangled names.
+  std::vector<symbol> Lookup(const std::string& pattern) const;
+  // Function or object symbol covering addr (an unrelocated address).
+  // Returns false if there is none.
+  bool FindByAddress(uint64_t addr, symbol* sym, uint64_t* offset) const;
+
+ private:
+  friend class IndexCache;
+  struct Entry {
+    uint64_t addr;
+    uint64_t size;
+    uint32_t name;       // offset into strings_
+    uint32_t demangled;  // offset into strings_, kNoName if not mangled
+    SymbolType type;
+    uint32_t padding = 0;  // zero in the index cache
+  };
+  // One searchable name, either the raw or demangled name of an entry.
+  struct NameRef {
+    uint32_t name;
+    uint32_t entry;
+  };
+  struct HashRef {
+    uint64_t hash;
+    uint32_t entry;
+    uint32_t padding = 0;
+  };
+  static constexpr uint32_t kNoName = UINT32_MAX;
+
+  void Add(const std::string& name, SymbolType type, uint64_t addr,
+           uint64_t size);
+  void Finish();
+  void FindMaxSize();
+  uint32_t AddString(const std::string& s);
+  std::string_view String(uint32_t offset) const;
+  symbol ToSymbol(uint32_t entry) const;
+  void MatchExact(std::string_view name, std::vector<uint32_t>* out) const;
+  void MatchGlob(const std::string& pattern, std::vector<uint32_t>* out) const;
+
+  std::vector<Entry> entries_;
+  std::string strings_;
+  std::vector<HashRef> by_hash_;  // sorted by hash
+  std::vector<NameRef> sorted_names_;
+  std::vector<uint32_t> by_address_;  // func/object entries sorted by addr
+  uint64_t max_size_ = 1;  // largest size in by_address_, at least 1
+};
@@ -0,0 +1,33 @@
+#pragma once
+#include <sys/types.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+
+#include "memory.h"
+#include "registers.h"
+#include "traced_thread.h"
+
+// Where commands that only look at the debuggee read its memory and
+// registers from: the live process, or a core file it left behind.
+class Target {
+ public:
+  virtual ~Target() = default;
+  // Copy len bytes at addr to buf. Throws if any of them is unreadable.
+  virtual void ReadMemory(uint64_t addr, void* buf, size_t len) = 0;
+  virtual uint64_t ReadRegister(pid_t tid, Register::Reg r) = 0;
+};
+
+// The stopped threads of a traced process.
+class ProcessTarget : public Target {
+ public:
+  ProcessTarget(Memory* memory, std::map<pid_t, TracedThread>* threads)
+      : memory_{memory}, threads_{threads} {}
+  void ReadMemory(uint64_t addr, void* buf, size_t len) override;
+  uint64_t ReadRegister(pid_t tid, Register::Reg r) override;
+
+ private:
+  Memory* memory_;
+  std::map<pid_t, TracedThread>* threads_;
+};
@@ -0,0 +1,38 @@
+#pragma once
+#include <sys/types.h>
+
+#include <array>
+#include <cstdint>
+#include <vector>
+
+// Fixed size ring of tracepoint hits. Records are preallocated so a hit
+// costs no allocation, and once the ring is full the oldest are overwritten.
+class TraceBuffer {
+ public:
+  static constexpr size_t kMaxValues = 8;
+  static constexpr size_t kDefaultCapacity = 1 << 16;
+
+  struct Record {
+    uint64_t time_ns;  // steady clock
+    uint64_t addr;     // address of the tracepoint
+    pid_t tid;
+    uint32_t count;   // number of values
+    uint32_t failed;  // bit i set if values[i] could not be evaluated
+    std::array<uint64_t, kMaxValues> values;
+  };
+
+  explicit TraceBuffer(size_t capacity = kDefaultCapacity);
+
+  // Slot for a new record, overwriting the oldest one if the ring is full.
+  Record& Append();
+  void Clear();
+  // Records held, oldest first through At(0).
+  size_t Size() const;
+  const Record& At(size_t i) const;
+  // Records appended since the last Clear, including overwritten ones.
+  uint64_t Total() const;
+
+ private:
+  std::vector<Record> records_;
+  uint64_t total_ = 0;
+};
@@ -0,0 +1,33 @@
+#pragma once
+#include <sys/ptrace.h>
+#include <sys/types.h>
+
+#include <string>
+
+#include "registers.h"
+
+// Options every traced thread is seized with: follow new threads, and stop
+// at exec.
+const auto kPtraceOptions = PTRACE_O_TRACECLONE | PTRACE_O_TRACEEXEC;
+
+// One thread of the debuggee. Threads run and stop together (all-stop), so
+// while the prompt is shown every thread is stopped.
+struct TracedThread {
+  explicit TracedThread(pid_t tid) : tid{tid}, registers{tid} {}
+
+  pid_t tid;
+  RegisterFile registers;
+  // Resumed and not yet seen stopping by waitpid
+  bool running = false;
+  // Created by clone, its first stop has not been seen yet
+  bool starting = false;
+  // How the thread was last resumed, to resume it the same way after an
+  // event it should not stop for
+  enum __ptrace_request resume_request = PTRACE_CONT;
+  // Stopped on a breakpoint that was reported, it has to be stepped past
+  // the breakpoint before it runs again
+  bool at_breakpoint = false;
+  // Signal to pass on when the thread is resumed, 0 for none
+  int pending_signal = 0;
+  std::string stop_reason = "new thread";
+};
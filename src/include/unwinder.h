@@ -0,0 +1,123 @@
+#pragma once
+#include <array>
+#include <cstdint>
+#include <functional>
+#include <unordered_map>
+#include <vector>
+
+#include "elf/elf++.hh"
+
+// Stack unwinder driven by the DWARF call frame information in .eh_frame
+// and .debug_frame, so it works without frame pointers.
+//
+// The FDEs are indexed by address the first time they are needed. The
+// first unwind through an FDE decodes its CFA instructions into a table of
+// rows, which is kept, so later unwinds through it cost a binary search
+// plus the memory reads of the saved registers. Code without CFI falls
+// back to following the frame pointer.
+class Unwinder {
+ public:
+  // Registers by DWARF number: 0-15 are the general purpose registers,
+  // 16 the return address
+  static constexpr int kRegisters = 17;
+  static constexpr int kRbp = 6;
+  static constexpr int kRsp = 7;
+  static constexpr int kReturnAddress = 16;
+
+  struct Frame {
+    uint64_t pc = 0;
+    // pc is a return address, which may lie past the end of the call's
+    // function, so lookups use pc - 1. Not set for the innermost frame
+    // and callers of signal handlers.
+    bool return_address = false;
+    std::array<uint64_t, kRegisters> regs{};
+    uint32_t valid = 0;  // bit n is set if regs[n] is known
+  };
+  // Read 8 bytes of the tracee's memory, false if they are unreadable
+  using ReadMemory = std::function<bool(uint64_t addr, uint64_t* value)>;
+
+  Unwinder() = default;
+  // elf must outlive the unwinder.
+  explicit Unwinder(const elf::elf& elf) : elf_{&elf} {}
+
+  // Recover the frame of the caller of frame. Addresses in the tracee are
+  // the ELF's plus load_address. False if frame is the outermost one or
+  // cannot be unwound.
+  bool Step(const Frame& frame, Frame* caller, uint64_t load_address,
+            const ReadMemory& read) const;
+
+  size_t FdeCount() const;
+  // FDEs decoded into row tables so far
+  size_t CachedFdeCount() const;
+
+ private:
+  enum class RuleKind : uint8_t {
+    kUndefined,
+    kSameValue,
+    kOffset,         // saved at CFA + offset
+    kValOffset,      // value is CFA + offset
+    kRegister,       // in register offset
+    kExpression,     // saved at the address the expression computes
+    kValExpression,  // value is what the expression computes
+  };
+  struct Rule {
+    RuleKind kind = RuleKind::kUndefined;
+    uint32_t expression_len = 0;
+    int64_t offset = 0;
+    const uint8_t* expression = nullptr;
+  };
+  // Unwind rules from address on
+  struct Row {
+    uint64_t address = 0;
+    int cfa_register = kRsp;  // -1 if the CFA is given by cfa_expression
+    int64_t cfa_offset = 0;
+    const uint8_t* cfa_expression = nullptr;
+    uint32_t cfa_expression_len = 0;
+    std::array<Rule, kRegisters> rules;
+  };
+  struct Cie {
+    uint64_t code_align;
+    int64_t data_align;
+    uint64_t return_register;
+    uint8_t fde_encoding;
+    bool has_augmentation_data;
+    bool signal_frame;
+    const uint8_t* instructions;
+    const uint8_t* end;
+    // Section the CIE is in, for PC relative pointers
+    const uint8_t* section;
+    uint64_t section_addr;
+  };
+  struct Fde {
+    uint64_t low;
+    uint64_t high;
+    uint32_t cie;
+    const uint8_t* instructions;
+    const uint8_t* end;
+  };
+  class Cursor;
+
+  void Load() const;
+  void ParseSection(const elf::section& sec, bool eh_frame) const;
+  uint32_t ParseCie(const elf::section& sec, uint64_t offset, bool eh_frame,
+                    std::unordered_map<uint64_t, uint32_t>* cie_index) const;
+  // The FDE's rows, decoded on first use
+  const std::vector<Row>& Rows(uint32_t fde) const;
+  void Execute(const Cie& cie, const uint8_t* begin, const uint8_t* end,
+               const Row& initial, Row* row, std::vector<Row>* rows) const;
+  bool StepFramePointer(const Frame& frame, Frame* caller,
+                        const ReadMemory& read) const;
+  // Evaluate a DWARF expression over frame's registers, with initial
+  // pushed first if push_initial is set. False if it uses anything
+  // unsupported or unknown.
+  bool Evaluate(const uint8_t* expr, size_t len, const Frame& frame,
+                const ReadMemory& read, bool push_initial, uint64_t initial,
+                uint64_t* result) const;
+
+  const elf::elf* elf_ = nullptr;
+  // Mutable because the tables are built on demand
+  mutable bool loaded_ = false;
+  mutable std::vector<Cie> cies_;
+  mutable std::vector<Fde> fdes_;  // sorted by low
+  mutable std::unordered_map<uint32_t, std::vector<Row>> rows_;
+};
@@ -0,0 +1,58 @@
+#pragma once
+#include <cstddef>
+#include <cstdint>
+
+// Just enough of an x86-64 decoder to find instruction boundaries, classify
+// control flow and locate the ModRM memory operand. Operand semantics are
+// not decoded.
+struct Instruction {
+  enum class Kind {
+    kOther,
+    kCall,            // call rel32
+    kJump,            // jmp rel8/rel32
+    kCondJump,        // jcc, loop, jrcxz
+    kIndirectCall,    // call r/m, far call
+    kIndirectJump,    // jmp r/m, far jmp
+    kReturn,          // ret, retf, iret
+  };
+
+  size_t length = 0;
+  Kind kind = Kind::kOther;
+
+  size_t opcode_offset = 0;  // offset of the (last) opcode byte
+  uint8_t opcode = 0;
+  int opcode_map = 0;  // 0: one byte, 1: 0F, 2: 0F 38, 3: 0F 3A
+  uint8_t rex = 0;
+  bool operand_size_prefix = false;  // 66
+  bool address_size_prefix = false;  // 67
+  bool rep_prefix = false;           // F2 or F3
+  uint8_t segment_prefix = 0;        // 64 (fs) or 65 (gs), 0 for neither
+  bool vex = false;                  // VEX or EVEX encoded
+
+  bool has_modrm = false;
+  uint8_t modrm = 0;
+  bool has_sib = false;
+  uint8_t sib = 0;
+  size_t disp_offset = 0;  // offset of the displacement, if disp_size != 0
+  int disp_size = 0;
+  int64_t disp = 0;
+  bool rip_relative = false;
+
+  size_t imm_offset = 0;
+  int imm_size = 0;
+
+  // Relative branch displacement, valid for kCall, kJump and kCondJump
+  size_t rel_offset = 0;
+  int rel_size = 0;
+  int64_t rel = 0;
+
+  // Destination of a relative branch at addr
+  uint64_t BranchTarget(uint64_t addr) const { return addr + length + rel; }
+  int ModrmMod() const { return modrm >> 6; }
+  int ModrmReg() const { return (modrm >> 3) & 7; }
+  int ModrmRm() const { return modrm & 7; }
+};
+
+// Decode the instruction at code, reading at most len bytes. Returns false
+// if the bytes are not a valid instruction this decoder understands.
+bool DecodeInstruction(const uint8_t* code, size_t len, Instruction* insn);
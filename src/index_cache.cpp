@@ -0,0 +1,433 @@
+#include "index_cache.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iomanip>
+#include <sstream>
+#include <type_traits>
+
+namespace {
+
+// Bump whenever the layout of any cached table changes
+const uint32_t kVersion = 2;
+const char kMagic[8] = {'D', 'B', 'G', 'I', 'D', 'X', '\0', '\0'};
+const auto kAlignment = 8;
+
+enum Table {
+  kShards,
+  kCuRanges,
+  kUnrangedCus,
+  kFunctions,
+  kMaxHigh,
+  kLines,
+  kLineStrings,
+  kSymbolEntries,
+  kSymbolStrings,
+  kSymbolHashes,
+  kSymbolNames,
+  kSymbolsByAddress,
+  kTableCount,
+};
+
+// The PC index shards are stored back to back in the kFunctions, kMaxHigh,
+// kLines and kLineStrings tables, kShards has their sizes.
+struct ShardSize {
+  uint64_t functions;
+  uint64_t lines;
+  uint64_t strings;
+};
+
+struct Header {
+  char magic[8];
+  uint32_t version;
+  uint32_t key_size;
+  // Byte offset and size of each table from the start of the file
+  uint64_t tables[kTableCount][2];
+};
+
+std::string Hex(const uint8_t* data, size_t len) {
+  std::ostringstream out;
+  for (size_t i = 0; i < len; i++) {
+    out << std::hex << std::setw(2) << std::setfill('0')
+        << static_cast<int>(data[i]);
+  }
+  return out.str();
+}
+
+// Descriptor of the NT_GNU_BUILD_ID note, empty if there is none
+std::string BuildId(const elf::elf& elf) {
+  const auto& sec = elf.get_section(".note.gnu.build-id");
+  if (!sec.valid() || sec.size() < 12) {
+    return "";
+  }
+  const auto* note = static_cast<const uint8_t*>(sec.data());
+  uint32_t name_size, desc_size;
+  std::memcpy(&name_size, note, sizeof(name_size));
+  std::memcpy(&desc_size, note + 4, sizeof(desc_size));
+  auto desc_offset = 12 + ((name_size + 3) & ~3U);
+  if (desc_offset + desc_size > sec.size()) {
+    return "";
+  }
+  return Hex(note + desc_offset, desc_size);
+}
+
+std::string CacheDirectory() {
+  std::string dir;
+  if (const auto* xdg = std::getenv("XDG_CACHE_HOME"); xdg && *xdg) {
+    dir = xdg;
+  } else if (const auto* home = std::getenv("HOME"); home && *home) {
+    dir = std::string(home) + "/.cache";
+  } else {
+    return "";
+  }
+  mkdir(dir.c_str(), 0755);
+  dir += "/debugger";
+  mkdir(dir.c_str(), 0755);
+  return dir;
+}
+
+template <typename T>
+void AppendTable(const std::vector<T>& v, Table t, Header* header,
+                 std::string* out) {
+  static_assert(std::is_trivially_copyable_v<T>);
+  // Padding would write whatever was in memory, so the structs written
+  // spell theirs out as fields
+  static_assert(std::has_unique_object_representations_v<T>);
+  out->resize((out->size() + kAlignment - 1) & ~(kAlignment - 1));
+  header->tables[t][0] = out->size();
+  header->tables[t][1] = v.size() * sizeof(T);
+  out->append(reinterpret_cast<const char*>(v.data()), v.size() * sizeof(T));
+}
+
+void AppendTable(const std::string& s, Table t, Header* header,
+                 std::string* out) {
+  header->tables[t][0] = out->size();
+  header->tables[t][1] = s.size();
+  out->append(s);
+}
+
+// Checks table t holds whole Ts and lies within the file, and returns
+// where it is and how many Ts it holds.
+template <typename T>
+bool FindTable(size_t file_size, const Header& header, Table t,
+               size_t* offset, size_t* count) {
+  auto [table_offset, size] = header.tables[t];
+  if (table_offset > file_size || size > file_size - table_offset ||
+      size % sizeof(T)) {
+    return false;
+  }
+  *offset = table_offset;
+  *count = size / sizeof(T);
+  return true;
+}
+
+// Copy count Ts starting at the first'th T of the table at offset
+template <typename T>
+void CopyTable(const char* base, size_t offset, size_t first, size_t count,
+               std::vector<T>* v) {
+  v->resize(count);
+  std::memcpy(v->data(), base + offset + first * sizeof(T),
+              count * sizeof(T));
+}
+
+template <typename T>
+bool ReadTable(const char* base, size_t file_size, const Header& header,
+               Table t, std::vector<T>* v) {
+  size_t offset, count;
+  if (!FindTable<T>(file_size, header, t, &offset, &count)) {
+    return false;
+  }
+  CopyTable(base, offset, 0, count, v);
+  return true;
+}
+
+bool ReadTable(const char* base, size_t file_size, const Header& header,
+               Table t, std::string* s) {
+  size_t offset, size;
+  if (!FindTable<char>(file_size, header, t, &offset, &size)) {
+    return false;
+  }
+  s->assign(base + offset, size);
+  return true;
+}
+
+// Every string a table refers to must end within it, strings are used as
+// C strings
+bool ValidStrings(const std::string& strings) {
+  return strings.empty() || strings.back() == '\0';
+}
+
+}  // namespace
+
+IndexCache::IndexCache(const std::string& binary_path, const elf::elf& elf) {
+  key_ = BuildId(elf);
+  std::string name = key_;
+  if (key_.empty()) {
+    struct stat st {};
+    char* real = realpath(binary_path.c_str(), nullptr);
+    std::string path = real != nullptr ? real : binary_path;
+    std::free(real);
+    stat(path.c_str(), &st);
+    key_ = path + ":" + std::to_string(st.st_mtim.tv_sec) + "." +
+           std::to_string(st.st_mtim.tv_nsec) + ":" +
+           std::to_string(st.st_size);
+    auto hash = HashName(key_);
+    name = "path-" + Hex(reinterpret_cast<const uint8_t*>(&hash), sizeof(hash));
+  }
+  auto dir = CacheDirectory();
+  if (!dir.empty()) {
+    path_ = dir + "/" + name + ".idx";
+  }
+}
+
+bool IndexCache::Load(const dwarf::dwarf& dw, PCIndex* pc_index,
+                      SymbolIndex* symbol_index) const {
+  if (path_.empty()) {
+    return false;
+  }
+  auto fd = open(path_.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st {};
+  if (fstat(fd, &st) != 0 || static_cast<size_t>(st.st_size) < sizeof(Header)) {
+    close(fd);
+    return false;
+  }
+  size_t size = st.st_size;
+  auto* map = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (map == MAP_FAILED) {
+    return false;
+  }
+  const auto* base = static_cast<const char*>(map);
+  auto result = Read(dw, base, size, pc_index, symbol_index);
+  munmap(map, size);
+  return result;
+}
+
+bool IndexCache::Read(const dwarf::dwarf& dw, const char* base, size_t size,
+                      PCIndex* pc_index, SymbolIndex* symbol_index) const {
+  Header header;
+  std::memcpy(&header, base, sizeof(header));
+  if (std::memcmp(header.magic, kMagic, sizeof(kMagic)) != 0 ||
+      header.version != kVersion || header.key_size != key_.size() ||
+      sizeof(header) + key_.size() > size ||
+      key_.compare(0, key_.size(), base + sizeof(header), header.key_size) !=
+          0) {
+    return false;
+  }
+
+  // Fill copies first so a corrupt file leaves the indexes untouched. The
+  // shard tables are copied straight out of the mapping into their shards.
+  std::vector<ShardSize> shard_sizes;
+  std::vector<PCIndex::CuRange> cu_ranges;
+  std::vector<uint32_t> unranged_cus;
+  size_t functions, max_high, lines, strings;
+  size_t function_count, max_high_count, line_count, string_size;
+  SymbolIndex sym;
+  if (!ReadTable(base, size, header, kShards, &shard_sizes) ||
+      !ReadTable(base, size, header, kCuRanges, &cu_ranges) ||
+      !ReadTable(base, size, header, kUnrangedCus, &unranged_cus) ||
+      !FindTable<PCIndex::Function>(size, header, kFunctions, &functions,
+                                    &function_count) ||
+      !FindTable<uint64_t>(size, header, kMaxHigh, &max_high,
+                           &max_high_count) ||
+      !FindTable<PCIndex::Line>(size, header, kLines, &lines, &line_count) ||
+      !FindTable<char>(size, header, kLineStrings, &strings, &string_size) ||
+      !ReadTable(base, size, header, kSymbolEntries, &sym.entries_) ||
+      !ReadTable(base, size, header, kSymbolStrings, &sym.strings_) ||
+      !ReadTable(base, size, header, kSymbolHashes, &sym.by_hash_) ||
+      !ReadTable(base, size, header, kSymbolNames, &sym.sorted_names_) ||
+      !ReadTable(base, size, header, kSymbolsByAddress, &sym.by_address_) ||
+      max_high_count != function_count || !CheckSymbols(sym)) {
+    return false;
+  }
+
+  // One shard per compilation unit of this binary
+  const auto& cus = dw.compilation_units();
+  if (shard_sizes.size() != cus.size()) {
+    return false;
+  }
+  for (const auto& range : cu_ranges) {
+    if (range.cu >= shard_sizes.size()) {
+      return false;
+    }
+  }
+  for (auto cu : unranged_cus) {
+    if (cu >= shard_sizes.size()) {
+      return false;
+    }
+  }
+
+  auto info_size = dw.get_section(dwarf::section_type::info)->size();
+  std::vector<PCIndex::Shard> shards(shard_sizes.size());
+  size_t function = 0, line = 0, string = 0;
+  for (uint32_t cu = 0; cu < shards.size(); cu++) {
+    const auto& sizes = shard_sizes[cu];
+    if (sizes.functions > function_count - function ||
+        sizes.lines > line_count - line ||
+        sizes.strings > string_size - string) {
+      return false;
+    }
+    auto& shard = shards[cu];
+    CopyTable(base, functions, function, sizes.functions, &shard.functions);
+    CopyTable(base, max_high, function, sizes.functions, &shard.max_high);
+    CopyTable(base, lines, line, sizes.lines, &shard.lines);
+    shard.strings.assign(base + strings + string, sizes.strings);
+    // Dies of a unit lie between its header and the next unit's
+    auto die_low = cus[cu].get_section_offset();
+    auto die_high = cu + 1 < cus.size() ? cus[cu + 1].get_section_offset()
+                                        : info_size;
+    if (!CheckShard(shard, cu, die_low, die_high)) {
+      return false;
+    }
+    function += sizes.functions;
+    line += sizes.lines;
+    string += sizes.strings;
+  }
+
+  pc_index->Adopt(std::move(shards), std::move(cu_ranges),
+                  std::move(unranged_cus));
+  sym.FindMaxSize();
+  *symbol_index = std::move(sym);
+  return true;
+}
+
+bool IndexCache::CheckShard(const PCIndex::Shard& shard, uint32_t cu,
+                            uint64_t die_low, uint64_t die_high) {
+  if (!ValidStrings(shard.strings)) {
+    return false;
+  }
+  uint64_t max_high = 0;
+  for (size_t i = 0; i < shard.functions.size(); i++) {
+    const auto& f = shard.functions[i];
+    max_high = std::max(max_high, f.high);
+    if (f.cu != cu || f.name >= shard.strings.size() ||
+        f.die_offset <= die_low || f.die_offset >= die_high ||
+        shard.max_high[i] != max_high ||
+        (i > 0 && shard.functions[i - 1].low > f.low)) {
+      return false;
+    }
+  }
+  for (size_t i = 0; i < shard.lines.size(); i++) {
+    const auto& l = shard.lines[i];
+    if (l.cu != cu || l.file >= shard.strings.size() ||
+        (i > 0 && shard.lines[i - 1].address > l.address)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool IndexCache::CheckSymbols(const SymbolIndex& sym) {
+  if (!ValidStrings(sym.strings_)) {
+    return false;
+  }
+  auto valid_name = [&sym](uint32_t name) {
+    return name < sym.strings_.size();
+  };
+  for (const auto& e : sym.entries_) {
+    if (!valid_name(e.name) ||
+        (e.demangled != SymbolIndex::kNoName && !valid_name(e.demangled))) {
+      return false;
+    }
+  }
+  const auto entries = sym.entries_.size();
+  for (size_t i = 0; i < sym.by_hash_.size(); i++) {
+    if (sym.by_hash_[i].entry >= entries ||
+        (i > 0 && sym.by_hash_[i - 1].hash > sym.by_hash_[i].hash)) {
+      return false;
+    }
+  }
+  for (size_t i = 0; i < sym.sorted_names_.size(); i++) {
+    const auto& ref = sym.sorted_names_[i];
+    if (ref.entry >= entries || !valid_name(ref.name) ||
+        (i > 0 && sym.String(ref.name) <
+                      sym.String(sym.sorted_names_[i - 1].name))) {
+      return false;
+    }
+  }
+  for (size_t i = 0; i < sym.by_address_.size(); i++) {
+    auto entry = sym.by_address_[i];
+    if (entry >= entries ||
+        (i > 0 &&
+         sym.entries_[sym.by_address_[i - 1]].addr > sym.entries_[entry].addr)) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool IndexCache::Store(const PCIndex& pc_index,
+                       const SymbolIndex& symbol_index) const {
+  if (path_.empty()) {
+    return false;
+  }
+  Header header{};
+  std::memcpy(header.magic, kMagic, sizeof(kMagic));
+  header.version = kVersion;
+  header.key_size = key_.size();
+
+  pc_index.Wait();
+  std::vector<ShardSize> shard_sizes;
+  std::vector<PCIndex::Function> functions;
+  std::vector<uint64_t> max_high;
+  std::vector<PCIndex::Line> lines;
+  std::string strings;
+  for (const auto& shard : pc_index.shards_) {
+    shard_sizes.push_back(ShardSize{shard.functions.size(), shard.lines.size(),
+                                    shard.strings.size()});
+    functions.insert(functions.end(), shard.functions.begin(),
+                     shard.functions.end());
+    max_high.insert(max_high.end(), shard.max_high.begin(),
+                    shard.max_high.end());
+    lines.insert(lines.end(), shard.lines.begin(), shard.lines.end());
+    strings += shard.strings;
+  }
+
+  std::string out(sizeof(header), '\0');
+  out += key_;
+  AppendTable(shard_sizes, kShards, &header, &out);
+  AppendTable(pc_index.cu_ranges_, kCuRanges, &header, &out);
+  AppendTable(pc_index.unranged_cus_, kUnrangedCus, &header, &out);
+  AppendTable(functions, kFunctions, &header, &out);
+  AppendTable(max_high, kMaxHigh, &header, &out);
+  AppendTable(lines, kLines, &header, &out);
+  AppendTable(strings, kLineStrings, &header, &out);
+  AppendTable(symbol_index.entries_, kSymbolEntries, &header, &out);
+  AppendTable(symbol_index.strings_, kSymbolStrings, &header, &out);
+  AppendTable(symbol_index.by_hash_, kSymbolHashes, &header, &out);
+  AppendTable(symbol_index.sorted_names_, kSymbolNames, &header, &out);
+  AppendTable(symbol_index.by_address_, kSymbolsByAddress, &header, &out);
+  std::memcpy(out.data(), &header, sizeof(header));
+
+  // Write to a private file and rename it into place, so a concurrent
+  // debugger never sees a partial cache file.
+  auto tmp = path_ + "." + std::to_string(getpid());
+  auto fd = open(tmp.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    return false;
+  }
+  size_t done = 0;
+  while (done < out.size()) {
+    auto n = write(fd, out.data() + done, out.size() - done);
+    if (n <= 0) {
+      break;
+    }
+    done += n;
+  }
+  close(fd);
+  if (done != out.size() || rename(tmp.c_str(), path_.c_str()) != 0) {
+    unlink(tmp.c_str());
+    return false;
+  }
+  return true;
+}
@@ -0,0 +1,63 @@
+#include "inject_syscall.h"
+
+#include <sys/wait.h>
+
+#include <stdexcept>
+#include <string>
+
+#include "ptrace_wrapper.h"
+
+namespace {
+
+const uint8_t kSyscall[kSyscallLength] = {0x0f, 0x05};
+
+}  // namespace
+
+int64_t InjectSyscall(TracedThread* thread, Memory* memory, long nr,
+                      const uint64_t (&args)[6],
+                      const std::function<void(int event)>& on_event) {
+  auto tid = thread->tid;
+  auto saved = thread->registers.GetAll();
+  uint8_t code[sizeof(kSyscall)];
+  memory->Read(saved.rip, code, sizeof(code));
+  memory->WriteText(saved.rip, kSyscall, sizeof(kSyscall));
+  auto regs = saved;
+  regs.rax = nr;
+  // Keep the kernel from restarting a syscall the thread was stopped in
+  // instead of running this one
+  regs.orig_rax = -1;
+  regs.rdi = args[0];
+  regs.rsi = args[1];
+  regs.rdx = args[2];
+  regs.r10 = args[3];
+  regs.r8 = args[4];
+  regs.r9 = args[5];
+  thread->registers.SetAll(regs);
+  thread->registers.Flush();
+
+  // Events come before the trap of the step finishing the syscall
+  int status = 0;
+  while (true) {
+    Ptrace(PTRACE_SINGLESTEP, tid, nullptr, 0);
+    if (Waitpid(tid, &status, __WALL) != tid || !WIFSTOPPED(status)) {
+      throw std::runtime_error("Thread " + std::to_string(tid) +
+                               " exited in an injected syscall");
+    }
+    auto event = status >> 16;
+    if (event != 0) {
+      if (on_event) {
+        on_event(event);
+      }
+    } else if (WSTOPSIG(status) == SIGTRAP) {
+      break;
+    } else {
+      thread->pending_signal = WSTOPSIG(status);
+    }
+  }
+  thread->registers.Invalidate();
+  auto result = static_cast<int64_t>(thread->registers.Get(Register::rax));
+  thread->registers.SetAll(saved);
+  thread->registers.Flush();
+  memory->WriteText(saved.rip, code, sizeof(code));
+  return result;
+}
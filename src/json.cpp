@@ -0,0 +1,325 @@
+#include "json.h"
+
+#include <cctype>
+#include <cmath>
+#include <cstdio>
+#include <stdexcept>
+
+class JsonParser {
+ public:
+  explicit JsonParser(const std::string& text) : text_{text} {}
+
+  Json ParseDocument() {
+    auto value = ParseValue(0);
+    SkipSpace();
+    if (pos_ != text_.size()) {
+      Fail("trailing characters");
+    }
+    return value;
+  }
+
+ private:
+  static constexpr int kMaxDepth = 64;
+
+  Json ParseValue(int depth) {
+    if (depth > kMaxDepth) {
+      Fail("nested too deep");
+    }
+    SkipSpace();
+    if (pos_ == text_.size()) {
+      Fail("unexpected end");
+    }
+    auto c = text_[pos_];
+    if (c == '{') {
+      return ParseObject(depth);
+    }
+    if (c == '[') {
+      return ParseArray(depth);
+    }
+    if (c == '"') {
+      return Json(ParseString());
+    }
+    if (Accept("true")) {
+      return Json(true);
+    }
+    if (Accept("false")) {
+      return Json(false);
+    }
+    if (Accept("null")) {
+      return Json();
+    }
+    return ParseNumber();
+  }
+
+  Json ParseObject(int depth) {
+    pos_++;  // {
+    auto object = Json::Object();
+    SkipSpace();
+    if (Accept("}")) {
+      return object;
+    }
+    do {
+      SkipSpace();
+      if (pos_ == text_.size() || text_[pos_] != '"') {
+        Fail("expected a member name");
+      }
+      auto key = ParseString();
+      SkipSpace();
+      if (!Accept(":")) {
+        Fail("expected ':'");
+      }
+      object.members_.emplace_back(key, ParseValue(depth + 1));
+      SkipSpace();
+    } while (Accept(","));
+    if (!Accept("}")) {
+      Fail("expected '}'");
+    }
+    return object;
+  }
+
+  Json ParseArray(int depth) {
+    pos_++;  // [
+    auto array = Json::Array();
+    SkipSpace();
+    if (Accept("]")) {
+      return array;
+    }
+    do {
+      array.items_.push_back(ParseValue(depth + 1));
+      SkipSpace();
+    } while (Accept(","));
+    if (!Accept("]")) {
+      Fail("expected ']'");
+    }
+    return array;
+  }
+
+  std::string ParseString() {
+    pos_++;  // "
+    std::string s;
+    while (pos_ < text_.size() && text_[pos_] != '"') {
+      auto c = text_[pos_++];
+      if (c != '\\') {
+        s += c;
+        continue;
+      }
+      if (pos_ == text_.size()) {
+        break;
+      }
+      c = text_[pos_++];
+      switch (c) {
+        case 'n':
+          s += '\n';
+          break;
+        case 't':
+          s += '\t';
+          break;
+        case 'r':
+          s += '\r';
+          break;
+        case 'b':
+          s += '\b';
+          break;
+        case 'f':
+          s += '\f';
+          break;
+        case 'u': {
+          if (pos_ + 4 > text_.size()) {
+            Fail("bad \\u escape");
+          }
+          auto code = std::stoul(text_.substr(pos_, 4), nullptr, 16);
+          pos_ += 4;
+          // UTF-8 encode, surrogate pairs are not combined
+          if (code < 0x80) {
+            s += static_cast<char>(code);
+          } else if (code < 0x800) {
+            s += static_cast<char>(0xc0 | (code >> 6));
+            s += static_cast<char>(0x80 | (code & 0x3f));
+          } else {
+            s += static_cast<char>(0xe0 | (code >> 12));
+            s += static_cast<char>(0x80 | ((code >> 6) & 0x3f));
+            s += static_cast<char>(0x80 | (code & 0x3f));
+          }
+          break;
+        }
+        default:  // " \ /
+          s += c;
+      }
+    }
+    if (!Accept("\"")) {
+      Fail("unterminated string");
+    }
+    return s;
+  }
+
+  Json ParseNumber() {
+    size_t len = 0;
+    double value = 0;
+    try {
+      value = std::stod(text_.substr(pos_, 32), &len);
+    } catch (std::exception&) {
+      Fail("unexpected character");
+    }
+    pos_ += len;
+    return Json(value);
+  }
+
+  void SkipSpace() {
+    while (pos_ < text_.size() && std::isspace(text_[pos_])) {
+      pos_++;
+    }
+  }
+
+  bool Accept(const char* token) {
+    auto len = std::char_traits<char>::length(token);
+    if (text_.compare(pos_, len, token) != 0) {
+      return false;
+    }
+    pos_ += len;
+    return true;
+  }
+
+  [[noreturn]] void Fail(const std::string& msg) {
+    throw std::runtime_error("Bad JSON at offset " + std::to_string(pos_) +
+                             ": " + msg);
+  }
+
+  const std::string& text_;
+  size_t pos_ = 0;
+};
+
+Json Json::Array() {
+  Json json;
+  json.type_ = Type::kArray;
+  return json;
+}
+
+Json Json::Object() {
+  Json json;
+  json.type_ = Type::kObject;
+  return json;
+}
+
+Json Json::Hex(uint64_t value) {
+  char buf[32];
+  std::snprintf(buf, sizeof(buf), "0x%llx",
+                static_cast<unsigned long long>(value));
+  return Json(std::string(buf));
+}
+
+Json Json::Parse(const std::string& text) {
+  return JsonParser{text}.ParseDocument();
+}
+
+void Json::Push(Json value) {
+  type_ = Type::kArray;
+  items_.push_back(std::move(value));
+}
+
+Json& Json::operator[](const std::string& key) {
+  type_ = Type::kObject;
+  for (auto& [k, v] : members_) {
+    if (k == key) {
+      return v;
+    }
+  }
+  members_.emplace_back(key, Json());
+  return members_.back().second;
+}
+
+const Json* Json::Find(const std::string& key) const {
+  for (const auto& [k, v] : members_) {
+    if (k == key) {
+      return &v;
+    }
+  }
+  return nullptr;
+}
+
+std::string Json::Dump() const {
+  std::string out;
+  Dump(&out);
+  return out;
+}
+
+void Json::Dump(std::string* out) const {
+  switch (type_) {
+    case Type::kNull:
+      *out += "null";
+      break;
+    case Type::kBool:
+      *out += bool_ ? "true" : "false";
+      break;
+    case Type::kNumber: {
+      char buf[32];
+      if (std::isfinite(number_) && number_ == std::floor(number_) &&
+          std::fabs(number_) < 1e18) {
+        std::snprintf(buf, sizeof(buf), "%lld",
+                      static_cast<long long>(number_));
+      } else if (std::isfinite(number_)) {
+        std::snprintf(buf, sizeof(buf), "%.17g", number_);
+      } else {
+        std::snprintf(buf, sizeof(buf), "null");
+      }
+      *out += buf;
+      break;
+    }
+    case Type::kString:
+      *out += JsonQuote(string_);
+      break;
+    case Type::kArray:
+      *out += '[';
+      for (size_t i = 0; i < items_.size(); i++) {
+        if (i != 0) {
+          *out += ',';
+        }
+        items_[i].Dump(out);
+      }
+      *out += ']';
+      break;
+    case Type::kObject:
+      *out += '{';
+      for (size_t i = 0; i < members_.size(); i++) {
+        if (i != 0) {
+          *out += ',';
+        }
+        *out += JsonQuote(members_[i].first);
+        *out += ':';
+        members_[i].second.Dump(out);
+      }
+      *out += '}';
+      break;
+  }
+}
+
+std::string JsonQuote(const std::string& s) {
+  std::string quoted = "\"";
+  for (unsigned char c : s) {
+    switch (c) {
+      case '"':
+        quoted += "\\\"";
+        break;
+      case '\\':
+        quoted += "\\\\";
+        break;
+      case '\n':
+        quoted += "\\n";
+        break;
+      case '\t':
+        quoted += "\\t";
+        break;
+      case '\r':
+        quoted += "\\r";
+        break;
+      default:
+        if (c < 0x20) {
+          char buf[8];
+          std::snprintf(buf, sizeof(buf), "\\u%04x", c);
+          quoted += buf;
+        } else {
+          quoted += static_cast<char>(c);
+        }
+    }
+  }
+  return quoted + "\"";
+}
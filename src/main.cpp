@@ -1,8 +1,11 @@
+#include <fcntl.h>
 #include <sys/personality.h>
 #include <sys/ptrace.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
+#include <array>
+#include <climits>
 #include <iostream>
 
 #include "debugger.h"
@@ -16,13 +19,57 @@ void fail(const std::string& msg) {
 }
 
 int main(int argc, char* argv[]) {
+  // --server <socket> takes commands from a socket instead of the terminal
+  std::string server_socket;
+  if (argc >= 3 && std::string(argv[1]) == "--server") {
+    server_socket = argv[2];
+    argc -= 2;
+    argv += 2;
+  }
   if (argc < 2) {
-    cerr << "Please provide program to debug" << endl;
+    cerr << "Please provide program to debug, or -p <pid> to attach" << endl;
     return 1;
   }
+  auto run = [&server_socket](Debugger& debugger) {
+    if (server_socket.empty()) {
+      debugger.StartRepl();
+      return;
+    }
+    try {
+      debugger.StartServer(server_socket);
+    } catch (const std::exception& e) {
+      fail(e.what());
+    }
+  };
 
   cout << "***** DB v0.01 *****" << endl;
 
+  if (std::string(argv[1]) == "-p") {
+    if (argc < 3) {
+      fail("-p needs a pid");
+    }
+    auto pid = std::stoi(argv[2]);
+    auto exe = "/proc/" + std::to_string(pid) + "/exe";
+    std::array<char, PATH_MAX> binary{};
+    if (readlink(exe.c_str(), binary.data(), binary.size() - 1) < 0) {
+      fail("No process " + std::to_string(pid));
+    }
+    Debugger my_debugger(binary.data());
+    try {
+      my_debugger.Attach(pid);
+    } catch (const std::exception& e) {
+      fail(e.what());
+    }
+    run(my_debugger);
+    return 0;
+  }
+
+  // The child waits on this pipe until the parent has seized it
+  int go[2];
+  if (pipe2(go, O_CLOEXEC) != 0) {
+    fail("pipe");
+  }
+
   auto pid = fork();
   // and then there were two...
 
@@ -30,23 +77,33 @@ int main(int argc, char* argv[]) {
     // Disable ASLR in child so we can give addresses
     personality(ADDR_NO_RANDOMIZE);
 
-    // Let the child be examinable and controllable by the parent
-    auto ret = ptrace(PTRACE_TRACEME, 0, nullptr, nullptr);
-    if (ret != 0) {
-      fail("ptrace");
+    close(go[1]);
+    char c;
+    if (read(go[0], &c, 1) < 0) {
+      fail("read");
     }
 
     // Execute!!
     execv(argv[1], &argv[1]);
     fail("exec");
   } else {
+    // Seize rather than PTRACE_TRACEME so threads can be stopped with
+    // PTRACE_INTERRUPT, and follow every thread the debuggee creates
+    auto ret = ptrace(PTRACE_SEIZE, pid, nullptr, kPtraceOptions);
+    if (ret != 0) {
+      fail("ptrace");
+    }
+    close(go[0]);
+    close(go[1]);
+
     int status;
     waitpid(pid, &status, 0);
-    if (WIFEXITED(status)) {
+    if (WIFEXITED(status) ||
+        status >> 8 != (SIGTRAP | (PTRACE_EVENT_EXEC << 8))) {
       fail("Debugee terminated");
     }
     // Instantiate debugger and observe & control child
     Debugger my_debugger(argv[1], pid);
-    my_debugger.StartRepl();
+    run(my_debugger);
   }
 }
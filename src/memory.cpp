@@ -0,0 +1,109 @@
+#include "memory.h"
+
+#include <fcntl.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+#include <stdexcept>
+#include <string>
+
+#include "stats.h"
+
+Memory::~Memory() {
+  if (mem_fd_ >= 0) {
+    close(mem_fd_);
+  }
+}
+
+void Memory::SetPid(pid_t pid) {
+  if (mem_fd_ >= 0) {
+    close(mem_fd_);
+    mem_fd_ = -1;
+  }
+  pid_ = pid;
+}
+
+int Memory::MemFd() {
+  if (mem_fd_ < 0) {
+    auto path = "/proc/" + std::to_string(pid_) + "/mem";
+    mem_fd_ = open(path.c_str(), O_RDWR | O_CLOEXEC);
+    if (mem_fd_ < 0) {
+      throw std::runtime_error("Cannot open " + path);
+    }
+  }
+  return mem_fd_;
+}
+
+void Memory::Read(uint64_t addr, void* buf, size_t len) {
+  OpTimer timer{StatOp::kMemory};
+  auto* out = static_cast<uint8_t*>(buf);
+  size_t done = 0;
+  // process_vm_readv stops at the first page it cannot access, pick up from
+  // there through /proc/pid/mem which can also see unreadable mappings.
+  while (done < len) {
+    iovec local{out + done, len - done};
+    iovec remote{reinterpret_cast<void*>(addr + done), len - done};
+    ++memory_syscall_count;
+    auto n = process_vm_readv(pid_, &local, 1, &remote, 1, 0);
+    if (n <= 0) {
+      ++memory_syscall_count;
+      n = pread(MemFd(), out + done, len - done, addr + done);
+      if (n <= 0) {
+        throw std::runtime_error("Cannot read tracee memory");
+      }
+    }
+    done += n;
+  }
+}
+
+std::vector<uint8_t> Memory::Read(uint64_t addr, size_t len) {
+  std::vector<uint8_t> buf(len);
+  Read(addr, buf.data(), len);
+  return buf;
+}
+
+void Memory::Write(uint64_t addr, const void* buf, size_t len) {
+  OpTimer timer{StatOp::kMemory};
+  const auto* in = static_cast<const uint8_t*>(buf);
+  size_t done = 0;
+  // Text pages are mapped read-only and refuse process_vm_writev, but the
+  // kernel lets a tracer write them through /proc/pid/mem.
+  while (done < len) {
+    iovec local{const_cast<uint8_t*>(in + done), len - done};
+    iovec remote{reinterpret_cast<void*>(addr + done), len - done};
+    ++memory_syscall_count;
+    auto n = process_vm_writev(pid_, &local, 1, &remote, 1, 0);
+    if (n <= 0) {
+      ++memory_syscall_count;
+      n = pwrite(MemFd(), in + done, len - done, addr + done);
+      if (n <= 0) {
+        throw std::runtime_error("Cannot write tracee memory");
+      }
+    }
+    done += n;
+  }
+}
+
+void Memory::WriteText(uint64_t addr, const void* buf, size_t len) {
+  OpTimer timer{StatOp::kMemory};
+  const auto* in = static_cast<const uint8_t*>(buf);
+  size_t done = 0;
+  while (done < len) {
+    ++memory_syscall_count;
+    auto n = pwrite(MemFd(), in + done, len - done, addr + done);
+    if (n <= 0) {
+      throw std::runtime_error("Cannot write tracee memory");
+    }
+    done += n;
+  }
+}
+
+uint64_t Memory::ReadWord(uint64_t addr) {
+  uint64_t value = 0;
+  Read(addr, &value, sizeof(value));
+  return value;
+}
+
+void Memory::WriteWord(uint64_t addr, uint64_t value) {
+  Write(addr, &value, sizeof(value));
+}
@@ -0,0 +1,306 @@
+#include "pc_index.h"
+
+#include <algorithm>
+
+#include "stats.h"
+
+PCIndex::~PCIndex() {
+  // Stop handing out shards, the workers finish the one they are on
+  next_cu_ = shards_.size();
+  for (auto& worker : workers_) {
+    worker.join();
+  }
+}
+
+void PCIndex::Build(const dwarf::dwarf& dw, unsigned threads) {
+  dwarf_ = &dw;
+  // libelfin loads sections and abbreviation tables on first use without
+  // any locking, so do all of that here before the workers start.
+  for (auto type : {dwarf::section_type::line, dwarf::section_type::ranges,
+                    dwarf::section_type::str}) {
+    try {
+      dw.get_section(type);
+    } catch (const dwarf::format_error&) {
+      // Not present in this binary
+    }
+  }
+
+  const auto& cus = dw.compilation_units();
+  shards_.resize(cus.size());
+  states_ = std::vector<std::atomic<uint8_t>>(cus.size());
+  for (uint32_t cu = 0; cu < cus.size(); cu++) {
+    const auto& root = cus[cu].root();
+    if (root.has(dwarf::DW_AT::low_pc) || root.has(dwarf::DW_AT::ranges)) {
+      for (const auto& range : dwarf::die_pc_range(root)) {
+        cu_ranges_.push_back(CuRange{range.low, range.high, cu});
+      }
+    } else {
+      unranged_cus_.push_back(cu);
+    }
+  }
+  SortCuRanges();
+
+  if (threads == 0) {
+    threads = std::max(1U, std::thread::hardware_concurrency());
+  }
+  threads = std::min<size_t>(threads, cus.size());
+  for (unsigned i = 0; i < threads; i++) {
+    workers_.emplace_back(&PCIndex::Worker, this);
+  }
+}
+
+void PCIndex::Adopt(std::vector<Shard> shards, std::vector<CuRange> cu_ranges,
+                    std::vector<uint32_t> unranged_cus) {
+  shards_ = std::move(shards);
+  states_ = std::vector<std::atomic<uint8_t>>(shards_.size());
+  for (auto& state : states_) {
+    state = kReady;
+  }
+  ready_count_ = shards_.size();
+  cu_ranges_ = std::move(cu_ranges);
+  unranged_cus_ = std::move(unranged_cus);
+  SortCuRanges();
+}
+
+void PCIndex::SortCuRanges() {
+  std::sort(cu_ranges_.begin(), cu_ranges_.end(),
+            [](const CuRange& a, const CuRange& b) { return a.low < b.low; });
+  cu_max_high_.resize(cu_ranges_.size());
+  uint64_t max_high = 0;
+  for (size_t i = 0; i < cu_ranges_.size(); i++) {
+    max_high = std::max(max_high, cu_ranges_[i].high);
+    cu_max_high_[i] = max_high;
+  }
+}
+
+void PCIndex::Worker() {
+  for (uint32_t cu; (cu = next_cu_++) < shards_.size();) {
+    TryBuild(cu);
+  }
+}
+
+bool PCIndex::TryBuild(uint32_t cu) const {
+  uint8_t expected = kQueued;
+  if (!states_[cu].compare_exchange_strong(expected, kBuilding)) {
+    return false;
+  }
+  const auto& unit = dwarf_->compilation_units()[cu];
+  ShardBuilder builder{&shards_[cu], cu};
+  try {
+    builder.IndexDie(unit.root(), 0);
+    builder.IndexLineTable(unit.get_line_table());
+  } catch (const std::exception&) {
+    // Keep whatever was indexed before the malformed entry
+  }
+  builder.Finish();
+  {
+    std::lock_guard<std::mutex> lock{mutex_};
+    states_[cu] = kReady;
+    ready_count_++;
+  }
+  ready_.notify_all();
+  return true;
+}
+
+const PCIndex::Shard& PCIndex::GetShard(uint32_t cu) const {
+  if (states_[cu] != kReady && !TryBuild(cu)) {
+    std::unique_lock<std::mutex> lock{mutex_};
+    ready_.wait(lock, [this, cu] { return states_[cu] == kReady; });
+  }
+  return shards_[cu];
+}
+
+void PCIndex::Wait() const {
+  for (uint32_t cu = 0; cu < shards_.size(); cu++) {
+    GetShard(cu);
+  }
+}
+
+size_t PCIndex::CuCount() const { return shards_.size(); }
+
+size_t PCIndex::ReadyCount() const { return ready_count_; }
+
+std::vector<uint32_t> PCIndex::CusFor(uint64_t low, uint64_t high) const {
+  std::vector<uint32_t> cus;
+  auto it = std::upper_bound(
+      cu_ranges_.begin(), cu_ranges_.end(), high - 1,
+      [](uint64_t addr, const CuRange& r) { return addr < r.low; });
+  for (auto i = it - cu_ranges_.begin(); i-- > 0 && cu_max_high_[i] > low;) {
+    if (cu_ranges_[i].high > low) {
+      cus.push_back(cu_ranges_[i].cu);
+    }
+  }
+  std::sort(cus.begin(), cus.end());
+  cus.erase(std::unique(cus.begin(), cus.end()), cus.end());
+  cus.insert(cus.end(), unranged_cus_.begin(), unranged_cus_.end());
+  return cus;
+}
+
+std::string DieName(const dwarf::die& die) {
+  if (die.has(dwarf::DW_AT::name)) {
+    return dwarf::at_name(die);
+  }
+  if (die.has(dwarf::DW_AT::abstract_origin)) {
+    return DieName(dwarf::at_abstract_origin(die));
+  }
+  if (die.has(dwarf::DW_AT::specification)) {
+    return DieName(dwarf::at_specification(die));
+  }
+  return "??";
+}
+
+dwarf::die FindDieByOffset(const dwarf::die& root, uint64_t offset) {
+  if (root.get_section_offset() == offset) {
+    return root;
+  }
+  // Children are laid out in offset order, so the target can only be in the
+  // subtree of the last child that starts before it.
+  dwarf::die candidate;
+  for (const auto& child : root) {
+    if (child.get_section_offset() == offset) {
+      return child;
+    }
+    if (child.get_section_offset() > offset) {
+      break;
+    }
+    candidate = child;
+  }
+  if (!candidate.valid()) {
+    throw std::out_of_range{"Cannot find die"};
+  }
+  return FindDieByOffset(candidate, offset);
+}
+
+void PCIndex::ShardBuilder::IndexDie(const dwarf::die& die, uint32_t depth) {
+  for (const auto& child : die) {
+    auto child_depth = depth;
+    if (child.tag == dwarf::DW_TAG::subprogram ||
+        child.tag == dwarf::DW_TAG::inlined_subroutine) {
+      bool inlined = child.tag == dwarf::DW_TAG::inlined_subroutine;
+      if (child.has(dwarf::DW_AT::low_pc) || child.has(dwarf::DW_AT::ranges)) {
+        child_depth = inlined ? depth + 1 : 0;
+        auto name = Intern(DieName(child));
+        auto ranges = dwarf::die_pc_range(child);
+        auto entry = child.has(dwarf::DW_AT::low_pc)
+                         ? dwarf::at_low_pc(child)
+                         : (*ranges.begin()).low;
+        for (const auto& range : ranges) {
+          shard_->functions.push_back(Function{range.low, range.high, entry,
+                                               child.get_section_offset(), name,
+                                               cu_, child_depth});
+        }
+      }
+    }
+    IndexDie(child, child_depth);
+  }
+}
+
+void PCIndex::ShardBuilder::IndexLineTable(const dwarf::line_table& lt) {
+  for (auto it = lt.begin(); it != lt.end(); ++it) {
+    auto next = it;
+    ++next;
+    // Rows sharing an address with their successor cover no bytes, the
+    // last of them is the one that describes the address.
+    if (it->end_sequence || next == lt.end() ||
+        next->address <= it->address) {
+      continue;
+    }
+    shard_->lines.push_back(Line{it->address, next->address,
+                                 Intern(it->file->path), it->line, cu_,
+                                 it->is_stmt});
+  }
+}
+
+uint32_t PCIndex::ShardBuilder::Intern(const std::string& s) {
+  auto& strings = shard_->strings;
+  auto [it, inserted] =
+      interned_.emplace(s, static_cast<uint32_t>(strings.size()));
+  if (inserted) {
+    strings.append(s);
+    strings.push_back('\0');
+  }
+  return it->second;
+}
+
+void PCIndex::ShardBuilder::Finish() {
+  auto& functions = shard_->functions;
+  auto& lines = shard_->lines;
+  std::stable_sort(
+      functions.begin(), functions.end(),
+      [](const Function& a, const Function& b) { return a.low < b.low; });
+  std::stable_sort(
+      lines.begin(), lines.end(),
+      [](const Line& a, const Line& b) { return a.address < b.address; });
+
+  shard_->max_high.resize(functions.size());
+  uint64_t max_high = 0;
+  for (size_t i = 0; i < functions.size(); i++) {
+    max_high = std::max(max_high, functions[i].high);
+    shard_->max_high[i] = max_high;
+  }
+}
+
+const PCIndex::Function* PCIndex::FindFunction(uint64_t pc,
+                                               bool include_inlined) const {
+  OpTimer timer{StatOp::kDwarf};
+  const Function* best = nullptr;
+  for (auto cu : CusFor(pc, pc + 1)) {
+    const auto& shard = GetShard(cu);
+    const auto& functions = shard.functions;
+    auto it = std::upper_bound(
+        functions.begin(), functions.end(), pc,
+        [](uint64_t pc, const Function& f) { return pc < f.low; });
+
+    for (auto i = it - functions.begin(); i-- > 0 && shard.max_high[i] > pc;) {
+      const auto& f = functions[i];
+      if (pc >= f.high || (!include_inlined && f.depth != 0)) {
+        continue;
+      }
+      if (best == nullptr || f.depth > best->depth ||
+          (f.depth == best->depth &&
+           f.high - f.low < best->high - best->low)) {
+        best = &f;
+      }
+    }
+  }
+  return best;
+}
+
+const PCIndex::Line* PCIndex::FindLine(uint64_t pc) const {
+  OpTimer timer{StatOp::kDwarf};
+  for (auto cu : CusFor(pc, pc + 1)) {
+    const auto& lines = GetShard(cu).lines;
+    auto it = std::upper_bound(
+        lines.begin(), lines.end(), pc,
+        [](uint64_t pc, const Line& l) { return pc < l.address; });
+    if (it != lines.begin() && pc < (it - 1)->end) {
+      return &*(it - 1);
+    }
+  }
+  return nullptr;
+}
+
+std::span<const PCIndex::Line> PCIndex::LinesInRange(uint64_t low,
+                                                     uint64_t high) const {
+  OpTimer timer{StatOp::kDwarf};
+  auto by_address = [](const Line& l, uint64_t addr) {
+    return l.address < addr;
+  };
+  for (auto cu : CusFor(low, low + 1)) {
+    const auto& lines = GetShard(cu).lines;
+    auto first = std::lower_bound(lines.begin(), lines.end(), low, by_address);
+    auto last = std::lower_bound(first, lines.end(), high, by_address);
+    if (first != last) {
+      return {first, last};
+    }
+  }
+  return {};
+}
+
+std::string_view PCIndex::Name(const Function& f) const {
+  return shards_[f.cu].strings.c_str() + f.name;
+}
+
+std::string_view PCIndex::File(const Line& l) const {
+  return shards_[l.cu].strings.c_str() + l.file;
+}
@@ -0,0 +1,515 @@
+#include "record_log.h"
+
+#include <cpuid.h>
+#include <linux/futex.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+#include <algorithm>
+#include <stdexcept>
+
+#include "ptrace_wrapper.h"
+
+namespace {
+
+// Most a read syscall's buffer is logged for
+const auto kMaxSyscallBuffer = 1 << 20;
+
+// Registers in mask bit order after bit 0, which flags memory changes.
+// Those most instructions change come first so the mask fits in a byte.
+const Register::Reg kLogOrder[] = {
+    Register::rip,     Register::eflags,  Register::rsp,  Register::rax,
+    Register::rdx,     Register::rcx,     Register::rsi,  Register::rdi,
+    Register::rbp,     Register::rbx,     Register::r8,   Register::r9,
+    Register::r10,     Register::r11,     Register::r12,  Register::r13,
+    Register::r14,     Register::r15,     Register::orig_rax,
+    Register::fs_base, Register::gs_base, Register::cs,   Register::ss,
+    Register::ds,      Register::es,      Register::fs,   Register::gs};
+
+// General purpose registers by their number in instruction encodings
+const Register::Reg kEncodedRegisters[] = {
+    Register::rax, Register::rcx, Register::rdx, Register::rbx,
+    Register::rsp, Register::rbp, Register::rsi, Register::rdi,
+    Register::r8,  Register::r9,  Register::r10, Register::r11,
+    Register::r12, Register::r13, Register::r14, Register::r15};
+
+uint64_t& RegisterRef(user_regs_struct& regs, Register::Reg r) {
+  return *(reinterpret_cast<uint64_t*>(&regs) + static_cast<size_t>(r));
+}
+
+uint64_t RegisterValue(const user_regs_struct& regs, Register::Reg r) {
+  return *(reinterpret_cast<const uint64_t*>(&regs) + static_cast<size_t>(r));
+}
+
+void PutVarint(std::vector<uint8_t>* out, uint64_t value) {
+  while (value >= 0x80) {
+    out->push_back(static_cast<uint8_t>(value | 0x80));
+    value >>= 7;
+  }
+  out->push_back(static_cast<uint8_t>(value));
+}
+
+uint64_t GetVarint(const std::vector<uint8_t>& in, size_t* pos) {
+  uint64_t value = 0;
+  for (int shift = 0;; shift += 7) {
+    auto byte = in[(*pos)++];
+    value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0) {
+      return value;
+    }
+  }
+}
+
+size_t VarintSize(uint64_t value) {
+  size_t size = 1;
+  while (value >= 0x80) {
+    value >>= 7;
+    size++;
+  }
+  return size;
+}
+
+uint64_t ZigZag(uint64_t delta) {
+  auto v = static_cast<int64_t>(delta);
+  return (static_cast<uint64_t>(v) << 1) ^ static_cast<uint64_t>(v >> 63);
+}
+
+uint64_t UnZigZag(uint64_t v) { return (v >> 1) ^ (0 - (v & 1)); }
+
+uint64_t EffectiveAddress(const Instruction& insn,
+                          const user_regs_struct& regs) {
+  uint64_t addr = insn.disp;
+  auto rex_b = (insn.rex & 1) << 3;
+  auto rex_x = (insn.rex & 2) << 2;
+  if (insn.rip_relative) {
+    addr += regs.rip + insn.length;
+  } else if (insn.has_sib) {
+    auto base = insn.sib & 7;
+    auto index = ((insn.sib >> 3) & 7) | rex_x;
+    if (base != 5 || insn.ModrmMod() != 0) {
+      addr += RegisterValue(regs, kEncodedRegisters[base | rex_b]);
+    }
+    if (index != 4) {
+      addr += RegisterValue(regs, kEncodedRegisters[index]) << (insn.sib >> 6);
+    }
+  } else {
+    addr += RegisterValue(regs, kEncodedRegisters[insn.ModrmRm() | rex_b]);
+  }
+  if (insn.address_size_prefix) {
+    addr &= 0xffffffff;
+  }
+  if (insn.segment_prefix == 0x64) {
+    addr += regs.fs_base;
+  } else if (insn.segment_prefix == 0x65) {
+    addr += regs.gs_base;
+  }
+  return addr;
+}
+
+// Largest XSAVE area this CPU writes, standard or compacted, with every
+// feature it supports enabled
+size_t XsaveAreaSize() {
+  static const size_t size = [] {
+    unsigned eax, ebx, ecx, edx;
+    if (!__get_cpuid_count(0xd, 0, &eax, &ebx, &ecx, &edx)) {
+      return size_t{512};  // fxsave only
+    }
+    size_t largest = ecx;
+    // Sub-leaf 1 has the compacted size including supervisor state
+    if (__get_cpuid_count(0xd, 1, &eax, &ebx, &ecx, &edx)) {
+      largest = std::max<size_t>(largest, ebx);
+    }
+    return largest;
+  }();
+  return size;
+}
+
+// Upper bound on what the ModRM operand of insn stores
+size_t OperandBytes(const Instruction& insn) {
+  if (insn.vex) {
+    return 64;  // a zmm register
+  }
+  if (insn.opcode_map == 0) {
+    // x87 fsave stores 108 bytes
+    return insn.opcode >= 0xd8 && insn.opcode <= 0xdf ? 108 : 8;
+  }
+  if (insn.opcode_map == 1 && insn.opcode == 0xae) {
+    switch (insn.ModrmReg()) {
+      case 0:
+        return 512;  // fxsave
+      case 4:
+      case 6:
+        return XsaveAreaSize();  // xsave, xsaveopt
+    }
+  }
+  if (insn.opcode_map == 1 && insn.opcode == 0xc7 && insn.ModrmReg() >= 3 &&
+      insn.ModrmReg() <= 5) {
+    return XsaveAreaSize();  // xrstors, xsavec, xsaves
+  }
+  return 16;
+}
+
+// Memory the system call about to be made with regs writes. False if it
+// may write memory not covered here.
+bool SyscallRanges(const user_regs_struct& regs,
+                   std::vector<std::pair<uint64_t, size_t>>* ranges) {
+  auto buffer = [](uint64_t len) {
+    return std::min<uint64_t>(len, kMaxSyscallBuffer);
+  };
+  // Optional pointer arguments
+  auto add = [ranges](uint64_t addr, size_t len) {
+    if (addr != 0) {
+      ranges->emplace_back(addr, len);
+    }
+  };
+  switch (regs.rax) {
+    case SYS_read:
+    case SYS_pread64:
+    case SYS_getdents64:
+      add(regs.rsi, buffer(regs.rdx));
+      return true;
+    case SYS_recvfrom:
+      add(regs.rsi, buffer(regs.rdx));
+      add(regs.r8, sizeof(sockaddr_storage));
+      add(regs.r9, sizeof(socklen_t));
+      return true;
+    case SYS_fstat:
+    case SYS_stat:
+    case SYS_lstat:
+      add(regs.rsi, sizeof(struct stat));
+      return true;
+    case SYS_newfstatat:
+      add(regs.rdx, sizeof(struct stat));
+      return true;
+    case SYS_clock_gettime:
+    case SYS_clock_getres:
+    case SYS_nanosleep:
+      add(regs.rsi, sizeof(timespec));
+      return true;
+    case SYS_clock_nanosleep:
+      add(regs.r10, sizeof(timespec));
+      return true;
+    case SYS_gettimeofday:
+      add(regs.rdi, sizeof(timeval));
+      add(regs.rsi, sizeof(struct timezone));
+      return true;
+    case SYS_futex:
+      // The other operations, such as FUTEX_WAKE_OP, change futex words
+      switch (regs.rsi & FUTEX_CMD_MASK) {
+        case FUTEX_WAIT:
+        case FUTEX_WAKE:
+        case FUTEX_WAIT_BITSET:
+        case FUTEX_WAKE_BITSET:
+          return true;
+      }
+      return false;
+    // Write no memory of the process
+    case SYS_write:
+    case SYS_pwrite64:
+    case SYS_writev:
+    case SYS_sendto:
+    case SYS_open:
+    case SYS_openat:
+    case SYS_close:
+    case SYS_lseek:
+    case SYS_access:
+    case SYS_dup:
+    case SYS_dup2:
+    case SYS_dup3:
+    case SYS_fsync:
+    case SYS_fdatasync:
+    case SYS_unlink:
+    case SYS_mkdir:
+    case SYS_rmdir:
+    case SYS_rename:
+    case SYS_chdir:
+    case SYS_umask:
+    case SYS_mmap:
+    case SYS_mprotect:
+    case SYS_munmap:
+    case SYS_madvise:
+    case SYS_brk:
+    case SYS_sched_yield:
+    case SYS_getpid:
+    case SYS_gettid:
+    case SYS_getppid:
+    case SYS_getuid:
+    case SYS_geteuid:
+    case SYS_getgid:
+    case SYS_getegid:
+    case SYS_kill:
+    case SYS_tgkill:
+    case SYS_exit:
+    case SYS_exit_group:
+      return true;
+    default:
+      return false;
+  }
+}
+
+bool IsSyscall(const Instruction& insn) {
+  return !insn.vex && ((insn.opcode_map == 1 && insn.opcode == 0x05) ||
+                       (insn.opcode_map == 0 && insn.opcode == 0xcd));
+}
+
+}  // namespace
+
+std::vector<std::pair<uint64_t, size_t>> WrittenRanges(
+    const Instruction& insn, const user_regs_struct& regs) {
+  std::vector<std::pair<uint64_t, size_t>> ranges;
+  if (insn.has_modrm && insn.ModrmMod() != 3) {
+    ranges.emplace_back(EffectiveAddress(insn, regs), OperandBytes(insn));
+  }
+  auto legacy = !insn.vex && insn.opcode_map == 0;
+  auto op = insn.opcode;
+  if (insn.kind == Instruction::Kind::kCall ||
+      insn.kind == Instruction::Kind::kIndirectCall ||
+      (legacy && ((op >= 0x50 && op <= 0x57) || op == 0x68 || op == 0x6a ||
+                  op == 0x9c || (op == 0xff && insn.ModrmReg() == 6)))) {
+    ranges.emplace_back(regs.rsp - 8, 8);
+  } else if (legacy && op == 0xc8) {
+    // enter pushes rbp and up to 31 frame pointers
+    ranges.emplace_back(regs.rsp - 32 * 8, 32 * 8);
+  } else if (legacy && (op == 0xa4 || op == 0xa5 || op == 0xaa || op == 0xab)) {
+    // movs and stos, a step does one element even with a rep prefix
+    ranges.emplace_back(regs.rdi, 8);
+  } else if (!insn.vex && insn.opcode_map == 1 && op == 0x05) {
+    SyscallRanges(regs, &ranges);
+  }
+  return ranges;
+}
+
+bool WritesModelled(const Instruction& insn, const user_regs_struct& regs) {
+  if (!IsSyscall(insn)) {
+    return true;
+  }
+  // int 0x80 uses the 32 bit system call numbers
+  std::vector<std::pair<uint64_t, size_t>> ranges;
+  return insn.opcode == 0x05 && SyscallRanges(regs, &ranges);
+}
+
+std::vector<std::vector<uint8_t>> ReadRanges(
+    Memory* memory, const std::vector<std::pair<uint64_t, size_t>>& ranges) {
+  std::vector<std::vector<uint8_t>> contents;
+  for (const auto& [addr, len] : ranges) {
+    auto& bytes = contents.emplace_back(len);
+    try {
+      memory->Read(addr, bytes.data(), len);
+    } catch (std::exception&) {
+      // Only the start of a generous range may be mapped
+      bytes.resize(std::min<size_t>(len, kPageSize - addr % kPageSize));
+      try {
+        memory->Read(addr, bytes.data(), bytes.size());
+      } catch (std::exception&) {
+        bytes.clear();
+      }
+    }
+  }
+  return contents;
+}
+
+std::vector<MemoryChange> DiffRanges(
+    const std::vector<std::pair<uint64_t, size_t>>& ranges,
+    const std::vector<std::vector<uint8_t>>& before,
+    const std::vector<std::vector<uint8_t>>& after) {
+  std::vector<MemoryChange> changes;
+  for (size_t i = 0; i < ranges.size(); i++) {
+    auto len = std::min(before[i].size(), after[i].size());
+    size_t first = 0;
+    while (first < len && before[i][first] == after[i][first]) {
+      first++;
+    }
+    while (len > first && before[i][len - 1] == after[i][len - 1]) {
+      len--;
+    }
+    if (first == len) {
+      continue;
+    }
+    MemoryChange change{ranges[i].first + first, {}};
+    for (auto j = first; j < len; j++) {
+      change.delta.push_back(before[i][j] ^ after[i][j]);
+    }
+    changes.push_back(std::move(change));
+  }
+  return changes;
+}
+
+void RecordLog::Start(pid_t tid, const user_regs_struct& regs) {
+  Clear();
+  tid_ = tid;
+  regs_ = regs;
+}
+
+void RecordLog::Clear() {
+  tid_ = 0;
+  buffer_.clear();
+  buffer_.shrink_to_fit();
+  size_ = position_ = offset_ = 0;
+  overlay_.clear();
+}
+
+void RecordLog::Append(const user_regs_struct& regs,
+                       const std::vector<MemoryChange>& changes) {
+  if (Replaying()) {
+    throw std::logic_error("Appending to a record log being replayed");
+  }
+  auto start = buffer_.size();
+  uint64_t mask = changes.empty() ? 0 : 1;
+  for (size_t i = 0; i < std::size(kLogOrder); i++) {
+    auto r = kLogOrder[i];
+    if (RegisterValue(regs, r) != RegisterValue(regs_, r)) {
+      mask |= 2ULL << i;
+    }
+  }
+  PutVarint(&buffer_, mask);
+  for (size_t i = 0; i < std::size(kLogOrder); i++) {
+    if ((mask & (2ULL << i)) != 0) {
+      PutVarint(&buffer_, ZigZag(RegisterValue(regs, kLogOrder[i]) -
+                                 RegisterValue(regs_, kLogOrder[i])));
+    }
+  }
+  if (!changes.empty()) {
+    PutVarint(&buffer_, changes.size());
+    for (const auto& change : changes) {
+      PutVarint(&buffer_, ZigZag(change.addr - regs.rsp));
+      PutVarint(&buffer_, change.delta.size());
+      buffer_.insert(buffer_.end(), change.delta.begin(), change.delta.end());
+    }
+  }
+  // The length, last byte first, so it can be read from the end
+  std::vector<uint8_t> length;
+  PutVarint(&length, buffer_.size() - start);
+  buffer_.insert(buffer_.end(), length.rbegin(), length.rend());
+
+  regs_ = regs;
+  position_ = ++size_;
+  offset_ = buffer_.size();
+}
+
+bool RecordLog::Active() const { return tid_ != 0; }
+
+pid_t RecordLog::Tid() const { return tid_; }
+
+bool RecordLog::Replaying() const { return position_ != size_; }
+
+size_t RecordLog::Size() const { return size_; }
+
+size_t RecordLog::Position() const { return position_; }
+
+size_t RecordLog::Bytes() const { return buffer_.size(); }
+
+bool RecordLog::StepBack() {
+  if (position_ == 0) {
+    return false;
+  }
+  uint64_t len = 0;
+  auto end = offset_;
+  for (int shift = 0;; shift += 7) {
+    auto byte = buffer_[--end];
+    len |= static_cast<uint64_t>(byte & 0x7f) << shift;
+    if ((byte & 0x80) == 0) {
+      break;
+    }
+  }
+  offset_ = end - len;
+  Apply(offset_, -1);
+  position_--;
+  return true;
+}
+
+bool RecordLog::StepForward() {
+  if (position_ == size_) {
+    return false;
+  }
+  auto end = Apply(offset_, 1);
+  offset_ = end + VarintSize(end - offset_);
+  if (++position_ == size_) {
+    // Back at the live state
+    overlay_.clear();
+  }
+  return true;
+}
+
+const user_regs_struct& RecordLog::Registers() const { return regs_; }
+
+void RecordLog::Rewind(uint64_t addr, uint8_t* buf, size_t len) const {
+  for (auto it = overlay_.lower_bound(addr);
+       it != overlay_.end() && it->first < addr + len; ++it) {
+    buf[it->first - addr] = it->second;
+  }
+}
+
+size_t RecordLog::Apply(size_t pos, int direction) {
+  auto mask = GetVarint(buffer_, &pos);
+  // Memory changes are relative to rsp after the instruction
+  auto rsp = regs_.rsp;
+  for (size_t i = 0; i < std::size(kLogOrder); i++) {
+    if ((mask & (2ULL << i)) != 0) {
+      auto delta = UnZigZag(GetVarint(buffer_, &pos));
+      RegisterRef(regs_, kLogOrder[i]) += direction > 0 ? delta : 0 - delta;
+    }
+  }
+  if (direction > 0) {
+    rsp = regs_.rsp;
+  }
+  if ((mask & 1) != 0) {
+    auto count = GetVarint(buffer_, &pos);
+    for (uint64_t i = 0; i < count; i++) {
+      auto addr = rsp + UnZigZag(GetVarint(buffer_, &pos));
+      auto len = GetVarint(buffer_, &pos);
+      ApplyChange(addr, &buffer_[pos], len);
+      pos += len;
+    }
+  }
+  return pos;
+}
+
+void RecordLog::ApplyChange(uint64_t addr, const uint8_t* delta, size_t len) {
+  std::vector<uint8_t> live;
+  for (size_t i = 0; i < len; i++) {
+    auto it = overlay_.find(addr + i);
+    if (it == overlay_.end()) {
+      if (live.empty()) {
+        // Memory unmapped since reads as zeros
+        live.resize(len);
+        try {
+          memory_->Read(addr, live.data(), len);
+        } catch (std::exception&) {
+        }
+      }
+      it = overlay_.emplace(addr + i, live[i]).first;
+    }
+    it->second ^= delta[i];
+  }
+}
+
+int RecordStep(RecordLog* log, TracedThread* thread, Memory* memory,
+               const Instruction& insn) {
+  thread->registers.Flush();
+  auto ranges = WrittenRanges(insn, thread->registers.GetAll());
+  auto before = ReadRanges(memory, ranges);
+  int status = 0;
+  Ptrace(PTRACE_SINGLESTEP, thread->tid, nullptr, 0);
+  Waitpid(thread->tid, &status, __WALL);
+  thread->registers.Invalidate();
+  if (WIFSTOPPED(status) && WSTOPSIG(status) == SIGTRAP && status >> 16 == 0) {
+    log->Append(thread->registers.GetAll(),
+                DiffRanges(ranges, before, ReadRanges(memory, ranges)));
+  }
+  return status;
+}
+
+void ReplayTarget::ReadMemory(uint64_t addr, void* buf, size_t len) {
+  live_.ReadMemory(addr, buf, len);
+  log_->Rewind(addr, static_cast<uint8_t*>(buf), len);
+}
+
+uint64_t ReplayTarget::ReadRegister(pid_t tid, Register::Reg r) {
+  if (log_->Replaying() && tid == log_->Tid()) {
+    return RegisterValue(log_->Registers(), r);
+  }
+  return live_.ReadRegister(tid, r);
+}
@@ -0,0 +1,75 @@
+#include "registers.h"
+
+#include "ptrace_wrapper.h"
+
+namespace Register {
+const std::unordered_map<Reg, std::pair<std::string, int>> register_lookup = {
+    {r15, {"r15", 15}},
+    {r14, {"r14", 14}},
+    {r13, {"r13", 13}},
+    {r12, {"r12", 12}},
+    {rbp, {"rbp", 6}},
+    {rbx, {"rbx", 3}},
+    {r11, {"r11", 11}},
+    {r10, {"r10", 10}},
+    {r9, {"r9", 9}},
+    {r8, {"r8", 8}},
+    {rax, {"rax", 0}},
+    {rcx, {"rcx", 2}},
+    {rdx, {"rdx", 1}},
+    {rsi, {"rsi", 4}},
+    {rdi, {"rdi", 5}},
+    {orig_rax, {"orig_rax", -1}},
+    {rip, {"rip", -1}},
+    {cs, {"cs", 51}},
+    {eflags, {"eflags", 49}},
+    {rsp, {"rsp", 7}},
+    {ss, {"ss", 52}},
+    {fs_base, {"fs_base", 58}},
+    {gs_base, {"gs_base", 59}},
+    {ds, {"ds", 53}},
+    {es, {"es", 50}},
+    {fs, {"fs", 54}},
+    {gs, {"gs", 55}}};
+}  // namespace Register
+
+uint64_t RegisterFile::Get(Register::Reg r) {
+  Fill();
+  return *(reinterpret_cast<uint64_t*>(&regs_) + static_cast<size_t>(r));
+}
+
+const user_regs_struct& RegisterFile::GetAll() {
+  Fill();
+  return regs_;
+}
+
+void RegisterFile::Set(Register::Reg r, uint64_t value) {
+  Fill();
+  *(reinterpret_cast<uint64_t*>(&regs_) + static_cast<size_t>(r)) = value;
+  dirty_ = true;
+}
+
+void RegisterFile::SetAll(const user_regs_struct& regs) {
+  regs_ = regs;
+  valid_ = true;
+  dirty_ = true;
+}
+
+void RegisterFile::Flush() {
+  if (dirty_) {
+    Ptrace(PTRACE_SETREGS, pid_, nullptr, &regs_);
+    dirty_ = false;
+  }
+}
+
+void RegisterFile::Invalidate() {
+  valid_ = false;
+  dirty_ = false;
+}
+
+void RegisterFile::Fill() {
+  if (!valid_) {
+    Ptrace(PTRACE_GETREGS, pid_, nullptr, &regs_);
+    valid_ = true;
+  }
+}
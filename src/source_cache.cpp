@@ -0,0 +1,106 @@
+#include "source_cache.h"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <stdexcept>
+
+#include "stats.h"
+
+SourceFile::SourceFile(const std::string& path) {
+  auto fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    throw std::runtime_error("Cannot open " + path);
+  }
+  struct stat st {};
+  if (fstat(fd, &st) != 0) {
+    close(fd);
+    throw std::runtime_error("Cannot stat " + path);
+  }
+  mtime_ = st.st_mtim;
+  size_ = st.st_size;
+  // mmap refuses empty mappings, an empty file simply has no lines
+  if (size_ != 0) {
+    auto* map = mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED) {
+      close(fd);
+      throw std::runtime_error("Cannot map " + path);
+    }
+    data_ = static_cast<const char*>(map);
+  }
+  close(fd);
+}
+
+SourceFile::~SourceFile() {
+  if (data_ != nullptr) {
+    munmap(const_cast<char*>(data_), size_);
+  }
+}
+
+void SourceFile::IndexLines() {
+  if (indexed_) {
+    return;
+  }
+  indexed_ = true;
+  if (size_ == 0) {
+    return;
+  }
+  line_offsets_.push_back(0);
+  const char* p = data_;
+  const char* end = data_ + size_;
+  while ((p = static_cast<const char*>(std::memchr(p, '\n', end - p))) !=
+         nullptr) {
+    ++p;
+    if (p == end) {
+      break;
+    }
+    line_offsets_.push_back(p - data_);
+  }
+}
+
+unsigned SourceFile::LineCount() {
+  IndexLines();
+  return line_offsets_.size();
+}
+
+std::string_view SourceFile::Line(unsigned n) {
+  IndexLines();
+  if (n == 0 || n > line_offsets_.size()) {
+    return {};
+  }
+  auto begin = line_offsets_[n - 1];
+  auto end = n < line_offsets_.size() ? line_offsets_[n] : size_;
+  std::string_view line{data_ + begin, end - begin};
+  if (!line.empty() && line.back() == '\n') {
+    line.remove_suffix(1);
+  }
+  return line;
+}
+
+const timespec& SourceFile::GetMtime() const { return mtime_; }
+
+SourceFile* SourceCache::Get(const std::string& path) {
+  OpTimer timer{StatOp::kSource};
+  struct stat st {};
+  if (stat(path.c_str(), &st) != 0) {
+    files_.erase(path);
+    return nullptr;
+  }
+  auto& file = files_[path];
+  if (file != nullptr && (file->GetMtime().tv_sec != st.st_mtim.tv_sec ||
+                          file->GetMtime().tv_nsec != st.st_mtim.tv_nsec)) {
+    file.reset();
+  }
+  if (file == nullptr) {
+    try {
+      file = std::make_unique<SourceFile>(path);
+    } catch (const std::runtime_error&) {
+      files_.erase(path);
+      return nullptr;
+    }
+  }
+  return file.get();
+}
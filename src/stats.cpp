@@ -0,0 +1,167 @@
+#include "stats.h"
+
+#include <algorithm>
+#include <bit>
+#include <cmath>
+#include <iomanip>
+#include <sstream>
+
+namespace {
+
+const char* const kOpNames[] = {"ptrace", "waitpid", "memory", "dwarf",
+                                "source"};
+static_assert(std::size(kOpNames) == static_cast<size_t>(StatOp::kCount));
+
+// Where ops made while no command is running are recorded
+const auto kOutsideCommands = "(outside commands)";
+
+std::string FormatNs(uint64_t ns) {
+  std::ostringstream out;
+  out << std::fixed << std::setprecision(1);
+  if (ns < 1000) {
+    out << ns << " ns";
+  } else if (ns < 1000000) {
+    out << ns / 1e3 << " us";
+  } else if (ns < 1000000000) {
+    out << ns / 1e6 << " ms";
+  } else {
+    out << ns / 1e9 << " s";
+  }
+  return out.str();
+}
+
+void PrintHistogram(std::ostream& out, const std::string& name,
+                    const LatencyHistogram& h) {
+  out << "  " << std::left << std::setw(9) << name << std::right
+      << std::setw(8) << h.Count() << std::setw(11) << FormatNs(h.Total())
+      << std::setw(11) << FormatNs(h.Quantile(0.5)) << std::setw(11)
+      << FormatNs(h.Quantile(0.9)) << std::setw(11)
+      << FormatNs(h.Quantile(0.99)) << std::setw(11) << FormatNs(h.Max())
+      << std::endl;
+}
+
+}  // namespace
+
+int LatencyHistogram::BucketIndex(uint64_t ns) {
+  if (ns < kSubBuckets) {
+    return static_cast<int>(ns);
+  }
+  // The top kSubBucketBits + 1 bits pick the bucket
+  auto shift = std::bit_width(ns) - 1 - kSubBucketBits;
+  return (shift + 1) * kSubBuckets +
+         static_cast<int>((ns >> shift) & (kSubBuckets - 1));
+}
+
+uint64_t LatencyHistogram::BucketUpperBound(int index) {
+  if (index < kSubBuckets) {
+    return index;
+  }
+  auto shift = index / kSubBuckets - 1;
+  auto low = static_cast<uint64_t>(kSubBuckets + index % kSubBuckets)
+             << shift;
+  return low + (1ULL << shift) - 1;
+}
+
+void LatencyHistogram::Record(uint64_t ns) {
+  counts_[BucketIndex(ns)]++;
+  count_++;
+  total_ += ns;
+  max_ = std::max(max_, ns);
+}
+
+uint64_t LatencyHistogram::Quantile(double q) const {
+  if (count_ == 0) {
+    return 0;
+  }
+  auto rank = std::max<uint64_t>(1, std::ceil(q * count_));
+  uint64_t seen = 0;
+  for (size_t i = 0; i < counts_.size(); i++) {
+    seen += counts_[i];
+    if (seen >= rank) {
+      return std::min(BucketUpperBound(i), max_);
+    }
+  }
+  return max_;
+}
+
+Json LatencyHistogram::ToJson() const {
+  auto json = Json::Object();
+  json["count"] = count_;
+  json["total_ns"] = total_;
+  json["p50_ns"] = Quantile(0.5);
+  json["p90_ns"] = Quantile(0.9);
+  json["p99_ns"] = Quantile(0.99);
+  json["max_ns"] = max_;
+  auto& buckets = json["buckets"] = Json::Array();
+  for (size_t i = 0; i < counts_.size(); i++) {
+    if (counts_[i] != 0) {
+      auto bucket = Json::Array();
+      bucket.Push(BucketUpperBound(i));
+      bucket.Push(counts_[i]);
+      buckets.Push(std::move(bucket));
+    }
+  }
+  return json;
+}
+
+void Stats::Reset() {
+  commands_.clear();
+  current_ = nullptr;
+  timing_ = {};
+}
+
+void Stats::BeginCommand(const std::string& name) {
+  current_ = &commands_[name];
+}
+
+void Stats::EndCommand(uint64_t ns) {
+  if (current_ != nullptr) {
+    current_->latency.Record(ns);
+    current_ = nullptr;
+  }
+}
+
+void Stats::Record(StatOp op, uint64_t ns) {
+  auto* command =
+      current_ != nullptr ? current_ : &commands_[kOutsideCommands];
+  command->ops[static_cast<size_t>(op)].Record(ns);
+}
+
+void Stats::Print(std::ostream& out) const {
+  if (commands_.empty()) {
+    out << "No stats recorded" << (stats_enabled ? "" : ", use stats on")
+        << std::endl;
+    return;
+  }
+  out << "  " << std::left << std::setw(9) << "" << std::right
+      << std::setw(8) << "count" << std::setw(11) << "total" << std::setw(11)
+      << "p50" << std::setw(11) << "p90" << std::setw(11) << "p99"
+      << std::setw(11) << "max" << std::endl;
+  for (const auto& [name, command] : commands_) {
+    out << name << std::endl;
+    if (command.latency.Count() != 0) {
+      PrintHistogram(out, "command", command.latency);
+    }
+    for (size_t i = 0; i < command.ops.size(); i++) {
+      if (command.ops[i].Count() != 0) {
+        PrintHistogram(out, kOpNames[i], command.ops[i]);
+      }
+    }
+  }
+}
+
+Json Stats::ToJson() const {
+  auto json = Json::Object();
+  json["enabled"] = stats_enabled;
+  auto& commands = json["commands"] = Json::Object();
+  for (const auto& [name, command] : commands_) {
+    auto& entry = commands[name] = command.latency.ToJson();
+    auto& ops = entry["ops"] = Json::Object();
+    for (size_t i = 0; i < command.ops.size(); i++) {
+      if (command.ops[i].Count() != 0) {
+        ops[kOpNames[i]] = command.ops[i].ToJson();
+      }
+    }
+  }
+  return json;
+}
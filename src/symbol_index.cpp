@@ -0,0 +1,206 @@
+#include "symbol_index.h"
+
+#include <cxxabi.h>
+#include <fnmatch.h>
+
+#include <algorithm>
+#include <cstdlib>
+
+namespace {
+
+SymbolType to_symbol_type(elf::stt sym) {
+  switch (sym) {
+    case elf::stt::notype:
+      return SymbolType::notype;
+    case elf::stt::object:
+      return SymbolType::object;
+    case elf::stt::func:
+      return SymbolType::func;
+    case elf::stt::section:
+      return SymbolType::section;
+    case elf::stt::file:
+      return SymbolType::file;
+    default:
+      return SymbolType::notype;
+  }
+}
+
+std::string Demangle(const std::string& name) {
+  if (name.compare(0, 2, "_Z") != 0) {
+    return "";
+  }
+  int status = 0;
+  char* demangled =
+      abi::__cxa_demangle(name.c_str(), nullptr, nullptr, &status);
+  if (status != 0 || demangled == nullptr) {
+    return "";
+  }
+  std::string result{demangled};
+  std::free(demangled);
+  return result;
+}
+
+bool IsGlob(const std::string& pattern) {
+  return pattern.find_first_of("*?[") != std::string::npos;
+}
+
+}  // namespace
+
+uint64_t HashName(std::string_view name) {
+  uint64_t hash = 0xcbf29ce484222325;
+  for (auto c : name) {
+    hash = (hash ^ static_cast<uint8_t>(c)) * 0x100000001b3;
+  }
+  return hash;
+}
+
+SymbolIndex::SymbolIndex(const elf::elf& elf) {
+  for (const auto& sec : elf.sections()) {
+    if (sec.get_hdr().type != elf::sht::symtab &&
+        sec.get_hdr().type != elf::sht::dynsym) {
+      continue;
+    }
+    for (auto sym : sec.as_symtab()) {
+      const auto& d = sym.get_data();
+      Add(sym.get_name(), to_symbol_type(d.type()), d.value, d.size);
+    }
+  }
+  Finish();
+}
+
+void SymbolIndex::Add(const std::string& name, SymbolType type, uint64_t addr,
+                      uint64_t size) {
+  auto demangled = Demangle(name);
+  entries_.push_back(Entry{addr, size, AddString(name),
+                           demangled.empty() ? kNoName : AddString(demangled),
+                           type});
+}
+
+uint32_t SymbolIndex::AddString(const std::string& s) {
+  auto offset = static_cast<uint32_t>(strings_.size());
+  strings_.append(s);
+  strings_.push_back('\0');
+  return offset;
+}
+
+std::string_view SymbolIndex::String(uint32_t offset) const {
+  return strings_.c_str() + offset;
+}
+
+void SymbolIndex::Finish() {
+  for (uint32_t i = 0; i < entries_.size(); i++) {
+    const auto& e = entries_[i];
+    by_hash_.push_back(HashRef{HashName(String(e.name)), i});
+    sorted_names_.push_back(NameRef{e.name, i});
+    if (e.demangled != kNoName) {
+      by_hash_.push_back(HashRef{HashName(String(e.demangled)), i});
+      sorted_names_.push_back(NameRef{e.demangled, i});
+    }
+    if ((e.type == SymbolType::func || e.type == SymbolType::object) &&
+        e.addr != 0) {
+      by_address_.push_back(i);
+    }
+  }
+  std::sort(by_hash_.begin(), by_hash_.end(),
+            [](const HashRef& a, const HashRef& b) { return a.hash < b.hash; });
+  std::sort(sorted_names_.begin(), sorted_names_.end(),
+            [this](const NameRef& a, const NameRef& b) {
+              return String(a.name) < String(b.name);
+            });
+  std::sort(by_address_.begin(), by_address_.end(),
+            [this](uint32_t a, uint32_t b) {
+              return entries_[a].addr < entries_[b].addr;
+            });
+  FindMaxSize();
+}
+
+void SymbolIndex::FindMaxSize() {
+  max_size_ = 1;
+  for (auto entry : by_address_) {
+    max_size_ = std::max(max_size_, entries_[entry].size);
+  }
+}
+
+symbol SymbolIndex::ToSymbol(uint32_t entry) const {
+  const auto& e = entries_[entry];
+  return symbol{e.type, std::string(String(e.name)), e.addr, e.size,
+                e.demangled == kNoName ? ""
+                                       : std::string(String(e.demangled))};
+}
+
+void SymbolIndex::MatchExact(std::string_view name,
+                             std::vector<uint32_t>* out) const {
+  auto hash = HashName(name);
+  auto first = std::lower_bound(
+      by_hash_.begin(), by_hash_.end(), hash,
+      [](const HashRef& r, uint64_t h) { return r.hash < h; });
+  for (auto it = first; it != by_hash_.end() && it->hash == hash; ++it) {
+    const auto& e = entries_[it->entry];
+    if (String(e.name) == name ||
+        (e.demangled != kNoName && String(e.demangled) == name)) {
+      out->push_back(it->entry);
+    }
+  }
+}
+
+void SymbolIndex::MatchGlob(const std::string& pattern,
+                            std::vector<uint32_t>* out) const {
+  // Only names sharing the literal prefix of the pattern can match, and
+  // those form a contiguous run of the sorted array.
+  std::string_view prefix{pattern.data(), pattern.find_first_of("*?[\\")};
+  auto first = std::lower_bound(
+      sorted_names_.begin(), sorted_names_.end(), prefix,
+      [this](const NameRef& r, std::string_view p) { return String(r.name) < p; });
+
+  for (auto it = first;
+       it != sorted_names_.end() && String(it->name).starts_with(prefix);
+       ++it) {
+    if (fnmatch(pattern.c_str(), String(it->name).data(), 0) == 0) {
+      out->push_back(it->entry);
+    }
+  }
+}
+
+std::vector<symbol> SymbolIndex::Lookup(const std::string& pattern) const {
+  std::vector<uint32_t> matches;
+  if (IsGlob(pattern)) {
+    MatchGlob(pattern, &matches);
+  } else {
+    MatchExact(pattern, &matches);
+  }
+
+  // A symbol matched through both its raw and demangled name is listed once
+  std::sort(matches.begin(), matches.end());
+  matches.erase(std::unique(matches.begin(), matches.end()), matches.end());
+
+  std::vector<symbol> syms;
+  syms.reserve(matches.size());
+  for (auto entry : matches) {
+    syms.push_back(ToSymbol(entry));
+  }
+  return syms;
+}
+
+bool SymbolIndex::FindByAddress(uint64_t addr, symbol* sym,
+                                uint64_t* offset) const {
+  auto it = std::upper_bound(by_address_.begin(), by_address_.end(), addr,
+                             [this](uint64_t addr, uint32_t entry) {
+                               return addr < entries_[entry].addr;
+                             });
+  // Walk back until a symbol covers addr. Zero-size symbols, and those
+  // nested in larger ones, can start between addr and the symbol covering
+  // it, so only stop once no symbol starting earlier is large enough.
+  while (it != by_address_.begin()) {
+    --it;
+    const auto& e = entries_[*it];
+    if (addr - e.addr >= max_size_) {
+      break;
+    }
+    if (addr < e.addr + std::max<uint64_t>(e.size, 1)) {
+      *sym = ToSymbol(*it);
+      *offset = addr - e.addr;
+      return true;
+    }
+  }
+  return false;
+}
@@ -0,0 +1,9 @@
+#include "target.h"
+
+void ProcessTarget::ReadMemory(uint64_t addr, void* buf, size_t len) {
+  memory_->Read(addr, buf, len);
+}
+
+uint64_t ProcessTarget::ReadRegister(pid_t tid, Register::Reg r) {
+  return threads_->at(tid).registers.Get(r);
+}
@@ -0,0 +1,22 @@
+#include "trace_buffer.h"
+
+#include <algorithm>
+
+TraceBuffer::TraceBuffer(size_t capacity) : records_(capacity) {}
+
+TraceBuffer::Record& TraceBuffer::Append() {
+  return records_[total_++ % records_.size()];
+}
+
+void TraceBuffer::Clear() { total_ = 0; }
+
+size_t TraceBuffer::Size() const {
+  return std::min<uint64_t>(total_, records_.size());
+}
+
+const TraceBuffer::Record& TraceBuffer::At(size_t i) const {
+  auto oldest = total_ - Size();
+  return records_[(oldest + i) % records_.size()];
+}
+
+uint64_t TraceBuffer::Total() const { return total_; }
@@ -0,0 +1,780 @@
+#include "unwinder.h"
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+
+namespace {
+
+// DW_EH_PE pointer encodings
+const uint8_t kPeOmit = 0xff;
+const uint8_t kPeUleb128 = 0x01;
+const uint8_t kPeUdata2 = 0x02;
+const uint8_t kPeUdata4 = 0x03;
+const uint8_t kPeUdata8 = 0x04;
+const uint8_t kPeSleb128 = 0x09;
+const uint8_t kPeSdata2 = 0x0a;
+const uint8_t kPeSdata4 = 0x0b;
+const uint8_t kPeSdata8 = 0x0c;
+const uint8_t kPePcrel = 0x10;
+
+const auto kMaxExpressionStack = 64;
+
+}  // namespace
+
+// Bounds checked reader, throws when running off the end. PC relative
+// pointers are resolved with the address base is loaded at.
+class Unwinder::Cursor {
+ public:
+  Cursor(const uint8_t* pos, const uint8_t* end, const uint8_t* base,
+         uint64_t base_addr)
+      : base_{base}, addr_{base_addr}, pos_{pos}, end_{end} {}
+
+  template <typename T>
+  T Fixed() {
+    Need(sizeof(T));
+    T value;
+    std::memcpy(&value, pos_, sizeof(T));
+    pos_ += sizeof(T);
+    return value;
+  }
+
+  uint64_t Uleb() {
+    uint64_t value = 0;
+    int shift = 0;
+    uint8_t byte = 0;
+    do {
+      Need(1);
+      byte = *pos_++;
+      if (shift < 64) {
+        value |= static_cast<uint64_t>(byte & 0x7f) << shift;
+      }
+      shift += 7;
+    } while (byte & 0x80);
+    return value;
+  }
+
+  int64_t Sleb() {
+    int64_t value = 0;
+    int shift = 0;
+    uint8_t byte = 0;
+    do {
+      Need(1);
+      byte = *pos_++;
+      if (shift < 64) {
+        value |= static_cast<int64_t>(byte & 0x7f) << shift;
+      }
+      shift += 7;
+    } while (byte & 0x80);
+    if (shift < 64 && (byte & 0x40)) {
+      value |= -(static_cast<int64_t>(1) << shift);
+    }
+    return value;
+  }
+
+  const char* String() {
+    const auto* s = reinterpret_cast<const char*>(pos_);
+    auto len = strnlen(s, end_ - pos_);
+    Need(len + 1);
+    pos_ += len + 1;
+    return s;
+  }
+
+  // A pointer in DW_EH_PE encoding
+  uint64_t Encoded(uint8_t encoding) {
+    auto field_addr = addr_ + (pos_ - base_);
+    uint64_t value = 0;
+    switch (encoding & 0x0f) {
+      case 0:
+        value = Fixed<uint64_t>();
+        break;
+      case kPeUleb128:
+        value = Uleb();
+        break;
+      case kPeUdata2:
+        value = Fixed<uint16_t>();
+        break;
+      case kPeUdata4:
+        value = Fixed<uint32_t>();
+        break;
+      case kPeUdata8:
+        value = Fixed<uint64_t>();
+        break;
+      case kPeSleb128:
+        value = Sleb();
+        break;
+      case kPeSdata2:
+        value = Fixed<int16_t>();
+        break;
+      case kPeSdata4:
+        value = Fixed<int32_t>();
+        break;
+      case kPeSdata8:
+        value = Fixed<int64_t>();
+        break;
+      default:
+        throw std::runtime_error("Unsupported pointer encoding in CFI");
+    }
+    switch (encoding & 0x70) {
+      case 0:
+        return value;
+      case kPePcrel:
+        if (base_ == nullptr) {
+          break;
+        }
+        return field_addr + value;
+      default:
+        break;
+    }
+    throw std::runtime_error("Unsupported pointer encoding in CFI");
+  }
+
+  void Skip(size_t len) {
+    Need(len);
+    pos_ += len;
+  }
+
+  const uint8_t* Pos() const { return pos_; }
+  void Seek(const uint8_t* pos) { pos_ = pos; }
+  bool Done() const { return pos_ >= end_; }
+
+ private:
+  void Need(size_t len) const {
+    if (static_cast<size_t>(end_ - pos_) < len) {
+      throw std::runtime_error("Truncated call frame information");
+    }
+  }
+
+  const uint8_t* base_;
+  uint64_t addr_;
+  const uint8_t* pos_;
+  const uint8_t* end_;
+};
+
+void Unwinder::Load() const {
+  if (loaded_ || elf_ == nullptr) {
+    return;
+  }
+  loaded_ = true;
+  // .eh_frame first so it wins where both describe a function
+  for (const auto* name : {".eh_frame", ".debug_frame"}) {
+    const auto& sec = elf_->get_section(name);
+    if (!sec.valid()) {
+      continue;
+    }
+    try {
+      ParseSection(sec, name == std::string(".eh_frame"));
+    } catch (std::exception&) {
+      // Keep what was parsed before the damage
+    }
+  }
+  std::stable_sort(fdes_.begin(), fdes_.end(),
+                   [](const auto& a, const auto& b) { return a.low < b.low; });
+  fdes_.erase(std::unique(fdes_.begin(), fdes_.end(),
+                          [](const auto& a, const auto& b) {
+                            return a.low == b.low;
+                          }),
+              fdes_.end());
+}
+
+void Unwinder::ParseSection(const elf::section& sec, bool eh_frame) const {
+  const auto* begin = static_cast<const uint8_t*>(sec.data());
+  const auto* end = begin + sec.size();
+  std::unordered_map<uint64_t, uint32_t> cie_index;
+  auto addr = sec.get_hdr().addr;
+  Cursor cursor{begin, end, begin, addr};
+  while (!cursor.Done()) {
+    uint64_t length = cursor.Fixed<uint32_t>();
+    if (length == 0) {
+      if (eh_frame) {
+        break;  // terminator
+      }
+      continue;
+    }
+    bool is64 = length == 0xffffffff;
+    if (is64) {
+      length = cursor.Fixed<uint64_t>();
+    }
+    const auto* entry_end = cursor.Pos() + length;
+    if (entry_end > end || entry_end < cursor.Pos()) {
+      throw std::runtime_error("Truncated call frame information");
+    }
+    auto id_offset = cursor.Pos() - begin;
+    uint64_t id = is64 ? cursor.Fixed<uint64_t>() : cursor.Fixed<uint32_t>();
+    uint64_t cie_id = eh_frame ? 0 : (is64 ? ~0ULL : 0xffffffff);
+    if (id != cie_id) {
+      // An FDE, pointing at its CIE relative to itself in .eh_frame
+      auto cie_offset = eh_frame ? id_offset - id : id;
+      auto cie = ParseCie(sec, cie_offset, eh_frame, &cie_index);
+      Cursor fde{cursor.Pos(), entry_end, begin, addr};
+      Fde entry;
+      entry.cie = cie;
+      auto encoding = cies_[cie].fde_encoding;
+      entry.low = fde.Encoded(encoding);
+      entry.high = entry.low + fde.Encoded(encoding & 0x0f);
+      if (cies_[cie].has_augmentation_data) {
+        fde.Skip(fde.Uleb());
+      }
+      entry.instructions = fde.Pos();
+      entry.end = entry_end;
+      // FDEs of code dropped by the linker are left with a zero address
+      if (entry.low != 0 && entry.high > entry.low) {
+        fdes_.push_back(entry);
+      }
+    }
+    cursor.Seek(entry_end);
+  }
+}
+
+uint32_t Unwinder::ParseCie(
+    const elf::section& sec, uint64_t offset, bool eh_frame,
+    std::unordered_map<uint64_t, uint32_t>* cie_index) const {
+  if (auto it = cie_index->find(offset); it != cie_index->end()) {
+    return it->second;
+  }
+  const auto* begin = static_cast<const uint8_t*>(sec.data());
+  const auto* end = begin + sec.size();
+  if (offset >= sec.size()) {
+    throw std::runtime_error("Bad CIE pointer in call frame information");
+  }
+  auto addr = sec.get_hdr().addr;
+  Cursor cursor{begin + offset, end, begin, addr};
+  uint64_t length = cursor.Fixed<uint32_t>();
+  bool is64 = length == 0xffffffff;
+  if (is64) {
+    length = cursor.Fixed<uint64_t>();
+  }
+  const auto* entry_end = cursor.Pos() + length;
+  if (entry_end > end || entry_end < cursor.Pos()) {
+    throw std::runtime_error("Truncated call frame information");
+  }
+  cursor = Cursor{cursor.Pos(), entry_end, begin, addr};
+  cursor.Skip(is64 ? 8 : 4);  // CIE id
+
+  Cie cie{};
+  cie.section = begin;
+  cie.section_addr = addr;
+  auto version = cursor.Fixed<uint8_t>();
+  std::string augmentation = cursor.String();
+  if (!eh_frame && version >= 4) {
+    cursor.Skip(2);  // address and segment selector size
+  }
+  cie.code_align = cursor.Uleb();
+  cie.data_align = cursor.Sleb();
+  cie.return_register =
+      version == 1 ? cursor.Fixed<uint8_t>() : cursor.Uleb();
+  // .debug_frame addresses are plain 8 byte values
+  cie.fde_encoding = 0;
+  if (!augmentation.empty() && augmentation[0] == 'z') {
+    cie.has_augmentation_data = true;
+    auto len = cursor.Uleb();
+    const auto* data_end = cursor.Pos() + len;
+    for (size_t i = 1; i < augmentation.size(); i++) {
+      switch (augmentation[i]) {
+        case 'R':
+          cie.fde_encoding = cursor.Fixed<uint8_t>();
+          break;
+        case 'P': {
+          auto encoding = cursor.Fixed<uint8_t>();
+          if (encoding != kPeOmit) {
+            cursor.Encoded(encoding & 0x7f);  // personality routine
+          }
+          break;
+        }
+        case 'L':
+          cursor.Fixed<uint8_t>();  // LSDA encoding
+          break;
+        case 'S':
+          cie.signal_frame = true;
+          break;
+        default:
+          break;
+      }
+    }
+    cursor.Seek(data_end);
+  }
+  cie.instructions = cursor.Pos();
+  cie.end = entry_end;
+  cies_.push_back(cie);
+  (*cie_index)[offset] = cies_.size() - 1;
+  return cies_.size() - 1;
+}
+
+size_t Unwinder::FdeCount() const {
+  Load();
+  return fdes_.size();
+}
+
+size_t Unwinder::CachedFdeCount() const { return rows_.size(); }
+
+const std::vector<Unwinder::Row>& Unwinder::Rows(uint32_t index) const {
+  if (auto it = rows_.find(index); it != rows_.end()) {
+    return it->second;
+  }
+  const auto& fde = fdes_[index];
+  const auto& cie = cies_[fde.cie];
+  // Without rules, callee saved registers keep their values and the
+  // others are lost across calls
+  Row initial;
+  initial.address = fde.low;
+  for (auto reg : {3, kRbp, 12, 13, 14, 15}) {
+    initial.rules[reg].kind = RuleKind::kSameValue;
+  }
+  std::vector<Row> rows;
+  Row row = initial;
+  try {
+    Execute(cie, cie.instructions, cie.end, initial, &row, nullptr);
+    row.address = fde.low;
+    initial = row;
+    Execute(cie, fde.instructions, fde.end, initial, &row, &rows);
+  } catch (std::exception&) {
+    // Use the rows decoded up to the bad instruction
+  }
+  rows.push_back(row);
+  return rows_[index] = std::move(rows);
+}
+
+void Unwinder::Execute(const Cie& cie, const uint8_t* begin,
+                       const uint8_t* end, const Row& initial, Row* row,
+                       std::vector<Row>* rows) const {
+  Cursor cursor{begin, end, cie.section, cie.section_addr};
+  std::vector<Row> saved;
+  auto advance = [&](uint64_t address) {
+    if (rows != nullptr) {
+      rows->push_back(*row);
+    }
+    row->address = address;
+  };
+  auto rule = [row](uint64_t reg) -> Rule* {
+    // Rules for vector and other registers are parsed and dropped
+    return reg < kRegisters ? &row->rules[reg] : nullptr;
+  };
+  auto set = [&](uint64_t reg, RuleKind kind, int64_t offset) {
+    if (auto* r = rule(reg)) {
+      *r = Rule{kind, 0, offset, nullptr};
+    }
+  };
+  auto set_expression = [&](uint64_t reg, RuleKind kind) {
+    auto len = cursor.Uleb();
+    const auto* expr = cursor.Pos();
+    cursor.Skip(len);
+    if (auto* r = rule(reg)) {
+      *r = Rule{kind, static_cast<uint32_t>(len), 0, expr};
+    }
+  };
+  auto restore = [&](uint64_t reg) {
+    if (auto* r = rule(reg)) {
+      *r = initial.rules[reg];
+    }
+  };
+
+  while (!cursor.Done()) {
+    auto op = cursor.Fixed<uint8_t>();
+    auto low = op & 0x3f;
+    switch (op >> 6) {
+      case 1:  // DW_CFA_advance_loc
+        advance(row->address + low * cie.code_align);
+        continue;
+      case 2:  // DW_CFA_offset
+        set(low, RuleKind::kOffset, cursor.Uleb() * cie.data_align);
+        continue;
+      case 3:  // DW_CFA_restore
+        restore(low);
+        continue;
+      default:
+        break;
+    }
+    switch (op) {
+      case 0x00:  // DW_CFA_nop
+        break;
+      case 0x01:  // DW_CFA_set_loc
+        advance(cursor.Encoded(cie.fde_encoding));
+        break;
+      case 0x02:  // DW_CFA_advance_loc1
+        advance(row->address + cursor.Fixed<uint8_t>() * cie.code_align);
+        break;
+      case 0x03:  // DW_CFA_advance_loc2
+        advance(row->address + cursor.Fixed<uint16_t>() * cie.code_align);
+        break;
+      case 0x04:  // DW_CFA_advance_loc4
+        advance(row->address + cursor.Fixed<uint32_t>() * cie.code_align);
+        break;
+      case 0x05: {  // DW_CFA_offset_extended
+        auto reg = cursor.Uleb();
+        set(reg, RuleKind::kOffset, cursor.Uleb() * cie.data_align);
+        break;
+      }
+      case 0x06:  // DW_CFA_restore_extended
+        restore(cursor.Uleb());
+        break;
+      case 0x07:  // DW_CFA_undefined
+        set(cursor.Uleb(), RuleKind::kUndefined, 0);
+        break;
+      case 0x08:  // DW_CFA_same_value
+        set(cursor.Uleb(), RuleKind::kSameValue, 0);
+        break;
+      case 0x09: {  // DW_CFA_register
+        auto reg = cursor.Uleb();
+        set(reg, RuleKind::kRegister, cursor.Uleb());
+        break;
+      }
+      case 0x0a:  // DW_CFA_remember_state
+        saved.push_back(*row);
+        break;
+      case 0x0b: {  // DW_CFA_restore_state, which keeps the location
+        if (saved.empty()) {
+          throw std::runtime_error("DW_CFA_restore_state without state");
+        }
+        auto address = row->address;
+        *row = saved.back();
+        row->address = address;
+        saved.pop_back();
+        break;
+      }
+      case 0x0c:  // DW_CFA_def_cfa
+        row->cfa_register = cursor.Uleb();
+        row->cfa_offset = cursor.Uleb();
+        break;
+      case 0x0d:  // DW_CFA_def_cfa_register
+        row->cfa_register = cursor.Uleb();
+        break;
+      case 0x0e:  // DW_CFA_def_cfa_offset
+        row->cfa_offset = cursor.Uleb();
+        break;
+      case 0x0f: {  // DW_CFA_def_cfa_expression
+        auto len = cursor.Uleb();
+        row->cfa_register = -1;
+        row->cfa_expression = cursor.Pos();
+        row->cfa_expression_len = len;
+        cursor.Skip(len);
+        break;
+      }
+      case 0x10: {  // DW_CFA_expression
+        set_expression(cursor.Uleb(), RuleKind::kExpression);
+        break;
+      }
+      case 0x11: {  // DW_CFA_offset_extended_sf
+        auto reg = cursor.Uleb();
+        set(reg, RuleKind::kOffset, cursor.Sleb() * cie.data_align);
+        break;
+      }
+      case 0x12:  // DW_CFA_def_cfa_sf
+        row->cfa_register = cursor.Uleb();
+        row->cfa_offset = cursor.Sleb() * cie.data_align;
+        break;
+      case 0x13:  // DW_CFA_def_cfa_offset_sf
+        row->cfa_offset = cursor.Sleb() * cie.data_align;
+        break;
+      case 0x14: {  // DW_CFA_val_offset
+        auto reg = cursor.Uleb();
+        set(reg, RuleKind::kValOffset, cursor.Uleb() * cie.data_align);
+        break;
+      }
+      case 0x15: {  // DW_CFA_val_offset_sf
+        auto reg = cursor.Uleb();
+        set(reg, RuleKind::kValOffset, cursor.Sleb() * cie.data_align);
+        break;
+      }
+      case 0x16: {  // DW_CFA_val_expression
+        set_expression(cursor.Uleb(), RuleKind::kValExpression);
+        break;
+      }
+      case 0x2e:  // DW_CFA_GNU_args_size
+        cursor.Uleb();
+        break;
+      case 0x2f: {  // DW_CFA_GNU_negative_offset_extended
+        auto reg = cursor.Uleb();
+        set(reg, RuleKind::kOffset, -cursor.Sleb() * cie.data_align);
+        break;
+      }
+      default:
+        throw std::runtime_error("Unknown CFA instruction");
+    }
+  }
+}
+
+bool Unwinder::Step(const Frame& frame, Frame* caller, uint64_t load_address,
+                    const ReadMemory& read) const {
+  Load();
+  auto pc = frame.pc - load_address - (frame.return_address ? 1 : 0);
+  auto fde = std::upper_bound(
+      fdes_.begin(), fdes_.end(), pc,
+      [](uint64_t pc, const auto& f) { return pc < f.low; });
+  if (fde == fdes_.begin() || pc >= (--fde)->high) {
+    return StepFramePointer(frame, caller, read);
+  }
+  const auto& rows = Rows(fde - fdes_.begin());
+  auto row_it = std::upper_bound(
+      rows.begin(), rows.end(), pc,
+      [](uint64_t pc, const auto& r) { return pc < r.address; });
+  if (row_it == rows.begin()) {
+    return false;
+  }
+  const auto& row = *--row_it;
+
+  uint64_t cfa = 0;
+  if (row.cfa_register >= 0) {
+    if (row.cfa_register >= kRegisters ||
+        (frame.valid & (1u << row.cfa_register)) == 0) {
+      return false;
+    }
+    cfa = frame.regs[row.cfa_register] + row.cfa_offset;
+  } else if (!Evaluate(row.cfa_expression, row.cfa_expression_len, frame,
+                       read, false, 0, &cfa)) {
+    return false;
+  }
+
+  *caller = Frame{};
+  for (int reg = 0; reg < kRegisters; reg++) {
+    const auto& rule = row.rules[reg];
+    uint64_t value = 0;
+    bool known = false;
+    switch (rule.kind) {
+      case RuleKind::kUndefined:
+        break;
+      case RuleKind::kSameValue:
+        value = frame.regs[reg];
+        known = frame.valid & (1u << reg);
+        break;
+      case RuleKind::kOffset:
+        known = read(cfa + rule.offset, &value);
+        break;
+      case RuleKind::kValOffset:
+        value = cfa + rule.offset;
+        known = true;
+        break;
+      case RuleKind::kRegister:
+        if (rule.offset >= 0 && rule.offset < kRegisters) {
+          value = frame.regs[rule.offset];
+          known = frame.valid & (1u << rule.offset);
+        }
+        break;
+      case RuleKind::kExpression: {
+        uint64_t addr = 0;
+        known = Evaluate(rule.expression, rule.expression_len, frame, read,
+                         true, cfa, &addr) &&
+                read(addr, &value);
+        break;
+      }
+      case RuleKind::kValExpression:
+        known = Evaluate(rule.expression, rule.expression_len, frame, read,
+                         true, cfa, &value);
+        break;
+    }
+    if (known) {
+      caller->regs[reg] = value;
+      caller->valid |= 1u << reg;
+    }
+  }
+  // The caller's stack pointer is the CFA by definition
+  caller->regs[kRsp] = cfa;
+  caller->valid |= 1u << kRsp;
+
+  const auto& cie = cies_[fde->cie];
+  auto ra = cie.return_register;
+  if (ra >= kRegisters || (caller->valid & (1u << ra)) == 0 ||
+      caller->regs[ra] == 0) {
+    return false;  // the outermost frame has its return address undefined
+  }
+  caller->pc = caller->regs[ra];
+  caller->return_address = !cie.signal_frame;
+  return true;
+}
+
+bool Unwinder::StepFramePointer(const Frame& frame, Frame* caller,
+                                const ReadMemory& read) const {
+  if ((frame.valid & (1u << kRbp)) == 0 || frame.regs[kRbp] == 0) {
+    return false;
+  }
+  auto frame_pointer = frame.regs[kRbp];
+  uint64_t saved_frame_pointer = 0;
+  uint64_t return_address = 0;
+  if (!read(frame_pointer, &saved_frame_pointer) ||
+      !read(frame_pointer + 8, &return_address) || return_address == 0) {
+    return false;
+  }
+  *caller = Frame{};
+  for (auto reg : {3, 12, 13, 14, 15}) {
+    caller->regs[reg] = frame.regs[reg];
+    caller->valid |= frame.valid & (1u << reg);
+  }
+  caller->regs[kRbp] = saved_frame_pointer;
+  caller->regs[kRsp] = frame_pointer + 16;
+  caller->regs[kReturnAddress] = return_address;
+  caller->valid |= (1u << kRbp) | (1u << kRsp) | (1u << kReturnAddress);
+  caller->pc = return_address;
+  caller->return_address = true;
+  return true;
+}
+
+bool Unwinder::Evaluate(const uint8_t* expr, size_t len, const Frame& frame,
+                        const ReadMemory& read, bool push_initial,
+                        uint64_t initial, uint64_t* result) const {
+  std::array<uint64_t, kMaxExpressionStack> stack;
+  size_t sp = 0;
+  auto push = [&](uint64_t v) {
+    if (sp == stack.size()) {
+      throw std::runtime_error("DWARF expression stack overflow");
+    }
+    stack[sp++] = v;
+  };
+  auto pop = [&]() {
+    if (sp == 0) {
+      throw std::runtime_error("DWARF expression stack underflow");
+    }
+    return stack[--sp];
+  };
+  auto reg = [&](uint64_t n) {
+    if (n >= kRegisters || (frame.valid & (1u << n)) == 0) {
+      throw std::runtime_error("Register unknown in this frame");
+    }
+    return frame.regs[n];
+  };
+
+  try {
+    if (push_initial) {
+      push(initial);
+    }
+    Cursor cursor{expr, expr + len, nullptr, 0};
+    while (!cursor.Done()) {
+      auto op = cursor.Fixed<uint8_t>();
+      if (op >= 0x30 && op <= 0x4f) {  // DW_OP_lit<n>
+        push(op - 0x30);
+        continue;
+      }
+      if (op >= 0x70 && op <= 0x8f) {  // DW_OP_breg<n>
+        push(reg(op - 0x70) + cursor.Sleb());
+        continue;
+      }
+      uint64_t b = 0;
+      uint64_t a = 0;
+      switch (op) {
+        case 0x06:  // DW_OP_deref
+          if (!read(pop(), &a)) {
+            return false;
+          }
+          push(a);
+          break;
+        case 0x08:  // DW_OP_const1u
+          push(cursor.Fixed<uint8_t>());
+          break;
+        case 0x09:  // DW_OP_const1s
+          push(cursor.Fixed<int8_t>());
+          break;
+        case 0x0a:  // DW_OP_const2u
+          push(cursor.Fixed<uint16_t>());
+          break;
+        case 0x0b:  // DW_OP_const2s
+          push(cursor.Fixed<int16_t>());
+          break;
+        case 0x0c:  // DW_OP_const4u
+          push(cursor.Fixed<uint32_t>());
+          break;
+        case 0x0d:  // DW_OP_const4s
+          push(cursor.Fixed<int32_t>());
+          break;
+        case 0x0e:  // DW_OP_const8u
+        case 0x0f:  // DW_OP_const8s
+          push(cursor.Fixed<uint64_t>());
+          break;
+        case 0x10:  // DW_OP_constu
+          push(cursor.Uleb());
+          break;
+        case 0x11:  // DW_OP_consts
+          push(cursor.Sleb());
+          break;
+        case 0x12:  // DW_OP_dup
+          a = pop();
+          push(a);
+          push(a);
+          break;
+        case 0x13:  // DW_OP_drop
+          pop();
+          break;
+        case 0x16:  // DW_OP_swap
+          b = pop();
+          a = pop();
+          push(b);
+          push(a);
+          break;
+        case 0x1f:  // DW_OP_neg
+          push(-pop());
+          break;
+        case 0x20:  // DW_OP_not
+          push(~pop());
+          break;
+        case 0x23:  // DW_OP_plus_uconst
+          push(pop() + cursor.Uleb());
+          break;
+        case 0x92: {  // DW_OP_bregx
+          auto n = cursor.Uleb();
+          push(reg(n) + cursor.Sleb());
+          break;
+        }
+        case 0x96:  // DW_OP_nop
+          break;
+        default: {
+          // Binary operators
+          b = pop();
+          a = pop();
+          auto sa = static_cast<int64_t>(a);
+          auto sb = static_cast<int64_t>(b);
+          switch (op) {
+            case 0x1a:  // DW_OP_and
+              push(a & b);
+              break;
+            case 0x1c:  // DW_OP_minus
+              push(a - b);
+              break;
+            case 0x1e:  // DW_OP_mul
+              push(a * b);
+              break;
+            case 0x21:  // DW_OP_or
+              push(a | b);
+              break;
+            case 0x22:  // DW_OP_plus
+              push(a + b);
+              break;
+            case 0x24:  // DW_OP_shl
+              push(a << (b & 63));
+              break;
+            case 0x25:  // DW_OP_shr
+              push(a >> (b & 63));
+              break;
+            case 0x26:  // DW_OP_shra
+              push(sa >> (b & 63));
+              break;
+            case 0x27:  // DW_OP_xor
+              push(a ^ b);
+              break;
+            case 0x29:  // DW_OP_eq
+              push(sa == sb);
+              break;
+            case 0x2a:  // DW_OP_ge
+              push(sa >= sb);
+              break;
+            case 0x2b:  // DW_OP_gt
+              push(sa > sb);
+              break;
+            case 0x2c:  // DW_OP_le
+              push(sa <= sb);
+              break;
+            case 0x2d:  // DW_OP_lt
+              push(sa < sb);
+              break;
+            case 0x2e:  // DW_OP_ne
+              push(sa != sb);
+              break;
+            default:
+              return false;
+          }
+        }
+      }
+    }
+    *result = pop();
+    return true;
+  } catch (std::exception&) {
+    return false;
+  }
+}
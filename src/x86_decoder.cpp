@@ -0,0 +1,445 @@
+#include "x86_decoder.h"
+
+#include <cstring>
+
+namespace {
+
+enum class Imm { kNone, kByte, kWord, kZ, kV, kEnter, kMoffs, kRel8, kRel32 };
+
+struct OpcodeInfo {
+  bool valid;
+  bool modrm;
+  Imm imm;
+};
+
+// One byte opcode map in 64-bit mode. Prefixes are consumed before this is
+// consulted.
+OpcodeInfo OneByteInfo(uint8_t op) {
+  if (op < 0x40) {
+    switch (op & 7) {
+      case 0:
+      case 1:
+      case 2:
+      case 3:
+        return {true, true, Imm::kNone};
+      case 4:
+        return {true, false, Imm::kByte};
+      case 5:
+        return {true, false, Imm::kZ};
+      default:
+        // push/pop segment, daa/das/aaa/aas are invalid in 64-bit mode
+        return {false, false, Imm::kNone};
+    }
+  }
+  if (op >= 0x50 && op <= 0x5f) {
+    return {true, false, Imm::kNone};
+  }
+  if (op >= 0x70 && op <= 0x7f) {
+    return {true, false, Imm::kRel8};
+  }
+  if (op >= 0x84 && op <= 0x8f) {
+    return {true, true, Imm::kNone};
+  }
+  if (op >= 0x90 && op <= 0x9f) {
+    return {op != 0x9a, false, Imm::kNone};
+  }
+  if (op >= 0xb0 && op <= 0xb7) {
+    return {true, false, Imm::kByte};
+  }
+  if (op >= 0xb8 && op <= 0xbf) {
+    return {true, false, Imm::kV};
+  }
+  if (op >= 0xd8 && op <= 0xdf) {
+    return {true, true, Imm::kNone};  // x87
+  }
+  switch (op) {
+    case 0x63:
+      return {true, true, Imm::kNone};
+    case 0x68:
+      return {true, false, Imm::kZ};
+    case 0x69:
+      return {true, true, Imm::kZ};
+    case 0x6a:
+      return {true, false, Imm::kByte};
+    case 0x6b:
+      return {true, true, Imm::kByte};
+    case 0x6c:
+    case 0x6d:
+    case 0x6e:
+    case 0x6f:
+      return {true, false, Imm::kNone};
+    case 0x80:
+    case 0x83:
+      return {true, true, Imm::kByte};
+    case 0x81:
+      return {true, true, Imm::kZ};
+    case 0xa0:
+    case 0xa1:
+    case 0xa2:
+    case 0xa3:
+      return {true, false, Imm::kMoffs};
+    case 0xa4:
+    case 0xa5:
+    case 0xa6:
+    case 0xa7:
+    case 0xaa:
+    case 0xab:
+    case 0xac:
+    case 0xad:
+    case 0xae:
+    case 0xaf:
+      return {true, false, Imm::kNone};
+    case 0xa8:
+      return {true, false, Imm::kByte};
+    case 0xa9:
+      return {true, false, Imm::kZ};
+    case 0xc0:
+    case 0xc1:
+    case 0xc6:
+      return {true, true, Imm::kByte};
+    case 0xc7:
+      return {true, true, Imm::kZ};
+    case 0xc2:
+    case 0xca:
+      return {true, false, Imm::kWord};
+    case 0xc3:
+    case 0xc9:
+    case 0xcb:
+    case 0xcc:
+    case 0xcf:
+      return {true, false, Imm::kNone};
+    case 0xc8:
+      return {true, false, Imm::kEnter};
+    case 0xcd:
+      return {true, false, Imm::kByte};
+    case 0xd0:
+    case 0xd1:
+    case 0xd2:
+    case 0xd3:
+      return {true, true, Imm::kNone};
+    case 0xd7:
+      return {true, false, Imm::kNone};
+    case 0xe0:
+    case 0xe1:
+    case 0xe2:
+    case 0xe3:
+    case 0xeb:
+      return {true, false, Imm::kRel8};
+    case 0xe4:
+    case 0xe5:
+    case 0xe6:
+    case 0xe7:
+      return {true, false, Imm::kByte};
+    case 0xe8:
+    case 0xe9:
+      return {true, false, Imm::kRel32};
+    case 0xec:
+    case 0xed:
+    case 0xee:
+    case 0xef:
+    case 0xf1:
+    case 0xf4:
+    case 0xf5:
+    case 0xf8:
+    case 0xf9:
+    case 0xfa:
+    case 0xfb:
+    case 0xfc:
+    case 0xfd:
+      return {true, false, Imm::kNone};
+    case 0xf6:
+    case 0xf7:
+    case 0xfe:
+    case 0xff:
+      return {true, true, Imm::kNone};  // F6/F7 immediates depend on ModRM
+    default:
+      return {false, false, Imm::kNone};
+  }
+}
+
+// Two byte (0F xx) opcode map
+OpcodeInfo TwoByteInfo(uint8_t op) {
+  if (op >= 0x80 && op <= 0x8f) {
+    return {true, false, Imm::kRel32};
+  }
+  if (op >= 0xc8 && op <= 0xcf) {
+    return {true, false, Imm::kNone};  // bswap
+  }
+  switch (op) {
+    case 0x04:
+    case 0x0a:
+    case 0x0c:
+    case 0x24:
+    case 0x25:
+    case 0x26:
+    case 0x27:
+    case 0x36:
+    case 0x39:
+    case 0x3b:
+    case 0x3c:
+    case 0x3d:
+    case 0x3e:
+    case 0x3f:
+    case 0x7a:
+    case 0x7b:
+    case 0xa6:
+    case 0xa7:
+    case 0xff:
+      return {false, false, Imm::kNone};
+    case 0x05:
+    case 0x06:
+    case 0x07:
+    case 0x08:
+    case 0x09:
+    case 0x0b:
+    case 0x0e:
+    case 0x30:
+    case 0x31:
+    case 0x32:
+    case 0x33:
+    case 0x34:
+    case 0x35:
+    case 0x37:
+    case 0x77:
+    case 0xa0:
+    case 0xa1:
+    case 0xa2:
+    case 0xa8:
+    case 0xa9:
+    case 0xaa:
+      return {true, false, Imm::kNone};
+    case 0x0f:  // 3DNow!, opcode is an immediate after the operands
+    case 0x70:
+    case 0x71:
+    case 0x72:
+    case 0x73:
+    case 0xa4:
+    case 0xac:
+    case 0xba:
+    case 0xc2:
+    case 0xc4:
+    case 0xc5:
+    case 0xc6:
+      return {true, true, Imm::kByte};
+    default:
+      return {true, true, Imm::kNone};
+  }
+}
+
+int ImmediateSize(Imm imm, const Instruction& insn) {
+  bool rex_w = (insn.rex & 0x8) != 0;
+  switch (imm) {
+    case Imm::kNone:
+      return 0;
+    case Imm::kByte:
+    case Imm::kRel8:
+      return 1;
+    case Imm::kWord:
+      return 2;
+    case Imm::kEnter:
+      return 3;
+    case Imm::kZ:
+      return insn.operand_size_prefix && !rex_w ? 2 : 4;
+    case Imm::kV:
+      return rex_w ? 8 : (insn.operand_size_prefix ? 2 : 4);
+    case Imm::kMoffs:
+      return insn.address_size_prefix ? 4 : 8;
+    case Imm::kRel32:
+      return 4;
+  }
+  return 0;
+}
+
+int64_t ReadSigned(const uint8_t* p, int size) {
+  switch (size) {
+    case 1:
+      return static_cast<int8_t>(p[0]);
+    case 2: {
+      int16_t v;
+      std::memcpy(&v, p, sizeof(v));
+      return v;
+    }
+    case 4: {
+      int32_t v;
+      std::memcpy(&v, p, sizeof(v));
+      return v;
+    }
+    case 8: {
+      int64_t v;
+      std::memcpy(&v, p, sizeof(v));
+      return v;
+    }
+    default:
+      return 0;
+  }
+}
+
+}  // namespace
+
+bool DecodeInstruction(const uint8_t* code, size_t len, Instruction* insn) {
+  const auto kMaxLength = 15;
+  *insn = Instruction{};
+  size_t pos = 0;
+  auto available = [&](size_t n) {
+    return pos + n <= len && pos + n <= kMaxLength;
+  };
+
+  // Legacy prefixes
+  while (available(1)) {
+    auto b = code[pos];
+    if (b == 0x66) {
+      insn->operand_size_prefix = true;
+    } else if (b == 0x67) {
+      insn->address_size_prefix = true;
+    } else if (b == 0xf2 || b == 0xf3) {
+      insn->rep_prefix = true;
+    } else if (b == 0x64 || b == 0x65) {
+      insn->segment_prefix = b;
+    } else if (b != 0xf0 && b != 0x2e && b != 0x36 && b != 0x3e &&
+               b != 0x26 && b != 0x64 && b != 0x65) {
+      break;
+    }
+    pos++;
+  }
+  if (available(1) && (code[pos] & 0xf0) == 0x40) {
+    insn->rex = code[pos++];
+  }
+  if (!available(1)) {
+    return false;
+  }
+
+  OpcodeInfo info;
+  auto first = code[pos];
+  if (first == 0xc4 || first == 0xc5 || first == 0x62) {
+    // VEX/EVEX: the prefix encodes the opcode map. Everything in the 0F 38
+    // and 0F 3A maps has a ModRM byte and only 0F 3A has an immediate.
+    insn->vex = true;
+    size_t prefix_len = first == 0xc5 ? 2 : (first == 0xc4 ? 3 : 4);
+    if (!available(prefix_len + 1)) {
+      return false;
+    }
+    insn->opcode_map =
+        first == 0xc5 ? 1 : (code[pos + 1] & (first == 0xc4 ? 0x1f : 0x7));
+    // The prefix holds REX.R, X and B inverted, which address computations
+    // need for r8-r15
+    insn->rex = 0x40 | ((~code[pos + 1] >> 5) & (first == 0xc5 ? 4 : 7));
+    if (first == 0xc4 || first == 0x62) {
+      // Keep REX.W so immediates and operand sizes decode consistently
+      if ((code[pos + 2] & 0x80) != 0) {
+        insn->rex |= 0x48;
+      }
+    }
+    pos += prefix_len;
+    if (insn->opcode_map == 1) {
+      // Same immediates as the legacy 0F map, e.g. vpshufd or vcmpps
+      info = TwoByteInfo(code[pos]);
+      info.valid = info.valid && info.imm != Imm::kRel32;
+    } else {
+      info = {insn->opcode_map == 2 || insn->opcode_map == 3, true,
+              insn->opcode_map == 3 ? Imm::kByte : Imm::kNone};
+    }
+  } else if (first == 0x0f) {
+    pos++;
+    if (!available(1)) {
+      return false;
+    }
+    if (code[pos] == 0x38 || code[pos] == 0x3a) {
+      insn->opcode_map = code[pos] == 0x38 ? 2 : 3;
+      pos++;
+      info = {true, true, insn->opcode_map == 3 ? Imm::kByte : Imm::kNone};
+    } else {
+      insn->opcode_map = 1;
+      info = TwoByteInfo(code[pos]);
+    }
+  } else {
+    info = OneByteInfo(first);
+  }
+  if (!info.valid || !available(1)) {
+    return false;
+  }
+  insn->opcode_offset = pos;
+  insn->opcode = code[pos++];
+
+  if (info.modrm) {
+    if (!available(1)) {
+      return false;
+    }
+    insn->has_modrm = true;
+    insn->modrm = code[pos++];
+    auto mod = insn->ModrmMod();
+    auto rm = insn->ModrmRm();
+    if (mod != 3 && rm == 4) {
+      if (!available(1)) {
+        return false;
+      }
+      insn->has_sib = true;
+      insn->sib = code[pos++];
+    }
+    if (mod == 1) {
+      insn->disp_size = 1;
+    } else if (mod == 2) {
+      insn->disp_size = 4;
+    } else if (mod == 0 && rm == 5) {
+      insn->disp_size = 4;
+      insn->rip_relative = true;
+    } else if (mod == 0 && insn->has_sib && (insn->sib & 7) == 5) {
+      insn->disp_size = 4;
+    }
+    if (insn->disp_size != 0) {
+      if (!available(insn->disp_size)) {
+        return false;
+      }
+      insn->disp_offset = pos;
+      insn->disp = ReadSigned(code + pos, insn->disp_size);
+      pos += insn->disp_size;
+    }
+  }
+
+  auto imm = info.imm;
+  if (insn->opcode_map == 0 && (insn->opcode == 0xf6 || insn->opcode == 0xf7) &&
+      insn->ModrmReg() <= 1) {
+    imm = insn->opcode == 0xf6 ? Imm::kByte : Imm::kZ;  // test r/m, imm
+  }
+  auto imm_size = ImmediateSize(imm, *insn);
+  if (!available(imm_size)) {
+    return false;
+  }
+  if (imm == Imm::kRel8 || imm == Imm::kRel32) {
+    insn->rel_offset = pos;
+    insn->rel_size = imm_size;
+    insn->rel = ReadSigned(code + pos, imm_size);
+  } else if (imm_size != 0) {
+    insn->imm_offset = pos;
+    insn->imm_size = imm_size;
+  }
+  pos += imm_size;
+  insn->length = pos;
+
+  // Classify control flow
+  auto op = insn->opcode;
+  if (insn->vex) {
+    return true;
+  }
+  if (insn->opcode_map == 0) {
+    if (op == 0xe8) {
+      insn->kind = Instruction::Kind::kCall;
+    } else if (op == 0xe9 || op == 0xeb) {
+      insn->kind = Instruction::Kind::kJump;
+    } else if ((op >= 0x70 && op <= 0x7f) || (op >= 0xe0 && op <= 0xe3)) {
+      insn->kind = Instruction::Kind::kCondJump;
+    } else if (op == 0xc2 || op == 0xc3 || op == 0xca || op == 0xcb ||
+               op == 0xcf) {
+      insn->kind = Instruction::Kind::kReturn;
+    } else if (op == 0xff) {
+      auto reg = insn->ModrmReg();
+      if (reg == 2 || reg == 3) {
+        insn->kind = Instruction::Kind::kIndirectCall;
+      } else if (reg == 4 || reg == 5) {
+        insn->kind = Instruction::Kind::kIndirectJump;
+      }
+    }
+  } else if (insn->opcode_map == 1 && op >= 0x80 && op <= 0x8f) {
+    insn->kind = Instruction::Kind::kCondJump;
+  }
+  return true;
+}
@@ -0,0 +1,8 @@
+// Debuggee of the checkpoint test: counter goes from 1 to 3 in main
+int counter = 1;
+
+int main() {
+  counter = 2;
+  counter = 3;
+  return 0;
+}
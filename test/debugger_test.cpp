@@ -0,0 +1,301 @@
+// Runs the debugger on a test program through its command server and
+// checks what the commands do. Exits non-zero on the first failure.
+//
+//   DebuggerTest <debugger> <test> <program>
+//
+// checkpoint: on test/counter.cpp, counter is back at its value at the
+//   checkpoint after running on and restarting it.
+// gdb-server: on test/spin.cpp, a scripted gdb client negotiates the
+//   packet size and no-ack mode, reads registers and 64 KiB of memory,
+//   stops at a breakpoint and a watchpoint and interrupts the process.
+// step: on test/helloworld.cpp, step goes through main, f, g and h line by
+//   line, into each call with line information and over the others, and
+//   back out past the calls.
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <filesystem>
+#include <functional>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "session.h"
+
+namespace {
+
+void Expect(bool ok, const std::string& what) {
+  if (!ok) {
+    throw std::runtime_error(what);
+  }
+}
+
+// Address of the symbol name, the program is linked at a fixed address
+std::string SymbolAddress(Session& session, const std::string& name) {
+  std::istringstream output{session.Output("symbol " + name)};
+  std::string symbol, type, addr;
+  output >> symbol >> type >> addr;
+  Expect(symbol == name, "No symbol " + name);
+  return addr;
+}
+
+std::string Hex(uint64_t value) {
+  std::ostringstream out;
+  out << std::hex << value;
+  return out.str();
+}
+
+// A 64 bit register value as a gdb client sees it, in target byte order
+std::string RegisterHex(uint64_t value) {
+  std::string hex;
+  for (int i = 0; i < 8; i++, value >>= 8) {
+    auto byte = Hex(value & 0xff);
+    hex += byte.size() == 1 ? "0" + byte : byte;
+  }
+  return hex;
+}
+
+// Client side of the GDB remote serial protocol, enough to script a session
+class GdbClient {
+ public:
+  explicit GdbClient(const std::string& path) {
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    path.copy(addr.sun_path, sizeof(addr.sun_path) - 1);
+    // The server is listening once the socket can be connected to
+    for (int tries = 0;; tries++) {
+      fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+      if (connect(fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) ==
+          0) {
+        return;
+      }
+      close(fd_);
+      Expect(tries < kConnectTries, "The gdb server did not start");
+      std::this_thread::sleep_for(std::chrono::milliseconds(10));
+    }
+  }
+
+  ~GdbClient() { close(fd_); }
+
+  GdbClient(const GdbClient&) = delete;
+  GdbClient& operator=(const GdbClient&) = delete;
+
+  std::string Request(const std::string& payload) {
+    Send(payload);
+    return Reply();
+  }
+
+  void Send(const std::string& payload) {
+    uint8_t sum = 0;
+    for (auto c : payload) {
+      sum += c;
+    }
+    auto checksum = Hex(sum);
+    Write("$" + payload + "#" + (checksum.size() == 1 ? "0" : "") + checksum);
+    if (acks_) {
+      auto ack = ReadByte();
+      Expect(ack == '+', "Packet " + payload + " not acknowledged");
+    }
+  }
+
+  // Next packet from the server, its checksum checked
+  std::string Reply() {
+    while (ReadByte() != '$') {
+    }
+    std::string payload;
+    uint8_t sum = 0;
+    for (char c; (c = ReadByte()) != '#';) {
+      payload += c;
+      sum += c;
+    }
+    std::string checksum{ReadByte(), ReadByte()};
+    Expect(std::stoul(checksum, nullptr, 16) == sum,
+           "Bad checksum on " + payload.substr(0, 32));
+    if (acks_) {
+      Write("+");
+    }
+    return payload;
+  }
+
+  // ^C, as gdb sends it to interrupt the running process
+  void Interrupt() { Write("\x03"); }
+
+  // After QStartNoAckMode neither side acknowledges packets
+  void StopAcks() { acks_ = false; }
+
+ private:
+  static constexpr int kConnectTries = 1000;
+
+  void Write(const std::string& data) {
+    Expect(send(fd_, data.data(), data.size(), MSG_NOSIGNAL) ==
+               static_cast<ssize_t>(data.size()),
+           "Lost the gdb server");
+  }
+
+  char ReadByte() {
+    if (pos_ == input_.size()) {
+      char buf[64 * 1024];
+      auto n = recv(fd_, buf, sizeof(buf), 0);
+      Expect(n > 0, "The gdb server disconnected");
+      input_.assign(buf, n);
+      pos_ = 0;
+    }
+    return input_[pos_++];
+  }
+
+  int fd_ = -1;
+  bool acks_ = true;
+  std::string input_;
+  size_t pos_ = 0;
+};
+
+// An int in memory as the hex bytes read-memory returns
+std::string ReadInt(Session& session, const std::string& addr) {
+  return session.Run("read-memory " + addr + " 4").Find("bytes")->AsString();
+}
+
+void TestCheckpoint(Session& session) {
+  auto counter = SymbolAddress(session, "counter");
+  session.Run("breakpoint main");
+  session.Run("continue");
+  Expect(ReadInt(session, counter) == "01000000", "counter is not 1 at main");
+
+  auto output = session.Output("checkpoint");
+  Expect(output.find("Checkpoint 1") == 0, "No checkpoint: " + output);
+  session.Run("next");
+  session.Run("next");
+  Expect(ReadInt(session, counter) == "03000000",
+         "counter is not 3 after two lines");
+
+  session.Run("restart 1");
+  Expect(ReadInt(session, counter) == "01000000",
+         "counter is not back at 1 after the restart");
+  // The restarted process runs on from there
+  session.Run("next");
+  Expect(ReadInt(session, counter) == "02000000",
+         "counter is not 2 a line after the restart");
+}
+
+void TestGdbServer(Session& session) {
+  // tick(), symbol looks up raw names
+  auto tick = std::stoull(SymbolAddress(session, "_Z4tickv"), nullptr, 16);
+  auto buffer = std::stoull(SymbolAddress(session, "buffer"), nullptr, 16);
+  auto ticks = std::stoull(SymbolAddress(session, "ticks"), nullptr, 16);
+  auto path = std::filesystem::temp_directory_path() /
+              ("debugger-test-" + std::to_string(getpid()) + ".gdb");
+  // Answered once the gdb session is over
+  session.Send("gdbserver " + path.string());
+  {
+    GdbClient gdb{path};
+    auto supported = gdb.Request("qSupported:multiprocess+;swbreak+;hwbreak+");
+    Expect(supported.find("PacketSize=20000") != std::string::npos,
+           "No PacketSize in " + supported);
+    Expect(gdb.Request("QStartNoAckMode") == "OK", "No no-ack mode");
+    gdb.StopAcks();
+    auto stop = gdb.Request("?");
+    Expect(stop.rfind("T05", 0) == 0, "Not stopped with SIGTRAP: " + stop);
+
+    // 20 64-bit, 16 32-bit, 8 80-bit and 16 128-bit registers, with rip
+    // after the 16 general purpose ones
+    auto registers = gdb.Request("g");
+    Expect(registers.size() == 1120,
+           "g returned " + std::to_string(registers.size()) + " digits");
+    Expect(registers.substr(16 * 16, 16) == gdb.Request("p10"),
+           "rip differs between g and p");
+
+    auto memory = gdb.Request("m" + Hex(buffer) + ",10000");
+    Expect(memory == std::string(2 * 64 * 1024, '0'),
+           "m returned " + std::to_string(memory.size()) +
+               " digits instead of 64 KiB of zeros");
+
+    Expect(gdb.Request("Z0," + Hex(tick) + ",1") == "OK", "Z0 failed");
+    stop = gdb.Request("vCont;c");
+    Expect(stop.rfind("T05", 0) == 0 &&
+               stop.find("swbreak:") != std::string::npos,
+           "Not stopped at the breakpoint: " + stop);
+    Expect(gdb.Request("p10") == RegisterHex(tick), "Not stopped in tick");
+    Expect(gdb.Request("z0," + Hex(tick) + ",1") == "OK", "z0 failed");
+
+    Expect(gdb.Request("Z2," + Hex(ticks) + ",4") == "OK", "Z2 failed");
+    stop = gdb.Request("vCont;c");
+    Expect(stop.find("watch:" + Hex(ticks) + ";") != std::string::npos,
+           "Not stopped at the watchpoint: " + stop);
+    Expect(gdb.Request("z2," + Hex(ticks) + ",4") == "OK", "z2 failed");
+
+    // Nothing stops the process now but the interrupt
+    gdb.Send("vCont;c");
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    gdb.Interrupt();
+    stop = gdb.Reply();
+    Expect(stop.rfind("T02", 0) == 0, "Not stopped with SIGINT: " + stop);
+
+    // k ends the session without a reply
+    gdb.Send("k");
+  }
+  session.Receive("gdbserver");
+}
+
+void TestStep(Session& session) {
+  session.Run("breakpoint main");
+  session.Run("continue");
+  // Lines of helloworld.cpp step stops at. Calls are entered at the line
+  // of the function's opening brace. A return lands on the instruction
+  // after the call, which starts the row of the next line.
+  const std::vector<int> kLines = {
+      // main up to f()
+      34, 35, 36, 37, 38, 39, 40,
+      // f up to g()
+      23, 24, 25, 26, 27, 28, 29, 30,
+      // g up to h()
+      13, 14, 15, 16, 17, 18, 19, 20,
+      // h, stepping over the calls into libstdc++
+      3, 4, 5, 6, 7, 8, 9, 10, 11,
+      // back out through g and f to the end of main
+      21, 31, 41, 42};
+  for (size_t i = 0; i < kLines.size(); i++) {
+    if (i != 0) {
+      session.Run("step");
+    }
+    auto result = session.Run("backtrace 1");
+    const auto* frames = result.Find("frames");
+    Expect(frames != nullptr && !frames->Items().empty(), "No frame");
+    const auto* line = frames->Items()[0].Find("line");
+    auto at = line ? static_cast<int>(line->AsNumber()) : 0;
+    Expect(at == kLines[i], "Step " + std::to_string(i) + " stopped at line " +
+                                std::to_string(at) + ", expected " +
+                                std::to_string(kLines[i]));
+  }
+}
+
+const std::map<std::string, std::function<void(Session&)>> kTests = {
+    {"checkpoint", TestCheckpoint},
+    {"gdb-server", TestGdbServer},
+    {"step", TestStep},
+};
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  if (argc != 4 || kTests.count(argv[2]) == 0) {
+    std::cerr << "Usage: " << argv[0] << " <debugger> <test> <program>"
+              << std::endl;
+    return 1;
+  }
+  auto socket = std::filesystem::temp_directory_path() /
+                ("debugger-test-" + std::to_string(getpid()) + ".sock");
+  try {
+    Session session{argv[1], {argv[3]}, socket};
+    kTests.at(argv[2])(session);
+  } catch (const std::exception& e) {
+    std::cerr << argv[2] << ": " << e.what() << std::endl;
+    return 1;
+  }
+  std::cout << argv[2] << ": passed" << std::endl;
+  return 0;
+}
@@ -0,0 +1,173 @@
+// Checks PCIndex against a plain walk over the DWARF of a binary, the way
+// functions and lines were looked up before there was an index: for every
+// address in .text, FindFunction must find the subprogram the walk over
+// every die finds, and FindLine the row line_table::find_address finds.
+// Given a stride, only every stride-th address is checked, for binaries too
+// large to walk for each of them.
+//
+//   PCIndexTest <binary> [<stride>]
+#include <fcntl.h>
+
+#include <iostream>
+#include <sstream>
+#include <string>
+
+#include "dwarf/dwarf++.hh"
+#include "elf/elf++.hh"
+#include "pc_index.h"
+
+namespace {
+
+// Mismatches printed, any more are only counted
+const auto kMaxReported = 20;
+
+bool HasRange(const dwarf::die& die) {
+  return die.has(dwarf::DW_AT::low_pc) || die.has(dwarf::DW_AT::ranges);
+}
+
+// Smallest subprogram containing pc in the tree under die, inlined
+// subroutines left out as FindFunction leaves them out by default
+void WalkFunctions(const dwarf::die& die, uint64_t pc, dwarf::die* best,
+                   uint64_t* best_size) {
+  for (const auto& child : die) {
+    if (child.tag == dwarf::DW_TAG::subprogram && HasRange(child)) {
+      for (const auto& range : dwarf::die_pc_range(child)) {
+        if (range.low <= pc && pc < range.high &&
+            range.high - range.low < *best_size) {
+          *best = child;
+          *best_size = range.high - range.low;
+        }
+      }
+    }
+    WalkFunctions(child, pc, best, best_size);
+  }
+}
+
+// Unit whose ranges contain pc, nullptr if none
+const dwarf::compilation_unit* FindUnit(const dwarf::dwarf& dw, uint64_t pc) {
+  for (const auto& cu : dw.compilation_units()) {
+    if (HasRange(cu.root()) && dwarf::die_pc_range(cu.root()).contains(pc)) {
+      return &cu;
+    }
+  }
+  return nullptr;
+}
+
+class Checker {
+ public:
+  explicit Checker(const dwarf::dwarf& dw) : dwarf_{dw} {
+    index_.Build(dw);
+    index_.Wait();
+  }
+
+  void Check(uint64_t pc) {
+    CheckFunction(pc);
+    CheckLine(pc);
+  }
+
+  int Failures() const { return failures_; }
+
+ private:
+  void CheckFunction(uint64_t pc) {
+    dwarf::die expected;
+    uint64_t size = UINT64_MAX;
+    if (const auto* cu = FindUnit(dwarf_, pc)) {
+      WalkFunctions(cu->root(), pc, &expected, &size);
+    }
+    const auto* found = index_.FindFunction(pc);
+    if (!expected.valid() && found == nullptr) {
+      return;
+    }
+    if (!expected.valid() || found == nullptr ||
+        found->die_offset != expected.get_section_offset()) {
+      Fail(pc, "function",
+           expected.valid() ? DieName(expected) : "none",
+           found ? std::string(index_.Name(*found)) : "none");
+    }
+  }
+
+  void CheckLine(uint64_t pc) {
+    const auto* cu = FindUnit(dwarf_, pc);
+    const auto* found = index_.FindLine(pc);
+    if (cu == nullptr) {
+      if (found != nullptr) {
+        Fail(pc, "line", "none", Describe(*found));
+      }
+      return;
+    }
+    const auto& lt = cu->get_line_table();
+    auto expected = lt.find_address(pc);
+    if (expected == lt.end()) {
+      if (found != nullptr) {
+        Fail(pc, "line", "none", Describe(*found));
+      }
+      return;
+    }
+    auto want = expected->file->path + ":" + std::to_string(expected->line) +
+                " at 0x" + Hex(expected->address);
+    if (found == nullptr || Describe(*found) != want) {
+      Fail(pc, "line", want, found ? Describe(*found) : "none");
+    }
+  }
+
+  std::string Describe(const PCIndex::Line& line) const {
+    return std::string(index_.File(line)) + ":" + std::to_string(line.line) +
+           " at 0x" + Hex(line.address);
+  }
+
+  static std::string Hex(uint64_t value) {
+    std::ostringstream out;
+    out << std::hex << value;
+    return out.str();
+  }
+
+  void Fail(uint64_t pc, const std::string& what, const std::string& expected,
+            const std::string& found) {
+    if (++failures_ <= kMaxReported) {
+      std::cerr << "0x" << Hex(pc) << ": expected " << what << " " << expected
+                << ", index found " << found << std::endl;
+    }
+  }
+
+  const dwarf::dwarf& dwarf_;
+  PCIndex index_;
+  int failures_ = 0;
+};
+
+}  // namespace
+
+int main(int argc, char* argv[]) {
+  if (argc != 2 && argc != 3) {
+    std::cerr << "Usage: " << argv[0] << " <binary> [<stride>]" << std::endl;
+    return 1;
+  }
+  uint64_t stride = argc == 3 ? std::stoull(argv[2]) : 1;
+  if (stride == 0) {
+    std::cerr << "Stride must be positive" << std::endl;
+    return 1;
+  }
+  auto fd = open(argv[1], O_RDONLY);
+  if (fd < 0) {
+    std::cerr << "Cannot open " << argv[1] << std::endl;
+    return 1;
+  }
+  elf::elf ef{elf::create_mmap_loader(fd)};
+  dwarf::dwarf dw{dwarf::elf::create_loader(ef)};
+  const auto& text = ef.get_section(".text");
+  if (!text.valid()) {
+    std::cerr << argv[1] << " has no .text" << std::endl;
+    return 1;
+  }
+
+  Checker checker{dw};
+  auto low = text.get_hdr().addr;
+  auto high = low + text.size();
+  uint64_t checked = 0;
+  for (auto pc = low; pc < high; pc += stride) {
+    checker.Check(pc);
+    checked++;
+  }
+  std::cout << std::dec << checked << " addresses checked, "
+            << checker.Failures() << " mismatches" << std::endl;
+  return checker.Failures() == 0 ? 0 : 1;
+}
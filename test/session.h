@@ -0,0 +1,137 @@
+#pragma once
+// A debugger started with --server, driven through its command server by
+// the tests and by RunBench.
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <chrono>
+#include <stdexcept>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include "json.h"
+
+class Session {
+ public:
+  // Run debugger with args after "--server socket_path" and connect to it
+  Session(const std::string& debugger, const std::vector<std::string>& args,
+          const std::string& socket_path) {
+    pid_ = fork();
+    if (pid_ < 0) {
+      throw std::runtime_error("fork failed");
+    }
+    if (pid_ == 0) {
+      // Keep the debugger's and the program's output out of the results
+      freopen("/dev/null", "w", stdout);
+      freopen("/dev/null", "w", stderr);
+      std::vector<char*> argv{const_cast<char*>(debugger.c_str()),
+                              const_cast<char*>("--server"),
+                              const_cast<char*>(socket_path.c_str())};
+      for (const auto& arg : args) {
+        argv.push_back(const_cast<char*>(arg.c_str()));
+      }
+      argv.push_back(nullptr);
+      execv(debugger.c_str(), argv.data());
+      _exit(127);
+    }
+    Connect(socket_path);
+  }
+
+  ~Session() {
+    if (fd_ >= 0) {
+      std::string quit = "{\"command\": \"quit\"}\n";
+      send(fd_, quit.data(), quit.size(), MSG_NOSIGNAL);
+      close(fd_);
+    }
+    int status;
+    waitpid(pid_, &status, 0);
+  }
+
+  Session(const Session&) = delete;
+  Session& operator=(const Session&) = delete;
+
+  // Result of cmd, throws if it failed
+  Json Run(const std::string& cmd) {
+    Send(cmd);
+    return Receive(cmd);
+  }
+
+  // Send cmd without waiting for its result, which Receive then returns
+  void Send(const std::string& cmd) {
+    auto request = Json::Object();
+    request["id"] = ++id_;
+    request["command"] = cmd;
+    auto line = request.Dump() + "\n";
+    if (send(fd_, line.data(), line.size(), MSG_NOSIGNAL) !=
+        static_cast<ssize_t>(line.size())) {
+      throw std::runtime_error("Lost the debugger");
+    }
+  }
+
+  // Result of the oldest command sent and not received, throws if it
+  // failed
+  Json Receive(const std::string& cmd) {
+    size_t end;
+    while ((end = pending_.find('\n')) == pending_.npos) {
+      char buf[64 * 1024];
+      auto n = read(fd_, buf, sizeof(buf));
+      if (n <= 0) {
+        throw std::runtime_error("Lost the debugger running " + cmd);
+      }
+      pending_.append(buf, n);
+    }
+    auto response = Json::Parse(pending_.substr(0, end));
+    pending_.erase(0, end + 1);
+    const auto* ok = response.Find("ok");
+    if (ok == nullptr || !ok->AsBool()) {
+      const auto* error = response.Find("error");
+      throw std::runtime_error(cmd + ": " +
+                               (error ? error->AsString() : "failed"));
+    }
+    return *response.Find("result");
+  }
+
+  // Text cmd printed
+  std::string Output(const std::string& cmd) {
+    auto result = Run(cmd);
+    const auto* output = result.Find("output");
+    return output != nullptr ? output->AsString() : "";
+  }
+
+ private:
+  static constexpr auto kConnectTimeout = std::chrono::seconds(30);
+
+  void Connect(const std::string& socket_path) {
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    socket_path.copy(addr.sun_path, sizeof(addr.sun_path) - 1);
+    auto deadline = std::chrono::steady_clock::now() + kConnectTimeout;
+    while (true) {
+      fd_ = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+      if (connect(fd_, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) ==
+          0) {
+        return;
+      }
+      close(fd_);
+      fd_ = -1;
+      int status;
+      if (waitpid(pid_, &status, WNOHANG) == pid_) {
+        pid_ = -1;
+        throw std::runtime_error("The debugger exited on startup");
+      }
+      if (std::chrono::steady_clock::now() > deadline) {
+        throw std::runtime_error("The debugger did not start listening");
+      }
+      std::this_thread::sleep_for(std::chrono::microseconds(100));
+    }
+  }
+
+  pid_t pid_ = -1;
+  int fd_ = -1;
+  int id_ = 0;
+  std::string pending_;
+};
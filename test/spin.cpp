@@ -0,0 +1,12 @@
+// Debuggee of the gdb server test: tick() runs until the process is
+// interrupted
+char buffer[64 * 1024];
+volatile int ticks;
+
+void tick() { ticks++; }
+
+int main() {
+  while (true) {
+    tick();
+  }
+}